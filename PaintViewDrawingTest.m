@@ -19,12 +19,696 @@
 
 #import "PaintViewDrawingTest.h"
 #import "SWPaintView.h"
+#import "SWStrokeRecording.h"
+#import "SWBrushTool.h"
+#import "SWTileHandoff.h"
+#import "SWImageDataSource.h"
+#import "SWImageBatch.h"
+#import "SWBMPCodec.h"
+#import "SWEyeDropperTool.h"
+#import "SWBrushEngine.h"
+#import "SWFillTool.h"
+#import "SWPNGWriter.h"
+#import "SWGIFWriter.h"
+#import "SWJPEGWriter.h"
+#import "SWClipboard.h"
+#import "SWSelectionTool.h"
+#import <ImageIO/ImageIO.h>
+#import <mach/mach.h>
 
 @implementation PaintViewDrawingTest
 
+// A diagonal drag with the brush, as the paint view would have recorded it
+- (SWStrokeRecording *)diagonalBrushStroke
+{
+    SWStrokeRecording *recording = [[SWStrokeRecording alloc] initWithToolName:NSStringFromClass([SWBrushTool class])
+                                                                    canvasSize:NSMakeSize(64, 64)];
+    recording.lineWidth = 3;
+    recording.toolDefaults = @{kSWBrushStyleKey: @(SWBrushStyleRound), kSWBrushSpacingKey: @25};
+    [recording addEvent:MOUSE_DOWN atPoint:NSMakePoint(4, 4) flags:0 timestamp:0];
+    for (NSInteger i = 5; i < 60; i += 5)
+        [recording addEvent:MOUSE_DRAGGED atPoint:NSMakePoint(i, i) flags:0 timestamp:i / 100.0];
+    [recording addEvent:MOUSE_UP atPoint:NSMakePoint(60, 60) flags:0 timestamp:0.6];
+    return recording;
+}
+
+
+- (void)testReplayIsRepeatable
+{
+    SWStrokeRecording *recording = [self diagonalBrushStroke];
+    NSBitmapImageRep *first = nil, *second = nil;
+    NSDictionary *report = [SWStrokeBenchmark runRecording:recording atSize:recording.canvasSize iterations:1 finalCanvas:&first];
+    [SWStrokeBenchmark runRecording:recording atSize:recording.canvasSize iterations:1 finalCanvas:&second];
+    
+    STAssertNil(report[@"error"], @"The brush should be replayable");
+    STAssertEquals([report[@"events"] unsignedIntegerValue], recording.eventCount, @"Every event should be timed");
+    STAssertEquals([SWStrokeBenchmark differingPixelsBetweenImage:first andImage:second], (NSUInteger)0,
+                   @"Replaying the same stroke should paint the same pixels");
+    
+    // Something was drawn, in the foreground color, along the diagonal
+    NSColor *color = [first colorAtX:31 y:32];
+    STAssertTrue(color.redComponent < 0.5, @"The stroke should have been drawn");
+}
+
+
+- (void)testRecordingSurvivesAFile
+{
+    SWStrokeRecording *recording = [self diagonalBrushStroke];
+    NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:@"test.pbstroke"]];
+    STAssertTrue([recording writeToURL:url], @"The recording should be writable");
+    
+    SWStrokeRecording *copy = [[SWStrokeRecording alloc] initWithContentsOfURL:url];
+    STAssertEqualObjects(copy.toolName, recording.toolName, @"The tool should be kept");
+    STAssertEquals(copy.eventCount, recording.eventCount, @"Every event should be kept");
+    STAssertEquals(copy.lineWidth, recording.lineWidth, @"The line width should be kept");
+    STAssertEqualObjects(copy.toolDefaults, recording.toolDefaults, @"The brush settings should be kept");
+    [[NSFileManager defaultManager] removeItemAtURL:url error:NULL];
+}
+
+// One thread keeps painting rectangles and publishing while this one keeps
+// reading frames back.  Every frame read has to be exactly one the painting
+// thread published: never half of one and half of the next
+- (void)testTileHandoffNeverTears
+{
+    enum { width = 97, height = 71, rowBytes = width * 4, frames = 2000 };
+    NSMutableData *fronts = [NSMutableData dataWithLength:2 * rowBytes * height];
+    NSMutableData *back = [NSMutableData dataWithLength:rowBytes * height];
+    NSMutableArray *published = [NSMutableArray array];
+    NSLock *publishedLock = [[NSLock alloc] init];
+    
+    uint8_t *front0 = fronts.mutableBytes;
+    SWTileHandoff *handoff = SWTileHandoffCreate(width, height, 4, rowBytes, 16, front0, front0 + rowBytes * height);
+    STAssertTrue(handoff != NULL, @"The handoff should be created");
+    SWTileHandoffMarkAllDirty(handoff);
+    
+    __block BOOL painting = YES;
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_group_async(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        uint8_t *pixels = back.mutableBytes;
+        for (NSUInteger frame = 1; published.count < frames; frame++)
+        {
+            SWTileRect rect = { random() % width, random() % height, 1 + random() % 40, 1 + random() % 40 };
+            for (size_t y = rect.y; y < MIN(rect.y + rect.height, (size_t)height); y++)
+                memset(pixels + y * rowBytes + rect.x * 4, frame & 0xff, (MIN(rect.x + rect.width, (size_t)width) - rect.x) * 4);
+            SWTileHandoffMarkDirty(handoff, rect);
+            
+            if (SWTileHandoffPublish(handoff, pixels))
+            {
+                [publishedLock lock];
+                [published addObject:[back copy]];
+                [publishedLock unlock];
+            }
+            if (frame % 8 == 0)
+                usleep(100);
+        }
+        painting = NO;
+    });
+    
+    NSUInteger checked = 0, torn = 0;
+    while (painting)
+    {
+        const uint8_t *front = SWTileHandoffAcquireFront(handoff, NULL);
+        uint64_t generation = SWTileHandoffGeneration(handoff);
+        if (front)
+        {
+            // At most one more frame can have gone out since we got ours
+            BOOL matched = NO;
+            for (uint64_t g = generation; g >= 1 && g + 1 >= generation && !matched; g--)
+            {
+                NSData *expected = nil;
+                while (!expected)
+                {
+                    [publishedLock lock];
+                    expected = (published.count >= g) ? published[g - 1] : nil;
+                    [publishedLock unlock];
+                }
+                matched = !memcmp(front, expected.bytes, rowBytes * height);
+            }
+            checked++;
+            torn += !matched;
+        }
+        SWTileHandoffReleaseFront(handoff, front);
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+    SWTileHandoffDestroy(handoff);
+    
+    STAssertTrue(checked > 0, @"Some frames should have been read");
+    STAssertEquals(torn, (NSUInteger)0, @"No frame should be torn");
+}
+
 //- (void) testTheTest
 //{
 //    STAssertEquals(32, 32, @"ZOMG");
 //}
 
+
+// Drawing in one layer after the image has been flattened once should only
+// redo the part noted as edited, and get the same answer as starting over
+- (void)testCompositeKeepsUpWithTheActiveLayer
+{
+    SWImageDataSource *dataSource = [[SWImageDataSource alloc] initWithSize:NSMakeSize(200, 150) fillBackground:NO];
+    SWLayer *top = [dataSource newBlankLayer];
+    top.opacity = 0.5;
+    [dataSource setLayers:[dataSource.layers arrayByAddingObject:top] activeLayerIndex:1];
+    [dataSource compositeImage];
+    
+    SWLockFocus(dataSource.mainImage);
+    [[NSColor redColor] setFill];
+    NSRectFill(NSMakeRect(130, 70, 20, 20));
+    SWUnlockFocus(dataSource.mainImage);
+    [dataSource noteEditedRect:NSMakeRect(130, 70, 20, 20)];
+    
+    NSBitmapImageRep *incremental = nil, *fresh = nil;
+    [SWImageTools initImageRep:&incremental withSize:dataSource.size];
+    [SWImageTools drawToImage:incremental fromImage:dataSource.compositeImage withComposition:NO];
+    
+    // The same stack, with nothing cached
+    SWImageDataSource *other = [[SWImageDataSource alloc] initWithSize:dataSource.size fillBackground:NO];
+    [other setLayers:dataSource.layers activeLayerIndex:0];
+    fresh = other.compositeImage;
+    
+    STAssertEquals([SWStrokeBenchmark differingPixelsBetweenImage:incremental andImage:fresh], (NSUInteger)0,
+                   @"Recompositing only the changed tiles should match recompositing everything");
+    STAssertTrue([incremental colorAtX:140 y:dataSource.size.height - 80].alphaComponent > 0.25,
+                 @"The new drawing should show through at the layer's opacity");
+}
+
+
+// What the encoders are tried on
+typedef enum {
+    SWTestNoise,        // A different color for nearly every pixel
+    SWTestFewColors,    // Sixteen of them, so palettes can hold them exactly
+    SWTestGradient      // Smooth, like a photo, for the lossy encoders
+} SWTestPattern;
+
+// The odd sizes are the ones that catch the edges of bands, blocks and rows
+static const NSSize kSWTestSizes[] = { { 1, 1 }, { 7, 5 }, { 17, 13 }, { 33, 9 }, { 64, 48 } };
+
+
+// An upright test image.  With holes, every third pixel is clear; the rest are
+// opaque, so premultiplied and straight alpha are the same and lossless
+// formats have no excuse for any difference
+static NSBitmapImageRep *SWTestImage(NSSize size, SWTestPattern pattern, BOOL holes)
+{
+    NSBitmapImageRep *image = nil;
+    [SWImageTools initImageRep:&image withSize:size];
+    NSInteger w = size.width, h = size.height;
+    for (NSInteger y = 0; y < h; y++)
+    {
+        unsigned char *p = image.bitmapData + y * image.bytesPerRow;
+        for (NSInteger x = 0; x < w; x++, p += 4)
+        {
+            uint32_t hash = (uint32_t)(x * 73856093 ^ y * 19349663) * 2654435761u;
+            if (pattern == SWTestFewColors)
+                hash = ((hash >> 28) + 1) * 0x3D1F4Bu;
+            if (pattern == SWTestGradient)
+            {
+                p[0] = x * 255 / MAX(w - 1, 1);
+                p[1] = y * 255 / MAX(h - 1, 1);
+                p[2] = (x + y) * 255 / MAX(w + h - 2, 1);
+            }
+            else
+            {
+                p[0] = hash >> 8;
+                p[1] = hash >> 16;
+                p[2] = hash >> 24;
+            }
+            p[3] = 255;
+            if (holes && (x + 2 * y) % 3 == 0)
+                memset(p, 0, 4);
+        }
+    }
+    return image;
+}
+
+
+// Decodes what an encoder made with ImageIO, and compares it with the image it
+// was made from.  The image is drawn in its own color space, so nothing gets
+// color matched on the way.  Returns the biggest difference in any channel,
+// or -1 if it didn't decode to the same size
+static NSInteger SWTestRoundTrip(NSBitmapImageRep *original, NSData *encoded, double *meanDelta)
+{
+    CGImageSourceRef source = encoded ? CGImageSourceCreateWithData((__bridge CFDataRef)encoded, NULL) : NULL;
+    CGImageRef image = source ? CGImageSourceCreateImageAtIndex(source, 0, NULL) : NULL;
+    if (source)
+        CFRelease(source);
+    if (!image)
+        return -1;
+    
+    size_t w = CGImageGetWidth(image), h = CGImageGetHeight(image);
+    if (w != (size_t)original.pixelsWide || h != (size_t)original.pixelsHigh)
+    {
+        CGImageRelease(image);
+        return -1;
+    }
+    CGColorSpaceRef space = CGImageGetColorSpace(image);
+    if (CGColorSpaceGetModel(space) == kCGColorSpaceModelIndexed)
+        space = CGColorSpaceGetBaseColorSpace(space);
+    NSMutableData *decoded = [NSMutableData dataWithLength:w * h * 4];
+    CGContextRef context = CGBitmapContextCreate(decoded.mutableBytes, w, h, 8, w * 4, space, 
+                                                 kCGImageAlphaPremultipliedLast);
+    CGContextSetBlendMode(context, kCGBlendModeCopy);
+    CGContextDrawImage(context, CGRectMake(0, 0, w, h), image);
+    CGContextRelease(context);
+    CGImageRelease(image);
+    
+    // A bitmap context's first row is the top one, like the original's
+    NSInteger maxDelta = 0;
+    double total = 0;
+    const unsigned char *d = decoded.bytes;
+    for (size_t y = 0; y < h; y++)
+    {
+        const unsigned char *o = original.bitmapData + y * original.bytesPerRow;
+        for (size_t i = 0; i < w * 4; i++, d++)
+        {
+            NSInteger delta = labs((long)o[i] - (long)*d);
+            maxDelta = MAX(maxDelta, delta);
+            total += delta;
+        }
+    }
+    if (meanDelta)
+        *meanDelta = total / (w * h * 4);
+    return maxDelta;
+}
+
+
+static uint64_t SWTestFootprint(void)
+{
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+        return 0;
+    return info.phys_footprint;
+}
+
+
+// A poster-sized canvas, filled with the background color and drawn in a
+// little, should only cost what was drawn
+- (void)testHugeCanvasCostsWhatIsDrawn
+{
+    uint64_t before = SWTestFootprint();
+    SWImageDataSource *dataSource = [[SWImageDataSource alloc] initWithSize:NSMakeSize(20000, 20000)];
+    NSBitmapImageRep *image = dataSource.mainImage;
+    
+    SWLockFocus(image);
+    [[NSColor blueColor] setFill];
+    NSRectFill(NSMakeRect(100, 100, 200, 200));
+    SWUnlockFocus(image);
+    [SWImageTools invertImage:image];
+    
+    uint64_t growth = SWTestFootprint() - before;
+    STAssertTrue(growth < 256 * 1024 * 1024, @"1.6 GB of canvas shouldn't cost more than what was drawn in it");
+    
+    // The untouched part is still the background, inverted
+    NSColor *background = [[image colorAtX:19000 y:19000] colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+    NSColor *drawn = [[image colorAtX:200 y:20000 - 1 - 200] colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+    STAssertEquals(background.alphaComponent, (CGFloat)1.0, @"The background should still be there");
+    STAssertTrue(drawn.blueComponent < 0.1 && drawn.redComponent > 0.9, @"Blue should have inverted to yellow");
+}
+
+
+// With a budget far smaller than the canvas, a stroke across it has to let
+// tiles go, and none of what was drawn can go missing along the way
+- (void)testOutOfCoreCanvasKeepsWhatWasDrawn
+{
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    [defaults setInteger:1 forKey:kSWScratchFileThresholdKey];
+    [defaults setInteger:1 forKey:kSWScratchResidentMegabytesKey];
+    SWImageDataSource *dataSource = [[SWImageDataSource alloc] initWithSize:NSMakeSize(2000, 2000)];
+    [defaults removeObjectForKey:kSWScratchFileThresholdKey];
+    [defaults removeObjectForKey:kSWScratchResidentMegabytesKey];
+    STAssertTrue(dataSource.usesScratchFile, @"A canvas over the threshold should be out of core");
+    
+    NSBitmapImageRep *image = dataSource.mainImage;
+    NSPoint last = NSMakePoint(0, 0);
+    for (CGFloat y = 0; y < 2000; y += 20)
+    {
+        NSPoint point = NSMakePoint(1000, y);
+        [dataSource noteStrokeFromPoint:last toPoint:point radius:10];
+        SWLockFocus(image);
+        [[NSColor redColor] setFill];
+        NSRectFill(NSMakeRect(990, y, 20, 20));
+        SWUnlockFocus(image);
+        last = point;
+    }
+    
+    SWScratchStatistics statistics = dataSource.scratchStatistics;
+    STAssertTrue(statistics.evictions > 0, @"The stroke should have gone over budget");
+    STAssertTrue(statistics.residentTiles * SW_SCRATCH_TILE_BYTES <= 1024 * 1024, @"The budget should hold");
+    
+    for (NSInteger row = 0; row < 2000; row += 7)
+    {
+        NSColor *color = [image colorAtX:1000 y:row];
+        STAssertTrue(color.redComponent > 0.9 && color.greenComponent < 0.1, @"Row %ld should still be red", (long)row);
+    }
+}
+
+
+// Operations run in the order given, with crops measured from the top left
+- (void)testBatchRunsOperationsInOrder
+{
+    // A white image with a red square in its top left corner
+    NSBitmapImageRep *image;
+    [SWImageTools initImageRep:&image withSize:NSMakeSize(40, 30)];
+    [SWImageTools fillImage:image withColor:[NSColor whiteColor]];
+    SWLockFocus(image);
+    [[NSColor redColor] setFill];
+    NSRectFill(NSMakeRect(0, 0, 10, 10));
+    SWUnlockFocus(image);
+    
+    NSURL *input = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:@"batch.bmp"]];
+    STAssertTrue([SWBMPWriter writeImage:[SWImageTools flippedCopyOfImage:image] toURL:input error:NULL], @"The input should be written");
+    
+    NSString *error = nil;
+    NSArray *operations = [SWImageBatch operationsFromString:@"flip_horizontal, crop=20:0:20:10, resize=200%" error:&error];
+    STAssertNotNil(operations, @"The operations should parse: %@", error);
+    STAssertNil([SWImageBatch operationsFromString:@"crop=1:2:3" error:NULL], @"A crop needs four numbers");
+    
+    NSUInteger failures = 0;
+    NSArray *results = [SWImageBatch processURLs:@[input]
+                                      operations:operations
+                                 outputDirectory:nil
+                                          format:@"png"
+                                         quality:1
+                                            jobs:2
+                                    memoryBudget:1024 * 1024
+                                        failures:&failures];
+    STAssertEquals(failures, (NSUInteger)0, @"Nothing should have failed: %@", results);
+    
+    NSURL *output = [NSURL fileURLWithPath:results[0][@"output"]];
+    SWImageDataSource *result = [[SWImageDataSource alloc] initWithURL:output];
+    [[NSFileManager defaultManager] removeItemAtURL:input error:NULL];
+    [[NSFileManager defaultManager] removeItemAtURL:output error:NULL];
+    STAssertEquals(result.size, NSMakeSize(40, 20), @"Cropped to 20x10, then doubled");
+    
+    // The square was flipped to the right, and the crop kept it
+    NSColor *right = [[result.mainImage colorAtX:35 y:20 - 1 - 2] colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+    NSColor *left = [[result.mainImage colorAtX:5 y:20 - 1 - 2] colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+    STAssertTrue(right.redComponent > 0.9 && right.greenComponent < 0.1, @"The square should be on the right");
+    STAssertTrue(left.greenComponent > 0.9, @"The left should be white");
+}
+
+- (void)testEyeDropperAveragesAndKeepsUp
+{
+    // A one-pixel black and white checkerboard
+    NSBitmapImageRep *image;
+    [SWImageTools initImageRep:&image withSize:NSMakeSize(64, 64)];
+    unsigned char *data = image.bitmapData;
+    for (NSInteger y = 0; y < 64; y++)
+        for (NSInteger x = 0; x < 64; x++)
+        {
+            unsigned char *p = data + y * image.bytesPerRow + x * 4;
+            p[0] = p[1] = p[2] = ((x + y) % 2) ? 255 : 0;
+            p[3] = 255;
+        }
+    
+    SWEyeDropperTool *tool = [[SWEyeDropperTool alloc] initWithController:nil];
+    NSColor *point = [tool colorAtPoint:NSMakePoint(10.5, 10.5) inImage:image sample:SWEyeDropperPoint];
+    NSColor *average = [tool colorAtPoint:NSMakePoint(10.5, 10.5) inImage:image sample:SWEyeDropperAverage11x11];
+    STAssertTrue(point.redComponent < 0.01 || point.redComponent > 0.99, @"A single pixel is black or white");
+    STAssertEqualsWithAccuracy(average.redComponent, 0.5, 0.01, @"Eleven by eleven of a checkerboard is about half gray");
+    STAssertNil([tool colorAtPoint:NSMakePoint(-1, 10) inImage:image sample:SWEyeDropperAverage3x3], @"Nothing outside the image");
+    
+    // Paint a corner red and say so: the sampler should pick it up
+    SWLockFocus(image);
+    [[NSColor redColor] setFill];
+    NSRectFill(NSMakeRect(0, 0, 40, 40));
+    SWUnlockFocus(image);
+    [tool canvasDidChangeInRect:NSMakeRect(0, 0, 40, 40)];
+    NSColor *dominant = [tool colorAtPoint:NSMakePoint(20.5, 20.5) inImage:image sample:SWEyeDropperDominant];
+    STAssertTrue(dominant.redComponent > 0.99 && dominant.greenComponent < 0.01, @"The paint should be picked up");
+}
+
+- (void)testAntialiasedDrawingIsExactAndRepeatable
+{
+    NSBitmapImageRep *first, *second;
+    [SWImageTools initImageRep:&first withSize:NSMakeSize(64, 64)];
+    [SWImageTools initImageRep:&second withSize:NSMakeSize(64, 64)];
+    
+    SWTool *tool = [[SWBrushTool alloc] initWithController:nil];
+    NSBezierPath *circle = [NSBezierPath bezierPathWithOvalInRect:NSMakeRect(12.3, 8.7, 30, 30)];
+    [tool fillPath:circle inImage:first withColor:[NSColor blackColor] operation:NSCompositingOperationSourceOver];
+    [tool fillPath:circle inImage:second withColor:[NSColor blackColor] operation:NSCompositingOperationSourceOver];
+    STAssertTrue(memcmp(first.bitmapData, second.bitmapData, first.bytesPerRow * 64) == 0, 
+                 @"The same path should always come out the same");
+    
+    // The coverage adds up to the area, and the edges are soft
+    double area = 0;
+    NSUInteger partial = 0;
+    for (NSInteger i = 0; i < 64 * 64; i++)
+    {
+        unsigned char alpha = first.bitmapData[i * 4 + 3];
+        area += alpha / 255.0;
+        partial += (alpha > 0 && alpha < 255);
+    }
+    STAssertEqualsWithAccuracy(area, M_PI * 15 * 15, 2.0, @"A circle's coverage should be its area");
+    STAssertTrue(partial > 50, @"The edge of the circle should be antialiased");
+}
+
+- (void)testGrowingSmoothStrokeMatchesTheWholeStroke
+{
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    [defaults setBool:YES forKey:kSWAntialiasKey];
+    [defaults setInteger:SWSymmetryMirror8 forKey:kSWSymmetryKey];
+    [defaults setInteger:SWBrushStyleLine forKey:kSWBrushStyleKey];
+    
+    NSBitmapImageRep *image, *buffer, *whole;
+    [SWImageTools initImageRep:&image withSize:NSMakeSize(96, 96)];
+    [SWImageTools initImageRep:&buffer withSize:NSMakeSize(96, 96)];
+    [SWImageTools initImageRep:&whole withSize:NSMakeSize(96, 96)];
+    SWBrushTool *tool = [[SWBrushTool alloc] initWithController:nil];
+    [tool setFrontColor:[NSColor colorWithCalibratedRed:0.2 green:0.4 blue:0.8 alpha:0.6]];
+    [tool setLineWidth:5];
+    tool.savedPoint = NSMakePoint(30, 12);
+    [tool resetRedrawRect];
+    [tool performDrawAtPoint:NSMakePoint(30, 12) withMainImage:image bufferImage:buffer mouseEvent:MOUSE_DOWN];
+    
+    // Doubling back and crossing itself, a few points at a time
+    NSPoint drag[] = { { 34, 15 }, { 40, 16 }, { 41, 22 }, { 36, 30 }, { 29, 26 }, 
+                       { 30, 18 }, { 38, 20 }, { 44, 27 }, { 43, 28 }, { 20, 40 } };
+    for (NSUInteger i = 0; i < 10; i += 3)
+        [tool performDrawAlongPoints:drag + i count:MIN(3, 10 - i) withMainImage:image bufferImage:buffer];
+    
+    [tool strokePath:[tool symmetricPath:tool.path] 
+             inImage:whole 
+           withColor:[tool.drawingColor colorUsingColorSpaceName:NSCalibratedRGBColorSpace] 
+           operation:NSCompositingOperationCopy];
+    [defaults removeObjectForKey:kSWAntialiasKey];
+    [defaults removeObjectForKey:kSWSymmetryKey];
+    [defaults removeObjectForKey:kSWBrushStyleKey];
+    
+    NSInteger worst = 0;
+    for (NSInteger i = 0; i < 96 * buffer.bytesPerRow; i++)
+        worst = MAX(worst, labs((long)buffer.bitmapData[i] - (long)whole.bitmapData[i]));
+    STAssertTrue(worst <= 1, @"Drawing a stroke as it grows should look like drawing it all at once");
+}
+
+- (void)testDabsKeepTheMostCoverage
+{
+    NSBitmapImageRep *image;
+    [SWImageTools initImageRep:&image withSize:NSMakeSize(64, 64)];
+    SWBrushTipCache *tips = SWBrushTipCacheCreate();
+    const SWBrushTip *tip = SWBrushTipCacheGet(tips, SWTipSoft, 31);
+    STAssertTrue(tip == SWBrushTipCacheGet(tips, SWTipSoft, 31), @"A tip should only be made once");
+    
+    // The same dab twice is no darker than once
+    uint8_t black[4] = { 0, 0, 0, 255 };
+    long left, top;
+    SWBrushDabOrigin(tip, 32, 32, &left, &top);
+    SWBrushStamp(image.bitmapData, 64, 64, image.bytesPerRow, tip, left, top, black);
+    NSData *once = [NSData dataWithBytes:image.bitmapData length:image.bytesPerRow * 64];
+    SWBrushStamp(image.bitmapData, 64, 64, image.bytesPerRow, tip, left, top, black);
+    STAssertTrue(memcmp(once.bytes, image.bitmapData, once.length) == 0, @"Overlapping dabs shouldn't build up");
+    STAssertEquals((int)image.bitmapData[32 * image.bytesPerRow + 32 * 4 + 3], 255, @"A soft tip is solid in the middle");
+    
+    // A round tip covers its area
+    tip = SWBrushTipCacheGet(tips, SWTipRound, 40);
+    double area = 0;
+    for (long i = 0; i < tip->size * tip->size; i++)
+        area += tip->mask[i] / 255.0;
+    STAssertEqualsWithAccuracy(area, M_PI * 20 * 20, 4.0, @"A round tip should cover a circle");
+    SWBrushTipCacheDestroy(tips);
+}
+
+- (void)testGradientFillStaysInsideTheMask
+{
+    NSBitmapImageRep *image;
+    [SWImageTools initImageRep:&image withSize:NSMakeSize(256, 16)];
+    
+    // Only the left half is let through
+    NSMutableData *mask = [NSMutableData dataWithLength:256 * 16];
+    uint8_t *m = mask.mutableBytes;
+    memset(m, 255, 256 * 16);
+    for (NSInteger y = 0; y < 16; y++)
+        memset(m + y * 256, 0, 128);
+    
+    const uint8_t black[4] = { 0, 0, 0, 255 }, red[4] = { 255, 0, 0, 255 };
+    SWFillShader *shader = SWFillShaderCreate(256, 16);
+    SWFillShaderSetDither(shader, 1);
+    SWFillShaderSetLinear(shader, 0, 0, 128, 0, black, red);
+    SWFillImageWithShader(image, shader, m, 256);
+    SWFillShaderDestroy(shader);
+    
+    // Dithered, a column still averages out to the exact color
+    for (NSInteger x = 0; x < 128; x += 4)
+    {
+        double sum = 0;
+        for (NSInteger y = 0; y < 16; y++)
+            for (NSInteger i = 0; i < 4; i++)
+                sum += image.bitmapData[y * image.bytesPerRow + (x + i) * 4];
+        STAssertEqualsWithAccuracy(sum / 64, 255.0 * (x + 2) / 128, 0.25, @"The gradient should be smooth");
+    }
+    for (NSInteger y = 0; y < 16; y++)
+        for (NSInteger x = 128; x < 256; x++)
+            STAssertEquals((int)image.bitmapData[y * image.bytesPerRow + x * 4 + 3], 0, @"Nothing outside the mask");
+}
+
+- (void)testMirroredStrokeIsSymmetric
+{
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    [defaults setInteger:SWSymmetryMirror8 forKey:kSWSymmetryKey];
+    [defaults setInteger:SWBrushStyleRound forKey:kSWBrushStyleKey];
+    
+    NSBitmapImageRep *image, *buffer;
+    [SWImageTools initImageRep:&image withSize:NSMakeSize(64, 64)];
+    [SWImageTools initImageRep:&buffer withSize:NSMakeSize(64, 64)];
+    SWBrushTool *tool = [[SWBrushTool alloc] initWithController:nil];
+    [tool setFrontColor:[NSColor blackColor]];
+    [tool setLineWidth:7];
+    tool.savedPoint = NSMakePoint(10, 20);
+    [tool performDrawAtPoint:NSMakePoint(10, 20) withMainImage:image bufferImage:buffer mouseEvent:MOUSE_DOWN];
+    NSPoint drag[] = { { 14, 22 }, { 18, 24 } };
+    [tool performDrawAlongPoints:drag count:2 withMainImage:image bufferImage:buffer];
+    NSRect dirty = tool.invalidRect;
+    NSRect pieces[kSWMaxSymmetryCopies];
+    NSUInteger pieceCount = [tool getInvalidRects:pieces];
+    [defaults removeObjectForKey:kSWSymmetryKey];
+    [defaults removeObjectForKey:kSWBrushStyleKey];
+    
+    // Mirrored left to right and across a diagonal, it's the same
+    const unsigned char *data = buffer.bitmapData;
+    NSInteger bpr = buffer.bytesPerRow, painted = 0;
+    for (NSInteger y = 0; y < 64; y++)
+        for (NSInteger x = 0; x < 64; x++)
+        {
+            int alpha = data[y * bpr + x * 4 + 3];
+            painted += (alpha != 0);
+            STAssertEquals(alpha, (int)data[y * bpr + (63 - x) * 4 + 3], @"The stroke should be mirrored left to right");
+            STAssertEquals(alpha, (int)data[x * bpr + y * 4 + 3], @"The stroke should be mirrored across the diagonal");
+        }
+    STAssertTrue(painted > 8 * 7 * 7, @"Every copy should be painted");
+    
+    // One rectangle takes in every copy of the last dab
+    NSPoint copies[] = { { 18.5, 24.5 }, { 45.5, 24.5 }, { 18.5, 39.5 }, { 45.5, 39.5 },
+                         { 24.5, 18.5 }, { 39.5, 18.5 }, { 24.5, 45.5 }, { 39.5, 45.5 } };
+    for (NSInteger i = 0; i < 8; i++)
+    {
+        STAssertTrue(NSPointInRect(copies[i], dirty), @"Each copy should be redrawn");
+        BOOL inPiece = NO;
+        for (NSUInteger j = 0; j < pieceCount; j++)
+            inPiece = inPiece || NSPointInRect(copies[i], pieces[j]);
+        STAssertTrue(inPiece, @"Each copy should be in a piece of the redraw rect");
+    }
+    
+    // ...but the pieces are apart, and leave out the middle
+    STAssertTrue(pieceCount > 1, @"Copies that don't overlap should be redrawn separately");
+    for (NSUInteger i = 0; i < pieceCount; i++)
+    {
+        STAssertFalse(NSPointInRect(NSMakePoint(32, 32), pieces[i]), @"Nothing between the copies should be redrawn");
+        for (NSUInteger j = i + 1; j < pieceCount; j++)
+            STAssertFalse(NSIntersectsRect(pieces[i], pieces[j]), @"Pieces that overlap should be merged");
+    }
+}
+
+- (void)testPNGRoundTripIsExact
+{
+    // Noise needs RGBA or RGB; few colors go in a palette, clear or not
+    for (NSUInteger i = 0; i < sizeof(kSWTestSizes) / sizeof(kSWTestSizes[0]); i++)
+        for (int kind = 0; kind < 4; kind++)
+        {
+            NSBitmapImageRep *image = SWTestImage(kSWTestSizes[i], (kind < 2) ? SWTestNoise : SWTestFewColors, kind % 2);
+            NSInteger delta = SWTestRoundTrip(image, [SWPNGWriter PNGDataFromImage:image], NULL);
+            STAssertEquals(delta, (NSInteger)0, @"A %.0fx%.0f PNG (kind %d) should decode to the same pixels",
+                           kSWTestSizes[i].width, kSWTestSizes[i].height, kind);
+        }
+}
+
+- (void)testBMPRoundTripIsExact
+{
+    // Opaque images are 24-bit files; clear pixels need the 32-bit kind
+    NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:@"roundtrip.bmp"]];
+    for (NSUInteger i = 0; i < sizeof(kSWTestSizes) / sizeof(kSWTestSizes[0]); i++)
+        for (int holes = 0; holes < 2; holes++)
+        {
+            NSBitmapImageRep *image = SWTestImage(kSWTestSizes[i], SWTestNoise, holes);
+            STAssertTrue([SWBMPWriter writeImage:image toURL:url error:NULL], @"The BMP should be written");
+            NSInteger delta = SWTestRoundTrip(image, [NSData dataWithContentsOfURL:url], NULL);
+            STAssertEquals(delta, (NSInteger)0, @"A %.0fx%.0f BMP (holes %d) should decode to the same pixels",
+                           kSWTestSizes[i].width, kSWTestSizes[i].height, holes);
+        }
+    [[NSFileManager defaultManager] removeItemAtURL:url error:NULL];
+}
+
+- (void)testGIFRoundTripIsExact
+{
+    // Sixteen colors fit in the palette exactly, however they're dithered
+    for (NSUInteger i = 0; i < sizeof(kSWTestSizes) / sizeof(kSWTestSizes[0]); i++)
+        for (int holes = 0; holes < 2; holes++)
+            for (SWGIFDithering dithering = SWGIFDitheringNone; dithering <= SWGIFDitheringDiffusion; dithering++)
+            {
+                NSBitmapImageRep *image = SWTestImage(kSWTestSizes[i], SWTestFewColors, holes);
+                NSInteger delta = SWTestRoundTrip(image, [SWGIFWriter GIFDataFromImage:image dithering:dithering], NULL);
+                STAssertEquals(delta, (NSInteger)0, @"A %.0fx%.0f GIF (holes %d, dithering %ld) should decode to the same pixels",
+                               kSWTestSizes[i].width, kSWTestSizes[i].height, holes, (long)dithering);
+            }
+}
+
+- (void)testJPEGRoundTripIsClose
+{
+    // Sizes that aren't whole blocks make the encoder pad the last ones
+    for (NSUInteger i = 0; i < sizeof(kSWTestSizes) / sizeof(kSWTestSizes[0]); i++)
+    {
+        NSBitmapImageRep *image = SWTestImage(kSWTestSizes[i], SWTestGradient, NO);
+        double mean = 0;
+        NSInteger delta = SWTestRoundTrip(image, [SWJPEGWriter JPEGDataFromImage:image quality:1.0], &mean);
+        STAssertTrue(delta >= 0, @"A %.0fx%.0f JPEG should decode", kSWTestSizes[i].width, kSWTestSizes[i].height);
+        STAssertTrue(delta <= 24 && mean <= 3.0, @"A %.0fx%.0f JPEG should be close: %ld at most, %.2f on average",
+                     kSWTestSizes[i].width, kSWTestSizes[i].height, (long)delta, mean);
+    }
+}
+
+- (void)testCopyAndPasteSkipEncoding
+{
+    // A selection, as it sits in the canvas, copied the way the document does it
+    NSBitmapImageRep *selection = SWTestImage(NSMakeSize(33, 9), SWTestNoise, YES);
+    SWMemoryClipboard *clipboard = [[SWMemoryClipboard alloc] init];
+    [clipboard writeImage:[SWImageTools flippedCopyOfImage:selection]];
+    STAssertTrue(clipboard.hasImage, @"The copy should be on the clipboard");
+    STAssertEquals(clipboard.imageSize, NSMakeSize(33, 9), @"Its size should be known without decoding");
+    
+    NSBitmapImageRep *pasted = clipboard.canvasImage;
+    BOOL same = (pasted.pixelsWide == 33 && pasted.pixelsHigh == 9);
+    for (NSInteger y = 0; same && y < 9; y++)
+        same = !memcmp(pasted.bitmapData + y * pasted.bytesPerRow, selection.bitmapData + y * selection.bytesPerRow, 33 * 4);
+    STAssertTrue(same, @"Pasting should give back exactly what was copied");
+    STAssertEquals(clipboard.encodeCount, (NSUInteger)0, @"Nothing should be encoded until another application asks");
+    
+    // Another application asking gets it encoded, once
+    STAssertNotNil([clipboard dataForType:NSPasteboardTypePNG], @"The promise should be kept");
+    [clipboard dataForType:NSPasteboardTypePNG];
+    STAssertEquals(clipboard.encodeCount, (NSUInteger)1, @"A kept promise should be kept for next time");
+    
+    // The pasted image floats as the selection as it is
+    NSBitmapImageRep *image, *buffer;
+    [SWImageTools initImageRep:&image withSize:NSMakeSize(64, 64)];
+    [SWImageTools initImageRep:&buffer withSize:NSMakeSize(64, 64)];
+    SWSelectionTool *tool = [[SWSelectionTool alloc] initWithController:nil];
+    [tool setBackColor:[NSColor whiteColor]];
+    [tool setClippingRect:NSMakeRect(10, 20, 33, 9) forImage:pasted withMainImage:image bufferImage:buffer];
+    STAssertTrue(tool.isSelected, @"The paste should be selected");
+    STAssertTrue(tool.selectedImage == pasted, @"The pasted image should be the floating selection, not a copy of it");
+    STAssertTrue(NSEqualRects(tool.clippingRect, NSMakeRect(10, 20, 33, 9)), @"It should float where it was put");
+    [tool tieUpLooseEnds];
+}
+
 @end
@@ -21,11 +21,12 @@
 #import "SWTool.h"
 
 @interface SWAirbrushTool : SWTool {
-    NSTimer *airbrushTimer;
+    dispatch_source_t airbrushTimer;
     NSPoint p;
     BOOL isSpraying;
 }
 
-- (void)endSpray:(NSTimer *)timer;
+- (void)spray;
+- (void)endSpray;
 
 @end
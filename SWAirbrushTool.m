@@ -52,29 +52,41 @@
 {
     p = point;
     if (event == MOUSE_UP) {
-        [self endSpray:airbrushTimer];
+        [self endSpray];
     } else if (event == MOUSE_DOWN) {        
         // Seed a random number based on the time!
         srandom(time(NULL));
 
         _bufferImage = bufferImage;
         _mainImage = mainImage;
+        [self beginSymmetryInImage:mainImage];
 
         // Prep the images
         [SWImageTools drawToImage:_bufferImage fromImage:_mainImage withComposition:NO];
 
-        airbrushTimer = [NSTimer scheduledTimerWithTimeInterval:0.02 // 20 ms
-                                                         target:self
-                                                       selector:@selector(spray:)
-                                                       userInfo:nil
-                                                        repeats:YES];
+        airbrushTimer = [self startTimerWithInterval:0.02 // 20 ms
+                                             handler:^{
+                                                 [self spray];
+                                             }];
         isSpraying = YES;
     }
     path = nil;
     return nil;
 }
 
-- (void)spray:(NSTimer *)timer
+// Drags only move the nozzle, and the timer does the spraying, so there's
+// nothing here that can't keep up on the render queue
+- (BOOL)drawsOffMainThread
+{
+    return YES;
+}
+
+- (BOOL)isAnimating
+{
+    return isSpraying;
+}
+
+- (void)spray
 {
     SWLockFocus(_bufferImage); 
     
@@ -84,22 +96,28 @@
     } else {
         [frontColor setStroke];
     }
-    [[self pathFromPoint:savedPoint toPoint:p] stroke];
+    [[self symmetricPath:[self pathFromPoint:savedPoint toPoint:p]] stroke];
+    
+    // Each copy of the spray is redrawn on its own
+    NSRect copies[kSWMaxSymmetryCopies];
+    NSUInteger count = [self symmetricRects:copies ofRect:redrawRect];
+    [self beginRedrawBatch];
+    for (NSUInteger i = 0; i < count; i++)
+        [self addPieceToRedrawRect:copies[i]];
+    [self endRedrawBatch];
     savedPoint = p;
     
     SWUnlockFocus(_bufferImage);
     
     // Get the view to perform a redraw to see the new spray
-    [NSApp sendAction:@selector(refreshImage:)
-                   to:nil
-                 from:self];
-    
+    [self refreshInvalidRect];
 }
 
 // Once they lift the mouse button, this happens
-- (void)endSpray:(NSTimer *)timer
+- (void)endSpray
 {
-    [timer invalidate];
+    [self stopTimer:airbrushTimer];
+    airbrushTimer = nil;
     
     isSpraying = NO;
     
@@ -122,7 +140,7 @@
 {
     [super tieUpLooseEnds];
     if (isSpraying) {
-        [self endSpray:airbrushTimer];
+        [self endSpray];
     }
     
     [super tieUpLooseEnds];
@@ -23,6 +23,7 @@
 @class SWToolboxController;
 
 extern NSString * const kSWUndoKey;
+extern NSString * const kSWGIFDitheringKey;  // An SWGIFDithering
 
 @interface SWAppController : NSObject
 {
@@ -41,5 +42,28 @@ extern NSString * const kSWUndoKey;
 - (IBAction)quit:(id)sender;
 - (IBAction)newFromClipboard:(id)sender;
 
+// Picks how the eyedropper samples, from the tag of the menu item
+- (IBAction)setEyeDropperSample:(id)sender;
+
+// Turns antialiased drawing on or off for the tools that have it
+- (IBAction)toggleAntialias:(id)sender;
+
+// The brush's style and dab spacing, from the tags of the menu items, and the
+// image it makes custom tips from
+- (IBAction)setBrushStyle:(id)sender;
+- (IBAction)setBrushSpacing:(id)sender;
+- (IBAction)chooseBrushTipImage:(id)sender;
+
+// What the fill tool floods with, from the tag of the menu item, whether its
+// gradients are dithered, and the image it tiles patterns from
+- (IBAction)setFillMode:(id)sender;
+- (IBAction)toggleFillDither:(id)sender;
+- (IBAction)chooseFillPatternImage:(id)sender;
+
+// How strokes are copied about the middle of the canvas, and how many times
+// round rotational symmetry goes, from the tags of the menu items
+- (IBAction)setSymmetry:(id)sender;
+- (IBAction)setSymmetryFolds:(id)sender;
+
 
 @end
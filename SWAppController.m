@@ -22,12 +22,19 @@
 #import "SWPreferenceController.h"
 #import "SWToolboxController.h"
 #import "SWDocument.h"
+#import "SWGIFWriter.h"
+#import "SWClipboard.h"
+#import "SWJournal.h"
+#import "SWEyeDropperTool.h"
+#import "SWBrushTool.h"
+#import "SWFillTool.h"
 #ifndef APPSTORE
 #import "PFMoveApplication.h"
 #import <Sparkle/Sparkle.h>
 #endif // APPSTORE
 
 NSString * const kSWUndoKey = @"UndoLevels";
+NSString * const kSWGIFDitheringKey = @"GIFDithering";
 
 @implementation SWAppController
 
@@ -57,6 +64,15 @@ NSString * const kSWUndoKey = @"UndoLevels";
         defaultValues[@"VerticalSize"] = @480;
         defaultValues[kSWUndoKey] = @10;
         defaultValues[@"FileType"] = @"PNG";
+        defaultValues[kSWGIFDitheringKey] = @(SWGIFDitheringDiffusion);
+        defaultValues[kSWEyeDropperSampleKey] = @(SWEyeDropperPoint);
+        defaultValues[kSWAntialiasKey] = @NO;
+        defaultValues[kSWBrushStyleKey] = @(SWBrushStyleLine);
+        defaultValues[kSWBrushSpacingKey] = @25;
+        defaultValues[kSWFillModeKey] = @(SWFillModeSolid);
+        defaultValues[kSWFillDitherKey] = @YES;
+        defaultValues[kSWSymmetryKey] = @(SWSymmetryNone);
+        defaultValues[kSWSymmetryFoldsKey] = @6;
         
         // Register the dictionary of defaults
         [NSUserDefaults.standardUserDefaults registerDefaults:defaultValues];        
@@ -87,6 +103,21 @@ NSString * const kSWUndoKey = @"UndoLevels";
 }
 
 
+// Anything left in a journal was never saved: we must have crashed last time,
+// so bring those canvases back
+- (void)applicationDidFinishLaunching:(NSNotification *)aNotification
+{
+    for (NSURL *url in [SWJournal abandonedJournalURLs])
+    {
+        NSUInteger activeIndex = 0;
+        NSArray *layers = [SWJournal layersByReplayingJournalAtURL:url activeLayerIndex:&activeIndex];
+        if (layers)
+            [SWDocument openRecoveredDocumentWithLayers:layers activeLayerIndex:activeIndex];
+        [[NSFileManager defaultManager] removeItemAtURL:url error:NULL];
+    }
+}
+
+
 // Makes the toolbox panel appear and disappear
 - (IBAction)showToolboxPanel:(id)sender
 {
@@ -136,8 +167,7 @@ NSString * const kSWUndoKey = @"UndoLevels";
 // Creates a new instance of SWDocument based on the image in the clipboard
 - (IBAction)newFromClipboard:(id)sender
 {
-    NSData *data = [SWImageTools readImageFromPasteboard:[NSPasteboard generalPasteboard]];
-    if (data) 
+    if ([[SWPasteboardClipboard generalClipboard] hasImage])
     {
         [SWDocument setWillShowSheet:NO];
         [[NSDocumentController sharedDocumentController] newDocument:self];
@@ -148,12 +178,128 @@ NSString * const kSWUndoKey = @"UndoLevels";
 {
     SEL action = menuItem.action;
     if (action == @selector(newFromClipboard:)) {
-        return ([SWImageTools readImageFromPasteboard:[NSPasteboard generalPasteboard]] != nil);
+        return [[SWPasteboardClipboard generalClipboard] hasImage];
+    }
+    if (action == @selector(setEyeDropperSample:)) {
+        NSInteger sample = [NSUserDefaults.standardUserDefaults integerForKey:kSWEyeDropperSampleKey];
+        menuItem.state = (menuItem.tag == sample) ? NSControlStateValueOn : NSControlStateValueOff;
+    }
+    if (action == @selector(toggleAntialias:)) {
+        BOOL antialias = [NSUserDefaults.standardUserDefaults boolForKey:kSWAntialiasKey];
+        menuItem.state = antialias ? NSControlStateValueOn : NSControlStateValueOff;
+    }
+    if (action == @selector(setBrushStyle:)) {
+        NSInteger style = [NSUserDefaults.standardUserDefaults integerForKey:kSWBrushStyleKey];
+        menuItem.state = (menuItem.tag == style) ? NSControlStateValueOn : NSControlStateValueOff;
+        if (menuItem.tag == SWBrushStyleImage)
+            return ([NSUserDefaults.standardUserDefaults stringForKey:kSWBrushTipImageKey] != nil);
+    }
+    if (action == @selector(setBrushSpacing:)) {
+        NSInteger spacing = [NSUserDefaults.standardUserDefaults integerForKey:kSWBrushSpacingKey];
+        menuItem.state = (menuItem.tag == spacing) ? NSControlStateValueOn : NSControlStateValueOff;
+    }
+    if (action == @selector(setFillMode:)) {
+        NSInteger mode = [NSUserDefaults.standardUserDefaults integerForKey:kSWFillModeKey];
+        menuItem.state = (menuItem.tag == mode) ? NSControlStateValueOn : NSControlStateValueOff;
+        if (menuItem.tag == SWFillModePattern)
+            return ([NSUserDefaults.standardUserDefaults stringForKey:kSWFillPatternImageKey] != nil);
+    }
+    if (action == @selector(toggleFillDither:)) {
+        BOOL dither = [NSUserDefaults.standardUserDefaults boolForKey:kSWFillDitherKey];
+        menuItem.state = dither ? NSControlStateValueOn : NSControlStateValueOff;
+    }
+    if (action == @selector(setSymmetry:)) {
+        NSInteger symmetry = [NSUserDefaults.standardUserDefaults integerForKey:kSWSymmetryKey];
+        menuItem.state = (menuItem.tag == symmetry) ? NSControlStateValueOn : NSControlStateValueOff;
+    }
+    if (action == @selector(setSymmetryFolds:)) {
+        NSInteger folds = [NSUserDefaults.standardUserDefaults integerForKey:kSWSymmetryFoldsKey];
+        menuItem.state = (menuItem.tag == folds) ? NSControlStateValueOn : NSControlStateValueOff;
     }
     return YES;
 }
 
 
+- (IBAction)setEyeDropperSample:(id)sender
+{
+    [NSUserDefaults.standardUserDefaults setInteger:[sender tag] forKey:kSWEyeDropperSampleKey];
+}
+
+
+- (IBAction)toggleAntialias:(id)sender
+{
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    [defaults setBool:![defaults boolForKey:kSWAntialiasKey] forKey:kSWAntialiasKey];
+}
+
+
+- (IBAction)setBrushStyle:(id)sender
+{
+    [NSUserDefaults.standardUserDefaults setInteger:[sender tag] forKey:kSWBrushStyleKey];
+}
+
+
+- (IBAction)setBrushSpacing:(id)sender
+{
+    [NSUserDefaults.standardUserDefaults setInteger:[sender tag] forKey:kSWBrushSpacingKey];
+}
+
+
+- (IBAction)chooseBrushTipImage:(id)sender
+{
+    NSOpenPanel *openPanel = [NSOpenPanel openPanel];
+    openPanel.allowedFileTypes = [NSImage imageTypes];
+    openPanel.message = NSLocalizedString(@"Dark parts of the image will paint; light or clear parts won't.", nil);
+    if ([openPanel runModal] != NSModalResponseOK)
+        return;
+    
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    [defaults setObject:openPanel.URL.path forKey:kSWBrushTipImageKey];
+    [defaults setInteger:SWBrushStyleImage forKey:kSWBrushStyleKey];
+}
+
+
+- (IBAction)setFillMode:(id)sender
+{
+    [NSUserDefaults.standardUserDefaults setInteger:[sender tag] forKey:kSWFillModeKey];
+}
+
+
+- (IBAction)toggleFillDither:(id)sender
+{
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    [defaults setBool:![defaults boolForKey:kSWFillDitherKey] forKey:kSWFillDitherKey];
+}
+
+
+- (IBAction)chooseFillPatternImage:(id)sender
+{
+    NSOpenPanel *openPanel = [NSOpenPanel openPanel];
+    openPanel.allowedFileTypes = [NSImage imageTypes];
+    if ([openPanel runModal] != NSModalResponseOK)
+        return;
+    
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    [defaults setObject:openPanel.URL.path forKey:kSWFillPatternImageKey];
+    [defaults setInteger:SWFillModePattern forKey:kSWFillModeKey];
+}
+
+
+- (IBAction)setSymmetry:(id)sender
+{
+    [NSUserDefaults.standardUserDefaults setInteger:[sender tag] forKey:kSWSymmetryKey];
+}
+
+
+// Picking how many folds means wanting them
+- (IBAction)setSymmetryFolds:(id)sender
+{
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    [defaults setInteger:[sender tag] forKey:kSWSymmetryFoldsKey];
+    [defaults setInteger:SWSymmetryRotational forKey:kSWSymmetryKey];
+}
+
+
 #pragma mark URLS to web pages/email addresses
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,61 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+
+// BMP files are stored bottom-up, which happens to be exactly how our flipped
+// canvas is laid out.  So instead of going through ImageIO (and several full
+// copies of the image), we map the file and swizzle its rows straight into the
+// canvas, and write files by streaming the rows back out.
+
+// Reads uncompressed 24- and 32-bit files.  Anything else (RLE, palettes, OS/2
+// headers...) gets a nil reader, and should be left to ImageIO
+@interface SWBMPReader : NSObject
+{
+    int fileDescriptor;
+    const unsigned char *mappedFile;
+    size_t mappedLength;
+
+    // Where the pixels are, and what they look like
+    const unsigned char *pixels;
+    NSInteger rowBytes;
+    NSInteger bitsPerPixel;
+    BOOL isTopDown;
+    BOOL hasAlpha;
+    NSSize size;
+}
+
+- (instancetype)initWithURL:(NSURL *)url NS_DESIGNATED_INITIALIZER;
+
+// Fills a canvas-sized image (one of ours, from +[SWImageTools initImageRep:withSize:])
+- (void)readIntoImage:(NSBitmapImageRep *)image;
+
+@property (readonly) NSSize size;
+
+@end
+
+
+@interface SWBMPWriter : NSObject
+
+// Writes an upright 8-bit RGBA image to disk, a band of rows at a time. Opaque
+// images become 24-bit files, anything else keeps its alpha in a 32-bit file
++ (BOOL)writeImage:(NSBitmapImageRep *)image toURL:(NSURL *)url error:(NSError **)outError;
+
+@end
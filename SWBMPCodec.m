@@ -0,0 +1,387 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWBMPCodec.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define kSWBMPFileHeaderSize    14
+#define kSWBMPInfoHeaderSize    40
+#define kSWBMPV4HeaderSize      108
+#define kSWBMPMasksOffset       (kSWBMPFileHeaderSize + kSWBMPInfoHeaderSize)
+
+#define kSWBMPCompressionRGB        0
+#define kSWBMPCompressionBitfields  3
+
+// Rows are converted in bands: big enough to keep every core busy when reading,
+// small enough that the writer never holds more than a sliver of the file
+#define kSWBMPBandRows          64
+
+
+static inline uint16_t SWBMPRead16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+
+static inline uint32_t SWBMPRead32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static inline void SWBMPWrite16(unsigned char *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+
+static inline void SWBMPWrite32(unsigned char *p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+
+// Rows are padded out to a multiple of four bytes
+static inline NSInteger SWBMPRowBytes(NSInteger width, NSInteger bitsPerPixel)
+{
+    return ((width * bitsPerPixel + 31) / 32) * 4;
+}
+
+
+// (c * a) / 255, rounded, without a division
+static inline uint32_t SWBMPMultiply(uint32_t c, uint32_t a)
+{
+    uint32_t t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+
+// BGRA (or BGRX) to RGBA in one pass.  Each pixel is a single 32-bit lane, so
+// the compiler turns this into vector shuffles
+static void SWBMPSwizzleRow32(const unsigned char *src, uint32_t *dst, NSInteger width,
+                              BOOL hasAlpha)
+{
+    const uint32_t *src32 = (const uint32_t *)src;
+    uint32_t alphaMask = hasAlpha ? 0xFF000000 : 0;
+    uint32_t alphaFill = hasAlpha ? 0 : 0xFF000000;
+
+    for (NSInteger x = 0; x < width; x++)
+    {
+        uint32_t v = CFSwapInt32LittleToHost(src32[x]);
+        v = ((v >> 16) & 0xFF) | (v & 0xFF00) | ((v & 0xFF) << 16) | (v & alphaMask) | alphaFill;
+        dst[x] = CFSwapInt32HostToLittle(v);
+    }
+
+    // BMP alpha is straight, but our canvas is premultiplied.  Opaque and clear
+    // pixels (most of them) come through untouched
+    if (hasAlpha)
+    {
+        unsigned char *p = (unsigned char *)dst;
+        for (NSInteger x = 0; x < width; x++, p += 4)
+        {
+            uint32_t a = p[3];
+            if (a == 255)
+                continue;
+            p[0] = SWBMPMultiply(p[0], a);
+            p[1] = SWBMPMultiply(p[1], a);
+            p[2] = SWBMPMultiply(p[2], a);
+        }
+    }
+}
+
+
+static void SWBMPSwizzleRow24(const unsigned char *src, uint32_t *dst, NSInteger width)
+{
+    unsigned char *p = (unsigned char *)dst;
+    for (NSInteger x = 0; x < width; x++, src += 3, p += 4)
+    {
+        p[0] = src[2];
+        p[1] = src[1];
+        p[2] = src[0];
+        p[3] = 255;
+    }
+}
+
+
+@implementation SWBMPReader
+
+@synthesize size;
+
+- (instancetype)init
+{
+    return [self initWithURL:nil];
+}
+
+
+- (instancetype)initWithURL:(NSURL *)url
+{
+    self = [super init];
+    fileDescriptor = -1;
+
+    if (!url.isFileURL)
+        return nil;
+
+    fileDescriptor = open(url.fileSystemRepresentation, O_RDONLY);
+    if (fileDescriptor < 0)
+        return nil;
+
+    struct stat info;
+    if (fstat(fileDescriptor, &info) != 0 || info.st_size < kSWBMPMasksOffset)
+        return nil;
+
+    // Check the magic number before bothering to map anything
+    unsigned char magic[2];
+    if (pread(fileDescriptor, magic, 2, 0) != 2 || magic[0] != 'B' || magic[1] != 'M')
+        return nil;
+
+    mappedLength = (size_t)info.st_size;
+    void *map = mmap(NULL, mappedLength, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+    if (map == MAP_FAILED)
+        return nil;
+    mappedFile = map;
+
+    // We're going to read the pixels front to back, once
+    madvise(map, mappedLength, MADV_SEQUENTIAL);
+
+    uint32_t pixelOffset = SWBMPRead32(mappedFile + 10);
+    uint32_t headerSize = SWBMPRead32(mappedFile + 14);
+    int32_t width = (int32_t)SWBMPRead32(mappedFile + 18);
+    int32_t height = (int32_t)SWBMPRead32(mappedFile + 22);
+    uint16_t planes = SWBMPRead16(mappedFile + 26);
+    uint16_t bitCount = SWBMPRead16(mappedFile + 28);
+    uint32_t compression = SWBMPRead32(mappedFile + 30);
+
+    // OS/2 headers are 12 bytes; leave those (and anything unusual) to ImageIO
+    if (headerSize < kSWBMPInfoHeaderSize || planes != 1 || width <= 0 || height == 0 ||
+        height == INT32_MIN || (bitCount != 24 && bitCount != 32))
+        return nil;
+
+    if (compression == kSWBMPCompressionBitfields)
+    {
+        // We only take the standard BGRA layout.  The masks live right after the
+        // 40-byte header, either inside a larger header or on their own
+        if (bitCount != 32 || (size_t)kSWBMPMasksOffset + 16 > mappedLength)
+            return nil;
+
+        const unsigned char *masks = mappedFile + kSWBMPMasksOffset;
+        if (SWBMPRead32(masks) != 0x00FF0000 || SWBMPRead32(masks + 4) != 0x0000FF00 ||
+            SWBMPRead32(masks + 8) != 0x000000FF)
+            return nil;
+
+        // Only the V3 and later headers are guaranteed to carry an alpha mask
+        uint32_t alphaMask = (headerSize > kSWBMPInfoHeaderSize) ? SWBMPRead32(masks + 12) : 0;
+        if (alphaMask != 0 && alphaMask != 0xFF000000)
+            return nil;
+        hasAlpha = (alphaMask != 0);
+    }
+    else if (compression != kSWBMPCompressionRGB)
+        return nil;
+
+    isTopDown = (height < 0);
+    bitsPerPixel = bitCount;
+    rowBytes = SWBMPRowBytes(width, bitCount);
+    size = NSMakeSize(width, ABS(height));
+
+    // Don't trust the header: make sure every row is really in the file
+    if (pixelOffset > mappedLength ||
+        (mappedLength - pixelOffset) / rowBytes < (size_t)size.height)
+        return nil;
+    pixels = mappedFile + pixelOffset;
+
+    return self;
+}
+
+
+- (void)dealloc
+{
+    if (mappedFile)
+        munmap((void *)mappedFile, mappedLength);
+    if (fileDescriptor >= 0)
+        close(fileDescriptor);
+}
+
+
+- (void)readIntoImage:(NSBitmapImageRep *)image
+{
+    NSInteger width = (NSInteger)size.width;
+    NSInteger height = (NSInteger)size.height;
+    NSAssert(image.pixelsWide == width && image.pixelsHigh == height && image.bitsPerPixel == 32,
+             @"The image has to match the file!");
+
+    unsigned char *dest = image.bitmapData;
+    NSInteger destRowBytes = image.bytesPerRow;
+    NSInteger bands = (height + kSWBMPBandRows - 1) / kSWBMPBandRows;
+
+    // Bottom-up files line up row for row with the canvas, so each file row
+    // only has to be swizzled into place.  Every band is independent
+    dispatch_apply(bands, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t band) {
+        NSInteger first = band * kSWBMPBandRows;
+        NSInteger last = MIN(first + kSWBMPBandRows, height);
+        for (NSInteger row = first; row < last; row++)
+        {
+            const unsigned char *src = pixels + row * rowBytes;
+            NSInteger destRow = isTopDown ? (height - 1 - row) : row;
+            uint32_t *dst = (uint32_t *)(dest + destRow * destRowBytes);
+
+            if (bitsPerPixel == 32)
+                SWBMPSwizzleRow32(src, dst, width, hasAlpha);
+            else
+                SWBMPSwizzleRow24(src, dst, width);
+        }
+    });
+}
+
+@end
+
+
+@implementation SWBMPWriter
+
+// Premultiplied RGBA back to the straight BGRA (or BGR) that BMP wants
+static void SWBMPUnswizzleRow(const unsigned char *src, unsigned char *dst, NSInteger width,
+                              BOOL hasAlpha)
+{
+    for (NSInteger x = 0; x < width; x++, src += 4)
+    {
+        uint32_t a = src[3];
+        uint32_t r = src[0], g = src[1], b = src[2];
+        if (hasAlpha && a != 255)
+        {
+            if (a == 0)
+                r = g = b = 0;
+            else
+            {
+                r = MIN((r * 255 + a / 2) / a, 255);
+                g = MIN((g * 255 + a / 2) / a, 255);
+                b = MIN((b * 255 + a / 2) / a, 255);
+            }
+        }
+
+        *dst++ = b;
+        *dst++ = g;
+        *dst++ = r;
+        if (hasAlpha)
+            *dst++ = a;
+    }
+}
+
+
++ (BOOL)writeImage:(NSBitmapImageRep *)image toURL:(NSURL *)url error:(NSError **)outError
+{
+    NSAssert(image.bitsPerPixel == 32 && image.samplesPerPixel == 4 && !image.isPlanar,
+             @"The BMP writer only takes 8-bit RGBA images");
+
+    NSInteger width = image.pixelsWide;
+    NSInteger height = image.pixelsHigh;
+    NSInteger srcRowBytes = image.bytesPerRow;
+    const unsigned char *src = image.bitmapData;
+
+    // One quick scan (which usually stops at the first transparent pixel) saves
+    // a quarter of the file for opaque images
+    BOOL hasAlpha = NO;
+    for (NSInteger row = 0; row < height && !hasAlpha; row++)
+    {
+        const unsigned char *p = src + row * srcRowBytes;
+        for (NSInteger x = 0; x < width; x++)
+        {
+            if (p[4 * x + 3] != 255)
+            {
+                hasAlpha = YES;
+                break;
+            }
+        }
+    }
+
+    NSInteger bitsPerPixel = hasAlpha ? 32 : 24;
+    NSInteger rowBytes = SWBMPRowBytes(width, bitsPerPixel);
+    uint32_t headerSize = hasAlpha ? kSWBMPV4HeaderSize : kSWBMPInfoHeaderSize;
+    uint32_t pixelOffset = kSWBMPFileHeaderSize + headerSize;
+    uint64_t fileSize = pixelOffset + (uint64_t)rowBytes * height;
+
+    if (fileSize > UINT32_MAX)
+    {
+        if (outError)
+            *outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:EFBIG userInfo:nil];
+        return NO;
+    }
+
+    unsigned char header[kSWBMPFileHeaderSize + kSWBMPV4HeaderSize];
+    memset(header, 0, sizeof(header));
+    header[0] = 'B';
+    header[1] = 'M';
+    SWBMPWrite32(header + 2, (uint32_t)fileSize);
+    SWBMPWrite32(header + 10, pixelOffset);
+
+    unsigned char *info = header + kSWBMPFileHeaderSize;
+    SWBMPWrite32(info, headerSize);
+    SWBMPWrite32(info + 4, (uint32_t)width);
+    SWBMPWrite32(info + 8, (uint32_t)height);       // Positive: bottom-up
+    SWBMPWrite16(info + 12, 1);
+    SWBMPWrite16(info + 14, bitsPerPixel);
+    SWBMPWrite32(info + 16, hasAlpha ? kSWBMPCompressionBitfields : kSWBMPCompressionRGB);
+    SWBMPWrite32(info + 20, (uint32_t)(rowBytes * height));
+    SWBMPWrite32(info + 24, 2835);                  // 72 DPI, in pixels per meter
+    SWBMPWrite32(info + 28, 2835);
+    if (hasAlpha)
+    {
+        SWBMPWrite32(info + 40, 0x00FF0000);
+        SWBMPWrite32(info + 44, 0x0000FF00);
+        SWBMPWrite32(info + 48, 0x000000FF);
+        SWBMPWrite32(info + 52, 0xFF000000);
+        SWBMPWrite32(info + 56, 0x73524742);        // 'sRGB'
+    }
+
+    FILE *file = fopen(url.fileSystemRepresentation, "wb");
+    if (!file)
+    {
+        if (outError)
+            *outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        return NO;
+    }
+
+    BOOL success = (fwrite(header, 1, pixelOffset, file) == pixelOffset);
+
+    // The image is upright and the file is bottom-up, so walk it backwards, one
+    // band at a time. Padding bytes stay zero from the calloc
+    unsigned char *band = calloc(kSWBMPBandRows, rowBytes);
+    for (NSInteger row = height - 1; success && row >= 0; )
+    {
+        NSInteger count = MIN(kSWBMPBandRows, row + 1);
+        for (NSInteger i = 0; i < count; i++, row--)
+            SWBMPUnswizzleRow(src + row * srcRowBytes, band + i * rowBytes, width, hasAlpha);
+
+        success = (fwrite(band, rowBytes, count, file) == (size_t)count);
+    }
+    free(band);
+
+    if (fclose(file) != 0)
+        success = NO;
+
+    if (!success && outError)
+        *outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+    return success;
+}
+
+@end
@@ -28,12 +28,12 @@
     NSInteger bombSpeed;
     BOOL isExploding;
     NSPoint p;
-    NSTimer *bombTimer;
+    dispatch_source_t bombTimer;
     NSColor *bombColor;
 }
 
-- (void)drawNewCircle:(NSTimer *)timer;
-- (void)endExplosion:(NSTimer *)timer;
+- (void)drawNewCircle;
+- (void)endExplosion;
 
 
 @end
@@ -35,7 +35,7 @@
     if (event == MOUSE_DOWN) {
         // If there's an explosion going on, kill it
         if (isExploding) {
-            [self endExplosion:bombTimer];
+            [self endExplosion];
         }
         
         i = 0;
@@ -53,19 +53,29 @@
             bombSpeed = 50;
         }
         max = sqrt(mainImage.size.width*mainImage.size.width + _mainImage.size.height*_mainImage.size.height);
-        bombTimer = [NSTimer scheduledTimerWithTimeInterval:(1.0/60.0) // 1 μs
-                                                     target:self
-                                                   selector:@selector(drawNewCircle:)
-                                                   userInfo:nil
-                                                    repeats:YES];
+        bombTimer = [self startTimerWithInterval:(1.0/60.0) // 1 μs
+                                         handler:^{
+                                             [self drawNewCircle];
+                                         }];
         isExploding = YES;
     }
     return nil;
 }
 
+- (BOOL)drawsOffMainThread
+{
+    return YES;
+}
+
+- (BOOL)isAnimating
+{
+    return isExploding;
+}
+
 // Each time this method is called (by the timer), a larger circle is drawn. This happens
-// until the circle is larger than the image, at which point we can end the animation
-- (void)drawNewCircle:(NSTimer *)timer
+// until the circle is larger than the image, at which point we can end the animation.
+// The circles go in the buffer, so the main image is only touched once it's over
+- (void)drawNewCircle
 {
     if (i < max) {
         // Where to draw the circle - it's a square!
@@ -75,7 +85,7 @@
         rect.size.height = 2*i;
         
         // Perform the actual drawing
-        SWLockFocus(_mainImage);
+        SWLockFocus(_bufferImage);
         
         //SWClearImageRect(image, rect);
         
@@ -86,27 +96,39 @@
         [bombColor set];
         [[NSBezierPath bezierPathWithOvalInRect:rect] fill];
         [NSGraphicsContext restoreGraphicsState];
-        SWUnlockFocus(_mainImage);
+        SWUnlockFocus(_bufferImage);
         
         // Change the redraw rect
         redrawRect = rect;
 
         // Get the view to perform a redraw to see the new circle
-        [NSApp sendAction:@selector(refreshImage:)
-                       to:nil
-                     from:self];
+        [self refreshInvalidRect];
         
         // bombSpeed == either 2 or 25, depending on the shift
         i += bombSpeed;
+    } else if ([NSThread isMainThread]) {
+        [self endExplosion];
     } else {
-        [self endExplosion:timer];
+        // The undo and the main image both belong to the main thread.  If
+        // another click gets there first, it's a different explosion by then
+        dispatch_source_t finishedTimer = bombTimer;
+        dispatch_source_cancel(finishedTimer);
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (self->bombTimer == finishedTimer)
+                [self endExplosion];
+        });
     }
 }
 
-- (void)endExplosion:(NSTimer *)timer
+- (void)endExplosion
 {
+    // A click may have beaten the timer to it
+    if (!isExploding)
+        return;
+    
     // Stop the timer
-    [timer invalidate];
+    [self stopTimer:bombTimer];
+    bombTimer = nil;
     [document handleUndoWithImageData:nil frame:NSZeroRect];
     
     SWLockFocus(_mainImage);    
@@ -115,10 +137,10 @@
     SWUnlockFocus(_mainImage);
 
     [SWImageTools clearImage:_bufferImage];
+    isExploding = NO;
     [NSApp sendAction:@selector(refreshImage:)
                    to:nil
                  from:nil];
-    isExploding = NO;
 }
 
 - (NSCursor *)cursor
@@ -135,7 +157,7 @@
 - (void)tieUpLooseEnds
 {
     if (isExploding) {
-        [self endExplosion:bombTimer];
+        [self endExplosion];
     }
     
     [super tieUpLooseEnds];
@@ -0,0 +1,274 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "SWBrushEngine.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Enough for a few sizes of each shape
+#define SW_BRUSH_CACHE_SLOTS 16
+
+// Samples a side per pixel, when a mask is worked out from a shape
+#define SW_BRUSH_SUBSAMPLES 4
+
+// Where alpha is in a pixel read as one 32-bit word
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SW_ALPHA_SHIFT 0
+#else
+#define SW_ALPHA_SHIFT 24
+#endif
+
+typedef struct {
+    SWBrushTipShape shape;
+    unsigned long custom;       // Which custom mask it was made from
+    unsigned long lastUse;
+    SWBrushTip tip;
+} SWBrushCacheSlot;
+
+struct SWBrushTipCache {
+    SWBrushCacheSlot slots[SW_BRUSH_CACHE_SLOTS];
+    unsigned long clock;
+
+    uint8_t *customMask;
+    long customWidth, customHeight;
+    unsigned long custom;
+};
+
+
+SWBrushTipCache *SWBrushTipCacheCreate(void)
+{
+    return calloc(1, sizeof(SWBrushTipCache));
+}
+
+
+void SWBrushTipCacheDestroy(SWBrushTipCache *cache)
+{
+    if (!cache)
+        return;
+    for (int i = 0; i < SW_BRUSH_CACHE_SLOTS; i++)
+        free((void *)cache->slots[i].tip.mask);
+    free(cache->customMask);
+    free(cache);
+}
+
+
+void SWBrushTipCacheSetCustomMask(SWBrushTipCache *cache, const uint8_t *mask,
+                                  long width, long height, size_t bytesPerRow)
+{
+    free(cache->customMask);
+    cache->customMask = NULL;
+    cache->custom++;
+    if (!mask || width <= 0 || height <= 0)
+        return;
+
+    cache->customMask = malloc((size_t)width * height);
+    if (!cache->customMask)
+        return;
+    for (long y = 0; y < height; y++)
+        memcpy(cache->customMask + y * width, mask + y * bytesPerRow, width);
+    cache->customWidth = width;
+    cache->customHeight = height;
+}
+
+
+// The custom mask at a point, in its own pixels, between pixel centers
+static double SWBrushCustomSample(const SWBrushTipCache *cache, double x, double y)
+{
+    long w = cache->customWidth, h = cache->customHeight;
+    x -= 0.5;
+    y -= 0.5;
+    long x0 = (long)floor(x), y0 = (long)floor(y);
+    double fx = x - x0, fy = y - y0;
+    double value = 0;
+    for (int j = 0; j < 2; j++)
+    {
+        long sy = y0 + j < 0 ? 0 : (y0 + j >= h ? h - 1 : y0 + j);
+        for (int i = 0; i < 2; i++)
+        {
+            long sx = x0 + i < 0 ? 0 : (x0 + i >= w ? w - 1 : x0 + i);
+            value += cache->customMask[sy * w + sx] * (i ? fx : 1 - fx) * (j ? fy : 1 - fy);
+        }
+    }
+    return value / 255.0;
+}
+
+
+// How much of the tip covers a point, with (0, 0) at its center and the
+// tip running from -size / 2 to size / 2 both ways
+static double SWBrushShapeValue(const SWBrushTipCache *cache, SWBrushTipShape shape, long size, double x, double y)
+{
+    double radius = size * 0.5;
+    switch (shape)
+    {
+        case SWTipRound:
+            return (x * x + y * y <= radius * radius) ? 1.0 : 0.0;
+        case SWTipSquare:
+            return 1.0;
+        case SWTipSoft:
+        {
+            double d2 = (x * x + y * y) / (radius * radius);
+            if (d2 >= 1.0)
+                return 0.0;
+            double taper = 1.0 - d2;
+            return exp(-2.0 * d2) * taper * taper;
+        }
+        case SWTipCustom:
+        {
+            // Scaled to fit, keeping its shape, and centered
+            long w = cache->customWidth, h = cache->customHeight;
+            double scale = (double)(w > h ? w : h) / size;
+            double sx = x * scale + w * 0.5, sy = y * scale + h * 0.5;
+            if (sx < 0 || sy < 0 || sx >= w || sy >= h)
+                return 0.0;
+            return SWBrushCustomSample(cache, sx, sy);
+        }
+    }
+    return 0.0;
+}
+
+
+static uint8_t *SWBrushMakeMask(const SWBrushTipCache *cache, SWBrushTipShape shape, long size)
+{
+    uint8_t *mask = malloc((size_t)size * size);
+    if (!mask)
+        return NULL;
+
+    // A round tip a pixel or two across is a square one
+    if (shape == SWTipRound && size <= 2)
+        shape = SWTipSquare;
+
+    // Only hard edges and shrunken images need more than one sample a pixel
+    int n = 1;
+    if (shape == SWTipRound)
+        n = SW_BRUSH_SUBSAMPLES;
+    else if (shape == SWTipCustom && (cache->customWidth > size || cache->customHeight > size))
+        n = SW_BRUSH_SUBSAMPLES;
+    double half = size * 0.5;
+    for (long y = 0; y < size; y++)
+    {
+        for (long x = 0; x < size; x++)
+        {
+            double sum = 0;
+            for (int j = 0; j < n; j++)
+                for (int i = 0; i < n; i++)
+                    sum += SWBrushShapeValue(cache, shape, size,
+                                             x + (i + 0.5) / n - half,
+                                             y + (j + 0.5) / n - half);
+            mask[y * size + x] = (uint8_t)(sum / (n * n) * 255.0 + 0.5);
+        }
+    }
+    return mask;
+}
+
+
+const SWBrushTip *SWBrushTipCacheGet(SWBrushTipCache *cache, SWBrushTipShape shape, long size)
+{
+    if (size < 1)
+        size = 1;
+    if (size > SW_BRUSH_MAX_TIP_SIZE)
+        size = SW_BRUSH_MAX_TIP_SIZE;
+    if (shape == SWTipCustom && !cache->customMask)
+        return NULL;
+
+    unsigned long custom = (shape == SWTipCustom) ? cache->custom : 0;
+    SWBrushCacheSlot *victim = &cache->slots[0];
+    for (int i = 0; i < SW_BRUSH_CACHE_SLOTS; i++)
+    {
+        SWBrushCacheSlot *slot = &cache->slots[i];
+        if (slot->tip.mask && slot->shape == shape && slot->tip.size == size && slot->custom == custom)
+        {
+            slot->lastUse = ++cache->clock;
+            return &slot->tip;
+        }
+        if (!slot->tip.mask || (victim->tip.mask && slot->lastUse < victim->lastUse))
+            victim = slot;
+    }
+
+    uint8_t *mask = SWBrushMakeMask(cache, shape, size);
+    if (!mask)
+        return NULL;
+    free((void *)victim->tip.mask);
+    victim->shape = shape;
+    victim->custom = custom;
+    victim->lastUse = ++cache->clock;
+    victim->tip.size = size;
+    victim->tip.mask = mask;
+    return &victim->tip;
+}
+
+
+void SWBrushDabOrigin(const SWBrushTip *tip, double x, double y, long *left, long *top)
+{
+    *left = (long)floor(x - tip->size * 0.5 + 0.5);
+    *top = (long)floor(y - tip->size * 0.5 + 0.5);
+}
+
+
+// Every byte of a pixel times alpha / 255, rounded, two bytes at a time
+static inline uint32_t SWBrushScale(uint32_t pixel, uint32_t alpha)
+{
+    uint32_t rb = (pixel & 0x00FF00FF) * alpha + 0x00800080;
+    uint32_t ag = ((pixel >> 8) & 0x00FF00FF) * alpha + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    ag = ((ag + ((ag >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    return rb | (ag << 8);
+}
+
+
+// One row of a dab.  No branches and nothing carried from one pixel to the
+// next, so the compiler turns it into vector code
+static void SWBrushStampRow(uint32_t *restrict pixels, const uint8_t *restrict mask, long count, uint32_t color)
+{
+    for (long i = 0; i < count; i++)
+    {
+        uint32_t source = SWBrushScale(color, mask[i]);
+        uint32_t dest = pixels[i];
+        pixels[i] = ((source >> SW_ALPHA_SHIFT) & 0xFF) > ((dest >> SW_ALPHA_SHIFT) & 0xFF) ? source : dest;
+    }
+}
+
+
+void SWBrushStamp(uint8_t *pixels, long width, long height, size_t bytesPerRow,
+                  const SWBrushTip *tip, long left, long top, const uint8_t rgba[4])
+{
+    long x0 = left < 0 ? 0 : left;
+    long y0 = top < 0 ? 0 : top;
+    long x1 = left + tip->size > width ? width : left + tip->size;
+    long y1 = top + tip->size > height ? height : top + tip->size;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    // Premultiplied, so no channel can be more than the alpha
+    uint8_t clamped[4] = { rgba[0], rgba[1], rgba[2], rgba[3] };
+    for (int c = 0; c < 3; c++)
+        if (clamped[c] > clamped[3])
+            clamped[c] = clamped[3];
+    uint32_t color;
+    memcpy(&color, clamped, 4);
+
+    for (long y = y0; y < y1; y++)
+    {
+        uint32_t *row = (uint32_t *)(pixels + (size_t)y * bytesPerRow) + x0;
+        const uint8_t *mask = tip->mask + (y - top) * tip->size + (x0 - left);
+        SWBrushStampRow(row, mask, x1 - x0, color);
+    }
+}
@@ -0,0 +1,85 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Brush strokes made of dabs: one stamp of a tip every so often along the
+// stroke.
+//
+// A tip is an 8-bit mask, square, worked out once for each shape and size
+// and kept in a small cache, so changing sizes back and forth doesn't cost
+// anything after the first time.  A dab only touches the pixels under its
+// mask, and where dabs overlap, each pixel keeps whichever one covered it
+// most.  That way a stroke is as opaque as its tip however close together
+// the dabs are, and the stroke goes down over the image in one piece at the
+// end, like the other tools' buffers do.
+//
+// Pixels are 8-bit premultiplied RGBA, and coordinates count rows in memory
+// order.  Plain C, so it can be built and hammered on anywhere.  Not
+// thread-safe.
+
+#ifndef SWBRUSHENGINE_H
+#define SWBRUSHENGINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SW_BRUSH_MAX_TIP_SIZE 1024
+
+typedef enum {
+    SWTipRound,      // Hard, with antialiased edges
+    SWTipSquare,
+    SWTipSoft,       // A Gaussian, tapered to nothing at the edge
+    SWTipCustom      // From SWBrushTipCacheSetCustomMask
+} SWBrushTipShape;
+
+typedef struct {
+    long size;               // Pixels a side
+    const uint8_t *mask;     // size * size, a row after another
+} SWBrushTip;
+
+typedef struct SWBrushTipCache SWBrushTipCache;
+
+SWBrushTipCache *SWBrushTipCacheCreate(void);
+void SWBrushTipCacheDestroy(SWBrushTipCache *cache);
+
+// The mask custom tips are made from, scaled to fit, at any size.  It's
+// copied.  Custom tips made from an earlier mask are thrown away
+void SWBrushTipCacheSetCustomMask(SWBrushTipCache *cache, const uint8_t *mask,
+                                  long width, long height, size_t bytesPerRow);
+
+// The tip, made if it isn't cached already.  Sizes are clamped to between 1
+// and SW_BRUSH_MAX_TIP_SIZE.  NULL if there's no custom mask for a custom tip,
+// or no memory.  Good until the next call
+const SWBrushTip *SWBrushTipCacheGet(SWBrushTipCache *cache, SWBrushTipShape shape, long size);
+
+// The top left pixel of a dab centered on (x, y)
+void SWBrushDabOrigin(const SWBrushTip *tip, double x, double y, long *left, long *top);
+
+// Stamps a dab of a premultiplied color, clipped to the image
+void SWBrushStamp(uint8_t *pixels, long width, long height, size_t bytesPerRow,
+                  const SWBrushTip *tip, long left, long top, const uint8_t rgba[4]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,7 +19,31 @@
 
 #import <Cocoa/Cocoa.h>
 #import "SWTool.h"
+#import "SWBrushEngine.h"
 
-@interface SWBrushTool : SWTool
+// What the brush paints with
+typedef NS_ENUM(NSInteger, SWBrushStyle) {
+    SWBrushStyleLine = 0,       // A plain line, lineWidth wide
+    SWBrushStyleRound,          // The rest are dabs of a tip lineWidth across
+    SWBrushStyleSquare,
+    SWBrushStyleSoft,
+    SWBrushStyleImage           // Made from the image at kSWBrushTipImageKey
+};
+
+extern NSString * const kSWBrushStyleKey;       // An SWBrushStyle
+extern NSString * const kSWBrushSpacingKey;     // Between dabs, as a percentage of the tip's size
+extern NSString * const kSWBrushTipImageKey;    // A path
+
+@interface SWBrushTool : SWTool {
+    SWBrushTipCache *tips;
+    NSString *tipImagePath;     // What the custom tips in the cache were made from
+    
+    // The current stroke's, if it's made of dabs
+    const SWBrushTip *tip;
+    uint8_t tipColor[4];
+    
+    // How much of the path is in the buffer already, if it's a line
+    NSInteger strokedElements;
+}
 
 @end
@@ -20,8 +20,112 @@
 #import "SWBrushTool.h"
 #import "SWDocument.h"
 
+NSString * const kSWBrushStyleKey = @"BrushStyle";
+NSString * const kSWBrushSpacingKey = @"BrushSpacing";
+NSString * const kSWBrushTipImageKey = @"BrushTipImage";
+
 @implementation SWBrushTool
 
+- (void)dealloc
+{
+    SWBrushTipCacheDestroy(tips);
+}
+
+// Dark, opaque parts of the image paint; light or clear parts don't.  Flipped
+// on the way in, like everything else in the canvas
+- (void)loadTipImage:(NSString *)imagePath
+{
+    tipImagePath = [imagePath copy];
+    NSImage *tipImage = imagePath ? [[NSImage alloc] initWithContentsOfFile:imagePath] : nil;
+    NSImageRep *bestRep = [tipImage bestRepresentationForRect:NSMakeRect(0, 0, SW_BRUSH_MAX_TIP_SIZE, SW_BRUSH_MAX_TIP_SIZE) 
+                                                      context:nil 
+                                                        hints:nil];
+    NSInteger w = MIN(bestRep.pixelsWide ?: tipImage.size.width, SW_BRUSH_MAX_TIP_SIZE);
+    NSInteger h = MIN(bestRep.pixelsHigh ?: tipImage.size.height, SW_BRUSH_MAX_TIP_SIZE);
+    if (w <= 0 || h <= 0)
+    {
+        SWBrushTipCacheSetCustomMask(tips, NULL, 0, 0, 0);
+        return;
+    }
+    
+    NSBitmapImageRep *rep = nil;
+    [SWImageTools initImageRep:&rep withSize:NSMakeSize(w, h)];
+    SWLockFocus(rep);
+    [tipImage drawInRect:NSMakeRect(0, 0, w, h)];
+    SWUnlockFocus(rep);
+    
+    NSMutableData *mask = [NSMutableData dataWithLength:w * h];
+    uint8_t *m = mask.mutableBytes;
+    for (NSInteger y = 0; y < h; y++)
+    {
+        const uint8_t *p = rep.bitmapData + (h - 1 - y) * rep.bytesPerRow;
+        for (NSInteger x = 0; x < w; x++, p += 4)
+        {
+            NSInteger luma = (299 * p[0] + 587 * p[1] + 114 * p[2]) / 1000;
+            m[y * w + x] = MAX(p[3] - luma, 0);
+        }
+    }
+    SWBrushTipCacheSetCustomMask(tips, m, w, h, w);
+}
+
+// The tip for a new stroke, or NULL if it's to be a line
+- (const SWBrushTip *)tipForImage:(NSBitmapImageRep *)image
+{
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    SWBrushStyle style = [defaults integerForKey:kSWBrushStyleKey];
+    if (style == SWBrushStyleLine || image.bitsPerPixel != 32 || image.isPlanar)
+        return NULL;
+    
+    if (!tips)
+        tips = SWBrushTipCacheCreate();
+    SWBrushTipShape shape = SWTipRound;
+    switch (style)
+    {
+        case SWBrushStyleSquare:
+            shape = SWTipSquare;
+            break;
+        case SWBrushStyleSoft:
+            shape = SWTipSoft;
+            break;
+        case SWBrushStyleImage:
+        {
+            shape = SWTipCustom;
+            NSString *imagePath = [defaults stringForKey:kSWBrushTipImageKey];
+            if (!tipImagePath || ![imagePath isEqualToString:tipImagePath])
+                [self loadTipImage:imagePath];
+            break;
+        }
+        default:
+            break;
+    }
+    return SWBrushTipCacheGet(tips, shape, lineWidth);
+}
+
+// Stamps one dab and its symmetric copies, adding each one's rectangle to the
+// redraw rect
+- (void)stampDabAtPoint:(NSPoint)point inImage:(NSBitmapImageRep *)image
+{
+    // Like the line: each point is the pixel to its upper right
+    NSPoint centers[kSWMaxSymmetryCopies];
+    NSUInteger count = [self symmetricPoints:centers ofPoint:NSMakePoint(point.x + 0.5, point.y + 0.5)];
+    NSInteger height = image.pixelsHigh;
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        long left, top;
+        SWBrushDabOrigin(tip, centers[i].x, height - centers[i].y, &left, &top);
+        SWBrushStamp(image.bitmapData, image.pixelsWide, height, image.bytesPerRow, tip, left, top, tipColor);
+        [self addPieceToRedrawRect:NSMakeRect(left, height - top - tip->size, tip->size, tip->size)];
+    }
+}
+
+- (CGFloat)dragSpacing
+{
+    if (!tip)
+        return 0.0;
+    CGFloat spacing = [NSUserDefaults.standardUserDefaults doubleForKey:kSWBrushSpacingKey];
+    return MAX(1.0, tip->size * spacing / 100.0);
+}
+
 // Generates the path to be drawn to the image
 - (NSBezierPath *)pathFromPoint:(NSPoint)begin toPoint:(NSPoint)end
 {
@@ -29,6 +133,14 @@
     {
         path = NSBezierPath.bezierPath;
         path.lineWidth = lineWidth;        
+        
+        // Smooth strokes are one round-jointed line, so their edges never
+        // overlap each other's
+        if (self.antialias)
+        {
+            path.lineCapStyle = NSLineCapStyleRound;
+            path.lineJoinStyle = NSLineJoinStyleRound;
+        }
     }
     //if (lineWidth <= 1) 
     //{
@@ -39,7 +151,8 @@
     end.x += 0.5;
     end.y += 0.5;
     //}
-    [path moveToPoint:begin];
+    if (path.isEmpty || !NSEqualPoints(path.currentPoint, begin) || !self.antialias)
+        [path moveToPoint:begin];
     [path lineToPoint:end];
 
     return path;
@@ -51,6 +164,19 @@
                          bufferImage:(NSBitmapImageRep *)bufferImage 
                           mouseEvent:(SWMouseEvent)event
 {
+    if (event == MOUSE_DOWN)
+    {
+        [self beginSymmetryInImage:bufferImage];
+        strokedElements = 0;
+        tip = [self tipForImage:bufferImage];
+        if (tip)
+        {
+            NSColor *color = (flags & NSEventModifierFlagOption) ? backColor : frontColor;
+            SWGetPremultipliedColor(color, tipColor);
+            [SWImageTools clearImage:bufferImage];
+        }
+    }
+    
     // Use the points clicked to build a redraw rectangle
     [super addRedrawRectFromPoint:point toPoint:savedPoint];
     
@@ -61,32 +187,109 @@
         [SWImageTools clearImage:bufferImage];
 
         path = nil;
+        tip = NULL;
     } 
+    else if (tip)
+    {
+        // Only the dabs need redrawing
+        [self beginRedrawBatch];
+        [self stampDabAtPoint:point inImage:bufferImage];
+        [self endRedrawBatch];
+        savedPoint = point;
+    }
     else 
     {        
-        SWLockFocus(bufferImage);
-        
-        // The best way I can come up with to clear the image
-        [SWImageTools clearImage:bufferImage];
-        
-        [[NSGraphicsContext currentContext] setShouldAntialias:NO];
-        
-        [NSGraphicsContext saveGraphicsState];
-        [NSGraphicsContext currentContext].compositingOperation = NSCompositingOperationCopy;
-        if (flags & NSEventModifierFlagOption)
-            [backColor setStroke];    
-        else
-            [frontColor setStroke];
-        
-        [[self pathFromPoint:savedPoint toPoint:point] stroke];
-        [NSGraphicsContext restoreGraphicsState];
+        [self pathFromPoint:savedPoint toPoint:point];
         savedPoint = point;
-        
-        SWUnlockFocus(bufferImage);
+        [self strokePathInImage:bufferImage];
     }
     return nil;
 }
 
+// A batch of drag points only needs the stroke redrawn once, at the end
+- (NSBezierPath *)performDrawAlongPoints:(const NSPoint *)points
+                                   count:(NSUInteger)count
+                           withMainImage:(NSBitmapImageRep *)mainImage
+                             bufferImage:(NSBitmapImageRep *)bufferImage
+{
+    [self beginRedrawBatch];
+    
+    // The paint view has already spaced the points out for the dabs
+    if (tip)
+    {
+        for (NSUInteger i = 0; i < count; i++)
+            [self stampDabAtPoint:points[i] inImage:bufferImage];
+        if (count)
+            savedPoint = points[count - 1];
+        [self endRedrawBatch];
+        return nil;
+    }
+    
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        [super addRedrawRectFromPoint:points[i] toPoint:savedPoint];
+        [self pathFromPoint:savedPoint toPoint:points[i]];
+        savedPoint = points[i];
+    }
+    [self endRedrawBatch];
+    
+    if (count)
+        [self strokePathInImage:bufferImage];
+    return nil;
+}
+
+// Nothing but the path and the buffer changes between mouse down and mouse up
+- (BOOL)drawsOffMainThread
+{
+    return YES;
+}
+
+- (void)strokePathInImage:(NSBitmapImageRep *)bufferImage
+{
+    // Smooth strokes are drawn again where the new segments reach, joins and
+    // all, which comes out the same as the whole stroke
+    if (self.antialias)
+    {
+        if (strokedElements == 0)
+            [SWImageTools clearImage:bufferImage];
+        strokedElements = path.elementCount;
+        
+        NSRect rects[kSWMaxSymmetryCopies];
+        NSUInteger count = [self getInvalidRects:rects];
+        [self restrokeSymmetricPath:path 
+                            inImage:bufferImage 
+                          withColor:((flags & NSEventModifierFlagOption) ? backColor : frontColor) 
+                            inRects:rects 
+                              count:count];
+        return;
+    }
+    
+    // Aliased strokes are a separate line for every segment, so only the ones
+    // added since last time need drawing
+    NSBezierPath *segments = [self symmetricPath:path fromElement:strokedElements];
+    
+    SWLockFocus(bufferImage);
+    
+    // The best way I can come up with to clear the image
+    if (strokedElements == 0)
+        [SWImageTools clearImage:bufferImage];
+    strokedElements = path.elementCount;
+    
+    [[NSGraphicsContext currentContext] setShouldAntialias:NO];
+    
+    [NSGraphicsContext saveGraphicsState];
+    [NSGraphicsContext currentContext].compositingOperation = NSCompositingOperationCopy;
+    if (flags & NSEventModifierFlagOption)
+        [backColor setStroke];    
+    else
+        [frontColor setStroke];
+    
+    [segments stroke];
+    [NSGraphicsContext restoreGraphicsState];
+    
+    SWUnlockFocus(bufferImage);
+}
+
 - (NSCursor *)cursor
 {
     if (!customCursor) {
@@ -0,0 +1,87 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+#import <stdatomic.h>
+#import "SWTileHandoff.h"
+#import "SWTool.h"
+
+// Rasterizes into a canvas's buffer image on a thread of its own, and hands
+// what it draws to the main thread a frame at a time.
+//
+// While a session is running the buffer image belongs to the render queue:
+// the main thread must only touch it from inside -performOnMainThread:, and
+// should show it with -drawInContext: rather than drawing it directly
+@interface SWCanvasRenderer : NSObject
+{
+    NSBitmapImageRep *bufferImage;
+    NSBitmapImageRep *frontImages[2];
+    CGColorSpaceRef colorSpace;
+    dispatch_queue_t queue;
+    SWTileHandoff *handoff;
+    
+    // Until a session's first frame is out, the main thread keeps drawing
+    // straight from the buffer
+    atomic_bool hasFirstFrame;
+    BOOL isRunning;
+    
+    // A frame that couldn't go out because the last one was still being
+    // shown goes out as soon as that one's let go of
+    atomic_bool publishDeferred;
+    
+    // Render queue only: what's been marked since the last frame went out, in
+    // as many pieces as a symmetric stroke has copies
+    NSRect unsentRects[kSWMaxSymmetryCopies];
+    NSUInteger unsentRectCount;
+}
+
+- (instancetype)initWithBufferImage:(NSBitmapImageRep *)image NS_DESIGNATED_INITIALIZER;
+
+@property (readonly) NSBitmapImageRep *bufferImage;
+@property (readonly) dispatch_queue_t queue;
+@property (readonly) BOOL isRunning;
+
+// Called on the main thread whenever a new frame is ready, for each rect of it
+// that changed
+@property (copy) void (^displayHandler)(NSRect changedRect);
+
+// Main thread.  Starting brings the presentation buffers up to date with the
+// buffer image, in the background; stopping waits for everything queued
+- (void)start;
+- (void)stop;
+
+// Runs a block on the render queue, then sends out whatever it marked
+- (void)perform:(dispatch_block_t)block;
+
+// Main thread, once it's drawn into the buffer itself (after -waitUntilDone):
+// sends the rect out with the next frame
+- (void)publishRect:(NSRect)rect;
+
+// Waits until everything queued so far has been drawn.  Main thread only
+- (void)waitUntilDone;
+
+// Render queue only
+- (void)markDirty:(NSRect)rect;
+- (void)publish;
+
+// Main thread: draws the latest frame the size of the buffer.  Returns NO if
+// it isn't running, and the caller should draw the buffer image itself
+- (BOOL)drawInContext:(CGContextRef)context;
+
+@end
@@ -0,0 +1,214 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWCanvasRenderer.h"
+
+// Small enough that a brush dab doesn't copy much more than it touched, big
+// enough that a whole canvas doesn't mean millions of little copies
+static const size_t kSWRendererTileSize = 64;
+
+
+@interface SWCanvasRenderer (Private)
+- (void)releaseFront:(const void *)front;
+@end
+
+
+// Gives a frame back to the handoff once Core Graphics is done drawing it
+static void SWCanvasRendererReleaseFront(void *info, const void *data, size_t size)
+{
+#pragma unused (size)
+    SWCanvasRenderer *renderer = CFBridgingRelease(info);
+    [renderer releaseFront:data];
+}
+
+
+@implementation SWCanvasRenderer
+
+@synthesize bufferImage;
+@synthesize queue;
+@synthesize isRunning;
+@synthesize displayHandler;
+
+- (instancetype)init
+{
+    return [self initWithBufferImage:nil];
+}
+
+- (instancetype)initWithBufferImage:(NSBitmapImageRep *)image
+{
+    self = [super init];
+    if (self && image)
+    {
+        bufferImage = image;
+        NSBitmapImageRep *front0 = nil, *front1 = nil;
+        [SWImageTools initImageRep:&front0 withSize:image.size];
+        [SWImageTools initImageRep:&front1 withSize:image.size];
+        frontImages[0] = front0;
+        frontImages[1] = front1;
+        colorSpace = CGColorSpaceRetain(image.colorSpace.CGColorSpace);
+        
+        // Both presentation buffers come from the same place as the buffer image,
+        // so the three of them are laid out alike
+        handoff = SWTileHandoffCreate(image.pixelsWide, image.pixelsHigh, image.bitsPerPixel / 8,
+                                      image.bytesPerRow, kSWRendererTileSize,
+                                      frontImages[0].bitmapData, frontImages[1].bitmapData);
+        queue = dispatch_queue_create("com.soggywaffles.paintbrush.render", DISPATCH_QUEUE_SERIAL);
+        atomic_init(&hasFirstFrame, false);
+        atomic_init(&publishDeferred, false);
+    }
+    if (!handoff)
+        return nil;
+    return self;
+}
+
+- (void)dealloc
+{
+    SWTileHandoffDestroy(handoff);
+    CGColorSpaceRelease(colorSpace);
+}
+
+
+#pragma mark Sessions
+
+- (void)start
+{
+    if (isRunning)
+        return;
+    isRunning = YES;
+    atomic_store(&hasFirstFrame, false);
+    
+    // Someone else may have drawn in the buffer since last time
+    dispatch_async(queue, ^{
+        SWTileHandoffMarkAllDirty(self->handoff);
+        self->unsentRectCount = 0;
+        [self publish];
+    });
+}
+
+- (void)stop
+{
+    if (!isRunning)
+        return;
+    [self waitUntilDone];
+    isRunning = NO;
+}
+
+- (void)perform:(dispatch_block_t)block
+{
+    dispatch_async(queue, ^{
+        block();
+        [self publish];
+    });
+}
+
+- (void)publishRect:(NSRect)rect
+{
+    dispatch_async(queue, ^{
+        [self markDirty:rect];
+        [self publish];
+    });
+}
+
+- (void)waitUntilDone
+{
+    dispatch_sync(queue, ^{});
+}
+
+
+#pragma mark The render queue
+
+- (void)markDirty:(NSRect)rect
+{
+    rect = NSIntersectionRect(NSIntegralRect(rect), (NSRect){ NSZeroPoint, bufferImage.size });
+    if (NSIsEmptyRect(rect))
+        return;
+    unsentRectCount = SWAddRectToRects(rect, unsentRects, unsentRectCount, kSWMaxSymmetryCopies);
+    
+    // The view's y runs the same way as the image's, which puts its first row
+    // in memory at the top of the view
+    SWTileHandoffMarkDirty(handoff, (SWTileRect){
+        (size_t)NSMinX(rect), (size_t)(bufferImage.pixelsHigh - NSMaxY(rect)),
+        (size_t)NSWidth(rect), (size_t)NSHeight(rect)
+    });
+}
+
+- (void)publish
+{
+    if (!SWTileHandoffPublish(handoff, bufferImage.bitmapData))
+    {
+        atomic_store(&publishDeferred, true);
+        return;
+    }
+    atomic_store(&publishDeferred, false);
+    atomic_store(&hasFirstFrame, true);
+    
+    NSUInteger count = unsentRectCount;
+    unsentRectCount = 0;
+    if (count == 0)
+        return;
+    
+    NSData *changedRects = [NSData dataWithBytes:unsentRects length:count * sizeof(NSRect)];
+    void (^handler)(NSRect) = self.displayHandler;
+    if (handler)
+        dispatch_async(dispatch_get_main_queue(), ^{
+            const NSRect *rects = changedRects.bytes;
+            for (NSUInteger i = 0; i < count; i++)
+                handler(rects[i]);
+        });
+}
+
+
+#pragma mark Presenting
+
+- (BOOL)drawInContext:(CGContextRef)context
+{
+    if (!isRunning || !atomic_load(&hasFirstFrame))
+        return NO;
+    
+    const uint8_t *front = SWTileHandoffAcquireFront(handoff, NULL);
+    if (!front)
+        return NO;
+    
+    // Wraps the frame without copying it; it goes back to the handoff when Core
+    // Graphics lets go of the image
+    size_t length = bufferImage.bytesPerRow * bufferImage.pixelsHigh;
+    CGDataProviderRef provider = CGDataProviderCreateWithData((void *)CFBridgingRetain(self), front, length,
+                                                              SWCanvasRendererReleaseFront);
+    CGImageRef image = CGImageCreate(bufferImage.pixelsWide, bufferImage.pixelsHigh,
+                                     bufferImage.bitsPerSample, bufferImage.bitsPerPixel, bufferImage.bytesPerRow,
+                                     colorSpace, kCGImageAlphaPremultipliedLast | kCGBitmapByteOrderDefault,
+                                     provider, NULL, false, kCGRenderingIntentDefault);
+    CGDataProviderRelease(provider);
+    
+    NSRect rect = (NSRect){ NSZeroPoint, bufferImage.size };
+    CGContextDrawImage(context, NSRectToCGRect(rect), image);
+    CGImageRelease(image);
+    return YES;
+}
+
+- (void)releaseFront:(const void *)front
+{
+    SWTileHandoffReleaseFront(handoff, front);
+    if (atomic_exchange(&publishDeferred, false))
+        dispatch_async(queue, ^{
+            [self publish];
+        });
+}
+
+@end
@@ -23,7 +23,7 @@
     NSGradient *backgroundGradient;
     NSShadow *shadow;
     NSImage *bgImagePattern;
-    NSBitmapImageRep *bgImage;
+    NSColor *bgPatternColor;    // Tiles bgImagePattern at draw time
 }
 
 -(void)centerDocument;
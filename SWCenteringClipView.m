@@ -22,7 +22,19 @@
 
 @implementation SWCenteringClipView
 
-@synthesize bgImagePattern;
+- (NSImage *)bgImagePattern
+{
+    return bgImagePattern;
+}
+
+- (void)setBgImagePattern:(NSImage *)pattern
+{
+    bgImagePattern = pattern;
+    
+    // The pattern color is rebuilt from the new image when we next draw
+    bgPatternColor = nil;
+    [self setNeedsDisplay:YES];
+}
 
 - (void)drawRect:(NSRect)rect {
     // Draw a dark gray gradient background, using the new NSGradient class that has been added in Leopard.
@@ -48,13 +60,20 @@
     
     [shadow set];
     
-    // Draw the background -- either an image pattern or a color
-    if (bgImage) {
-        [bgImage drawInRect:self.documentView.bounds];
+    // Draw the background -- either an image pattern or a color. The pattern is
+    // tiled straight into the context, so only the part inside the dirty rect
+    // ever gets rendered
+    if (bgImagePattern && !bgPatternColor)
+        bgPatternColor = [NSColor colorWithPatternImage:bgImagePattern];
+    
+    if (bgPatternColor) {
+        // Anchor the tiles to the corner of the document instead of the window
+        [NSGraphicsContext currentContext].patternPhase = [self convertPoint:docRect.origin toView:nil];
+        [bgPatternColor setFill];
     } else {
         [[NSColor whiteColor] setFill];        
-        NSRectFill(docRect);
     }
+    NSRectFill(docRect);
     
     [NSGraphicsContext restoreGraphicsState];
 }
@@ -73,38 +92,6 @@
         clipRect.origin.y = roundf((docRect.size.height - clipRect.size.height) / 2.0);
     }
     
-    // Potentially regenerate the background image
-    if (bgImagePattern)
-    {
-        BOOL needsRedraw = NO;
-        
-        // Did we change image sizes?
-        if (bgImage && !NSEqualSizes(bgImage.size, docRect.size))
-        {
-            bgImage = nil;
-            needsRedraw = YES;
-        }
-        
-        // Do we not have an image?
-        if (!bgImage && !NSEqualSizes(docRect.size, NSZeroSize))
-        {
-            NSBitmapImageRep *bgImage = nil;
-            [SWImageTools initImageRep:&bgImage withSize:docRect.size];
-            self->bgImage = bgImage;
-            needsRedraw = YES;
-        }
-        
-        // Did either (or both) of the above flip the needsRedraw flag?
-        if (bgImage && needsRedraw) 
-        {
-            SWLockFocus(bgImage);
-            CGContextDrawTiledImage([NSGraphicsContext currentContext].CGContext, 
-                                    CGRectMake(0, 0, bgImagePattern.size.width, bgImagePattern.size.height), 
-                                    [NSBitmapImageRep imageRepWithData:bgImagePattern.TIFFRepresentation].CGImage);
-            SWUnlockFocus(bgImage);
-        }
-    }
-    
     // Probably the most efficient way to move the bounds origin.
     [self scrollToPoint:clipRect.origin];
 }
@@ -0,0 +1,77 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+
+// Copying an image only publishes a promise: it gets encoded if (and when)
+// some other application actually asks for it.  Pasting decodes the image just
+// once, straight into a canvas-oriented (flipped) image, ready to float as a
+// selection.  Copying and pasting within Paintbrush skips encoding altogether.
+@protocol SWClipboard <NSObject>
+
+// Takes an upright image, which must not be changed afterwards
+- (void)writeImage:(NSBitmapImageRep *)image;
+
+@property (readonly) BOOL hasImage;
+
+// Size in pixels, without decoding more than the image's header
+@property (readonly) NSSize imageSize;
+
+// A new flipped image, like the ones in SWImageDataSource, or nil
+@property (readonly) NSBitmapImageRep *canvasImage;
+
+@end
+
+
+// The real thing, on top of an NSPasteboard
+@interface SWPasteboardClipboard : NSObject <SWClipboard>
+{
+    NSPasteboard *pasteboard;
+
+    // What we last put on the pasteboard, while it's still there
+    NSBitmapImageRep *ownImage;
+    NSInteger ownChangeCount;
+    id <NSPasteboardItemDataProvider> promise;
+}
+
++ (instancetype)generalClipboard;
+- (instancetype)initWithPasteboard:(NSPasteboard *)pb NS_DESIGNATED_INITIALIZER;
+
+@end
+
+
+// An in-memory stand-in, for exercising copy and paste without a window server
+@interface SWMemoryClipboard : NSObject <SWClipboard>
+{
+    NSBitmapImageRep *promisedImage;
+    NSMutableDictionary *encodedData;   // Kept promises, by type
+    NSData *foreignData;
+}
+
+// What another application would get, encoding the promise if it hasn't been yet
+- (NSData *)dataForType:(NSString *)type;
+
+// Stands in for another application copying an encoded image
+- (void)writeData:(NSData *)data;
+
+// How many times a promise has been kept
+@property (readonly) NSUInteger encodeCount;
+
+@end
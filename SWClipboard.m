@@ -0,0 +1,282 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWClipboard.h"
+#import "SWPNGWriter.h"
+#import <ImageIO/ImageIO.h>
+
+
+// The types we promise, best first
+static NSArray *SWClipboardWritableTypes(void)
+{
+    return @[NSPasteboardTypePNG, NSPasteboardTypeTIFF];
+}
+
+
+// ...and the ones we'll take from other applications
+static NSArray *SWClipboardReadableTypes(void)
+{
+    return @[NSPasteboardTypePNG, NSPasteboardTypeTIFF, NSPICTPboardType];
+}
+
+
+static NSData *SWClipboardEncode(NSBitmapImageRep *image, NSString *type)
+{
+    if ([type isEqualToString:NSPasteboardTypePNG])
+        return [SWPNGWriter PNGDataFromImage:image];
+    else if ([type isEqualToString:NSPasteboardTypeTIFF])
+        return image.TIFFRepresentation;
+    return nil;
+}
+
+
+// Reads the size from the header, without decoding any pixels
+static NSSize SWClipboardSizeOfData(NSData *data)
+{
+    CGImageSourceRef source = data ? CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL) : NULL;
+    if (!source)
+        return NSZeroSize;
+
+    NSDictionary *properties = CFBridgingRelease(CGImageSourceCopyPropertiesAtIndex(source, 0, NULL));
+    CFRelease(source);
+
+    return NSMakeSize([properties[(__bridge NSString *)kCGImagePropertyPixelWidth] doubleValue],
+                      [properties[(__bridge NSString *)kCGImagePropertyPixelHeight] doubleValue]);
+}
+
+
+// Decodes straight into a new flipped image: the one and only pass over the pixels
+static NSBitmapImageRep *SWClipboardDecode(NSData *data)
+{
+    CGImageSourceRef source = data ? CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL) : NULL;
+    if (!source)
+        return nil;
+
+    CGImageRef cgImage = CGImageSourceCreateImageAtIndex(source, 0, NULL);
+    CFRelease(source);
+    if (!cgImage)
+        return nil;
+
+    NSBitmapImageRep *image = nil;
+    [SWImageTools initImageRep:&image
+                      withSize:NSMakeSize(CGImageGetWidth(cgImage), CGImageGetHeight(cgImage))
+                       cleared:NO];
+    [SWImageTools drawFlippedToImage:image fromCGImage:cgImage];
+    CGImageRelease(cgImage);
+
+    return image;
+}
+
+
+// One copy's promise.  Each copy gets its own, so that a late request for an
+// old item still gets the image that was copied back then
+@interface SWClipboardPromise : NSObject <NSPasteboardItemDataProvider>
+{
+    NSBitmapImageRep *image;
+}
+
+- (instancetype)initWithImage:(NSBitmapImageRep *)image NS_DESIGNATED_INITIALIZER;
+
+@end
+
+
+@implementation SWClipboardPromise
+
+- (instancetype)init
+{
+    return [self initWithImage:nil];
+}
+
+
+- (instancetype)initWithImage:(NSBitmapImageRep *)anImage
+{
+    if (self = [super init])
+        image = anImage;
+    return self;
+}
+
+
+- (void)pasteboard:(NSPasteboard *)pasteboard item:(NSPasteboardItem *)item provideDataForType:(NSString *)type
+{
+    NSData *data = SWClipboardEncode(image, type);
+    if (data)
+        [item setData:data forType:type];
+}
+
+
+- (void)pasteboardFinishedWithDataProvider:(NSPasteboard *)pasteboard
+{
+    image = nil;
+}
+
+@end
+
+
+@implementation SWPasteboardClipboard
+
++ (instancetype)generalClipboard
+{
+    static SWPasteboardClipboard *generalClipboard = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        generalClipboard = [[self alloc] initWithPasteboard:[NSPasteboard generalPasteboard]];
+    });
+    return generalClipboard;
+}
+
+
+- (instancetype)init
+{
+    return [self initWithPasteboard:[NSPasteboard generalPasteboard]];
+}
+
+
+- (instancetype)initWithPasteboard:(NSPasteboard *)pb
+{
+    if (self = [super init])
+        pasteboard = pb;
+    return self;
+}
+
+
+- (void)writeImage:(NSBitmapImageRep *)image
+{
+    promise = [[SWClipboardPromise alloc] initWithImage:image];
+
+    NSPasteboardItem *item = [[NSPasteboardItem alloc] init];
+    [item setDataProvider:promise forTypes:SWClipboardWritableTypes()];
+    [pasteboard clearContents];
+    [pasteboard writeObjects:@[item]];
+
+    ownImage = image;
+    ownChangeCount = pasteboard.changeCount;
+}
+
+
+// Our own image, unless someone has copied something else since
+- (NSBitmapImageRep *)currentOwnImage
+{
+    if (ownImage && pasteboard.changeCount != ownChangeCount)
+        ownImage = nil;
+    return ownImage;
+}
+
+
+- (NSData *)foreignData
+{
+    NSString *type = [pasteboard availableTypeFromArray:SWClipboardReadableTypes()];
+    return type ? [pasteboard dataForType:type] : nil;
+}
+
+
+- (BOOL)hasImage
+{
+    return self.currentOwnImage || [pasteboard availableTypeFromArray:SWClipboardReadableTypes()];
+}
+
+
+- (NSSize)imageSize
+{
+    NSBitmapImageRep *image = self.currentOwnImage;
+    if (image)
+        return NSMakeSize(image.pixelsWide, image.pixelsHigh);
+    return SWClipboardSizeOfData(self.foreignData);
+}
+
+
+- (NSBitmapImageRep *)canvasImage
+{
+    NSBitmapImageRep *image = self.currentOwnImage;
+    if (image)
+        return [SWImageTools flippedCopyOfImage:image];
+    return SWClipboardDecode(self.foreignData);
+}
+
+@end
+
+
+@implementation SWMemoryClipboard
+
+@synthesize encodeCount;
+
+- (instancetype)init
+{
+    if (self = [super init])
+        encodedData = [NSMutableDictionary dictionary];
+    return self;
+}
+
+
+- (void)writeImage:(NSBitmapImageRep *)image
+{
+    promisedImage = image;
+    foreignData = nil;
+    [encodedData removeAllObjects];
+}
+
+
+- (void)writeData:(NSData *)data
+{
+    promisedImage = nil;
+    foreignData = data;
+    [encodedData removeAllObjects];
+}
+
+
+- (NSData *)dataForType:(NSString *)type
+{
+    if (!promisedImage)
+        return foreignData;
+
+    NSData *data = encodedData[type];
+    if (!data)
+    {
+        data = SWClipboardEncode(promisedImage, type);
+        if (data)
+        {
+            encodedData[type] = data;
+            encodeCount++;
+        }
+    }
+    return data;
+}
+
+
+- (BOOL)hasImage
+{
+    return (promisedImage || foreignData);
+}
+
+
+- (NSSize)imageSize
+{
+    if (promisedImage)
+        return NSMakeSize(promisedImage.pixelsWide, promisedImage.pixelsHigh);
+    return SWClipboardSizeOfData(foreignData);
+}
+
+
+- (NSBitmapImageRep *)canvasImage
+{
+    if (promisedImage)
+        return [SWImageTools flippedCopyOfImage:promisedImage];
+    return SWClipboardDecode(foreignData);
+}
+
+@end
@@ -0,0 +1,315 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "SWColorSampler.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define T SW_SAMPLER_TILE_SIZE
+
+// A tile's pixels, all 1024 of them, summed: 32 bits is plenty
+typedef uint32_t SWSamplerSums[4];
+
+// One quantized color in a tile, and every pixel that quantized to it
+typedef struct {
+    uint16_t key;
+    uint32_t count;
+    SWSamplerSums sums;
+} SWSamplerBin;
+
+typedef struct {
+    SWSamplerSums *table;       // (T + 1) x (T + 1), the first row and column zero
+    SWSamplerBin *bins;         // Sorted by key
+    size_t binCount;
+} SWSamplerTile;
+
+struct SWColorSampler {
+    const uint8_t *pixels;
+    size_t width, height, bytesPerRow;
+    size_t tilesWide, tilesHigh;
+    SWSamplerTile *tiles;
+};
+
+
+SWColorSampler *SWColorSamplerCreate(const uint8_t *pixels, size_t width, size_t height, size_t bytesPerRow)
+{
+    SWColorSampler *sampler = calloc(1, sizeof(SWColorSampler));
+    if (!sampler)
+        return NULL;
+    sampler->pixels = pixels;
+    sampler->width = width;
+    sampler->height = height;
+    sampler->bytesPerRow = bytesPerRow;
+    sampler->tilesWide = (width + T - 1) / T;
+    sampler->tilesHigh = (height + T - 1) / T;
+    sampler->tiles = calloc(sampler->tilesWide * sampler->tilesHigh + 1, sizeof(SWSamplerTile));
+    if (!sampler->tiles)
+    {
+        free(sampler);
+        return NULL;
+    }
+    return sampler;
+}
+
+
+static void SWSamplerTileDiscard(SWSamplerTile *tile)
+{
+    free(tile->table);
+    free(tile->bins);
+    tile->table = NULL;
+    tile->bins = NULL;
+    tile->binCount = 0;
+}
+
+
+void SWColorSamplerDestroy(SWColorSampler *sampler)
+{
+    if (!sampler)
+        return;
+    for (size_t i = 0; i < sampler->tilesWide * sampler->tilesHigh; i++)
+        SWSamplerTileDiscard(&sampler->tiles[i]);
+    free(sampler->tiles);
+    free(sampler);
+}
+
+
+// The part of the image a tile covers
+static void SWSamplerTileBounds(SWColorSampler *sampler, size_t tx, size_t ty,
+                                size_t *x0, size_t *y0, size_t *w, size_t *h)
+{
+    *x0 = tx * T;
+    *y0 = ty * T;
+    *w = (sampler->width - *x0 < T) ? sampler->width - *x0 : T;
+    *h = (sampler->height - *y0 < T) ? sampler->height - *y0 : T;
+}
+
+
+static const uint8_t *SWSamplerPixel(SWColorSampler *sampler, size_t x, size_t y)
+{
+    return sampler->pixels + y * sampler->bytesPerRow + x * 4;
+}
+
+
+static SWSamplerTile *SWSamplerTileAt(SWColorSampler *sampler, size_t tx, size_t ty)
+{
+    return &sampler->tiles[ty * sampler->tilesWide + tx];
+}
+
+
+void SWColorSamplerInvalidateRect(SWColorSampler *sampler, long x, long y, long width, long height)
+{
+    long x0 = x < 0 ? 0 : x, y0 = y < 0 ? 0 : y;
+    long x1 = x + width, y1 = y + height;
+    x1 = x1 > (long)sampler->width ? (long)sampler->width : x1;
+    y1 = y1 > (long)sampler->height ? (long)sampler->height : y1;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    for (size_t ty = y0 / T; ty <= (size_t)(y1 - 1) / T; ty++)
+        for (size_t tx = x0 / T; tx <= (size_t)(x1 - 1) / T; tx++)
+            SWSamplerTileDiscard(SWSamplerTileAt(sampler, tx, ty));
+}
+
+
+static bool SWSamplerBuildTable(SWColorSampler *sampler, SWSamplerTile *tile, size_t tx, size_t ty)
+{
+    if (tile->table)
+        return true;
+    tile->table = calloc((T + 1) * (T + 1), sizeof(SWSamplerSums));
+    if (!tile->table)
+        return false;
+
+    size_t x0, y0, w, h;
+    SWSamplerTileBounds(sampler, tx, ty, &x0, &y0, &w, &h);
+    for (size_t y = 0; y < h; y++)
+    {
+        const uint8_t *p = SWSamplerPixel(sampler, x0, y0 + y);
+        uint32_t row[4] = { 0, 0, 0, 0 };
+        for (size_t x = 0; x < w; x++)
+        {
+            uint32_t *above = tile->table[y * (T + 1) + x + 1];
+            uint32_t *here = tile->table[(y + 1) * (T + 1) + x + 1];
+            for (int c = 0; c < 4; c++)
+            {
+                row[c] += p[x * 4 + c];
+                here[c] = above[c] + row[c];
+            }
+        }
+    }
+    return true;
+}
+
+
+static int SWSamplerCompareKeys(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+static bool SWSamplerBuildBins(SWColorSampler *sampler, SWSamplerTile *tile, size_t tx, size_t ty)
+{
+    if (tile->bins)
+        return true;
+
+    // Each pixel with its key above it, so sorting groups them
+    size_t x0, y0, w, h;
+    SWSamplerTileBounds(sampler, tx, ty, &x0, &y0, &w, &h);
+    uint64_t keyed[T * T];
+    size_t count = 0;
+    for (size_t y = y0; y < y0 + h; y++)
+    {
+        const uint8_t *p = SWSamplerPixel(sampler, x0, y);
+        for (size_t x = 0; x < w; x++, p += 4)
+        {
+            uint64_t key = (p[0] >> 4) << 12 | (p[1] >> 4) << 8 | (p[2] >> 4) << 4 | (p[3] >> 4);
+            uint32_t pixel;
+            memcpy(&pixel, p, 4);
+            keyed[count++] = key << 32 | pixel;
+        }
+    }
+    qsort(keyed, count, sizeof(uint64_t), SWSamplerCompareKeys);
+
+    tile->bins = calloc(count, sizeof(SWSamplerBin));
+    if (!tile->bins)
+        return false;
+    size_t binCount = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint16_t key = (uint16_t)(keyed[i] >> 32);
+        if (binCount == 0 || tile->bins[binCount - 1].key != key)
+            tile->bins[binCount++].key = key;
+        SWSamplerBin *bin = &tile->bins[binCount - 1];
+        uint32_t pixel = (uint32_t)keyed[i];
+        uint8_t bytes[4];
+        memcpy(bytes, &pixel, 4);
+        bin->count++;
+        for (int c = 0; c < 4; c++)
+            bin->sums[c] += bytes[c];
+    }
+    tile->binCount = binCount;
+    return true;
+}
+
+
+static void SWSamplerResult(const uint64_t sums[4], size_t count, uint8_t rgba[4])
+{
+    for (int c = 0; c < 4; c++)
+        rgba[c] = count ? (uint8_t)((sums[c] + count / 2) / count) : 0;
+}
+
+
+size_t SWColorSamplerAverage(SWColorSampler *sampler, long x, long y, long radius, uint8_t rgba[4])
+{
+    long bx0 = x - radius, by0 = y - radius, bx1 = x + radius + 1, by1 = y + radius + 1;
+    bx0 = bx0 < 0 ? 0 : bx0;
+    by0 = by0 < 0 ? 0 : by0;
+    bx1 = bx1 > (long)sampler->width ? (long)sampler->width : bx1;
+    by1 = by1 > (long)sampler->height ? (long)sampler->height : by1;
+    if (bx0 >= bx1 || by0 >= by1)
+    {
+        memset(rgba, 0, 4);
+        return 0;
+    }
+
+    // Four lookups in every tile the box touches
+    uint64_t sums[4] = { 0, 0, 0, 0 };
+    for (size_t ty = by0 / T; ty <= (size_t)(by1 - 1) / T; ty++)
+    {
+        for (size_t tx = bx0 / T; tx <= (size_t)(bx1 - 1) / T; tx++)
+        {
+            SWSamplerTile *tile = SWSamplerTileAt(sampler, tx, ty);
+            if (!SWSamplerBuildTable(sampler, tile, tx, ty))
+                return 0;
+
+            long ox = tx * T, oy = ty * T;
+            long lx0 = (bx0 > ox ? bx0 : ox) - ox, ly0 = (by0 > oy ? by0 : oy) - oy;
+            long lx1 = (bx1 < ox + T ? bx1 : ox + T) - ox, ly1 = (by1 < oy + T ? by1 : oy + T) - oy;
+            const uint32_t *a = tile->table[ly0 * (T + 1) + lx0], *b = tile->table[ly0 * (T + 1) + lx1];
+            const uint32_t *c = tile->table[ly1 * (T + 1) + lx0], *d = tile->table[ly1 * (T + 1) + lx1];
+            for (int k = 0; k < 4; k++)
+                sums[k] += d[k] - b[k] - c[k] + a[k];
+        }
+    }
+
+    size_t count = (size_t)(bx1 - bx0) * (by1 - by0);
+    SWSamplerResult(sums, count, rgba);
+    return count;
+}
+
+
+size_t SWColorSamplerDominant(SWColorSampler *sampler, long x, long y, uint8_t rgba[4])
+{
+    memset(rgba, 0, 4);
+    if (x < 0 || y < 0 || x >= (long)sampler->width || y >= (long)sampler->height)
+        return 0;
+
+    // The two columns and rows of tiles whose shared corner is nearest the point
+    long firstX = (x + T / 2) / T - 1, firstY = (y + T / 2) / T - 1;
+    SWSamplerTile *tiles[4];
+    size_t tileCount = 0;
+    for (long ty = firstY; ty <= firstY + 1; ty++)
+    {
+        for (long tx = firstX; tx <= firstX + 1; tx++)
+        {
+            if (tx < 0 || ty < 0 || tx >= (long)sampler->tilesWide || ty >= (long)sampler->tilesHigh)
+                continue;
+            SWSamplerTile *tile = SWSamplerTileAt(sampler, tx, ty);
+            if (!SWSamplerBuildBins(sampler, tile, tx, ty))
+                return 0;
+            tiles[tileCount++] = tile;
+        }
+    }
+
+    // Merge the sorted lists, keeping the bin with the most pixels
+    size_t next[4] = { 0, 0, 0, 0 };
+    uint64_t bestSums[4] = { 0, 0, 0, 0 };
+    size_t bestCount = 0;
+    for (;;)
+    {
+        uint32_t key = UINT32_MAX;
+        for (size_t i = 0; i < tileCount; i++)
+            if (next[i] < tiles[i]->binCount && tiles[i]->bins[next[i]].key < key)
+                key = tiles[i]->bins[next[i]].key;
+        if (key == UINT32_MAX)
+            break;
+
+        uint64_t sums[4] = { 0, 0, 0, 0 };
+        size_t count = 0;
+        for (size_t i = 0; i < tileCount; i++)
+        {
+            if (next[i] >= tiles[i]->binCount || tiles[i]->bins[next[i]].key != key)
+                continue;
+            const SWSamplerBin *bin = &tiles[i]->bins[next[i]++];
+            count += bin->count;
+            for (int c = 0; c < 4; c++)
+                sums[c] += bin->sums[c];
+        }
+        if (count > bestCount)
+        {
+            bestCount = count;
+            memcpy(bestSums, sums, sizeof(sums));
+        }
+    }
+
+    SWSamplerResult(bestSums, bestCount, rgba);
+    return bestCount;
+}
@@ -0,0 +1,72 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Color statistics for the eyedropper, cheap enough to ask for on every mouse
+// move.
+//
+// The image is split into tiles of SW_SAMPLER_TILE_SIZE pixels a side, and each
+// tile gets two tables the first time a question touches it: a summed-area
+// table, which adds up any rectangle of the tile in four lookups, and a list of
+// the colors in it, quantized to 4 bits a channel, with how often each one
+// turns up.  Whoever draws in the image says where with
+// SWColorSamplerInvalidateRect, and the tiles there build their tables again
+// the next time they're asked about.  Only the tiles that are asked about ever
+// cost anything.
+//
+// Pixels are 8-bit premultiplied RGBA, and coordinates count rows in memory
+// order.  Plain C, so it can be built and hammered on anywhere.  Not thread-safe.
+
+#ifndef SWCOLORSAMPLER_H
+#define SWCOLORSAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Bigger than the biggest sampling box, so a box never covers more than four tiles
+#define SW_SAMPLER_TILE_SIZE 32
+
+typedef struct SWColorSampler SWColorSampler;
+
+// The pixels are read, never written, and have to outlive the sampler
+SWColorSampler *SWColorSamplerCreate(const uint8_t *pixels, size_t width, size_t height, size_t bytesPerRow);
+void SWColorSamplerDestroy(SWColorSampler *sampler);
+
+// The pixels in the rectangle have been drawn in since they were last asked about
+void SWColorSamplerInvalidateRect(SWColorSampler *sampler, long x, long y, long width, long height);
+
+// The average of the square of side 2 * radius + 1 around (x, y), as much of it
+// as is inside the image.  Returns 0 if none of it is
+size_t SWColorSamplerAverage(SWColorSampler *sampler, long x, long y, long radius, uint8_t rgba[4]);
+
+// The most common color in the four tiles nearest (x, y) -- a region about two
+// tiles a side, around the point.  Colors count as the same if they quantize
+// the same; what comes back is the average of every pixel that does, so flat
+// color comes back exactly.  Returns how many pixels that was, or 0 if the
+// point is outside the image
+size_t SWColorSamplerDominant(SWColorSampler *sampler, long x, long y, uint8_t rgba[4]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -114,14 +114,28 @@
             break;
     }
     
-    SWLockFocus(drawToMe);
-    [[NSGraphicsContext currentContext] setShouldAntialias:NO];
-    
-    [primaryColor setStroke];
     NSBezierPath *p = [self pathFromPoint:savedPoint toPoint:point];
-    [p stroke];
-    
-    SWUnlockFocus(drawToMe);
+    if (self.antialias)
+    {
+        // Always drawn in the buffer, which then goes down over the image as
+        // it was shown
+        [self strokePath:p inImage:bufferImage withColor:primaryColor operation:NSCompositingOperationSourceOver];
+        if (drawToMe == mainImage)
+        {
+            [SWImageTools drawToImage:mainImage fromImage:bufferImage withComposition:YES];
+            [SWImageTools clearImage:bufferImage];
+        }
+    }
+    else
+    {
+        SWLockFocus(drawToMe);
+        [[NSGraphicsContext currentContext] setShouldAntialias:NO];
+        
+        [primaryColor setStroke];
+        [p stroke];
+        
+        SWUnlockFocus(drawToMe);
+    }
     
     // Use the points clicked to build a redraw rectangle
     NSRect curveRect = p.bounds;
@@ -31,6 +31,8 @@
 @class SWTextToolWindowController;
 @class SWSavePanelAccessoryViewController;
 @class SWImageDataSource;
+@class SWJournal;
+@protocol SWClipboard;
 
 @interface SWDocument : NSDocument
 {
@@ -52,6 +54,18 @@
     // Misc other member variables
     NSNotificationCenter *nc;
     NSString *currentFileType;
+    
+    // Saving happens on a background thread, from a copy of the canvas taken
+    // when the save began.  An autosave can still be writing when a Save As
+    // starts, so each save's copy is kept under its save operation
+    NSMutableDictionary *saveSnapshots;
+    NSUInteger editCount;
+    
+    // Every edit since the last save, on disk, in case we crash
+    SWJournal *journal;
+    NSString *journalOperationName;
+    BOOL journalFlushPending;
+    BOOL journalEntryHeld;      // A tool is still drawing the edit
 }
 
 // Properties
@@ -71,6 +85,20 @@
 //- (IBAction)fullScreen:(id)sender;
 - (IBAction)crop:(id)sender;
 - (IBAction)invertColors:(id)sender;
+
+// Layers
+- (IBAction)newLayer:(id)sender;
+- (IBAction)duplicateLayer:(id)sender;
+- (IBAction)deleteLayer:(id)sender;
+- (IBAction)moveLayerUp:(id)sender;
+- (IBAction)moveLayerDown:(id)sender;
+- (IBAction)selectLayerAbove:(id)sender;
+- (IBAction)selectLayerBelow:(id)sender;
+- (IBAction)toggleLayerVisibility:(id)sender;
+- (IBAction)setLayerOpacity:(id)sender;     // Tagged with a percentage
+- (IBAction)setLayerBlendMode:(id)sender;   // Tagged with an SWBlendMode
+- (IBAction)mergeLayerDown:(id)sender;
+- (IBAction)flattenImage:(id)sender;
 - (void)showTextSheet:(NSNotification *)n;
 - (void)undoLevelChanged:(NSNotification *)n;
 
@@ -85,11 +113,27 @@
 // Undo
 - (void)handleUndoWithImageData:(NSData *)mainImageData 
                           frame:(NSRect)frame;
+- (void)handleUndoWithImageData:(NSData *)mainImageData 
+                          frame:(NSRect)frame
+                layerIdentifier:(NSUInteger)identifier;
+
+// Tools that go on drawing an edit after taking its undo hold its journal
+// entry back until they're done, so the journal gets the finished edit
+- (void)holdJournalEntry;
+- (void)releaseJournalEntry;
+
+// Swaps in a whole stack of layers, undoably
+- (void)setLayers:(NSArray *)newLayers 
+ activeLayerIndex:(NSUInteger)index 
+       actionName:(NSString *)actionName;
 
 // For copy-and-paste
-- (void)writeImageToPasteboard:(NSPasteboard *)pb;
+- (void)writeSelectionToClipboard:(id <SWClipboard>)clipboard;
 
 + (void)setWillShowSheet:(BOOL)showSheet;
 
+// Opens an untitled, edited document with layers brought back from a journal
++ (SWDocument *)openRecoveredDocumentWithLayers:(NSArray *)layers activeLayerIndex:(NSUInteger)index;
+
 
 @end
@@ -31,6 +31,12 @@
 #import "SWSavePanelAccessoryViewController.h"
 #import "SWPrintPanelAccessoryViewController.h"
 #import "SWImageDataSource.h"
+#import "SWPNGWriter.h"
+#import "SWBMPCodec.h"
+#import "SWGIFWriter.h"
+#import "SWJPEGWriter.h"
+#import "SWClipboard.h"
+#import "SWJournal.h"
 
 @implementation SWDocument
 
@@ -41,6 +47,9 @@
 // TODO: Nasty hack
 static BOOL kSWDocumentWillShowSheet = YES;
 
+// Where a writing thread keeps the snapshot it's saving
+static NSString * const kSWSaveSnapshotKey = @"SWSaveSnapshot";
+
 - (instancetype)init
 {
     if (self = [super init]) 
@@ -68,6 +77,15 @@ static BOOL kSWDocumentWillShowSheet = YES;
 }
 
 
+// The journal only covers edits that haven't been saved, so it goes when we do
+- (void)close
+{
+    [journal discard];
+    journal = nil;
+    [super close];
+}
+
+
 // Housekeeping
 - (void)dealloc
 {    
@@ -245,9 +263,14 @@ static BOOL kSWDocumentWillShowSheet = YES;
             // This is also important!
             [toolbox tieUpLooseEndsForCurrentTool];
 
-            [self handleUndoWithImageData:nil frame:NSZeroRect];
+            // Every layer gets resized, so undo puts back the whole stack
+            NSArray *oldLayers = dataSource.layers;
+            NSUInteger oldIndex = dataSource.activeLayerIndex;
             
             [dataSource resizeToSize:newSize scaleImage:[resizeController scales]];
+            [self registerUndoToLayers:oldLayers
+                      activeLayerIndex:oldIndex
+                            actionName:NSLocalizedString(@"Resize", @"The undo command string image resizings")];
             paintView.frame = NSMakeRect(0.0, 0.0, newSize.width, newSize.height); // Forces a redraw
             
             // We should also redraw the clip view
@@ -311,39 +334,134 @@ static BOOL kSWDocumentWillShowSheet = YES;
 }
 
 
-// Overridden so that we can reload the image after saving
-- (BOOL) saveToURL:(NSURL *)absURL 
-            ofType:(NSString *)type 
-  forSaveOperation:(NSSaveOperationType)saveOp 
-             error:(NSError **)outError
+// The canvas is copied before the save starts, so the encoding can happen in
+// the background while the user keeps painting
+- (BOOL)canAsynchronouslyWriteToURL:(NSURL *)url 
+                             ofType:(NSString *)typeName 
+                   forSaveOperation:(NSSaveOperationType)saveOperation
 {
-    BOOL status = [super saveToURL:absURL ofType:type forSaveOperation:saveOp error:outError];
-    
-    if (status==YES && (saveOp==NSSaveOperation || saveOp==NSSaveAsOperation))
+    return YES;
+}
+
+
+// Overridden so that we can take the snapshot to be saved, and reload the image
+// after saving to a lossy format
+- (void)saveToURL:(NSURL *)absURL 
+           ofType:(NSString *)type 
+ forSaveOperation:(NSSaveOperationType)saveOp 
+completionHandler:(void (^)(NSError *errorOrNil))completionHandler
+{
+    NSUInteger editCountAtSave = editCount;
+    NSDictionary *snapshot = @{@"Image": [SWImageTools flippedCopyOfImage:dataSource.compositeImage],
+                               @"Quality": @(savePanelAccessoryViewController.imageQuality)};
+    @synchronized(self)
     {
-        NSURL* url = self.fileURL;
+        if (!saveSnapshots)
+            saveSnapshots = [NSMutableDictionary dictionary];
+        saveSnapshots[@(saveOp)] = snapshot;
+    }
+    
+    [super saveToURL:absURL ofType:type forSaveOperation:saveOp completionHandler:^(NSError *errorOrNil) {
+        // Only this save's own copy: another one may have started since
+        @synchronized(self)
+        {
+            if (saveSnapshots[@(saveOp)] == snapshot)
+                [saveSnapshots removeObjectForKey:@(saveOp)];
+        }
         
-        // reload the image (this could fail)
-        status = [self readFromURL:url ofType:type error:outError];
+        // JPEG and GIF don't store exactly what we drew, so show the user what
+        // they actually saved -- unless they've kept drawing since.  The file
+        // only has the layers flattened, so reading it back would lose them
+        BOOL isLossy = [type isEqualToString:@"jpg"] || [type isEqualToString:@"gif"];
+        if (!errorOrNil && isLossy && editCount == editCountAtSave && dataSource.layers.count == 1 &&
+            (saveOp == NSSaveOperation || saveOp == NSSaveAsOperation))
+        {
+            NSError *readError = nil;
+            
+            // reload the image (this could fail)
+            if ([self readFromURL:self.fileURL ofType:type error:&readError])
+                [paintView setNeedsDisplay:YES];
+            else
+                errorOrNil = readError;
+        }
         
-        // re-initialize the UI
-        [paintView setNeedsDisplay:YES];
+        // Everything in the journal is in the file now
+        if (!errorOrNil && editCount == editCountAtSave &&
+            (saveOp == NSSaveOperation || saveOp == NSSaveAsOperation))
+        {
+            [journal discard];
+            journal = nil;
+        }
         
-//        // Tell the info panel that the url changed
-//        [ImageInfoPanel setURL:url];
+        completionHandler(errorOrNil);
+    }];
+}
+
+
+// Finds the snapshot of the save this thread is writing for, and keeps it
+// where -imageToSaveWithQuality: can see it until the write is done
+- (BOOL)writeToURL:(NSURL *)url
+            ofType:(NSString *)typeName
+  forSaveOperation:(NSSaveOperationType)saveOperation
+originalContentsURL:(NSURL *)absoluteOriginalContentsURL
+             error:(NSError **)outError
+{
+    NSMutableDictionary *threadDictionary = NSThread.currentThread.threadDictionary;
+    @synchronized(self)
+    {
+        threadDictionary[kSWSaveSnapshotKey] = saveSnapshots[@(saveOperation)];
     }
     
-    return status;
+    BOOL written = [super writeToURL:url
+                              ofType:typeName
+                    forSaveOperation:saveOperation
+                 originalContentsURL:absoluteOriginalContentsURL
+                               error:outError];
+    [threadDictionary removeObjectForKey:kSWSaveSnapshotKey];
+    return written;
+}
+
+
+// The upright copy of the canvas to save.  This normally runs on a background
+// thread, so it must only look at the snapshot
+- (NSBitmapImageRep *)imageToSaveWithQuality:(CGFloat *)quality
+{
+    NSDictionary *snapshot = NSThread.currentThread.threadDictionary[kSWSaveSnapshotKey];
+    NSBitmapImageRep *bitmap = snapshot[@"Image"];
+    CGFloat compressionFactor = [snapshot[@"Quality"] doubleValue];
+    
+    // Only happens for writes that didn't come through -saveToURL:..., which
+    // are on the main thread
+    if (!bitmap)
+    {
+        bitmap = [SWImageTools flippedCopyOfImage:dataSource.compositeImage];
+        compressionFactor = savePanelAccessoryViewController.imageQuality;
+    }
+    
+    // We have everything we need: let the user get back to work
+    [self unblockUserInteraction];
+    
+    if (quality)
+        *quality = compressionFactor;
+    return bitmap;
+}
+
+
+// BMPs are streamed straight to disk, instead of being built up in memory first
+- (BOOL)writeToURL:(NSURL *)url ofType:(NSString *)typeName error:(NSError **)outError
+{
+    if (![typeName isEqualToString:@"bmp"])
+        return [super writeToURL:url ofType:typeName error:outError];
+    
+    return [SWBMPWriter writeImage:[self imageToSaveWithQuality:NULL] toURL:url error:outError];
 }
 
 
 // Saving data: returns the correctly-formatted image data
 - (NSData *)dataOfType:(NSString *)aType error:(NSError **)anError
 {
-    NSBitmapImageRep *bitmap = dataSource.mainImage;
-//    NSBitmapImageRep *bitmap = [SWImageTools createMonochromeImage:[paintView mainImage]];
-
-    [SWImageTools flipImageVertical:bitmap];
+    CGFloat compressionFactor;
+    NSBitmapImageRep *bitmap = [self imageToSaveWithQuality:&compressionFactor];
         
     NSData *data = nil;
     NSBitmapImageFileType fileType = NSBitmapImageFileTypePNG;
@@ -363,17 +481,22 @@ static BOOL kSWDocumentWillShowSheet = YES;
     
     // We need to retrieve the data stored in the save panel, and pack them into a dictionary
     NSTIFFCompression tiffCompression = (fileType == NSBitmapImageFileTypeJPEG ? NSTIFFCompressionJPEG : NSTIFFCompressionNone);
-    CGFloat compressionFactor = savePanelAccessoryViewController.imageQuality;
     //BOOL alpha = [savePanelAccessoryViewController isAlphaEnabled];
     NSDictionary *propDict = @{NSImageCompressionMethod: @(tiffCompression),
                               NSImageCompressionFactor: [NSNumber numberWithFloat:compressionFactor]};
     
-    // Convert the image into the data that we need to return
-    data = [bitmap representationUsingType:fileType 
-                                properties:propDict];
-    
-    // Remember to re-flip the image after it's been saved!
-    [SWImageTools flipImageVertical:bitmap];
+    // Convert the image into the data that we need to return. PNG, JPEG and
+    // GIF have their own (much faster) encoders
+    if (fileType == NSBitmapImageFileTypePNG)
+        data = [SWPNGWriter PNGDataFromImage:bitmap];
+    else if (fileType == NSBitmapImageFileTypeJPEG)
+        data = [SWJPEGWriter JPEGDataFromImage:bitmap quality:compressionFactor];
+    else if (fileType == NSBitmapImageFileTypeGIF)
+        data = [SWGIFWriter GIFDataFromImage:bitmap
+                                   dithering:[NSUserDefaults.standardUserDefaults integerForKey:kSWGIFDitheringKey]];
+    else
+        data = [bitmap representationUsingType:fileType 
+                                    properties:propDict];
 
     return data;
 }
@@ -495,14 +618,32 @@ static BOOL kSWDocumentWillShowSheet = YES;
 ////////////////////////////////////////////////////////////////////////////////
 
 
-// Undo canvas resizing
+// Drawing always happens in the active layer
 - (void)handleUndoWithImageData:(NSData *)mainImageData frame:(NSRect)frame
+{
+    [self handleUndoWithImageData:mainImageData frame:frame layerIdentifier:dataSource.activeLayer.identifier];
+}
+
+
+// Undo canvas resizing
+- (void)handleUndoWithImageData:(NSData *)mainImageData frame:(NSRect)frame layerIdentifier:(NSUInteger)identifier
 {
     NSUndoManager *undo = self.undoManager;
     NSRect currentFrame = NSZeroRect;
+    
+    // Undoing a stroke in another layer brings that layer back to the front
+    [dataSource activateLayerWithIdentifier:identifier];
+    
+    // Every edit passes through here, which tells a finished save whether the
+    // canvas has moved on since its snapshot.  Only the tools say where they
+    // drew, so anything else could have changed it all
+    editCount++;
+    if (!paintView.isHandlingToolEvent)
+        [dataSource noteWholeCanvasEdited];
+    [self scheduleJournalEntry];
     currentFrame.size = dataSource.size;
     NSData *mainImageDataCurrent = [dataSource copyMainImageData];
-    [[undo prepareWithInvocationTarget:self] handleUndoWithImageData:mainImageDataCurrent frame:currentFrame];
+    [[undo prepareWithInvocationTarget:self] handleUndoWithImageData:mainImageDataCurrent frame:currentFrame layerIdentifier:identifier];
     
     // Without resize, set the string to drawing
     if (NSEqualSizes(frame.size, NSZeroSize) || NSEqualSizes(frame.size, dataSource.size))
@@ -520,7 +661,7 @@ static BOOL kSWDocumentWillShowSheet = YES;
     {
         // No data was passed, so retrieve it from the data source
         NSData *mainImageData = [dataSource copyMainImageData];
-        [[undo prepareWithInvocationTarget:self] handleUndoWithImageData:mainImageData frame:frame];
+        [[undo prepareWithInvocationTarget:self] handleUndoWithImageData:mainImageData frame:frame layerIdentifier:identifier];
     }
     
     [dataSource restoreMainImageFromData:mainImageData];
@@ -534,9 +675,147 @@ static BOOL kSWDocumentWillShowSheet = YES;
 }
 
 
-// Called whenever Copy or Cut are called (copies the overlay image to the pasteboard)
+// Layer changes, resizes and crops swap in a whole new stack of layers.  The
+// old stack shares its images with nobody who draws in them, so keeping a copy
+// of the array is all it takes to bring it back
+- (void)registerUndoToLayers:(NSArray *)oldLayers
+            activeLayerIndex:(NSUInteger)index
+                  actionName:(NSString *)actionName
+{
+    NSUndoManager *undo = self.undoManager;
+    [[undo prepareWithInvocationTarget:self] setLayers:oldLayers activeLayerIndex:index actionName:actionName];
+    [undo setActionName:actionName];
+    
+    editCount++;
+    [self scheduleJournalEntry];
+}
+
+
+- (void)setLayers:(NSArray *)newLayers activeLayerIndex:(NSUInteger)index actionName:(NSString *)actionName
+{
+    [self registerUndoToLayers:dataSource.layers activeLayerIndex:dataSource.activeLayerIndex actionName:actionName];
+    
+    NSSize oldSize = dataSource.size;
+    [dataSource setLayers:newLayers activeLayerIndex:index];
+    
+    // Undoing a resize brings back layers of the old size
+    if (!NSEqualSizes(oldSize, dataSource.size))
+    {
+        paintView.frame = (NSRect) { NSZeroPoint, dataSource.size };
+        [clipView setNeedsDisplay:YES];
+    }
+    
+    if (self.undoManager.undoing)
+        [paintView clearOverlay];
+    [paintView setNeedsDisplay:YES];
+}
+
+
+#pragma mark The journal
+
+////////////////////////////////////////////////////////////////////////////////
+//////////        The journal
+////////////////////////////////////////////////////////////////////////////////
+
+
+// The journal starts from the layers as they were before the first edit
+- (void)startJournalIfNeeded
+{
+    if (!journal && dataSource)
+        journal = [[SWJournal alloc] initWithLayers:dataSource.layers activeLayerIndex:dataSource.activeLayerIndex];
+}
+
+
+// Called before each edit: the edit itself gets recorded once it's been drawn,
+// when we're back in the run loop
+- (void)scheduleJournalEntry
+{
+    [self startJournalIfNeeded];
+    
+    NSUndoManager *undo = self.undoManager;
+    if (undo.undoing)
+        journalOperationName = @"Undo";
+    else if (undo.redoing)
+        journalOperationName = @"Redo";
+    else
+        journalOperationName = NSStringFromClass([toolbox.currentTool class]);
+    
+    if (!journalFlushPending)
+    {
+        journalFlushPending = YES;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self flushJournal];
+        });
+    }
+}
+
+
+- (void)holdJournalEntry
+{
+    journalEntryHeld = YES;
+}
+
+
+- (void)releaseJournalEntry
+{
+    if (!journalEntryHeld)
+        return;
+    journalEntryHeld = NO;
+    [self scheduleJournalEntry];
+}
+
+
+- (void)flushJournal
+{
+    journalFlushPending = NO;
+    if (journalEntryHeld)
+        return;
+    NSData *dirtyRects = [dataSource takeEditedRects];
+    if (!journal)
+        return;
+    
+    // Undo and redo don't come from a stroke
+    BOOL fromTool = !([journalOperationName isEqualToString:@"Undo"] ||
+                      [journalOperationName isEqualToString:@"Redo"]);
+    SWToolboxController *tc = [SWToolboxController sharedToolboxPanelController];
+    [journal recordOperation:journalOperationName
+                   lineWidth:tc.lineWidth
+                   fillStyle:tc.fillStyle
+                  foreground:tc.foregroundColor
+                  background:tc.backgroundColor
+                      points:(fromTool ? paintView.strokePoints : nil)
+                  dirtyRects:dirtyRects
+                      layers:dataSource.layers
+            activeLayerIndex:dataSource.activeLayerIndex];
+    [paintView clearStrokePoints];
+}
+
+
++ (SWDocument *)openRecoveredDocumentWithLayers:(NSArray *)layers activeLayerIndex:(NSUInteger)index
+{
+    NSDocumentController *controller = [NSDocumentController sharedDocumentController];
+    SWDocument *document = [controller makeUntitledDocumentOfType:controller.defaultType error:NULL];
+    if (!document)
+        return nil;
+    
+    // With a data source already in place, the nib skips the size sheet
+    document->dataSource = [[SWImageDataSource alloc] initWithImage:[layers[0] image]];
+    [document->dataSource setLayers:layers activeLayerIndex:index];
+    [controller addDocument:document];
+    [document makeWindowControllers];
+    [document showWindows];
+    
+    // It isn't saved anywhere, so journal it straight away in case we crash again
+    [document updateChangeCount:NSChangeDone];
+    [document startJournalIfNeeded];
+    
+    return document;
+}
+
+
+// Called whenever Copy or Cut are called (copies the overlay image to the clipboard)
 // TODO: Relieve some of this method's dependencies on the Selection tool
-- (void)writeImageToPasteboard:(NSPasteboard *)pb
+- (void)writeSelectionToClipboard:(id <SWClipboard>)clipboard
 {
     NSAssert([[toolbox currentTool] isKindOfClass:[SWSelectionTool class]], 
              @"How are we copying without a SWSelectionTool as the active tool?");
@@ -544,16 +823,11 @@ static BOOL kSWDocumentWillShowSheet = YES;
     {
         SWSelectionTool *currentTool = (SWSelectionTool *)toolbox.currentTool;
         
-        NSBitmapImageRep *selectedImage = [currentTool selectedImage];        
-        
-        // Make sure we flip the image before we put it in the pasteboard
-        [SWImageTools flipImageVertical:selectedImage];
-        
-        [pb declareTypes:@[NSPasteboardTypeTIFF] owner:self];
-        [pb setData:selectedImage.TIFFRepresentation forType:NSPasteboardTypeTIFF];
-        
-        // Now flip it again
-        [SWImageTools flipImageVertical:selectedImage];
+        // An upright copy of the selection is all it takes: it only gets
+        // encoded if another application asks for it
+        NSBitmapImageRep *selectedImage = [currentTool selectedImage];
+        if (selectedImage)
+            [clipboard writeImage:[SWImageTools flippedCopyOfImage:selectedImage]];
     }
 }
 
@@ -569,7 +843,7 @@ static BOOL kSWDocumentWillShowSheet = YES;
 // Copy
 - (IBAction)copy:(id)sender
 {
-    [self writeImageToPasteboard:[NSPasteboard generalPasteboard]];
+    [self writeSelectionToClipboard:[SWPasteboardClipboard generalClipboard]];
 }
 
 
@@ -580,11 +854,11 @@ static BOOL kSWDocumentWillShowSheet = YES;
     [self handleUndoWithImageData:nil frame:NSZeroRect];
     [toolboxController switchToScissors:nil];
     
-    NSData *data = [SWImageTools readImageFromPasteboard:[NSPasteboard generalPasteboard]];
-    if (data)
+    // Decoded once, straight into the image that floats as the selection
+    NSBitmapImageRep *image = [[SWPasteboardClipboard generalClipboard] canvasImage];
+    if (image)
     {
         [paintView cursorUpdate:nil];
-        NSBitmapImageRep *temp = [[NSBitmapImageRep alloc] initWithData:data];
 
         NSPoint origin = paintView.superview.bounds.origin;
         if (origin.x < 0) origin.x = 0;
@@ -593,17 +867,12 @@ static BOOL kSWDocumentWillShowSheet = YES;
         NSRect rect = NSZeroRect;
         rect.origin = origin;
 
-        // Use ceiling because pixels can be fractions, but the tool assumes integer values                                 
-        rect.size = NSMakeSize(ceil(temp.size.width), ceil(temp.size.height));
-        
-        [dataSource restoreBufferImageFromData:data];
-        
-        // As always, flip the image to be viewed in our flipped view
-        [SWImageTools flipImageVertical:dataSource.bufferImage];
+        rect.size = NSMakeSize(image.pixelsWide, image.pixelsHigh);
 
         [(SWSelectionTool *)toolbox.currentTool setClippingRect:rect
-                                                         forImage:dataSource.bufferImage
-                                                    withMainImage:dataSource.mainImage];
+                                                       forImage:image
+                                                  withMainImage:dataSource.mainImage
+                                                    bufferImage:dataSource.bufferImage];
         [paintView setNeedsDisplay:YES];
     }
 }
@@ -619,6 +888,7 @@ static BOOL kSWDocumentWillShowSheet = YES;
                                 withMainImage:dataSource.mainImage 
                                   bufferImage:dataSource.bufferImage 
                                    mouseEvent:MOUSE_UP];
+    [dataSource noteWholeCanvasEdited];
     
     [paintView cursorUpdate:nil];
     [paintView setNeedsDisplay:YES];
@@ -678,15 +948,8 @@ static BOOL kSWDocumentWillShowSheet = YES;
     } 
     else if (action == @selector(paste:)) 
     {
-        NSArray *array = [NSPasteboard generalPasteboard].types;
-        BOOL paste = NO;
-        id object;
-        for (object in array) 
-        {
-            if ([object isEqualToString:NSPasteboardTypeTIFF] || [object isEqualToString:NSPICTPboardType])
-                paste = YES;
-        }
-        return paste;
+        // Only checks the types: nothing gets encoded or decoded
+        return [[SWPasteboardClipboard generalClipboard] hasImage];
     }
     else if (action == @selector(zoomIn:))
         return [scrollView scaleFactor] < 16;
@@ -696,6 +959,36 @@ static BOOL kSWDocumentWillShowSheet = YES;
         return [scrollView scaleFactor] > 2.0;
     else if (action == @selector(newFromClipboard:))
         return YES;
+    else if ((action == @selector(deleteLayer:)) || 
+             (action == @selector(flattenImage:)))
+        return dataSource.layers.count > 1;
+    else if ((action == @selector(moveLayerUp:)) || 
+             (action == @selector(selectLayerAbove:)))
+        return dataSource.activeLayerIndex + 1 < dataSource.layers.count;
+    else if ((action == @selector(moveLayerDown:)) || 
+             (action == @selector(selectLayerBelow:)) || 
+             (action == @selector(mergeLayerDown:)))
+        return dataSource.activeLayerIndex > 0;
+    else if (action == @selector(toggleLayerVisibility:))
+    {
+        if ([(id)anItem isKindOfClass:[NSMenuItem class]])
+            [(NSMenuItem *)anItem setTitle:(dataSource.activeLayer.visible ? 
+                                            NSLocalizedString(@"Hide Layer", @"Menu item that hides the active layer") : 
+                                            NSLocalizedString(@"Show Layer", @"Menu item that shows the active layer"))];
+        return YES;
+    }
+    else if (action == @selector(setLayerOpacity:))
+    {
+        if ([(id)anItem isKindOfClass:[NSMenuItem class]])
+            [(NSMenuItem *)anItem setState:(round(dataSource.activeLayer.opacity * 100.0) == anItem.tag)];
+        return YES;
+    }
+    else if (action == @selector(setLayerBlendMode:))
+    {
+        if ([(id)anItem isKindOfClass:[NSMenuItem class]])
+            [(NSMenuItem *)anItem setState:(dataSource.activeLayer.blendMode == anItem.tag)];
+        return YES;
+    }
     else
         return YES;
 }
@@ -753,12 +1046,16 @@ static BOOL kSWDocumentWillShowSheet = YES;
         // This is also important!
         [toolbox tieUpLooseEndsForCurrentTool];
         
-        [self handleUndoWithImageData:nil frame:NSZeroRect];
-                
-        // Pretend we are a resize
-        [dataSource resizeToSize:rect.size scaleImage:NO];
+        NSArray *oldLayers = dataSource.layers;
+        NSUInteger oldIndex = dataSource.activeLayerIndex;
+        
+        // Every layer gets cropped to the selection...
+        [dataSource cropToRect:rect];
+        [self registerUndoToLayers:oldLayers
+                  activeLayerIndex:oldIndex
+                        actionName:NSLocalizedString(@"Crop", @"The undo command string for cropping")];
         
-        // Set the image
+        // ...and the active one gets exactly what was selected
         [dataSource restoreMainImageFromData:croppedImage.TIFFRepresentation];
         
         // Redraw the Paint view and the clip view
@@ -777,4 +1074,193 @@ static BOOL kSWDocumentWillShowSheet = YES;
 }
 
 
+
+#pragma mark Layers
+
+////////////////////////////////////////////////////////////////////////////////
+//////////        Layers
+////////////////////////////////////////////////////////////////////////////////
+
+
+// A layer change can't happen with a stroke or a selection half-finished,
+// and everything goes through a copy of the stack, so undo can put it back
+- (NSMutableArray *)layersForEditing
+{
+    [toolbox tieUpLooseEndsForCurrentTool];
+    return [dataSource.layers mutableCopy];
+}
+
+
+- (IBAction)newLayer:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex + 1;
+    [stack insertObject:[dataSource newBlankLayer] atIndex:index];
+    [self setLayers:stack activeLayerIndex:index
+         actionName:NSLocalizedString(@"New Layer", @"The undo command string for adding a layer")];
+}
+
+
+// The duplicate is a new layer in its own right, with its own pixels
+- (IBAction)duplicateLayer:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    SWLayer *original = dataSource.activeLayer;
+    
+    NSBitmapImageRep *image = [dataSource newCanvasImage];
+    [SWImageTools drawToImage:image fromImage:original.image withComposition:NO];
+    
+    NSString *name = [NSString stringWithFormat:NSLocalizedString(@"%@ Copy", @"The name of a duplicated layer"), original.name];
+    SWLayer *duplicate = [[SWLayer alloc] initWithImage:image name:name];
+    duplicate.opacity = original.opacity;
+    duplicate.visible = original.visible;
+    duplicate.blendMode = original.blendMode;
+    
+    NSUInteger index = dataSource.activeLayerIndex + 1;
+    [stack insertObject:duplicate atIndex:index];
+    [self setLayers:stack activeLayerIndex:index
+         actionName:NSLocalizedString(@"Duplicate Layer", @"The undo command string for duplicating a layer")];
+}
+
+
+- (IBAction)deleteLayer:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    if (stack.count < 2)
+        return;
+    
+    NSUInteger index = dataSource.activeLayerIndex;
+    [stack removeObjectAtIndex:index];
+    [self setLayers:stack activeLayerIndex:MIN(index, stack.count - 1)
+         actionName:NSLocalizedString(@"Delete Layer", @"The undo command string for deleting a layer")];
+}
+
+
+- (IBAction)moveLayerUp:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex;
+    if (index + 1 >= stack.count)
+        return;
+    
+    [stack exchangeObjectAtIndex:index withObjectAtIndex:index + 1];
+    [self setLayers:stack activeLayerIndex:index + 1
+         actionName:NSLocalizedString(@"Move Layer", @"The undo command string for reordering layers")];
+}
+
+
+- (IBAction)moveLayerDown:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex;
+    if (index == 0)
+        return;
+    
+    [stack exchangeObjectAtIndex:index withObjectAtIndex:index - 1];
+    [self setLayers:stack activeLayerIndex:index - 1
+         actionName:NSLocalizedString(@"Move Layer", @"The undo command string for reordering layers")];
+}
+
+
+// Choosing a layer to draw in isn't an edit, so it doesn't go on the undo stack
+- (IBAction)selectLayerAbove:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex;
+    if (index + 1 < stack.count)
+    {
+        [dataSource setLayers:stack activeLayerIndex:index + 1];
+        [paintView setNeedsDisplay:YES];
+    }
+}
+
+
+- (IBAction)selectLayerBelow:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex;
+    if (index > 0)
+    {
+        [dataSource setLayers:stack activeLayerIndex:index - 1];
+        [paintView setNeedsDisplay:YES];
+    }
+}
+
+
+- (IBAction)toggleLayerVisibility:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex;
+    SWLayer *layer = stack[index];
+    layer.visible = !layer.visible;
+    [self setLayers:stack activeLayerIndex:index
+         actionName:(layer.visible ? NSLocalizedString(@"Show Layer", @"The undo command string for showing a layer")
+                                   : NSLocalizedString(@"Hide Layer", @"The undo command string for hiding a layer"))];
+}
+
+
+// The menu items are tagged with a percentage
+- (IBAction)setLayerOpacity:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex;
+    [stack[index] setOpacity:[sender tag] / 100.0];
+    [self setLayers:stack activeLayerIndex:index
+         actionName:NSLocalizedString(@"Layer Opacity", @"The undo command string for changing a layer's opacity")];
+}
+
+
+// The menu items are tagged with an SWBlendMode
+- (IBAction)setLayerBlendMode:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex;
+    [stack[index] setBlendMode:(SWBlendMode)[sender tag]];
+    [self setLayers:stack activeLayerIndex:index
+         actionName:NSLocalizedString(@"Blend Mode", @"The undo command string for changing a layer's blend mode")];
+}
+
+
+// The layer below keeps its settings, and gets a new image with the active
+// layer drawn over it: the old one still belongs to the undo stack
+- (IBAction)mergeLayerDown:(id)sender
+{
+    NSMutableArray *stack = [self layersForEditing];
+    NSUInteger index = dataSource.activeLayerIndex;
+    if (index == 0)
+        return;
+    
+    SWLayer *lower = stack[index - 1];
+    NSBitmapImageRep *image = [dataSource newCanvasImage];
+    [SWImageTools drawToImage:image fromImage:lower.image withComposition:NO];
+    
+    SWLockFocus(image);
+    [stack[index] drawInContext:[NSGraphicsContext currentContext].CGContext
+                           rect:(NSRect) { NSZeroPoint, dataSource.size }];
+    SWUnlockFocus(image);
+    
+    lower.image = image;
+    [stack removeObjectAtIndex:index];
+    [self setLayers:stack activeLayerIndex:index - 1
+         actionName:NSLocalizedString(@"Merge Layers", @"The undo command string for merging a layer down")];
+}
+
+
+- (IBAction)flattenImage:(id)sender
+{
+    [toolbox tieUpLooseEndsForCurrentTool];
+    if (dataSource.layers.count < 2)
+        return;
+    
+    // The flattened image is a cache that keeps changing, so take a copy
+    NSBitmapImageRep *image = [dataSource newCanvasImage];
+    [SWImageTools drawToImage:image fromImage:dataSource.compositeImage withComposition:NO];
+    
+    SWLayer *background = [[SWLayer alloc] initWithImage:image
+                                                    name:NSLocalizedString(@"Background", @"The name of a document's first layer")];
+    [self setLayers:@[background] activeLayerIndex:0
+         actionName:NSLocalizedString(@"Flatten Image", @"The undo command string for flattening every layer into one")];
+}
+
+
 @end
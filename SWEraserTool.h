@@ -20,6 +20,9 @@
 #import <Cocoa/Cocoa.h>
 #import "SWTool.h"
 
-@interface SWEraserTool : SWTool
+@interface SWEraserTool : SWTool {
+    // How much of the path is in the buffer already
+    NSInteger strokedElements;
+}
 
 @end
@@ -29,6 +29,14 @@
     {
         path = NSBezierPath.bezierPath;
         path.lineWidth = lineWidth;        
+        
+        // Smooth strokes are one round-jointed line, so their edges never
+        // overlap each other's
+        if (self.antialias)
+        {
+            path.lineCapStyle = NSLineCapStyleRound;
+            path.lineJoinStyle = NSLineJoinStyleRound;
+        }
     }
     //if (lineWidth <= 1) 
     //{
@@ -39,7 +47,8 @@
     end.x += 0.5;
     end.y += 0.5;
     //}
-    [path moveToPoint:begin];
+    if (path.isEmpty || !NSEqualPoints(path.currentPoint, begin) || !self.antialias)
+        [path moveToPoint:begin];
     [path lineToPoint:end];
     
     return path;
@@ -51,6 +60,12 @@
                          bufferImage:(NSBitmapImageRep *)bufferImage 
                           mouseEvent:(SWMouseEvent)event
 {
+    if (event == MOUSE_DOWN)
+    {
+        [self beginSymmetryInImage:bufferImage];
+        strokedElements = 0;
+    }
+    
     // Use the points clicked to build a redraw rectangle
     [super addRedrawRectFromPoint:point toPoint:savedPoint];
     
@@ -64,29 +79,83 @@
     } 
     else 
     {        
-        SWLockFocus(bufferImage);
-        
-        // The best way I can come up with to clear the image
-        [SWImageTools clearImage:bufferImage];
-        
-        [[NSGraphicsContext currentContext] setShouldAntialias:NO];
-        
-        [NSGraphicsContext saveGraphicsState];
-        [NSGraphicsContext currentContext].compositingOperation = NSCompositingOperationCopy;
-        if (flags & NSEventModifierFlagOption)
-            [frontColor setStroke];
-        else
-            [backColor setStroke];    
-        
-        [[self pathFromPoint:savedPoint toPoint:point] stroke];
-        [NSGraphicsContext restoreGraphicsState];
+        [self pathFromPoint:savedPoint toPoint:point];
         savedPoint = point;
-        
-        SWUnlockFocus(bufferImage);
+        [self strokePathInImage:bufferImage];
+    }
+    return nil;
+}
+
+// A batch of drag points only needs the stroke redrawn once, at the end
+- (NSBezierPath *)performDrawAlongPoints:(const NSPoint *)points
+                                   count:(NSUInteger)count
+                           withMainImage:(NSBitmapImageRep *)mainImage
+                             bufferImage:(NSBitmapImageRep *)bufferImage
+{
+    [self beginRedrawBatch];
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        [super addRedrawRectFromPoint:points[i] toPoint:savedPoint];
+        [self pathFromPoint:savedPoint toPoint:points[i]];
+        savedPoint = points[i];
     }
+    [self endRedrawBatch];
+    
+    if (count)
+        [self strokePathInImage:bufferImage];
     return nil;
 }
 
+// Nothing but the path and the buffer changes between mouse down and mouse up
+- (BOOL)drawsOffMainThread
+{
+    return YES;
+}
+
+- (void)strokePathInImage:(NSBitmapImageRep *)bufferImage
+{
+    // Like the brush, smooth strokes are only drawn again where they've grown
+    if (self.antialias)
+    {
+        if (strokedElements == 0)
+            [SWImageTools clearImage:bufferImage];
+        strokedElements = path.elementCount;
+        
+        NSRect rects[kSWMaxSymmetryCopies];
+        NSUInteger count = [self getInvalidRects:rects];
+        [self restrokeSymmetricPath:path 
+                            inImage:bufferImage 
+                          withColor:((flags & NSEventModifierFlagOption) ? frontColor : backColor) 
+                            inRects:rects 
+                              count:count];
+        return;
+    }
+    
+    // Like the brush, only the segments added since last time need drawing
+    NSBezierPath *segments = [self symmetricPath:path fromElement:strokedElements];
+    
+    SWLockFocus(bufferImage);
+    
+    // The best way I can come up with to clear the image
+    if (strokedElements == 0)
+        [SWImageTools clearImage:bufferImage];
+    strokedElements = path.elementCount;
+    
+    [[NSGraphicsContext currentContext] setShouldAntialias:NO];
+    
+    [NSGraphicsContext saveGraphicsState];
+    [NSGraphicsContext currentContext].compositingOperation = NSCompositingOperationCopy;
+    if (flags & NSEventModifierFlagOption)
+        [frontColor setStroke];
+    else
+        [backColor setStroke];    
+    
+    [segments stroke];
+    [NSGraphicsContext restoreGraphicsState];
+    
+    SWUnlockFocus(bufferImage);
+}
+
 - (NSCursor *)cursor
 {
     if (!customCursor) {
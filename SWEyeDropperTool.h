@@ -19,10 +19,31 @@
 
 #import <Cocoa/Cocoa.h>
 #import "SWTool.h"
+#import "SWColorSampler.h"
+
+// How much of the image under the eyedropper goes into the color it picks
+typedef NS_ENUM(NSInteger, SWEyeDropperSample) {
+    SWEyeDropperPoint = 0,          // Just the one pixel
+    SWEyeDropperAverage3x3,
+    SWEyeDropperAverage5x5,
+    SWEyeDropperAverage11x11,
+    SWEyeDropperDominant            // The most common color around the point
+};
+
+extern NSString * const kSWEyeDropperSampleKey;    // An SWEyeDropperSample
 
 
 @interface SWEyeDropperTool : SWTool {
     NSBitmapImageRep *imageRep;
+    
+    // Built up for whichever image was sampled last, as it gets sampled
+    SWColorSampler *sampler;
+    NSBitmapImageRep *samplerImage;
+    
+    NSRect swatchRect;    // Where the hover preview is in the buffer, if anywhere
 }
 
+// The color the eyedropper would pick up at a point in the image
+- (NSColor *)colorAtPoint:(NSPoint)point inImage:(NSBitmapImageRep *)image sample:(SWEyeDropperSample)sample;
+
 @end
@@ -19,20 +19,117 @@
 
 #import "SWEyeDropperTool.h"
 #import "SWToolboxController.h"
+#import "SWImageTools.h"
+
+
+NSString * const kSWEyeDropperSampleKey = @"EyeDropperSample";
+
+// Where the preview swatch goes, from the point: below and to the right, clear
+// of the cursor
+static const CGFloat kSWSwatchOffset = 12.0;
+static const CGFloat kSWSwatchSize = 16.0;
 
 
 @implementation SWEyeDropperTool
 
+- (void)dealloc
+{
+    SWColorSamplerDestroy(sampler);
+}
+
+
+- (NSColor *)colorAtPoint:(NSPoint)point inImage:(NSBitmapImageRep *)image sample:(SWEyeDropperSample)sample
+{
+    NSInteger x = floor(point.x);
+    NSInteger y = image.pixelsHigh - floor(point.y) - 1;
+    if (x < 0 || y < 0 || x >= image.pixelsWide || y >= image.pixelsHigh)
+        return nil;
+    
+    // Only our own canvases have the layout the sampler wants
+    if (sample == SWEyeDropperPoint || image.bitsPerPixel != 32 || image.isPlanar)
+        return [[image colorAtX:x y:y] colorUsingColorSpace:[NSColorSpace genericRGBColorSpace]];
+    
+    if (image != samplerImage)
+    {
+        SWColorSamplerDestroy(sampler);
+        sampler = SWColorSamplerCreate(image.bitmapData, image.pixelsWide, image.pixelsHigh, image.bytesPerRow);
+        samplerImage = image;
+    }
+    
+    uint8_t rgba[4];
+    static const long radii[] = { 0, 1, 2, 5 };
+    size_t count = (sample == SWEyeDropperDominant) ?
+        SWColorSamplerDominant(sampler, x, y, rgba) :
+        SWColorSamplerAverage(sampler, x, y, radii[MIN(sample, SWEyeDropperAverage11x11)], rgba);
+    if (count == 0)
+        return nil;
+    
+    // The averages are of premultiplied colors, which is what keeps a
+    // see-through pixel from counting as much as an opaque one
+    if (rgba[3] == 0)
+        return [[NSColor clearColor] colorUsingColorSpace:[NSColorSpace genericRGBColorSpace]];
+    CGFloat alpha = rgba[3] / 255.0;
+    NSColor *color = [NSColor colorWithCalibratedRed:rgba[0] / 255.0 / alpha
+                                               green:rgba[1] / 255.0 / alpha
+                                                blue:rgba[2] / 255.0 / alpha
+                                               alpha:alpha];
+    return [color colorUsingColorSpace:[NSColorSpace genericRGBColorSpace]];
+}
+
+
+// The sampler never looks at the pixels again once a tile's tables are built,
+// so it has to hear about every edit.  A new canvas lets go of the old one
+- (void)canvasDidChangeInRect:(NSRect)rect
+{
+    if (!sampler)
+        return;
+    
+    if (NSIsEmptyRect(rect))
+    {
+        SWColorSamplerDestroy(sampler);
+        sampler = NULL;
+        samplerImage = nil;
+        return;
+    }
+    
+    rect = NSIntegralRect(rect);
+    SWColorSamplerInvalidateRect(sampler, NSMinX(rect), samplerImage.pixelsHigh - NSMaxY(rect),
+                                 NSWidth(rect), NSHeight(rect));
+}
+
+
+- (SWEyeDropperSample)currentSample
+{
+    return [NSUserDefaults.standardUserDefaults integerForKey:kSWEyeDropperSampleKey];
+}
+
+
+// Takes the last preview swatch back out of the buffer
+- (void)clearSwatch
+{
+    if (!_bufferImage || NSIsEmptyRect(swatchRect))
+        return;
+    [SWImageTools clearImage:_bufferImage inRect:swatchRect];
+    [self addRectToRedrawRect:swatchRect];
+    swatchRect = NSZeroRect;
+}
+
+
 - (NSBezierPath *)performDrawAtPoint:(NSPoint)point 
                        withMainImage:(NSBitmapImageRep *)mainImage 
                          bufferImage:(NSBitmapImageRep *)bufferImage 
                           mouseEvent:(SWMouseEvent)event
 {
+    if (event == MOUSE_DOWN)
+    {
+        [self resetRedrawRect];
+        [self clearSwatch];
+    }
+    
     // This should happen regardless of the type of click
-    NSColor *colorClicked = [mainImage colorAtX:point.x y:(mainImage.pixelsHigh - point.y - 1)];
+    NSColor *colorClickedConverted = [self colorAtPoint:point inImage:mainImage sample:[self currentSample]];
     
-    if (colorClicked != nil) {
-        NSColor *colorClickedConverted = [colorClicked colorUsingColorSpace:[NSColorSpace genericRGBColorSpace]];
+    if (colorClickedConverted != nil) {
         if (flags & NSEventModifierFlagOption) {
             [[SWToolboxController sharedToolboxPanelController] setBackgroundColor:colorClickedConverted];
         } else {
@@ -43,6 +140,41 @@
     return nil;
 }
 
+
+// A swatch of what a click would pick up follows the mouse around
+- (void)mouseHasMoved:(NSPoint)point
+{
+    if (!_mainImage || !_bufferImage)
+        return;
+    
+    [self resetRedrawRect];
+    [self clearSwatch];
+    
+    NSColor *color = [self colorAtPoint:point inImage:_mainImage sample:[self currentSample]];
+    if (color)
+    {
+        NSRect swatch = NSMakeRect(floor(point.x) + kSWSwatchOffset, floor(point.y) + kSWSwatchOffset,
+                                   kSWSwatchSize, kSWSwatchSize);
+        SWLockFocus(_bufferImage);
+        [color setFill];
+        NSRectFillUsingOperation(swatch, NSCompositingOperationCopy);
+        [[NSColor blackColor] setFill];
+        NSFrameRect(swatch);
+        SWUnlockFocus(_bufferImage);
+        
+        swatchRect = swatch;
+        [self addRectToRedrawRect:swatch];
+    }
+    [self refreshPreview];
+}
+
+
+- (void)tieUpLooseEnds
+{
+    [self clearSwatch];
+    [super tieUpLooseEnds];
+}
+
 - (NSCursor *)cursor
 {
     if (!customCursor) {
@@ -0,0 +1,366 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "SWFillShader.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Gradient positions are 8.24 fixed point, 0 to 1 being the gradient, so even
+// a gradient across an 8K canvas steps along it exactly enough
+#define SW_SHADE_POSITION   24
+#define SW_SHADE_ONE        (1 << SW_SHADE_POSITION)
+
+// ...and colors are worked out with this many bits below the 8 that are kept
+#define SW_SHADE_BITS       12
+
+// Gradient spans are shaded this many pixels at a time.  Linear ones start
+// each chunk again from an exact position, so rounding in the step never
+// adds up
+#define SW_SHADE_CHUNK      256
+
+// Positions start no further out than this, and the steps in a chunk add up
+// to no more than it, so they can't overflow
+#define SW_SHADE_MAX_T      (1 << 30)
+
+// Where a channel goes in a pixel read as one 32-bit word
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SW_SHADE_SHIFT(c)   (24 - 8 * (c))
+#else
+#define SW_SHADE_SHIFT(c)   (8 * (c))
+#endif
+
+// A gradient's colors: the first one, already shifted up, and how far it is
+// to the second, per channel
+typedef struct {
+    int32_t base[4], delta[4];
+} SWShadeRamp;
+
+typedef enum {
+    SWShadeLinear,
+    SWShadeRadial,
+    SWShadePattern
+} SWShadeKind;
+
+struct SWFillShader {
+    long width, height;
+    SWShadeKind kind;
+
+    SWShadeRamp ramp;
+    double a, b, c;             // Linear: position = a * x + b * y + c
+    double cx, cy;              // Radial
+    float inverseRadius;
+
+    // What gradients are rounded with, a chunk's worth for each row of the
+    // dither pattern, so a chunk of pixels reads them in order
+    int32_t thresholds[4][SW_SHADE_CHUNK + 3];
+
+    // Patterns: where in the pattern each column and row of the image is, worked
+    // out once so there's no wrapping around to do while filling
+    uint32_t *pattern;
+    uint32_t *columns;          // width of them
+    uint32_t *rows;             // height of them, as offsets to the start of a row
+};
+
+// A 4x4 Bayer matrix, each cell standing for a threshold a sixteenth of the
+// way further along a level
+static const int32_t SWShadeBayer[4][4] = {
+    { 0,  8,  2, 10 },
+    { 12, 4, 14,  6 },
+    { 3, 11,  1,  9 },
+    { 15, 7, 13,  5 }
+};
+
+
+SWFillShader *SWFillShaderCreate(long width, long height)
+{
+    SWFillShader *shader = calloc(1, sizeof(SWFillShader));
+    if (!shader)
+        return NULL;
+    shader->width = width;
+    shader->height = height;
+    shader->kind = SWShadeLinear;
+    SWFillShaderSetDither(shader, 0);
+    return shader;
+}
+
+
+void SWFillShaderDestroy(SWFillShader *shader)
+{
+    if (!shader)
+        return;
+    free(shader->pattern);
+    free(shader->columns);
+    free(shader->rows);
+    free(shader);
+}
+
+
+static void SWShaderSetColors(SWFillShader *shader, const uint8_t from[4], const uint8_t to[4])
+{
+    for (int c = 0; c < 4; c++)
+    {
+        shader->ramp.base[c] = (int32_t)from[c] << SW_SHADE_BITS;
+        shader->ramp.delta[c] = (int32_t)to[c] - from[c];
+    }
+}
+
+
+void SWFillShaderSetLinear(SWFillShader *shader, double x0, double y0, double x1, double y1,
+                           const uint8_t from[4], const uint8_t to[4])
+{
+    shader->kind = SWShadeLinear;
+    SWShaderSetColors(shader, from, to);
+
+    double vx = x1 - x0, vy = y1 - y0;
+    double length2 = vx * vx + vy * vy;
+    if (length2 < 1e-12)
+    {
+        shader->a = shader->b = shader->c = 0.0;
+        return;
+    }
+    shader->a = vx / length2;
+    shader->b = vy / length2;
+    shader->c = -(x0 * vx + y0 * vy) / length2;
+}
+
+
+void SWFillShaderSetRadial(SWFillShader *shader, double cx, double cy, double radius,
+                           const uint8_t from[4], const uint8_t to[4])
+{
+    shader->kind = SWShadeRadial;
+    SWShaderSetColors(shader, from, to);
+    shader->cx = cx;
+    shader->cy = cy;
+    shader->inverseRadius = (float)(1.0 / (radius > 0.5 ? radius : 0.5));
+}
+
+
+int SWFillShaderSetPattern(SWFillShader *shader, const uint8_t *pixels,
+                           long width, long height, size_t bytesPerRow)
+{
+    if (!pixels || width <= 0 || height <= 0)
+        return 0;
+    uint32_t *pattern = malloc((size_t)width * height * 4);
+    uint32_t *columns = malloc((shader->width ? shader->width : 1) * sizeof(uint32_t));
+    uint32_t *rows = malloc((shader->height ? shader->height : 1) * sizeof(uint32_t));
+    if (!pattern || !columns || !rows)
+    {
+        free(pattern);
+        free(columns);
+        free(rows);
+        return 0;
+    }
+
+    for (long y = 0; y < height; y++)
+        memcpy(pattern + y * width, pixels + y * bytesPerRow, width * 4);
+    for (long x = 0, px = 0; x < shader->width; x++, px = (px + 1 == width) ? 0 : px + 1)
+        columns[x] = (uint32_t)px;
+    for (long y = 0, py = 0; y < shader->height; y++, py = (py + 1 == height) ? 0 : py + 1)
+        rows[y] = (uint32_t)(py * width);
+
+    free(shader->pattern);
+    free(shader->columns);
+    free(shader->rows);
+    shader->pattern = pattern;
+    shader->columns = columns;
+    shader->rows = rows;
+    shader->kind = SWShadePattern;
+    return 1;
+}
+
+
+void SWFillShaderSetDither(SWFillShader *shader, int dither)
+{
+    for (int y = 0; y < 4; y++)
+    {
+        for (int x = 0; x < SW_SHADE_CHUNK + 3; x++)
+        {
+            if (dither)
+                shader->thresholds[y][x] = (2 * SWShadeBayer[y][x & 3] + 1) << (SW_SHADE_BITS - 5);
+            else
+                shader->thresholds[y][x] = 1 << (SW_SHADE_BITS - 1);
+        }
+    }
+}
+
+
+// The thresholds for a chunk of a row starting at column x
+static inline const int32_t *SWShaderThresholds(const SWFillShader *shader, long x, long y)
+{
+    return shader->thresholds[y & 3] + (x & 3);
+}
+
+
+// One pixel of a gradient, u being how far along it is, 0 to 1 << SW_SHADE_BITS.
+// Every channel is the same sum with the same threshold, so a premultiplied
+// color stays premultiplied
+static inline uint32_t SWShaderGradientPixel(const SWShadeRamp *ramp, int32_t u, int32_t threshold)
+{
+    uint32_t r = (uint32_t)((ramp->base[0] + ramp->delta[0] * u + threshold) >> SW_SHADE_BITS);
+    uint32_t g = (uint32_t)((ramp->base[1] + ramp->delta[1] * u + threshold) >> SW_SHADE_BITS);
+    uint32_t b = (uint32_t)((ramp->base[2] + ramp->delta[2] * u + threshold) >> SW_SHADE_BITS);
+    uint32_t a = (uint32_t)((ramp->base[3] + ramp->delta[3] * u + threshold) >> SW_SHADE_BITS);
+    return r << SW_SHADE_SHIFT(0) | g << SW_SHADE_SHIFT(1) | b << SW_SHADE_SHIFT(2) | a << SW_SHADE_SHIFT(3);
+}
+
+
+static inline int32_t SWShaderClamp(int32_t t)
+{
+    t = t < 0 ? 0 : t;
+    return t > SW_SHADE_ONE ? SW_SHADE_ONE : t;
+}
+
+
+// A chunk of a linear gradient, stepping along it in fixed point.  The ramp
+// is a copy, so the compiler knows the pixels being written can't change it
+static void SWShaderLinearChunk(uint32_t *restrict out, long count, int32_t t, int32_t dt,
+                                const SWShadeRamp *restrict ramp, const int32_t *restrict thresholds)
+{
+    for (long i = 0; i < count; i++)
+    {
+        out[i] = SWShaderGradientPixel(ramp, SWShaderClamp(t) >> (SW_SHADE_POSITION - SW_SHADE_BITS), thresholds[i]);
+        t += dt;
+    }
+}
+
+
+static void SWShaderRadialChunk(uint32_t *restrict out, long count, float dx, float dy2, float scale,
+                                const SWShadeRamp *restrict ramp, const int32_t *restrict thresholds)
+{
+    for (long i = 0; i < count; i++)
+    {
+        float d = dx + (float)i;
+        d = sqrtf(d * d + dy2) * scale;
+        int32_t u = (int32_t)(d < (1 << SW_SHADE_BITS) ? d + 0.5f : (1 << SW_SHADE_BITS));
+        out[i] = SWShaderGradientPixel(ramp, u, thresholds[i]);
+    }
+}
+
+
+static void SWShaderLinearSpan(const SWFillShader *shader, uint32_t *out, long x, long y, long count)
+{
+    SWShadeRamp ramp = shader->ramp;
+    double step = shader->a * SW_SHADE_ONE;
+    step = step > SW_SHADE_MAX_T - 1 ? SW_SHADE_MAX_T - 1 : (step < 1 - SW_SHADE_MAX_T ? 1 - SW_SHADE_MAX_T : step);
+    int32_t dt = (int32_t)lround(step);
+
+    // Gradients only a few pixels long take shorter chunks
+    long chunk = SW_SHADE_CHUNK;
+    if (dt != 0 && (SW_SHADE_MAX_T - 1) / labs((long)dt) < chunk)
+        chunk = (SW_SHADE_MAX_T - 1) / labs((long)dt);
+    chunk = chunk < 1 ? 1 : chunk;
+
+    for (long done = 0; done < count; done += chunk)
+    {
+        long n = count - done < chunk ? count - done : chunk;
+        double start = (shader->a * (x + done + 0.5) + shader->b * (y + 0.5) + shader->c) * SW_SHADE_ONE;
+        start = start > SW_SHADE_MAX_T ? SW_SHADE_MAX_T : (start < -SW_SHADE_MAX_T ? -SW_SHADE_MAX_T : start);
+        SWShaderLinearChunk(out + done, n, (int32_t)lround(start), dt, &ramp,
+                            SWShaderThresholds(shader, x + done, y));
+    }
+}
+
+
+static void SWShaderRadialSpan(const SWFillShader *shader, uint32_t *out, long x, long y, long count)
+{
+    SWShadeRamp ramp = shader->ramp;
+    float dy = (float)(y + 0.5 - shader->cy);
+    float scale = shader->inverseRadius * (1 << SW_SHADE_BITS);
+
+    for (long done = 0; done < count; done += SW_SHADE_CHUNK)
+    {
+        long n = count - done < SW_SHADE_CHUNK ? count - done : SW_SHADE_CHUNK;
+        SWShaderRadialChunk(out + done, n, (float)(x + done + 0.5 - shader->cx), dy * dy, scale, &ramp,
+                            SWShaderThresholds(shader, x + done, y));
+    }
+}
+
+
+static void SWShaderPatternSpan(const SWFillShader *shader, uint32_t *restrict out, long x, long y, long count)
+{
+    const uint32_t *restrict row = shader->pattern + shader->rows[y];
+    const uint32_t *restrict columns = shader->columns + x;
+    for (long i = 0; i < count; i++)
+        out[i] = row[columns[i]];
+}
+
+
+static void SWShaderSpan(const SWFillShader *shader, uint32_t *out, long x, long y, long count)
+{
+    switch (shader->kind)
+    {
+        case SWShadeLinear:
+            SWShaderLinearSpan(shader, out, x, y, count);
+            break;
+        case SWShadeRadial:
+            SWShaderRadialSpan(shader, out, x, y, count);
+            break;
+        case SWShadePattern:
+            SWShaderPatternSpan(shader, out, x, y, count);
+            break;
+    }
+}
+
+
+void SWFillShaderFillRows(const SWFillShader *shader, uint8_t *pixels, size_t bytesPerRow,
+                          long firstRow, long lastRow,
+                          const uint8_t *mask, size_t maskBytesPerRow)
+{
+    long w = shader->width;
+    firstRow = firstRow < 0 ? 0 : firstRow;
+    lastRow = lastRow > shader->height ? shader->height : lastRow;
+
+    for (long y = firstRow; y < lastRow; y++)
+    {
+        uint32_t *row = (uint32_t *)(pixels + (size_t)y * bytesPerRow);
+        if (!mask)
+        {
+            SWShaderSpan(shader, row, 0, y, w);
+            continue;
+        }
+
+        const uint8_t *m = mask + (size_t)y * maskBytesPerRow;
+        long x = 0;
+        while (x < w)
+        {
+            // Skip what's masked out, then shade the run that isn't
+            while (x < w && m[x] == 255)
+                x++;
+            long start = x;
+            while (x < w && m[x] == 0)
+                x++;
+            if (x > start)
+                SWShaderSpan(shader, row + start, start, y, x - start);
+
+            // Partly masked pixels are shaded on their own and mixed in
+            while (x < w && m[x] != 0 && m[x] != 255)
+            {
+                uint32_t word;
+                uint8_t *shade = (uint8_t *)&word, *p = (uint8_t *)(row + x);
+                uint32_t keep = m[x];
+                SWShaderSpan(shader, &word, x, y, 1);
+                for (int c = 0; c < 4; c++)
+                    p[c] = (uint8_t)((shade[c] * (255 - keep) + p[c] * keep + 127) / 255);
+                x++;
+            }
+        }
+    }
+}
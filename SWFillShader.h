@@ -0,0 +1,79 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Fills with something other than a flat color: linear and radial gradients
+// between two colors, and a pattern tiled from the image's origin.
+//
+// Rows are walked a span at a time, a span being a run of pixels the mask
+// lets through, and each span is shaded by a loop with nothing carried from
+// one pixel to the next but a fixed-point step, so the compiler vectorizes
+// it.  Gradients are worked out to 12 bits past the 8 that are kept, and can
+// be ordered dithered down to them, which hides the banding of long, gentle
+// gradients.
+//
+// Pixels are 8-bit premultiplied RGBA, and coordinates count rows in memory
+// order, with a pixel's center at (x + 0.5, y + 0.5).  Plain C, so it can be
+// built and hammered on anywhere.  Setting a shader up isn't thread-safe, but
+// once it's set up, any number of threads can fill different rows with it.
+
+#ifndef SWFILLSHADER_H
+#define SWFILLSHADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SWFillShader SWFillShader;
+
+// For filling an image of this size.  It starts out as a linear gradient from
+// clear to clear, which fills with nothing
+SWFillShader *SWFillShaderCreate(long width, long height);
+void SWFillShaderDestroy(SWFillShader *shader);
+
+// Colors are premultiplied.  The gradient runs from the first point, or the
+// center, to the second point, or the circle; beyond that it keeps the last
+// color.  A linear gradient with both points the same is the first color
+void SWFillShaderSetLinear(SWFillShader *shader, double x0, double y0, double x1, double y1,
+                           const uint8_t from[4], const uint8_t to[4]);
+void SWFillShaderSetRadial(SWFillShader *shader, double cx, double cy, double radius,
+                           const uint8_t from[4], const uint8_t to[4]);
+
+// The pattern is copied, so it can go away afterwards.  Returns 0 if there
+// wasn't the memory, leaving the shader as it was
+int SWFillShaderSetPattern(SWFillShader *shader, const uint8_t *pixels,
+                           long width, long height, size_t bytesPerRow);
+
+// Ordered dithering of gradients; off to start with
+void SWFillShaderSetDither(SWFillShader *shader, int dither);
+
+// Fills rows from firstRow up to lastRow, replacing what's there where the
+// mask is 0 and leaving it where the mask is 255, like a CGImageMask.  In
+// between, it's a mix.  No mask fills every pixel
+void SWFillShaderFillRows(const SWFillShader *shader, uint8_t *pixels, size_t bytesPerRow,
+                          long firstRow, long lastRow,
+                          const uint8_t *mask, size_t maskBytesPerRow);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -19,15 +19,46 @@
 
 #import <Cocoa/Cocoa.h>
 #import "SWTool.h"
+#import "SWFillShader.h"
 
 @class SWSelectionBuilder;
 
+// What the fill tool floods with
+typedef NS_ENUM(NSInteger, SWFillMode) {
+    SWFillModeSolid = 0,
+    SWFillModeLinear,           // Gradients go from the fill color to the other one,
+    SWFillModeRadial,           //    along the drag, or across the canvas on a click
+    SWFillModePattern           // The image at kSWFillPatternImageKey, tiled
+};
+
+extern NSString * const kSWFillModeKey;             // An SWFillMode
+extern NSString * const kSWFillDitherKey;           // Dither gradients
+extern NSString * const kSWFillPatternImageKey;     // A path
+
+// Shades the image where the mask is 0, a band of rows on each core.  No mask
+// shades all of it
+void SWFillImageWithShader(NSBitmapImageRep *image, const SWFillShader *shader,
+                           const uint8_t *mask, size_t maskBytesPerRow);
+
 @interface SWFillTool : SWTool {
     NSBitmapImageRep *aRep, *imageRep;
     NSBitmapImageRep *image;
     NSInteger h;
     NSInteger w;
     NSColor *fillColor;
+    
+    // While a gradient is being dragged out: the flood fill's mask, and where
+    // the drag started and was last shaded to
+    SWFillShader *shader;
+    CFDataRef maskData;
+    size_t maskRowBytes;
+    NSPoint startPoint, shadedPoint;
+    
+    // The pattern, its rows in the same order as the canvas's, and where it
+    // came from
+    NSData *patternPixels;
+    NSInteger patternWidth, patternHeight;
+    NSString *patternImagePath;
 }
 
 
@@ -21,17 +21,50 @@
 #import "SWSelectionBuilder.h"
 #import "SWDocument.h"
 
+NSString * const kSWFillModeKey = @"FillMode";
+NSString * const kSWFillDitherKey = @"FillDither";
+NSString * const kSWFillPatternImageKey = @"FillPatternImage";
+
+// Rows a worker shades at a time
+#define kSWFillBandRows     16
+
+
+void SWFillImageWithShader(NSBitmapImageRep *image, const SWFillShader *shader,
+                           const uint8_t *mask, size_t maskBytesPerRow)
+{
+    NSInteger height = image.pixelsHigh;
+    SWImageUseRect(image, NSMakeRect(0, 0, image.pixelsWide, height), NO);
+    
+    unsigned char *data = image.bitmapData;
+    size_t bytesPerRow = image.bytesPerRow;
+    size_t bands = (height + kSWFillBandRows - 1) / kSWFillBandRows;
+    dispatch_apply(bands, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t band) {
+        long first = band * kSWFillBandRows;
+        SWFillShaderFillRows(shader, data, bytesPerRow, first, MIN(height, first + kSWFillBandRows), 
+                             mask, maskBytesPerRow);
+    });
+}
+
 
 @interface SWFillTool (Private)
 
 - (CGImageRef) floodFillSelect:(NSPoint)point tolerance:(CGFloat)tolerance;
 - (void) fillMask:(CGImageRef)mask withColor:(NSColor *)color;
+- (BOOL) setUpShaderForMode:(SWFillMode)mode;
+- (void) shadeToPoint:(NSPoint)point;
+- (void) finishShading;
 
 @end
 
 
 @implementation SWFillTool
 
+- (void)dealloc
+{
+    [self finishShading];
+    SWFillShaderDestroy(shader);
+}
+
 - (NSBezierPath *)pathFromPoint:(NSPoint)begin toPoint:(NSPoint)end
 {
     return nil;
@@ -45,6 +78,7 @@
 {    
     if (event == MOUSE_DOWN) 
     {
+        [self finishShading];
 
         // Get the width and height of the image
         w = mainImage.size.width;
@@ -55,10 +89,30 @@
         // Which color are we using?
         fillColor = [(flags & NSEventModifierFlagOption) ? backColor : frontColor colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
         
+        // Anything but a solid color is shaded straight into the pixels, over
+        // the flood fill's mask, and gradients again as the mouse is dragged
+        SWFillMode mode = [NSUserDefaults.standardUserDefaults integerForKey:kSWFillModeKey];
+        if (mode != SWFillModeSolid && [self setUpShaderForMode:mode])
+        {
+            // The undo is of the canvas before any shading, but the journal
+            // waits for the last of it, on mouse up
+            [document handleUndoWithImageData:nil frame:NSZeroRect];
+            [document holdJournalEntry];
+            
+            CGImageRef mask = [self floodFillSelect:NSMakePoint(point.x, point.y+1) tolerance:0.0];
+            maskData = CGDataProviderCopyData(CGImageGetDataProvider(mask));
+            maskRowBytes = CGImageGetBytesPerRow(mask);
+            CGImageRelease(mask);
+            
+            startPoint = point;
+            [self shadeToPoint:point];
+            if (mode == SWFillModePattern)
+                [self finishShading];
+        }
         // Check to make sure if we should even bother trying to fill - 
         // if it's the same color, there's nothing to do
-        if (![SWImageTools color:[mainImage colorAtX:point.x y:(h - point.y)] 
-                  isEqualToColor:fillColor]) 
+        else if (![SWImageTools color:[mainImage colorAtX:point.x y:(h - point.y)] 
+                       isEqualToColor:fillColor]) 
         {
             // Prep an undo - we're about to change things!
             [document handleUndoWithImageData:nil frame:NSZeroRect];
@@ -75,9 +129,30 @@
             [super addRedrawRectFromPoint:NSZeroPoint toPoint:NSMakePoint(_mainImage.pixelsWide, _mainImage.pixelsHigh)];
         }
     }
+    else if (maskData)
+    {
+        if (!NSEqualPoints(point, shadedPoint))
+            [self shadeToPoint:point];
+        if (event == MOUSE_UP)
+            [self finishShading];
+    }
     return nil;
 }
 
+// Every shading covers the whole fill, so only the last point of a batch matters
+- (NSBezierPath *)performDrawAlongPoints:(const NSPoint *)points
+                                   count:(NSUInteger)count
+                           withMainImage:(NSBitmapImageRep *)mainImage
+                             bufferImage:(NSBitmapImageRep *)bufferImage
+{
+    if (count == 0)
+        return nil;
+    return [self performDrawAtPoint:points[count - 1]
+                      withMainImage:mainImage
+                        bufferImage:bufferImage
+                         mouseEvent:MOUSE_DRAGGED];
+}
+
 - (NSCursor *)cursor
 {
     if (!customCursor) {
@@ -106,6 +181,110 @@
     return ref;
 }
 
+// The pattern's pixels, loaded again only when the image it's from changes.
+// Flipped on the way in, like everything else in the canvas
+- (BOOL)loadPatternImage:(NSString *)imagePath
+{
+    if (patternPixels && [imagePath isEqualToString:patternImagePath])
+        return YES;
+    
+    patternPixels = nil;
+    patternImagePath = [imagePath copy];
+    NSImage *pattern = imagePath ? [[NSImage alloc] initWithContentsOfFile:imagePath] : nil;
+    NSImageRep *bestRep = [pattern bestRepresentationForRect:NSMakeRect(0, 0, pattern.size.width, pattern.size.height) 
+                                                     context:nil 
+                                                       hints:nil];
+    patternWidth = bestRep.pixelsWide ?: pattern.size.width;
+    patternHeight = bestRep.pixelsHigh ?: pattern.size.height;
+    if (patternWidth <= 0 || patternHeight <= 0)
+        return NO;
+    
+    NSBitmapImageRep *rep = nil;
+    [SWImageTools initImageRep:&rep withSize:NSMakeSize(patternWidth, patternHeight)];
+    SWLockFocus(rep);
+    [pattern drawInRect:NSMakeRect(0, 0, patternWidth, patternHeight)];
+    SWUnlockFocus(rep);
+    
+    NSMutableData *pixels = [NSMutableData dataWithLength:patternWidth * patternHeight * 4];
+    for (NSInteger y = 0; y < patternHeight; y++)
+        memcpy((uint8_t *)pixels.mutableBytes + y * patternWidth * 4, 
+               rep.bitmapData + (patternHeight - 1 - y) * rep.bytesPerRow, 
+               patternWidth * 4);
+    patternPixels = pixels;
+    return YES;
+}
+
+// Gets the shader ready for a fill of the main image.  NO if it can't be
+// done, and the fill should be a solid color after all
+- (BOOL)setUpShaderForMode:(SWFillMode)mode
+{
+    if (_mainImage.bitsPerPixel != 32 || _mainImage.isPlanar)
+        return NO;
+    
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    if (mode == SWFillModePattern && ![self loadPatternImage:[defaults stringForKey:kSWFillPatternImageKey]])
+        return NO;
+    
+    SWFillShaderDestroy(shader);
+    shader = SWFillShaderCreate(w, h);
+    if (!shader)
+        return NO;
+    SWFillShaderSetDither(shader, [defaults boolForKey:kSWFillDitherKey]);
+    if (mode == SWFillModePattern)
+        return SWFillShaderSetPattern(shader, patternPixels.bytes, patternWidth, patternHeight, patternWidth * 4);
+    return YES;
+}
+
+// Shades the fill again, with a gradient from where the drag started to here
+- (void)shadeToPoint:(NSPoint)point
+{
+    shadedPoint = point;
+    if (!maskData)
+        return;
+    
+    SWFillMode mode = [NSUserDefaults.standardUserDefaults integerForKey:kSWFillModeKey];
+    if (mode == SWFillModeLinear || mode == SWFillModeRadial)
+    {
+        NSColor *otherColor = (flags & NSEventModifierFlagOption) ? frontColor : backColor;
+        uint8_t from[4], to[4];
+        SWGetPremultipliedColor(fillColor, from);
+        SWGetPremultipliedColor(otherColor, to);
+        
+        // Pixel centers, with rows counted in memory order: the point's row
+        // is h - y, the one the flood fill started from
+        double x0 = startPoint.x + 0.5, y0 = h - startPoint.y + 0.5;
+        double x1 = point.x + 0.5, y1 = h - point.y + 0.5;
+        BOOL clicked = NSEqualPoints(point, startPoint);
+        if (mode == SWFillModeLinear)
+        {
+            // A click runs it across the canvas, left to right
+            if (clicked)
+                SWFillShaderSetLinear(shader, 0, y0, w, y0, from, to);
+            else
+                SWFillShaderSetLinear(shader, x0, y0, x1, y1, from, to);
+        }
+        else
+        {
+            // ...or out to the farthest corner
+            double radius = clicked ? hypot(MAX(x0, w - x0), MAX(y0, h - y0)) : hypot(x1 - x0, y1 - y0);
+            SWFillShaderSetRadial(shader, x0, y0, radius, from, to);
+        }
+    }
+    
+    SWFillImageWithShader(_mainImage, shader, CFDataGetBytePtr(maskData), maskRowBytes);
+    [super addRedrawRectFromPoint:NSZeroPoint toPoint:NSMakePoint(_mainImage.pixelsWide, _mainImage.pixelsHigh)];
+}
+
+- (void)finishShading
+{
+    if (maskData)
+    {
+        CFRelease(maskData);
+        [document releaseJournalEntry];
+    }
+    maskData = NULL;
+}
+
 - (void)fillMask:(CGImageRef)mask withColor:(NSColor *)color
 {
     // We want to render the image into our bitmap image rep, so create a
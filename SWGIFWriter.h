@@ -0,0 +1,40 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+
+// How to hide the banding when a painting has more colors than a GIF can hold
+typedef NS_ENUM(NSInteger, SWGIFDithering) {
+    SWGIFDitheringNone = 0,
+    SWGIFDitheringOrdered,      // 8x8 Bayer pattern: fast, and runs on all cores
+    SWGIFDitheringDiffusion,    // Floyd-Steinberg: smoother, but one row at a time
+};
+
+
+// Our own GIF encoder.  Paintings with 256 colors or fewer (most of them) are
+// saved with their exact colors.  Anything else gets a median cut palette,
+// refined with a few rounds of k-means, built from a sampled histogram.
+@interface SWGIFWriter : NSObject
+
+// Expects an upright (not flipped) 8-bit RGBA image, like the ones made by
+// +[SWImageTools flippedCopyOfImage:].  Mostly-clear pixels become transparent
++ (NSData *)GIFDataFromImage:(NSBitmapImageRep *)image dithering:(SWGIFDithering)dithering;
+
+@end
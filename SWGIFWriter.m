@@ -0,0 +1,776 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWGIFWriter.h"
+
+#define kSWGIFMaxColors         256
+#define kSWGIFHashBits          10
+#define kSWGIFHashSize          (1 << kSWGIFHashBits)
+
+// The histogram works on 5 bits per channel.  Images bigger than this many
+// pixels are sampled on a regular grid instead of being read in full
+#define kSWGIFBinCount          (1 << 15)
+#define kSWGIFMaxSamples        (1 << 20)
+#define kSWGIFRefinePasses      3
+
+// Rows per band when mapping pixels to the palette on all cores
+#define kSWGIFBandRows          32
+
+// How far (in 0-255 levels) the ordered dither pattern nudges each channel
+#define kSWGIFOrderedSpread     32
+
+// LZW codes max out at 12 bits.  The dictionary is an open-addressed hash of
+// (prefix code, next index) pairs, kept at most half full
+#define kSWGIFMaxCode           4095
+#define kSWGIFDictionaryBits    13
+#define kSWGIFDictionarySize    (1 << kSWGIFDictionaryBits)
+#define kSWGIFBlockLength       255
+
+// Pixels with less than half their alpha are written out as transparent
+#define kSWGIFTransparent       0xFFFFFFFF
+
+static const unsigned char kSWGIFBayer[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+// Everything we know about the image being encoded
+typedef struct SWGIFImage {
+    const unsigned char *pixels;        // Premultiplied RGBA, top row first
+    NSInteger rowBytes;
+    NSInteger width;
+    NSInteger height;
+
+    unsigned char palette[kSWGIFMaxColors * 3];
+    NSInteger colorCount;               // Real colors, not counting the transparent slot
+    NSInteger transparentIndex;         // -1 if nothing is transparent
+    BOOL isExact;                       // Every color in the image is in the palette
+
+    // Exact palettes: an open-addressed hash of the colors in the image
+    uint32_t paletteKeys[kSWGIFHashSize];
+    short paletteSlots[kSWGIFHashSize];
+
+    // Quantized palettes: the nearest palette entry for every 5-bit color
+    unsigned char inverseMap[kSWGIFBinCount];
+} SWGIFImage;
+
+// One histogram bin, or (once collapsed) one distinct color for median cut
+typedef struct SWGIFBin {
+    uint32_t count;
+    uint32_t sum[3];
+} SWGIFBin;
+
+typedef struct SWGIFColor {
+    unsigned char c[3];
+    uint32_t count;
+} SWGIFColor;
+
+typedef struct SWGIFBox {
+    NSInteger begin;
+    NSInteger end;
+    uint64_t count;
+    NSInteger axis;                     // The channel with the widest range
+    NSInteger range;
+} SWGIFBox;
+
+// Growable byte buffer for the LZW output, already split into sub-blocks
+typedef struct SWGIFCodeStream {
+    unsigned char *bytes;
+    size_t length;
+    size_t capacity;
+    size_t blockStart;                  // Where the current sub-block's length byte is
+    uint32_t bits;
+    NSInteger bitCount;
+} SWGIFCodeStream;
+
+
+// Straight (unpremultiplied) color, packed as 0x00BBGGRR, or kSWGIFTransparent
+static inline uint32_t SWGIFColorAt(const unsigned char *p)
+{
+    uint32_t a = p[3];
+    if (a < 128)
+        return kSWGIFTransparent;
+    if (a == 255)
+        return p[0] | (p[1] << 8) | (p[2] << 16);
+
+    uint32_t r = MIN((p[0] * 255 + a / 2) / a, 255);
+    uint32_t g = MIN((p[1] * 255 + a / 2) / a, 255);
+    uint32_t b = MIN((p[2] * 255 + a / 2) / a, 255);
+    return r | (g << 8) | (b << 16);
+}
+
+
+// Index into the 5-bit-per-channel histogram
+static inline uint32_t SWGIFBinOf(uint32_t color)
+{
+    return ((color >> 3) & 0x1F) | ((color >> 6) & 0x3E0) | ((color >> 9) & 0x7C00);
+}
+
+
+static inline uint32_t SWGIFHash(uint32_t color)
+{
+    return (color * 2654435761u) >> (32 - kSWGIFHashBits);
+}
+
+
+// Returns the palette index for a color, or -1 if it isn't in the palette
+static inline NSInteger SWGIFPaletteLookup(const SWGIFImage *gif, uint32_t color)
+{
+    uint32_t slot = SWGIFHash(color);
+    while (gif->paletteSlots[slot] >= 0)
+    {
+        if (gif->paletteKeys[slot] == color)
+            return gif->paletteSlots[slot];
+        slot = (slot + 1) & (kSWGIFHashSize - 1);
+    }
+    return -1;
+}
+
+
+static inline NSInteger SWGIFNearest(const unsigned char *palette, NSInteger count,
+                                     NSInteger r, NSInteger g, NSInteger b)
+{
+    NSInteger best = 0;
+    NSInteger bestDistance = NSIntegerMax;
+    for (NSInteger i = 0; i < count; i++)
+    {
+        NSInteger dr = r - palette[3 * i];
+        NSInteger dg = g - palette[3 * i + 1];
+        NSInteger db = b - palette[3 * i + 2];
+        NSInteger distance = dr * dr + dg * dg + db * db;
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+// Tries to collect every color in the image.  Gives up as soon as there are
+// too many, which for photos is usually within the first few rows
+static BOOL SWGIFFindExactPalette(SWGIFImage *gif)
+{
+    memset(gif->paletteSlots, 0xFF, sizeof(gif->paletteSlots));
+    NSInteger count = 0;
+    BOOL hasTransparency = NO;
+    uint32_t last = kSWGIFTransparent - 1;
+
+    for (NSInteger y = 0; y < gif->height; y++)
+    {
+        const unsigned char *p = gif->pixels + y * gif->rowBytes;
+        for (NSInteger x = 0; x < gif->width; x++, p += 4)
+        {
+            uint32_t color = SWGIFColorAt(p);
+            if (color == last)
+                continue;
+            last = color;
+
+            if (color == kSWGIFTransparent)
+            {
+                hasTransparency = YES;
+                continue;
+            }
+
+            uint32_t slot = SWGIFHash(color);
+            while (gif->paletteSlots[slot] >= 0 && gif->paletteKeys[slot] != color)
+                slot = (slot + 1) & (kSWGIFHashSize - 1);
+            if (gif->paletteSlots[slot] >= 0)
+                continue;
+
+            if (count == kSWGIFMaxColors)
+                return NO;
+            gif->paletteKeys[slot] = color;
+            gif->paletteSlots[slot] = count;
+            gif->palette[3 * count] = color & 0xFF;
+            gif->palette[3 * count + 1] = (color >> 8) & 0xFF;
+            gif->palette[3 * count + 2] = (color >> 16) & 0xFF;
+            count++;
+        }
+    }
+
+    if (count + hasTransparency > kSWGIFMaxColors)
+        return NO;
+
+    gif->colorCount = count;
+    gif->transparentIndex = hasTransparency ? count : -1;
+    gif->isExact = YES;
+    return YES;
+}
+
+
+// Builds the histogram of a regular sample of the pixels, one band of sampled
+// rows per core, then merges the bands
+static SWGIFBin *SWGIFBuildHistogram(const SWGIFImage *gif)
+{
+    NSInteger step = 1;
+    while ((gif->width / step) * (gif->height / step) > kSWGIFMaxSamples)
+        step++;
+
+    NSInteger sampledRows = (gif->height + step - 1) / step;
+    NSInteger bandCount = MAX(1, MIN((NSInteger)NSProcessInfo.processInfo.activeProcessorCount, sampledRows));
+    NSInteger rowsPerBand = (sampledRows + bandCount - 1) / bandCount;
+    SWGIFBin *bands = calloc(bandCount * kSWGIFBinCount, sizeof(SWGIFBin));
+
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply(bandCount, queue, ^(size_t i) {
+        SWGIFBin *histogram = bands + i * kSWGIFBinCount;
+        NSInteger last = MIN((NSInteger)(i + 1) * rowsPerBand, sampledRows);
+        for (NSInteger row = i * rowsPerBand; row < last; row++)
+        {
+            const unsigned char *p = gif->pixels + row * step * gif->rowBytes;
+            for (NSInteger x = 0; x < gif->width; x += step, p += 4 * step)
+            {
+                uint32_t color = SWGIFColorAt(p);
+                if (color == kSWGIFTransparent)
+                    continue;
+
+                SWGIFBin *bin = histogram + SWGIFBinOf(color);
+                bin->count++;
+                bin->sum[0] += color & 0xFF;
+                bin->sum[1] += (color >> 8) & 0xFF;
+                bin->sum[2] += (color >> 16) & 0xFF;
+            }
+        }
+    });
+
+    // Fold everything into the first band, a slice of bins per core
+    NSInteger sliceCount = 32;
+    NSInteger binsPerSlice = kSWGIFBinCount / sliceCount;
+    dispatch_apply(sliceCount, queue, ^(size_t slice) {
+        for (NSInteger band = 1; band < bandCount; band++)
+        {
+            for (NSInteger b = slice * binsPerSlice; b < (NSInteger)(slice + 1) * binsPerSlice; b++)
+            {
+                SWGIFBin *from = bands + band * kSWGIFBinCount + b;
+                bands[b].count += from->count;
+                bands[b].sum[0] += from->sum[0];
+                bands[b].sum[1] += from->sum[1];
+                bands[b].sum[2] += from->sum[2];
+            }
+        }
+    });
+
+    return bands;
+}
+
+
+static void SWGIFMeasureBox(const SWGIFColor *colors, SWGIFBox *box)
+{
+    unsigned char low[3] = { 255, 255, 255 };
+    unsigned char high[3] = { 0, 0, 0 };
+    box->count = 0;
+    for (NSInteger i = box->begin; i < box->end; i++)
+    {
+        for (NSInteger c = 0; c < 3; c++)
+        {
+            low[c] = MIN(low[c], colors[i].c[c]);
+            high[c] = MAX(high[c], colors[i].c[c]);
+        }
+        box->count += colors[i].count;
+    }
+
+    box->axis = 0;
+    box->range = 0;
+    for (NSInteger c = 0; c < 3; c++)
+    {
+        if (high[c] - low[c] > box->range)
+        {
+            box->range = high[c] - low[c];
+            box->axis = c;
+        }
+    }
+}
+
+
+// Sorts a box's colors along its widest channel: a counting sort, since there
+// are only 256 possible values
+static void SWGIFSortBox(SWGIFColor *colors, SWGIFColor *scratch, const SWGIFBox *box)
+{
+    NSInteger offsets[257] = { 0 };
+    for (NSInteger i = box->begin; i < box->end; i++)
+        offsets[colors[i].c[box->axis] + 1]++;
+    for (NSInteger v = 1; v <= 256; v++)
+        offsets[v] += offsets[v - 1];
+    for (NSInteger i = box->begin; i < box->end; i++)
+        scratch[offsets[colors[i].c[box->axis]]++] = colors[i];
+    memcpy(colors + box->begin, scratch, (box->end - box->begin) * sizeof(SWGIFColor));
+}
+
+
+// Median cut: keep splitting the box that covers the most pixels over the
+// widest range, at its median, until we have enough colors
+static NSInteger SWGIFMedianCut(SWGIFColor *colors, NSInteger colorCount, NSInteger maxColors,
+                                unsigned char *palette)
+{
+    SWGIFBox boxes[kSWGIFMaxColors];
+    SWGIFColor *scratch = malloc(colorCount * sizeof(SWGIFColor));
+    NSInteger boxCount = 1;
+    boxes[0].begin = 0;
+    boxes[0].end = colorCount;
+    SWGIFMeasureBox(colors, &boxes[0]);
+
+    while (boxCount < maxColors)
+    {
+        NSInteger best = -1;
+        uint64_t bestScore = 0;
+        for (NSInteger i = 0; i < boxCount; i++)
+        {
+            uint64_t score = boxes[i].count * boxes[i].range;
+            if (boxes[i].end - boxes[i].begin > 1 && score > bestScore)
+            {
+                bestScore = score;
+                best = i;
+            }
+        }
+        if (best < 0)
+            break;
+
+        SWGIFBox *box = &boxes[best];
+        SWGIFSortBox(colors, scratch, box);
+
+        uint64_t half = box->count / 2;
+        uint64_t running = 0;
+        NSInteger split = box->begin;
+        while (split < box->end - 1 && running + colors[split].count <= half)
+            running += colors[split++].count;
+        split = MAX(split, box->begin + 1);
+
+        boxes[boxCount].begin = split;
+        boxes[boxCount].end = box->end;
+        box->end = split;
+        SWGIFMeasureBox(colors, box);
+        SWGIFMeasureBox(colors, &boxes[boxCount]);
+        boxCount++;
+    }
+    free(scratch);
+
+    for (NSInteger i = 0; i < boxCount; i++)
+    {
+        uint64_t sum[3] = { 0, 0, 0 };
+        for (NSInteger j = boxes[i].begin; j < boxes[i].end; j++)
+            for (NSInteger c = 0; c < 3; c++)
+                sum[c] += (uint64_t)colors[j].c[c] * colors[j].count;
+        for (NSInteger c = 0; c < 3; c++)
+            palette[3 * i + c] = (sum[c] + boxes[i].count / 2) / MAX(boxes[i].count, 1);
+    }
+    return boxCount;
+}
+
+
+// A few rounds of k-means over the histogram pull each entry to the middle of
+// the colors that actually map to it
+static void SWGIFRefinePalette(const SWGIFColor *colors, NSInteger colorCount,
+                               unsigned char *palette, NSInteger paletteCount)
+{
+    for (NSInteger pass = 0; pass < kSWGIFRefinePasses; pass++)
+    {
+        uint64_t sums[kSWGIFMaxColors][4];
+        memset(sums, 0, sizeof(sums));
+        for (NSInteger i = 0; i < colorCount; i++)
+        {
+            NSInteger nearest = SWGIFNearest(palette, paletteCount, colors[i].c[0], colors[i].c[1], colors[i].c[2]);
+            for (NSInteger c = 0; c < 3; c++)
+                sums[nearest][c] += (uint64_t)colors[i].c[c] * colors[i].count;
+            sums[nearest][3] += colors[i].count;
+        }
+
+        for (NSInteger i = 0; i < paletteCount; i++)
+        {
+            if (sums[i][3] == 0)
+                continue;
+            for (NSInteger c = 0; c < 3; c++)
+                palette[3 * i + c] = (sums[i][c] + sums[i][3] / 2) / sums[i][3];
+        }
+    }
+}
+
+
+// Picks a palette for images with too many colors, and the lookup table that
+// maps colors onto it
+static void SWGIFQuantize(SWGIFImage *gif)
+{
+    SWGIFBin *histogram = SWGIFBuildHistogram(gif);
+
+    // Collapse the histogram to the bins that are in use, at their mean color
+    NSInteger colorCount = 0;
+    SWGIFColor *colors = malloc(kSWGIFBinCount * sizeof(SWGIFColor));
+    for (NSInteger b = 0; b < kSWGIFBinCount; b++)
+    {
+        uint32_t count = histogram[b].count;
+        if (count == 0)
+            continue;
+        for (NSInteger c = 0; c < 3; c++)
+            colors[colorCount].c[c] = (histogram[b].sum[c] + count / 2) / count;
+        colors[colorCount].count = count;
+        colorCount++;
+    }
+    free(histogram);
+
+    // One slot is always held back for transparency: sampling could miss the
+    // only clear pixel, and one color out of 256 is hardly missed
+    NSInteger paletteCount = 0;
+    if (colorCount > 0)
+    {
+        paletteCount = SWGIFMedianCut(colors, colorCount, kSWGIFMaxColors - 1, gif->palette);
+        SWGIFRefinePalette(colors, colorCount, gif->palette, paletteCount);
+    }
+    else
+    {
+        // Nothing but transparency
+        gif->palette[0] = gif->palette[1] = gif->palette[2] = 0;
+        paletteCount = 1;
+    }
+    free(colors);
+
+    gif->colorCount = paletteCount;
+    gif->transparentIndex = paletteCount;
+    gif->isExact = NO;
+
+    const unsigned char *palette = gif->palette;
+    unsigned char *inverseMap = gif->inverseMap;
+    NSInteger sliceCount = 32;
+    NSInteger binsPerSlice = kSWGIFBinCount / sliceCount;
+    dispatch_apply(sliceCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t slice) {
+        for (NSInteger b = slice * binsPerSlice; b < (NSInteger)(slice + 1) * binsPerSlice; b++)
+        {
+            NSInteger r = ((b & 0x1F) << 3) | 4;
+            NSInteger g = (((b >> 5) & 0x1F) << 3) | 4;
+            NSInteger bl = (((b >> 10) & 0x1F) << 3) | 4;
+            inverseMap[b] = SWGIFNearest(palette, paletteCount, r, g, bl);
+        }
+    });
+}
+
+
+// Maps a band of rows straight onto the palette, with or without the ordered
+// dither pattern.  Returns YES if any pixel came out transparent
+static BOOL SWGIFIndexBand(const SWGIFImage *gif, NSInteger firstRow, NSInteger lastRow,
+                           BOOL ordered, unsigned char *indices)
+{
+    BOOL foundTransparency = NO;
+    for (NSInteger y = firstRow; y < lastRow; y++)
+    {
+        const unsigned char *p = gif->pixels + y * gif->rowBytes;
+        unsigned char *out = indices + y * gif->width;
+        uint32_t last = kSWGIFTransparent - 1;
+        unsigned char lastIndex = 0;
+
+        for (NSInteger x = 0; x < gif->width; x++, p += 4)
+        {
+            uint32_t color = SWGIFColorAt(p);
+            if (color == kSWGIFTransparent)
+            {
+                out[x] = gif->transparentIndex;
+                foundTransparency = YES;
+                continue;
+            }
+
+            if (gif->isExact)
+            {
+                if (color != last)
+                {
+                    last = color;
+                    lastIndex = SWGIFPaletteLookup(gif, color);
+                }
+                out[x] = lastIndex;
+            }
+            else if (ordered)
+            {
+                NSInteger offset = ((2 * kSWGIFBayer[y & 7][x & 7] - 63) * kSWGIFOrderedSpread) / 128;
+                NSInteger r = MAX(0, MIN(255, (NSInteger)(color & 0xFF) + offset));
+                NSInteger g = MAX(0, MIN(255, (NSInteger)((color >> 8) & 0xFF) + offset));
+                NSInteger b = MAX(0, MIN(255, (NSInteger)((color >> 16) & 0xFF) + offset));
+                out[x] = gif->inverseMap[SWGIFBinOf(r | (g << 8) | (b << 16))];
+            }
+            else
+                out[x] = gif->inverseMap[SWGIFBinOf(color)];
+        }
+    }
+    return foundTransparency;
+}
+
+
+// Floyd-Steinberg, snaking back and forth so the error doesn't all drift one
+// way.  Each row depends on the one above, so this one can't be split up
+static BOOL SWGIFIndexDiffused(const SWGIFImage *gif, unsigned char *indices)
+{
+    BOOL foundTransparency = NO;
+    NSInteger width = gif->width;
+
+    // Error for this row and the next, with a pixel of padding at either end
+    NSInteger *errors = calloc(2 * (width + 2) * 3, sizeof(NSInteger));
+    NSInteger *current = errors;
+    NSInteger *next = errors + (width + 2) * 3;
+
+    for (NSInteger y = 0; y < gif->height; y++)
+    {
+        const unsigned char *row = gif->pixels + y * gif->rowBytes;
+        unsigned char *out = indices + y * width;
+        BOOL reverse = (y & 1);
+        NSInteger dir = reverse ? -1 : 1;
+        memset(next, 0, (width + 2) * 3 * sizeof(NSInteger));
+
+        for (NSInteger i = 0; i < width; i++)
+        {
+            NSInteger x = reverse ? width - 1 - i : i;
+            uint32_t color = SWGIFColorAt(row + 4 * x);
+            if (color == kSWGIFTransparent)
+            {
+                out[x] = gif->transparentIndex;
+                foundTransparency = YES;
+                continue;
+            }
+
+            NSInteger *e = current + (x + 1) * 3;
+            NSInteger value[3];
+            for (NSInteger c = 0; c < 3; c++)
+                value[c] = MAX(0, MIN(255, (NSInteger)((color >> (8 * c)) & 0xFF) + e[c] / 16));
+
+            unsigned char index = gif->inverseMap[SWGIFBinOf(value[0] | (value[1] << 8) | (value[2] << 16))];
+            out[x] = index;
+
+            for (NSInteger c = 0; c < 3; c++)
+            {
+                NSInteger error = value[c] - gif->palette[3 * index + c];
+                current[(x + 1 + dir) * 3 + c] += error * 7;
+                next[(x + 1 - dir) * 3 + c] += error * 3;
+                next[(x + 1) * 3 + c] += error * 5;
+                next[(x + 1 + dir) * 3 + c] += error;
+            }
+        }
+
+        NSInteger *swap = current;
+        current = next;
+        next = swap;
+    }
+
+    free(errors);
+    return foundTransparency;
+}
+
+
+static void SWGIFStreamAppend(SWGIFCodeStream *stream, unsigned char byte)
+{
+    if (stream->length == stream->capacity)
+    {
+        stream->capacity *= 2;
+        stream->bytes = realloc(stream->bytes, stream->capacity);
+    }
+    stream->bytes[stream->length++] = byte;
+}
+
+
+static void SWGIFStreamPutByte(SWGIFCodeStream *stream, unsigned char byte)
+{
+    // Every 255 bytes we start a new sub-block, with a length byte up front
+    if (stream->length - stream->blockStart > kSWGIFBlockLength)
+    {
+        stream->bytes[stream->blockStart] = kSWGIFBlockLength;
+        stream->blockStart = stream->length;
+        SWGIFStreamAppend(stream, 0);
+    }
+    SWGIFStreamAppend(stream, byte);
+}
+
+
+static inline void SWGIFStreamPutCode(SWGIFCodeStream *stream, uint32_t code, NSInteger codeSize)
+{
+    stream->bits |= code << stream->bitCount;
+    stream->bitCount += codeSize;
+    while (stream->bitCount >= 8)
+    {
+        SWGIFStreamPutByte(stream, stream->bits & 0xFF);
+        stream->bits >>= 8;
+        stream->bitCount -= 8;
+    }
+}
+
+
+// LZW-compresses the indices into GIF sub-blocks, ending with the terminator
+static void SWGIFCompress(const unsigned char *indices, size_t length, NSInteger minCodeSize,
+                          SWGIFCodeStream *stream)
+{
+    int32_t *keys = malloc(kSWGIFDictionarySize * sizeof(int32_t));
+    uint16_t *codes = malloc(kSWGIFDictionarySize * sizeof(uint16_t));
+    uint32_t clearCode = 1 << minCodeSize;
+    uint32_t endCode = clearCode + 1;
+    uint32_t maxCode = endCode;
+    NSInteger codeSize = minCodeSize + 1;
+
+    memset(keys, 0xFF, kSWGIFDictionarySize * sizeof(int32_t));
+    SWGIFStreamPutCode(stream, clearCode, codeSize);
+
+    uint32_t prefix = indices[0];
+    for (size_t i = 1; i < length; i++)
+    {
+        int32_t key = (int32_t)((prefix << 8) | indices[i]);
+        uint32_t slot = ((uint32_t)key * 2654435761u) >> (32 - kSWGIFDictionaryBits);
+        while (keys[slot] >= 0 && keys[slot] != key)
+            slot = (slot + 1) & (kSWGIFDictionarySize - 1);
+
+        if (keys[slot] == key)
+        {
+            prefix = codes[slot];
+            continue;
+        }
+
+        SWGIFStreamPutCode(stream, prefix, codeSize);
+        keys[slot] = key;
+        codes[slot] = ++maxCode;
+        if (maxCode >= (1u << codeSize))
+            codeSize++;
+
+        // Full dictionary: start over
+        if (maxCode == kSWGIFMaxCode)
+        {
+            SWGIFStreamPutCode(stream, clearCode, codeSize);
+            memset(keys, 0xFF, kSWGIFDictionarySize * sizeof(int32_t));
+            maxCode = endCode;
+            codeSize = minCodeSize + 1;
+        }
+        prefix = indices[i];
+    }
+
+    SWGIFStreamPutCode(stream, prefix, codeSize);
+    SWGIFStreamPutCode(stream, endCode, codeSize);
+    if (stream->bitCount > 0)
+        SWGIFStreamPutCode(stream, 0, 8 - stream->bitCount);
+
+    // Close off the last sub-block, and the image data
+    stream->bytes[stream->blockStart] = stream->length - stream->blockStart - 1;
+    if (stream->length - stream->blockStart > 1)
+        SWGIFStreamAppend(stream, 0);
+
+    free(keys);
+    free(codes);
+}
+
+
+@implementation SWGIFWriter
+
++ (NSData *)GIFDataFromImage:(NSBitmapImageRep *)image dithering:(SWGIFDithering)dithering
+{
+    NSInteger w = image.pixelsWide;
+    NSInteger h = image.pixelsHigh;
+    if (w == 0 || h == 0)
+        return nil;
+
+    // We only know how to deal with our own kind of image, and GIF dimensions
+    // are 16-bit
+    if (image.bitsPerPixel != 32 || image.samplesPerPixel != 4 || image.isPlanar ||
+        (image.bitmapFormat & (NSBitmapFormatAlphaFirst | NSBitmapFormatAlphaNonpremultiplied | NSBitmapFormatFloatingPointSamples)) ||
+        w > UINT16_MAX || h > UINT16_MAX)
+        return [image representationUsingType:NSBitmapImageFileTypeGIF properties:@{}];
+
+    SWGIFImage *gif = calloc(1, sizeof(SWGIFImage));
+    gif->pixels = image.bitmapData;
+    gif->rowBytes = image.bytesPerRow;
+    gif->width = w;
+    gif->height = h;
+
+    if (!SWGIFFindExactPalette(gif))
+        SWGIFQuantize(gif);
+    else
+        dithering = SWGIFDitheringNone;
+
+    // Map every pixel onto the palette
+    unsigned char *indices = malloc(w * h);
+    BOOL foundTransparency = NO;
+    if (dithering == SWGIFDitheringDiffusion)
+        foundTransparency = SWGIFIndexDiffused(gif, indices);
+    else
+    {
+        NSInteger bandCount = (h + kSWGIFBandRows - 1) / kSWGIFBandRows;
+        BOOL *bandTransparency = calloc(bandCount, sizeof(BOOL));
+        BOOL ordered = (dithering == SWGIFDitheringOrdered);
+        dispatch_apply(bandCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+            NSInteger firstRow = i * kSWGIFBandRows;
+            bandTransparency[i] = SWGIFIndexBand(gif, firstRow, MIN(firstRow + kSWGIFBandRows, h), ordered, indices);
+        });
+        for (NSInteger i = 0; i < bandCount; i++)
+            foundTransparency |= bandTransparency[i];
+        free(bandTransparency);
+    }
+
+    // The held-back transparent slot goes unused if sampling was too cautious
+    if (!foundTransparency)
+        gif->transparentIndex = -1;
+
+    NSInteger entries = gif->colorCount + (gif->transparentIndex >= 0);
+    NSInteger tableBits = 1;
+    while ((1 << tableBits) < entries)
+        tableBits++;
+
+    SWGIFCodeStream stream = { 0 };
+    stream.capacity = MAX(w * h / 2, 1024);
+    stream.bytes = malloc(stream.capacity);
+    SWGIFStreamAppend(&stream, 0);        // The first sub-block's length
+    SWGIFCompress(indices, w * h, MAX(tableBits, 2), &stream);
+    free(indices);
+
+    // Now stitch the file together
+    NSMutableData *data = [NSMutableData dataWithCapacity:stream.length + 1024];
+    [data appendBytes:"GIF89a" length:6];
+
+    unsigned char screen[7];
+    uint16_t littleWidth = CFSwapInt16HostToLittle((uint16_t)w);
+    uint16_t littleHeight = CFSwapInt16HostToLittle((uint16_t)h);
+    memcpy(screen, &littleWidth, 2);
+    memcpy(screen + 2, &littleHeight, 2);
+    screen[4] = 0x80 | ((tableBits - 1) << 4) | (tableBits - 1);      // Global color table
+    screen[5] = 0;                                                     // Background color
+    screen[6] = 0;                                                     // Square pixels
+    [data appendBytes:screen length:sizeof(screen)];
+
+    unsigned char table[kSWGIFMaxColors * 3];
+    memset(table, 0, sizeof(table));
+    memcpy(table, gif->palette, gif->colorCount * 3);
+    [data appendBytes:table length:(3 << tableBits)];
+
+    if (gif->transparentIndex >= 0)
+    {
+        unsigned char control[8] = { 0x21, 0xF9, 4, 0x01, 0, 0, gif->transparentIndex, 0 };
+        [data appendBytes:control length:sizeof(control)];
+    }
+
+    unsigned char descriptor[10] = { 0x2C, 0, 0, 0, 0 };
+    memcpy(descriptor + 5, &littleWidth, 2);
+    memcpy(descriptor + 7, &littleHeight, 2);
+    descriptor[9] = 0;
+    [data appendBytes:descriptor length:sizeof(descriptor)];
+
+    unsigned char minCodeSize = MAX(tableBits, 2);
+    [data appendBytes:&minCodeSize length:1];
+    [data appendBytes:stream.bytes length:stream.length];
+    [data appendBytes:";" length:1];
+
+    free(stream.bytes);
+    free(gif);
+    return data;
+}
+
+@end
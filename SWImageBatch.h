@@ -0,0 +1,71 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+// Launch arguments for a headless batch run:
+//
+//   -SWBatch a.png,photos/,...       images to work on, and folders of them
+//   -SWBatchOperations a,b,...       what to do to each one, in order:
+//                                      flip_horizontal, flip_vertical, invert,
+//                                      monochrome, crop=x:y:w:h (from the top
+//                                      left), resize=WxH or resize=50%
+//   -SWBatchOutput <folder>          where the results go (default: next to
+//                                    each image, as "<name> (processed)")
+//   -SWBatchFormat png|jpg|gif|bmp|tif   (default: each image's own)
+//   -SWBatchQuality <0-1>            for JPEGs (default: 0.8)
+//   -SWBatchJobs <n>                 images at once (default: one per core)
+//   -SWBatchMemory <MB>              decoded pixels allowed at once (default: 1024)
+//   -SWBatchScaling YES              run everything at 1, 2, 4... jobs and
+//                                    report how throughput scales
+//   -SWBatchReport <file>            where the JSON goes (default: "-", stdout)
+extern NSString * const kSWBatchKey;
+
+
+// Runs a list of image operations over many files, several at once.  Each image
+// is decoded, worked on and encoded by one worker; the images in flight never
+// hold more pixels between them than the memory budget allows (though one image
+// bigger than the whole budget still gets done, on its own).  BMPs are read and
+// written straight through a mapping, a band of rows at a time.
+@interface SWImageBatch : NSObject
+
+// Runs and returns YES if the launch arguments asked for a batch, in which case
+// the application shouldn't start at all.  The exit status is put in status
++ (BOOL)runIfRequestedWithStatus:(int *)status;
+
+// Parses a comma-separated operation list.  Returns nil, with the reason in
+// error, if any of it doesn't make sense
++ (NSArray *)operationsFromString:(NSString *)list error:(NSString **)error;
+
+// Every image file named, and every image file in the folders named
++ (NSArray *)imageURLsFromPaths:(NSArray *)paths;
+
+// JSON-ready results, one entry per file in the order given.  A nil directory
+// puts each result next to its original; a nil format keeps each one's own.
+// Sets failures to the number of files that couldn't be done
++ (NSArray *)processURLs:(NSArray *)urls
+              operations:(NSArray *)operations
+         outputDirectory:(NSURL *)directory
+                  format:(NSString *)format
+                 quality:(CGFloat)quality
+                    jobs:(NSUInteger)jobs
+            memoryBudget:(unsigned long long)bytes
+                failures:(NSUInteger *)failures;
+
+@end
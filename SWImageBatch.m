@@ -0,0 +1,623 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWImageBatch.h"
+#import "SWImageDataSource.h"
+#import "SWImagePipeline.h"
+#import "SWAppController.h"
+#import "SWPNGWriter.h"
+#import "SWJPEGWriter.h"
+#import "SWGIFWriter.h"
+#import "SWBMPCodec.h"
+#import <ImageIO/ImageIO.h>
+#include <mach/mach_time.h>
+
+NSString * const kSWBatchKey = @"SWBatch";
+
+#define kSWBatchDefaultMemoryMegabytes  1024
+#define kSWBatchDefaultQuality          0.8
+
+// The decoded canvas, the new one an operation draws into, and the upright copy
+// the encoder works from
+#define kSWBatchCopiesPerImage          3
+
+
+typedef NS_ENUM(NSInteger, SWBatchOperationKind) {
+    SWBatchFlipHorizontal,
+    SWBatchFlipVertical,
+    SWBatchInvert,
+    SWBatchMonochrome,
+    SWBatchCrop,
+    SWBatchResize
+};
+
+
+// One step of the list, already parsed
+@interface SWBatchOperation : NSObject
+{
+@public
+    SWBatchOperationKind kind;
+    NSRect rect;        // Crops, from the top left
+    NSSize size;        // Resizes to a fixed size...
+    CGFloat scale;      // ...or by a factor, if there isn't one
+}
+@end
+
+@implementation SWBatchOperation
+@end
+
+
+// Bytes of pixels in flight, shared by everyone working.  Anyone can go ahead
+// when nobody else is working, however much they need
+@interface SWBatchBudget : NSObject
+{
+    NSCondition *condition;
+    unsigned long long limit;
+    unsigned long long inUse;
+}
+- (instancetype)initWithLimit:(unsigned long long)bytes;
+- (void)take:(unsigned long long)bytes;
+- (void)giveBack:(unsigned long long)bytes;
+@end
+
+@implementation SWBatchBudget
+
+- (instancetype)initWithLimit:(unsigned long long)bytes
+{
+    if (self = [super init])
+    {
+        condition = [[NSCondition alloc] init];
+        limit = bytes;
+    }
+    return self;
+}
+
+
+- (void)take:(unsigned long long)bytes
+{
+    [condition lock];
+    while (inUse > 0 && inUse + bytes > limit)
+        [condition wait];
+    inUse += bytes;
+    [condition unlock];
+}
+
+
+- (void)giveBack:(unsigned long long)bytes
+{
+    [condition lock];
+    inUse -= bytes;
+    [condition broadcast];
+    [condition unlock];
+}
+
+@end
+
+
+#pragma mark Helpers
+
+static double SWBatchSeconds(uint64_t ticks)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)ticks * timebase.numer / timebase.denom / 1e9;
+}
+
+
+// The formats we can write, by the extensions that mean them
+static NSString *SWBatchFormatForExtension(NSString *extension)
+{
+    extension = extension.lowercaseString;
+    if ([extension isEqualToString:@"jpeg"])
+        return @"jpg";
+    if ([extension isEqualToString:@"tiff"])
+        return @"tif";
+    if ([@[@"png", @"jpg", @"gif", @"bmp", @"tif"] containsObject:extension])
+        return extension;
+    return nil;
+}
+
+
+static SWBatchOperation *SWBatchParseOperation(NSString *string)
+{
+    NSArray *parts = [string componentsSeparatedByString:@"="];
+    if (parts.count > 2)
+        return nil;
+    NSString *name = parts[0];
+    NSString *argument = (parts.count == 2) ? parts[1] : nil;
+
+    SWBatchOperation *operation = [[SWBatchOperation alloc] init];
+    NSDictionary *plain = @{@"flip_horizontal": @(SWBatchFlipHorizontal),
+                            @"flip_vertical": @(SWBatchFlipVertical),
+                            @"invert": @(SWBatchInvert),
+                            @"monochrome": @(SWBatchMonochrome)};
+    if (plain[name] && !argument)
+    {
+        operation->kind = [plain[name] integerValue];
+        return operation;
+    }
+
+    if ([name isEqualToString:@"crop"] && argument)
+    {
+        NSArray *numbers = [argument componentsSeparatedByString:@":"];
+        if (numbers.count != 4)
+            return nil;
+        operation->kind = SWBatchCrop;
+        operation->rect = NSMakeRect([numbers[0] integerValue], [numbers[1] integerValue],
+                                     [numbers[2] integerValue], [numbers[3] integerValue]);
+        if (operation->rect.origin.x < 0 || operation->rect.origin.y < 0 || NSIsEmptyRect(operation->rect))
+            return nil;
+        return operation;
+    }
+
+    if ([name isEqualToString:@"resize"] && argument)
+    {
+        operation->kind = SWBatchResize;
+        if ([argument hasSuffix:@"%"])
+        {
+            operation->scale = argument.doubleValue / 100;
+            return (operation->scale > 0) ? operation : nil;
+        }
+        NSArray *numbers = [argument componentsSeparatedByString:@"x"];
+        if (numbers.count != 2 || [numbers[0] integerValue] <= 0 || [numbers[1] integerValue] <= 0)
+            return nil;
+        operation->size = NSMakeSize([numbers[0] integerValue], [numbers[1] integerValue]);
+        return operation;
+    }
+
+    return nil;
+}
+
+
+// What an operation turns an image of the given size into: an empty size means
+// it can't be done to it
+static NSSize SWBatchSizeAfter(SWBatchOperation *operation, NSSize size)
+{
+    if (operation->kind == SWBatchCrop)
+    {
+        NSRect rect = NSIntersectionRect(operation->rect, (NSRect) { NSZeroPoint, size });
+        return rect.size;
+    }
+    if (operation->kind == SWBatchResize)
+    {
+        if (operation->size.width > 0)
+            return operation->size;
+        return NSMakeSize(MAX(1, round(size.width * operation->scale)),
+                          MAX(1, round(size.height * operation->scale)));
+    }
+    return size;
+}
+
+
+// What working on a file will cost, going by its header alone: the most pixels
+// it has at any point along the way, in every copy of them at once
+static unsigned long long SWBatchCost(NSURL *url, NSArray *operations)
+{
+    CGImageSourceRef source = CGImageSourceCreateWithURL((__bridge CFURLRef)url, NULL);
+    if (!source)
+        return 0;
+    NSDictionary *properties = CFBridgingRelease(CGImageSourceCopyPropertiesAtIndex(source, 0, NULL));
+    CFRelease(source);
+
+    NSSize size = NSMakeSize([properties[(NSString *)kCGImagePropertyPixelWidth] doubleValue],
+                             [properties[(NSString *)kCGImagePropertyPixelHeight] doubleValue]);
+    double pixels = size.width * size.height;
+    for (SWBatchOperation *operation in operations)
+    {
+        size = SWBatchSizeAfter(operation, size);
+        pixels = MAX(pixels, size.width * size.height);
+    }
+    return (unsigned long long)(pixels * 4 * kSWBatchCopiesPerImage);
+}
+
+
+static SWImageDataSource *SWBatchRunPipeline(SWImagePipeline *pipeline, SWImageDataSource *dataSource)
+{
+    if (!pipeline)
+        return dataSource;
+    if (pipeline.canRunInPlace)
+    {
+        [pipeline runInPlace];
+        return dataSource;
+    }
+    return [[SWImageDataSource alloc] initWithImage:[pipeline newImage]];
+}
+
+
+// Runs the operations in order.  Everything but resizing queues up on a
+// pipeline, so a run of them costs one pass over the image.  Returns whatever
+// ends up holding the result, or nil with the reason in error
+static SWImageDataSource *SWBatchApply(NSArray *operations, SWImageDataSource *dataSource, NSString **error)
+{
+    SWImagePipeline *pipeline = nil;
+    for (SWBatchOperation *operation in operations)
+    {
+        NSSize size = pipeline ? pipeline.size : dataSource.size;
+        NSSize newSize = SWBatchSizeAfter(operation, size);
+        if (newSize.width < 1 || newSize.height < 1)
+        {
+            *error = @"the crop is outside the image";
+            return nil;
+        }
+
+        if (operation->kind == SWBatchResize)
+        {
+            dataSource = SWBatchRunPipeline(pipeline, dataSource);
+            pipeline = nil;
+            [dataSource resizeToSize:newSize scaleImage:YES];
+            continue;
+        }
+
+        if (!pipeline)
+            pipeline = [[SWImagePipeline alloc] initWithImage:dataSource.mainImage];
+        switch (operation->kind)
+        {
+            case SWBatchFlipHorizontal:
+                [pipeline flipHorizontal];
+                break;
+            case SWBatchFlipVertical:
+                [pipeline flipVertical];
+                break;
+            case SWBatchInvert:
+                [pipeline invert];
+                break;
+            case SWBatchMonochrome:
+                [pipeline makeMonochrome];
+                break;
+            case SWBatchCrop:
+                // The canvas is flipped, so its own coordinates already run from the top
+                [pipeline cropToRect:NSIntersectionRect(operation->rect, (NSRect) { NSZeroPoint, size })];
+                break;
+            case SWBatchResize:
+                break;
+        }
+    }
+    return SWBatchRunPipeline(pipeline, dataSource);
+}
+
+
+static BOOL SWBatchWrite(NSBitmapImageRep *canvas, NSURL *url, NSString *format, CGFloat quality, NSString **error)
+{
+    NSBitmapImageRep *bitmap = [SWImageTools flippedCopyOfImage:canvas];
+    NSError *writeError = nil;
+
+    // BMPs go straight to disk, a band of rows at a time
+    if ([format isEqualToString:@"bmp"])
+    {
+        if ([SWBMPWriter writeImage:bitmap toURL:url error:&writeError])
+            return YES;
+        *error = writeError.localizedDescription ?: @"couldn't be written";
+        return NO;
+    }
+
+    NSData *data = nil;
+    if ([format isEqualToString:@"png"])
+        data = [SWPNGWriter PNGDataFromImage:bitmap];
+    else if ([format isEqualToString:@"jpg"])
+        data = [SWJPEGWriter JPEGDataFromImage:bitmap quality:quality];
+    else if ([format isEqualToString:@"gif"])
+        data = [SWGIFWriter GIFDataFromImage:bitmap
+                                   dithering:[NSUserDefaults.standardUserDefaults integerForKey:kSWGIFDitheringKey]];
+    else
+        data = [bitmap representationUsingType:NSBitmapImageFileTypeTIFF properties:@{}];
+
+    if (data && [data writeToURL:url options:NSDataWritingAtomic error:&writeError])
+        return YES;
+    *error = writeError.localizedDescription ?: @"couldn't be encoded";
+    return NO;
+}
+
+
+static NSURL *SWBatchOutputURL(NSURL *input, NSURL *directory, NSString *format)
+{
+    NSString *name = input.lastPathComponent.stringByDeletingPathExtension;
+    NSURL *output = [[directory ?: input.URLByDeletingLastPathComponent
+                      URLByAppendingPathComponent:name] URLByAppendingPathExtension:format];
+
+    // Never over the original
+    if (!directory || [output.path isEqualToString:input.path])
+        output = [[input.URLByDeletingLastPathComponent URLByAppendingPathComponent:
+                   [name stringByAppendingString:@" (processed)"]] URLByAppendingPathExtension:format];
+    return output;
+}
+
+
+@implementation SWImageBatch
+
++ (NSArray *)operationsFromString:(NSString *)list error:(NSString **)error
+{
+    NSMutableArray *operations = [NSMutableArray array];
+    for (NSString *component in [list componentsSeparatedByString:@","])
+    {
+        NSString *string = [component stringByTrimmingCharactersInSet:NSCharacterSet.whitespaceCharacterSet];
+        if (string.length == 0)
+            continue;
+
+        SWBatchOperation *operation = SWBatchParseOperation(string);
+        if (!operation)
+        {
+            if (error)
+                *error = [NSString stringWithFormat:@"Don't know how to \"%@\"", string];
+            return nil;
+        }
+        [operations addObject:operation];
+    }
+    return operations;
+}
+
+
++ (NSArray *)imageURLsFromPaths:(NSArray *)paths
+{
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableArray *urls = [NSMutableArray array];
+    for (NSString *component in paths)
+    {
+        NSString *path = [component stringByTrimmingCharactersInSet:NSCharacterSet.whitespaceCharacterSet];
+        if (path.length == 0)
+            continue;
+        NSURL *url = [NSURL fileURLWithPath:path.stringByExpandingTildeInPath];
+
+        BOOL isDirectory = NO;
+        if (![fileManager fileExistsAtPath:url.path isDirectory:&isDirectory] || !isDirectory)
+        {
+            // Whatever's wrong with it ends up in the report
+            [urls addObject:url];
+            continue;
+        }
+
+        NSArray *contents = [fileManager contentsOfDirectoryAtURL:url
+                                       includingPropertiesForKeys:nil
+                                                          options:NSDirectoryEnumerationSkipsHiddenFiles
+                                                            error:NULL];
+        contents = [contents sortedArrayUsingComparator:^NSComparisonResult(NSURL *a, NSURL *b) {
+            return [a.lastPathComponent localizedStandardCompare:b.lastPathComponent];
+        }];
+        for (NSURL *file in contents)
+            if (SWBatchFormatForExtension(file.pathExtension))
+                [urls addObject:file];
+    }
+    return urls;
+}
+
+
++ (NSDictionary *)processURL:(NSURL *)url
+                  operations:(NSArray *)operations
+             outputDirectory:(NSURL *)directory
+                      format:(NSString *)format
+                     quality:(CGFloat)quality
+{
+    uint64_t start = mach_absolute_time();
+    NSMutableDictionary *entry = [@{@"input": url.path} mutableCopy];
+    NSString *error = nil;
+
+    SWImageDataSource *dataSource = [[SWImageDataSource alloc] initWithURL:url];
+    if (!dataSource)
+        error = @"couldn't be read";
+    else
+    {
+        entry[@"width"] = @(dataSource.size.width);
+        entry[@"height"] = @(dataSource.size.height);
+        dataSource = SWBatchApply(operations, dataSource, &error);
+    }
+
+    if (!error)
+    {
+        format = format ?: SWBatchFormatForExtension(url.pathExtension) ?: @"png";
+        NSURL *output = SWBatchOutputURL(url, directory, format);
+        if (SWBatchWrite(dataSource.mainImage, output, format, quality, &error))
+        {
+            entry[@"output"] = output.path;
+            entry[@"output_width"] = @(dataSource.size.width);
+            entry[@"output_height"] = @(dataSource.size.height);
+        }
+    }
+
+    if (error)
+        entry[@"error"] = error;
+    entry[@"seconds"] = @(SWBatchSeconds(mach_absolute_time() - start));
+    return entry;
+}
+
+
++ (NSArray *)processURLs:(NSArray *)urls
+              operations:(NSArray *)operations
+         outputDirectory:(NSURL *)directory
+                  format:(NSString *)format
+                 quality:(CGFloat)quality
+                    jobs:(NSUInteger)jobs
+            memoryBudget:(unsigned long long)bytes
+                failures:(NSUInteger *)failures
+{
+    NSMutableArray *results = [NSMutableArray arrayWithCapacity:urls.count];
+    for (NSUInteger i = 0; i < urls.count; i++)
+        [results addObject:[NSNull null]];
+
+    // Files are handed out one at a time, as soon as there's both a job and the
+    // memory free for them, and whichever of the system's worker threads is
+    // idle picks each one up.  A big image just takes up more of the budget
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_semaphore_t freeJobs = dispatch_semaphore_create(MAX(jobs, 1));
+    SWBatchBudget *budget = [[SWBatchBudget alloc] initWithLimit:bytes];
+
+    for (NSUInteger i = 0; i < urls.count; i++)
+    {
+        NSURL *url = urls[i];
+        unsigned long long cost = SWBatchCost(url, operations);
+        dispatch_semaphore_wait(freeJobs, DISPATCH_TIME_FOREVER);
+        [budget take:cost];
+
+        dispatch_group_async(group, queue, ^{
+            @autoreleasepool
+            {
+                NSDictionary *entry = [self processURL:url
+                                            operations:operations
+                                       outputDirectory:directory
+                                                format:format
+                                               quality:quality];
+                @synchronized(results)
+                {
+                    results[i] = entry;
+                }
+            }
+            [budget giveBack:cost];
+            dispatch_semaphore_signal(freeJobs);
+        });
+    }
+    dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+
+    if (failures)
+        *failures = [results filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"error != nil"]].count;
+    return results;
+}
+
+
+// Megapixels read, out of everything that worked
++ (double)megapixelsInResults:(NSArray *)results
+{
+    double pixels = 0;
+    for (NSDictionary *entry in results)
+        if (!entry[@"error"])
+            pixels += [entry[@"width"] doubleValue] * [entry[@"height"] doubleValue];
+    return pixels / 1e6;
+}
+
+
++ (BOOL)runIfRequestedWithStatus:(int *)status
+{
+    // Only ever from the command line, like the benchmarks
+    NSDictionary *arguments = [NSUserDefaults.standardUserDefaults volatileDomainForName:NSArgumentDomain];
+    NSString *paths = arguments[kSWBatchKey];
+    if (!paths)
+        return NO;
+
+    NSString *operationList = arguments[@"SWBatchOperations"] ?: @"";
+    NSString *error = nil;
+    NSArray *operations = [self operationsFromString:operationList error:&error];
+    NSString *format = arguments[@"SWBatchFormat"];
+    if (operations && format && !SWBatchFormatForExtension(format))
+        error = [NSString stringWithFormat:@"Can't write \"%@\" files", format];
+    format = format ? SWBatchFormatForExtension(format) : nil;
+
+    NSURL *directory = nil;
+    if (!error && arguments[@"SWBatchOutput"])
+    {
+        directory = [NSURL fileURLWithPath:[arguments[@"SWBatchOutput"] stringByExpandingTildeInPath] isDirectory:YES];
+        NSError *directoryError = nil;
+        if (![[NSFileManager defaultManager] createDirectoryAtURL:directory
+                                      withIntermediateDirectories:YES
+                                                       attributes:nil
+                                                            error:&directoryError])
+            error = directoryError.localizedDescription;
+    }
+
+    if (error)
+    {
+        fprintf(stderr, "%s\n", error.UTF8String);
+        if (status)
+            *status = EXIT_FAILURE;
+        return YES;
+    }
+
+    NSUInteger cores = NSProcessInfo.processInfo.activeProcessorCount;
+    NSUInteger jobs = [arguments[@"SWBatchJobs"] integerValue] > 0 ? [arguments[@"SWBatchJobs"] integerValue] : cores;
+    unsigned long long memory = ([arguments[@"SWBatchMemory"] longLongValue] ?: kSWBatchDefaultMemoryMegabytes) * 1024ULL * 1024;
+    CGFloat quality = arguments[@"SWBatchQuality"] ? [arguments[@"SWBatchQuality"] doubleValue] : kSWBatchDefaultQuality;
+    NSArray *urls = [self imageURLsFromPaths:[paths componentsSeparatedByString:@","]];
+
+    NSUInteger failures = 0;
+    uint64_t start = mach_absolute_time();
+    NSArray *results = [self processURLs:urls
+                              operations:operations
+                         outputDirectory:directory
+                                  format:format
+                                 quality:quality
+                                    jobs:jobs
+                            memoryBudget:memory
+                                failures:&failures];
+    double seconds = SWBatchSeconds(mach_absolute_time() - start);
+    double megapixels = [self megapixelsInResults:results];
+
+    NSOperatingSystemVersion os = NSProcessInfo.processInfo.operatingSystemVersion;
+    NSMutableDictionary *report = [@{@"date": [[[NSISO8601DateFormatter alloc] init] stringFromDate:[NSDate date]],
+                                     @"cpus": @(cores),
+                                     @"os": [NSString stringWithFormat:@"%ld.%ld.%ld", (long)os.majorVersion,
+                                             (long)os.minorVersion, (long)os.patchVersion],
+                                     @"operations": operationList,
+                                     @"jobs": @(jobs),
+                                     @"memory_mb": @(memory / (1024 * 1024)),
+                                     @"files": results,
+                                     @"failures": @(failures),
+                                     @"seconds": @(seconds),
+                                     @"files_per_s": @(seconds > 0 ? urls.count / seconds : 0),
+                                     @"megapixels_per_s": @(seconds > 0 ? megapixels / seconds : 0)} mutableCopy];
+
+    // The run above has already warmed up the file cache, so every one of these
+    // starts from the same place
+    if ([arguments[@"SWBatchScaling"] boolValue])
+    {
+        NSMutableArray *scaling = [NSMutableArray array];
+        double baseline = 0;
+        for (NSUInteger count = 1; ; count = MIN(count * 2, cores))
+        {
+            uint64_t runStart = mach_absolute_time();
+            @autoreleasepool
+            {
+                [self processURLs:urls
+                       operations:operations
+                  outputDirectory:directory
+                           format:format
+                          quality:quality
+                             jobs:count
+                     memoryBudget:memory
+                         failures:NULL];
+            }
+            double runSeconds = SWBatchSeconds(mach_absolute_time() - runStart);
+            if (count == 1)
+                baseline = runSeconds;
+            [scaling addObject:@{@"jobs": @(count),
+                                 @"seconds": @(runSeconds),
+                                 @"files_per_s": @(runSeconds > 0 ? urls.count / runSeconds : 0),
+                                 @"megapixels_per_s": @(runSeconds > 0 ? megapixels / runSeconds : 0),
+                                 @"speedup": @(runSeconds > 0 ? baseline / runSeconds : 0)}];
+            if (count >= cores)
+                break;
+        }
+        report[@"scaling"] = scaling;
+    }
+
+    NSString *reportPath = arguments[@"SWBatchReport"] ?: @"-";
+    NSData *json = [NSJSONSerialization dataWithJSONObject:report
+                                                   options:NSJSONWritingPrettyPrinted | NSJSONWritingSortedKeys
+                                                     error:NULL];
+    if ([reportPath isEqualToString:@"-"])
+    {
+        fwrite(json.bytes, 1, json.length, stdout);
+        fputc('\n', stdout);
+    }
+    else
+        [json writeToFile:reportPath.stringByExpandingTildeInPath atomically:YES];
+
+    if (status)
+        *status = (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    return YES;
+}
+
+@end
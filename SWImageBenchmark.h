@@ -0,0 +1,55 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+// Launch arguments for a headless benchmark run:
+//
+//   -SWRunBenchmarks <file>          where the JSON goes ("-" for stdout)
+//   -SWBenchmarkSizes 640x480,...    canvas sizes (default: 640x480, 1080p, 4K and 8K)
+//   -SWBenchmarkIterations <n>       timed runs per operation and size (default: 5)
+//   -SWBenchmarkOperations a,b       only the named operations
+//   -SWBenchmarkVerify YES           compare against the scalar references instead
+extern NSString * const kSWRunBenchmarksKey;
+
+
+// Times every SWImageTools operation, plus brush dabs and strokes, flood fill,
+// resizing and each of the encoders, on synthetic canvases of several sizes.
+// Each one runs once on its own, then as one copy per core at the same time, to
+// show how it scales.
+//
+// Verifying runs the operations that have a well-defined result next to a
+// plain scalar version of the same thing, and reports any byte that differs.
+@interface SWImageBenchmark : NSObject
+
+// Runs and returns YES if the launch arguments asked for benchmarks, in which
+// case the application shouldn't start at all.  The exit status is put in status
++ (BOOL)runIfRequestedWithStatus:(int *)status;
+
+// Names of every operation, in the order they run
++ (NSArray *)operationNames;
+
+// JSON-ready results: one entry per operation, size and thread count
++ (NSArray *)timeOperations:(NSArray *)names sizes:(NSArray *)sizes iterations:(NSUInteger)iterations;
+
+// JSON-ready results: one entry per operation and size.  Sets passed to NO if
+// any operation isn't byte-exact
++ (NSArray *)verifyOperations:(NSArray *)names sizes:(NSArray *)sizes passed:(BOOL *)passed;
+
+@end
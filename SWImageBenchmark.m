@@ -0,0 +1,770 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWImageBenchmark.h"
+#import "SWImageDataSource.h"
+#import "SWFillTool.h"
+#import "SWImagePipeline.h"
+#import "SWPNGWriter.h"
+#import "SWJPEGWriter.h"
+#import "SWGIFWriter.h"
+#import "SWBMPCodec.h"
+#import "SWBrushEngine.h"
+#import "SWBrushTool.h"
+#import <ImageIO/ImageIO.h>
+#include <mach/mach_time.h>
+
+NSString * const kSWRunBenchmarksKey = @"SWRunBenchmarks";
+
+#define kSWBenchmarkDefaultIterations   5
+
+// Every concurrent copy needs its own images, which add up quickly at 8K
+#define kSWBenchmarkMemoryBudget        (2048ULL * 1024 * 1024)
+
+// Odd sizes catch the edge cases that round numbers hide
+#define kSWBenchmarkVerifySizes         @"640x480,641x479,97x1"
+
+// Dabs in one run of a brush operation
+#define kSWBenchmarkDabs                500
+
+// Drag events in one run of a stroke operation
+#define kSWBenchmarkStrokeEvents        120
+
+
+// What an operation starts from
+typedef NS_ENUM(NSInteger, SWBenchmarkInput) {
+    SWBenchmarkNoise,           // Random premultiplied pixels, some clear, some opaque
+    SWBenchmarkOpaqueNoise,     // The same, with every pixel opaque
+    SWBenchmarkDrawing,         // Flat blocks of color, like a real painting
+    SWBenchmarkWhite            // A blank canvas
+};
+
+
+// The images one run of an operation works with.  The input is never changed;
+// the canvas starts out as a copy of it before every run
+@interface SWBenchmarkJob : NSObject
+{
+@public
+    NSBitmapImageRep *input;
+    NSBitmapImageRep *canvas;
+    NSBitmapImageRep *other;    // A second image, for drawing from
+}
+@end
+
+@implementation SWBenchmarkJob
+@end
+
+
+// Runs the operation on a job, returning whatever it produced (an image, some
+// data) or the canvas if it works in place
+typedef id (^SWBenchmarkOperation)(SWBenchmarkJob *job);
+
+// The scalar version: the image the operation should have produced
+typedef NSBitmapImageRep *(^SWBenchmarkReference)(SWBenchmarkJob *job);
+
+
+#pragma mark Synthetic images
+
+static inline uint32_t SWBenchmarkRandom(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (*state = x);
+}
+
+
+static NSBitmapImageRep *SWBenchmarkImage(NSSize size, SWBenchmarkInput kind, uint32_t seed)
+{
+    NSBitmapImageRep *image = nil;
+    [SWImageTools initImageRep:&image withSize:size cleared:NO];
+
+    NSInteger w = image.pixelsWide, h = image.pixelsHigh;
+    uint32_t state = seed | 1;
+    for (NSInteger y = 0; y < h; y++)
+    {
+        unsigned char *p = image.bitmapData + y * image.bytesPerRow;
+        for (NSInteger x = 0; x < w; x++, p += 4)
+        {
+            uint32_t r = SWBenchmarkRandom(&state);
+            NSInteger i = y * w + x;
+            if (kind == SWBenchmarkWhite)
+                p[0] = p[1] = p[2] = p[3] = 255;
+            else if (kind == SWBenchmarkDrawing)
+            {
+                // The same color for every pixel in a 32x32 block
+                uint32_t block = (uint32_t)((y / 32) * 7919 + (x / 32) * 104729) | 1;
+                uint32_t c = SWBenchmarkRandom(&block);
+                p[0] = c; p[1] = c >> 8; p[2] = c >> 16; p[3] = 255;
+            }
+            else if (i % 7 == 0)
+                p[0] = p[1] = p[2] = p[3] = 255;
+            else if (kind == SWBenchmarkNoise && i % 9 == 0)
+                p[0] = p[1] = p[2] = p[3] = 0;
+            else
+            {
+                uint32_t a = (kind == SWBenchmarkOpaqueNoise || i % 4 == 0) ? 255 : (r >> 24);
+                p[0] = (r & 0xFF) * a / 255;
+                p[1] = ((r >> 8) & 0xFF) * a / 255;
+                p[2] = ((r >> 16) & 0xFF) * a / 255;
+                p[3] = a;
+            }
+        }
+    }
+    return image;
+}
+
+
+static void SWBenchmarkCopyPixels(NSBitmapImageRep *dest, NSBitmapImageRep *src)
+{
+    NSInteger rowLength = src.pixelsWide * 4;
+    for (NSInteger y = 0; y < src.pixelsHigh; y++)
+        memcpy(dest.bitmapData + y * dest.bytesPerRow, src.bitmapData + y * src.bytesPerRow, rowLength);
+}
+
+
+static NSBitmapImageRep *SWBenchmarkCopy(NSBitmapImageRep *src)
+{
+    NSBitmapImageRep *copy = nil;
+    [SWImageTools initImageRep:&copy withSize:NSMakeSize(src.pixelsWide, src.pixelsHigh) cleared:NO];
+    SWBenchmarkCopyPixels(copy, src);
+    return copy;
+}
+
+
+static NSBitmapImageRep *SWBenchmarkBlank(NSInteger w, NSInteger h)
+{
+    NSBitmapImageRep *image = nil;
+    [SWImageTools initImageRep:&image withSize:NSMakeSize(w, h) cleared:NO];
+    for (NSInteger y = 0; y < h; y++)
+        memset(image.bitmapData + y * image.bytesPerRow, 0, w * 4);
+    return image;
+}
+
+
+// Decodes into our flipped layout, like opening a file does
+static NSBitmapImageRep *SWBenchmarkDecode(NSData *data)
+{
+    CGImageSourceRef source = data ? CGImageSourceCreateWithData((__bridge CFDataRef)data, NULL) : NULL;
+    if (!source)
+        return nil;
+    CGImageRef image = CGImageSourceCreateImageAtIndex(source, 0, NULL);
+    CFRelease(source);
+
+    SWImageDataSource *dataSource = [[SWImageDataSource alloc] initWithCGImage:image];
+    CGImageRelease(image);
+    return dataSource.mainImage;
+}
+
+
+#pragma mark Scalar references
+
+static NSBitmapImageRep *SWReferenceFlip(NSBitmapImageRep *src, BOOL horizontal, BOOL vertical)
+{
+    NSInteger w = src.pixelsWide, h = src.pixelsHigh;
+    NSBitmapImageRep *dest = SWBenchmarkBlank(w, h);
+    for (NSInteger y = 0; y < h; y++)
+    {
+        const uint32_t *s = (const uint32_t *)(src.bitmapData + (vertical ? h - 1 - y : y) * src.bytesPerRow);
+        uint32_t *d = (uint32_t *)(dest.bitmapData + y * dest.bytesPerRow);
+        for (NSInteger x = 0; x < w; x++)
+            d[x] = s[horizontal ? w - 1 - x : x];
+    }
+    return dest;
+}
+
+
+// Quartz's y runs up from the bottom of memory, so a rect's rows are counted
+// from the end
+static NSBitmapImageRep *SWReferenceCrop(NSBitmapImageRep *src, NSRect rect)
+{
+    NSInteger x0 = rect.origin.x, w = rect.size.width, h = rect.size.height;
+    NSInteger firstRow = src.pixelsHigh - (NSInteger)rect.origin.y - h;
+    NSBitmapImageRep *dest = SWBenchmarkBlank(w, h);
+    for (NSInteger y = 0; y < h; y++)
+        memcpy(dest.bitmapData + y * dest.bytesPerRow,
+               src.bitmapData + (firstRow + y) * src.bytesPerRow + x0 * 4, w * 4);
+    return dest;
+}
+
+
+// Inverting a premultiplied color without unpremultiplying: c' = a - c
+static NSBitmapImageRep *SWReferenceInvert(NSBitmapImageRep *src)
+{
+    NSBitmapImageRep *dest = SWBenchmarkCopy(src);
+    for (NSInteger y = 0; y < dest.pixelsHigh; y++)
+    {
+        unsigned char *p = dest.bitmapData + y * dest.bytesPerRow;
+        for (NSInteger x = 0; x < dest.pixelsWide; x++, p += 4)
+        {
+            p[0] = p[3] - p[0];
+            p[1] = p[3] - p[1];
+            p[2] = p[3] - p[2];
+        }
+    }
+    return dest;
+}
+
+
+static NSBitmapImageRep *SWReferenceOver(NSBitmapImageRep *dest, NSBitmapImageRep *src)
+{
+    NSBitmapImageRep *result = SWBenchmarkCopy(dest);
+    for (NSInteger y = 0; y < result.pixelsHigh; y++)
+    {
+        unsigned char *d = result.bitmapData + y * result.bytesPerRow;
+        const unsigned char *s = src.bitmapData + y * src.bytesPerRow;
+        for (NSInteger x = 0; x < result.pixelsWide * 4; x += 4)
+        {
+            uint32_t inverseAlpha = 255 - s[x + 3];
+            for (NSInteger c = 0; c < 4; c++)
+                d[x + c] = s[x + c] + (d[x + c] * inverseAlpha + 127) / 255;
+        }
+    }
+    return result;
+}
+
+
+static NSBitmapImageRep *SWReferenceStrip(NSBitmapImageRep *src, uint32_t rgba)
+{
+    NSBitmapImageRep *dest = SWBenchmarkCopy(src);
+    for (NSInteger y = 0; y < dest.pixelsHigh; y++)
+    {
+        unsigned char *p = dest.bitmapData + y * dest.bytesPerRow;
+        for (NSInteger x = 0; x < dest.pixelsWide; x++, p += 4)
+        {
+            if (p[0] == (rgba >> 24) && p[1] == ((rgba >> 16) & 0xFF) &&
+                p[2] == ((rgba >> 8) & 0xFF) && p[3] == (rgba & 0xFF))
+                p[0] = p[1] = p[2] = p[3] = 0;
+        }
+    }
+    return dest;
+}
+
+
+#pragma mark Timing
+
+static double SWBenchmarkMilliseconds(uint64_t ticks)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)ticks * timebase.numer / timebase.denom / 1e6;
+}
+
+
+static int SWBenchmarkCompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static NSArray *SWBenchmarkParseSizes(NSString *string)
+{
+    NSMutableArray *sizes = [NSMutableArray array];
+    for (NSString *component in [string componentsSeparatedByString:@","])
+    {
+        NSArray *parts = [component componentsSeparatedByString:@"x"];
+        if (parts.count == 2 && [parts[0] integerValue] > 0 && [parts[1] integerValue] > 0)
+            [sizes addObject:[NSValue valueWithSize:NSMakeSize([parts[0] integerValue], [parts[1] integerValue])]];
+    }
+    return sizes;
+}
+
+
+@implementation SWImageBenchmark
+
+// Every operation, with the input it wants and whether it changes the canvas
++ (NSArray *)operations
+{
+    static NSArray *operations = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSColor *white = [NSColor colorWithCalibratedWhite:1.0 alpha:1.0];
+
+        SWBenchmarkOperation init = ^id(SWBenchmarkJob *job) {
+            NSBitmapImageRep *image = nil;
+            [SWImageTools initImageRep:&image withSize:NSMakeSize(job->input.pixelsWide, job->input.pixelsHigh)];
+            return image;
+        };
+        SWBenchmarkOperation initUncleared = ^id(SWBenchmarkJob *job) {
+            NSBitmapImageRep *image = nil;
+            [SWImageTools initImageRep:&image withSize:NSMakeSize(job->input.pixelsWide, job->input.pixelsHigh) cleared:NO];
+            return image;
+        };
+        SWBenchmarkReference blank = ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+            return SWBenchmarkBlank(job->input.pixelsWide, job->input.pixelsHigh);
+        };
+
+        // A stroke of dabs across the canvas, corner to corner.  The tip is made
+        // up front, as it would be cached in a real stroke, and only read after
+        SWBenchmarkOperation (^dabs)(SWBrushTipShape, long) = ^SWBenchmarkOperation(SWBrushTipShape shape, long size) {
+            const SWBrushTip *tip = SWBrushTipCacheGet(SWBrushTipCacheCreate(), shape, size);
+            return ^id(SWBenchmarkJob *job) {
+                NSBitmapImageRep *canvas = job->canvas;
+                const uint8_t color[4] = { 0, 0, 200, 200 };
+                for (NSInteger i = 0; i < kSWBenchmarkDabs; i++)
+                {
+                    long left, top;
+                    double t = (double)i / kSWBenchmarkDabs;
+                    SWBrushDabOrigin(tip, t * canvas.pixelsWide, t * canvas.pixelsHigh, &left, &top);
+                    SWBrushStamp(canvas.bitmapData, canvas.pixelsWide, canvas.pixelsHigh, canvas.bytesPerRow,
+                                 tip, left, top, color);
+                }
+                return canvas;
+            };
+        };
+
+        // The whole canvas shaded the way the fill tool shades what it floods,
+        // once the shader is set up by the block
+        SWBenchmarkOperation (^shade)(void (^)(SWFillShader *, long, long)) = ^SWBenchmarkOperation(void (^setUp)(SWFillShader *, long, long)) {
+            return ^id(SWBenchmarkJob *job) {
+                NSBitmapImageRep *canvas = job->canvas;
+                SWFillShader *shader = SWFillShaderCreate(canvas.pixelsWide, canvas.pixelsHigh);
+                setUp(shader, canvas.pixelsWide, canvas.pixelsHigh);
+                SWFillImageWithShader(canvas, shader, NULL, 0);
+                SWFillShaderDestroy(shader);
+                return canvas;
+            };
+        };
+
+        // A smooth brush stroke drawn eight ways at once, one drag event at a
+        // time, zigzagging out from the middle.  The tools read these settings
+        // straight from the defaults; the argument domain goes over the user's
+        // and is never saved, and the run ends with the process
+        SWBenchmarkOperation strokeMirror8 = ^id(SWBenchmarkJob *job) {
+            NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+            @synchronized (defaults)
+            {
+                NSDictionary *arguments = [defaults volatileDomainForName:NSArgumentDomain];
+                if (![arguments[kSWSymmetryKey] isEqual:@(SWSymmetryMirror8)])
+                {
+                    NSMutableDictionary *stroking = [arguments mutableCopy] ?: [NSMutableDictionary dictionary];
+                    [stroking addEntriesFromDictionary:@{kSWAntialiasKey: @YES,
+                                                         kSWSymmetryKey: @(SWSymmetryMirror8),
+                                                         kSWBrushStyleKey: @(SWBrushStyleLine)}];
+                    [defaults removeVolatileDomainForName:NSArgumentDomain];
+                    [defaults setVolatileDomain:stroking forName:NSArgumentDomain];
+                }
+            }
+
+            // The canvas is the buffer the stroke is drawn into; it's only
+            // put down on the main image at mouse up, which isn't timed
+            NSBitmapImageRep *canvas = job->canvas;
+            CGFloat w = canvas.pixelsWide, h = canvas.pixelsHigh;
+            SWBrushTool *tool = [[SWBrushTool alloc] initWithController:nil];
+            [tool setFrontColor:[NSColor colorWithCalibratedRed:0.0 green:0.0 blue:0.8 alpha:0.8]];
+            [tool setLineWidth:8];
+            NSPoint point = NSMakePoint(w / 2, h / 2);
+            tool.savedPoint = point;
+            [tool resetRedrawRect];
+            [tool performDrawAtPoint:point withMainImage:job->other bufferImage:canvas mouseEvent:MOUSE_DOWN];
+            for (NSInteger i = 1; i <= kSWBenchmarkStrokeEvents; i++)
+            {
+                double t = (double)i / kSWBenchmarkStrokeEvents;
+                point = NSMakePoint(w / 2 + t * w / 2 * 0.9, h / 2 + ((i % 2) ? 0.05 : 0.25) * t * h / 2);
+                [tool performDrawAlongPoints:&point count:1 withMainImage:job->other bufferImage:canvas];
+            }
+            return canvas;
+        };
+
+        // Colors for gradients, and a checkerboard to tile
+        static const uint8_t black[4] = { 0, 0, 0, 255 }, blue[4] = { 0, 0, 200, 200 };
+        static uint32_t checks[8 * 8];
+        for (NSInteger i = 0; i < 8 * 8; i++)
+            checks[i] = ((i / 8 + i % 8) % 2) ? 0xFFFFFFFF : 0;
+
+        // Five operations in a row, one at a time or all in one pass
+        SWBenchmarkReference chainReference = ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+            NSBitmapImageRep *image = SWReferenceInvert(SWReferenceStrip(job->input, 0xFFFFFFFF));
+            return SWReferenceCrop(SWReferenceFlip(image, YES, YES), [self cropRectForImage:job->input]);
+        };
+
+        operations = @[
+            @[@"init", @(SWBenchmarkNoise), @NO, init, blank],
+            @[@"init_uncleared", @(SWBenchmarkNoise), @NO, initUncleared],
+            @[@"clear", @(SWBenchmarkNoise), @YES, ^id(SWBenchmarkJob *job) {
+                [SWImageTools clearImage:job->canvas];
+                return job->canvas;
+            }, blank],
+            @[@"draw_copy", @(SWBenchmarkNoise), @YES, ^id(SWBenchmarkJob *job) {
+                [SWImageTools drawToImage:job->canvas fromImage:job->other withComposition:NO];
+                return job->canvas;
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWBenchmarkCopy(job->other);
+            }],
+            @[@"draw_over", @(SWBenchmarkNoise), @YES, ^id(SWBenchmarkJob *job) {
+                [SWImageTools drawToImage:job->canvas fromImage:job->other withComposition:YES];
+                return job->canvas;
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceOver(job->input, job->other);
+            }],
+            @[@"flip_horizontal", @(SWBenchmarkNoise), @YES, ^id(SWBenchmarkJob *job) {
+                [SWImageTools flipImageHorizontal:job->canvas];
+                return job->canvas;
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceFlip(job->input, YES, NO);
+            }],
+            @[@"flip_vertical", @(SWBenchmarkNoise), @YES, ^id(SWBenchmarkJob *job) {
+                [SWImageTools flipImageVertical:job->canvas];
+                return job->canvas;
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceFlip(job->input, NO, YES);
+            }],
+            @[@"flipped_copy", @(SWBenchmarkNoise), @NO, ^id(SWBenchmarkJob *job) {
+                return [SWImageTools flippedCopyOfImage:job->input];
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceFlip(job->input, NO, YES);
+            }],
+            @[@"crop", @(SWBenchmarkNoise), @NO, ^id(SWBenchmarkJob *job) {
+                return [SWImageTools cropImage:job->input toRect:[self cropRectForImage:job->input]];
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceCrop(job->input, [self cropRectForImage:job->input]);
+            }],
+            @[@"strip", @(SWBenchmarkNoise), @YES, ^id(SWBenchmarkJob *job) {
+                [SWImageTools stripImage:job->canvas ofColor:white];
+                return job->canvas;
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceStrip(job->input, 0xFFFFFFFF);
+            }],
+            @[@"invert", @(SWBenchmarkNoise), @YES, ^id(SWBenchmarkJob *job) {
+                [SWImageTools invertImage:job->canvas];
+                return job->canvas;
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceInvert(job->input);
+            }],
+            @[@"monochrome", @(SWBenchmarkOpaqueNoise), @NO, ^id(SWBenchmarkJob *job) {
+                return [SWImageTools createMonochromeImage:job->input];
+            }],
+            @[@"chain_separate", @(SWBenchmarkNoise), @YES, ^id(SWBenchmarkJob *job) {
+                [SWImageTools stripImage:job->canvas ofColor:white];
+                [SWImageTools invertImage:job->canvas];
+                [SWImageTools flipImageHorizontal:job->canvas];
+                [SWImageTools flipImageVertical:job->canvas];
+                return [SWImageTools cropImage:job->canvas toRect:[self cropRectForImage:job->canvas]];
+            }, chainReference],
+            @[@"chain_fused", @(SWBenchmarkNoise), @NO, ^id(SWBenchmarkJob *job) {
+                SWImagePipeline *pipeline = [[SWImagePipeline alloc] initWithImage:job->input];
+                [pipeline stripColor:white];
+                [pipeline invert];
+                [pipeline flipHorizontal];
+                [pipeline flipVertical];
+                [pipeline cropToRect:[self cropRectForImage:job->input]];
+                return [pipeline newImage];
+            }, chainReference],
+            @[@"dabs_round_256", @(SWBenchmarkWhite), @YES, dabs(SWTipRound, 256)],
+            @[@"dabs_soft_256", @(SWBenchmarkWhite), @YES, dabs(SWTipSoft, 256)],
+            @[@"dabs_round_512", @(SWBenchmarkWhite), @YES, dabs(SWTipRound, 512)],
+            @[@"stroke_mirror8", @(SWBenchmarkWhite), @YES, strokeMirror8],
+            @[@"fill", @(SWBenchmarkWhite), @YES, ^id(SWBenchmarkJob *job) {
+                // A blank canvas floods completely: the worst case
+                SWFillTool *tool = [[SWFillTool alloc] initWithController:nil];
+                [tool setFrontColor:[NSColor redColor]];
+                [tool performDrawAtPoint:NSMakePoint(job->canvas.pixelsWide / 2, job->canvas.pixelsHigh / 2)
+                           withMainImage:job->canvas
+                             bufferImage:nil
+                              mouseEvent:MOUSE_DOWN];
+                return job->canvas;
+            }],
+            @[@"fill_linear", @(SWBenchmarkWhite), @YES, shade(^(SWFillShader *shader, long w, long h) {
+                SWFillShaderSetDither(shader, 1);
+                SWFillShaderSetLinear(shader, 0, 0, w, h, black, blue);
+            })],
+            @[@"fill_radial", @(SWBenchmarkWhite), @YES, shade(^(SWFillShader *shader, long w, long h) {
+                SWFillShaderSetDither(shader, 1);
+                SWFillShaderSetRadial(shader, w / 2.0, h / 2.0, hypot(w, h) / 2.0, black, blue);
+            })],
+            @[@"fill_pattern", @(SWBenchmarkWhite), @YES, shade(^(SWFillShader *shader, long w, long h) {
+                SWFillShaderSetPattern(shader, (const uint8_t *)checks, 8, 8, 8 * 4);
+            })],
+            @[@"resize_half", @(SWBenchmarkDrawing), @NO, ^id(SWBenchmarkJob *job) {
+                SWImageDataSource *dataSource = [[SWImageDataSource alloc] initWithImage:job->canvas];
+                [dataSource resizeToSize:NSMakeSize(MAX(job->canvas.pixelsWide / 2, 1), MAX(job->canvas.pixelsHigh / 2, 1))
+                              scaleImage:YES];
+                return dataSource.mainImage;
+            }],
+            @[@"encode_png", @(SWBenchmarkDrawing), @NO, ^id(SWBenchmarkJob *job) {
+                return [SWPNGWriter PNGDataFromImage:job->input];
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceFlip(job->input, NO, YES);
+            }],
+            @[@"encode_jpeg", @(SWBenchmarkDrawing), @NO, ^id(SWBenchmarkJob *job) {
+                return [SWJPEGWriter JPEGDataFromImage:job->input quality:0.8];
+            }],
+            @[@"encode_gif", @(SWBenchmarkDrawing), @NO, ^id(SWBenchmarkJob *job) {
+                return [SWGIFWriter GIFDataFromImage:job->input dithering:SWGIFDitheringDiffusion];
+            }],
+            @[@"encode_bmp", @(SWBenchmarkDrawing), @NO, ^id(SWBenchmarkJob *job) {
+                NSURL *url = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:
+                                                     [NSUUID UUID].UUIDString]];
+                [SWBMPWriter writeImage:job->input toURL:url error:NULL];
+                return url;
+            }, ^NSBitmapImageRep *(SWBenchmarkJob *job) {
+                return SWReferenceFlip(job->input, NO, YES);
+            }],
+            @[@"encode_tiff", @(SWBenchmarkDrawing), @NO, ^id(SWBenchmarkJob *job) {
+                return job->input.TIFFRepresentation;
+            }],
+        ];
+    });
+    return operations;
+}
+
+
++ (NSRect)cropRectForImage:(NSBitmapImageRep *)image
+{
+    NSInteger w = image.pixelsWide, h = image.pixelsHigh;
+    return NSMakeRect(w / 4, h / 3, MAX(w / 2, 1), MAX(h / 2, 1));
+}
+
+
++ (NSArray *)operationNames
+{
+    NSMutableArray *names = [NSMutableArray array];
+    for (NSArray *operation in [self operations])
+        [names addObject:operation[0]];
+    return names;
+}
+
+
++ (NSArray *)operationsNamed:(NSArray *)names
+{
+    if (!names)
+        return [self operations];
+    return [[self operations] filteredArrayUsingPredicate:
+            [NSPredicate predicateWithBlock:^BOOL(NSArray *operation, NSDictionary *bindings) {
+        return [names containsObject:operation[0]];
+    }]];
+}
+
+
++ (SWBenchmarkJob *)jobWithSize:(NSSize)size input:(SWBenchmarkInput)kind seed:(uint32_t)seed
+{
+    SWBenchmarkJob *job = [[SWBenchmarkJob alloc] init];
+    job->input = SWBenchmarkImage(size, kind, seed);
+    job->canvas = SWBenchmarkCopy(job->input);
+    job->other = SWBenchmarkImage(size, kind, seed * 31 + 7);
+    return job;
+}
+
+
+// Turns whatever an operation produced into an image to compare: encoded data
+// gets decoded, like opening the file would
++ (NSBitmapImageRep *)imageFromResult:(id)result
+{
+    if ([result isKindOfClass:[NSBitmapImageRep class]])
+        return result;
+    if ([result isKindOfClass:[NSData class]])
+        return SWBenchmarkDecode(result);
+    if ([result isKindOfClass:[NSURL class]])
+    {
+        SWImageDataSource *dataSource = [[SWImageDataSource alloc] initWithURL:result];
+        [[NSFileManager defaultManager] removeItemAtURL:result error:NULL];
+        return dataSource.mainImage;
+    }
+    return nil;
+}
+
+
++ (NSArray *)timeOperations:(NSArray *)names sizes:(NSArray *)sizes iterations:(NSUInteger)iterations
+{
+    NSMutableArray *results = [NSMutableArray array];
+    NSUInteger cores = NSProcessInfo.processInfo.activeProcessorCount;
+    iterations = MAX(iterations, 1);
+    double *times = malloc(iterations * sizeof(double));
+
+    for (NSArray *operation in [self operationsNamed:names])
+    {
+        NSString *name = operation[0];
+        SWBenchmarkInput kind = [operation[1] integerValue];
+        BOOL inPlace = [operation[2] boolValue];
+        SWBenchmarkOperation run = operation[3];
+
+        for (NSValue *value in sizes)
+        {
+            NSSize size = value.sizeValue;
+            unsigned long long jobBytes = 3ULL * 4 * size.width * size.height;
+            NSUInteger parallelJobs = (NSUInteger)MAX(1, MIN(cores, kSWBenchmarkMemoryBudget / jobBytes));
+            NSArray *threadCounts = (parallelJobs > 1) ? @[@1, @(parallelJobs)] : @[@1];
+
+            for (NSNumber *threadCount in threadCounts)
+            {
+                NSUInteger threads = threadCount.unsignedIntegerValue;
+                @autoreleasepool
+                {
+                    NSMutableArray *jobs = [NSMutableArray array];
+                    for (NSUInteger i = 0; i < threads; i++)
+                        [jobs addObject:[self jobWithSize:size input:kind seed:(uint32_t)(i + 1)]];
+
+                    // One untimed run to warm up the caches and fault in the pages
+                    for (NSUInteger iteration = 0; iteration <= iterations; iteration++)
+                    {
+                        if (inPlace)
+                            for (SWBenchmarkJob *job in jobs)
+                                SWBenchmarkCopyPixels(job->canvas, job->input);
+
+                        uint64_t start = mach_absolute_time();
+                        if (threads == 1)
+                        {
+                            @autoreleasepool { run(jobs[0]); }
+                        }
+                        else
+                        {
+                            dispatch_apply(threads, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+                                @autoreleasepool { run(jobs[i]); }
+                            });
+                        }
+                        if (iteration > 0)
+                            times[iteration - 1] = SWBenchmarkMilliseconds(mach_absolute_time() - start);
+                    }
+                }
+
+                qsort(times, iterations, sizeof(double), SWBenchmarkCompareDoubles);
+                double median = times[iterations / 2];
+                NSMutableDictionary *result = [@{@"operation": name,
+                                                 @"width": @(size.width),
+                                                 @"height": @(size.height),
+                                                 @"threads": @(threads),
+                                                 @"iterations": @(iterations),
+                                                 @"median_ms": @(median),
+                                                 @"min_ms": @(times[0]),
+                                                 @"max_ms": @(times[iterations - 1]),
+                                                 @"megapixels_per_s": @(median > 0 ? threads * size.width * size.height / (median * 1000.0) : 0)} mutableCopy];
+                if ([name hasPrefix:@"dabs_"])
+                    result[@"dabs_per_s"] = @(median > 0 ? threads * kSWBenchmarkDabs / (median / 1000.0) : 0);
+                else if ([name hasPrefix:@"stroke_"])
+                    result[@"events_per_s"] = @(median > 0 ? threads * kSWBenchmarkStrokeEvents / (median / 1000.0) : 0);
+                [results addObject:result];
+            }
+        }
+    }
+
+    free(times);
+    return results;
+}
+
+
++ (NSArray *)verifyOperations:(NSArray *)names sizes:(NSArray *)sizes passed:(BOOL *)passed
+{
+    NSMutableArray *results = [NSMutableArray array];
+    BOOL allExact = YES;
+
+    for (NSArray *operation in [self operationsNamed:names])
+    {
+        // Only the ones with a well-defined answer
+        if (operation.count < 5)
+            continue;
+
+        NSString *name = operation[0];
+        SWBenchmarkOperation run = operation[3];
+        SWBenchmarkReference reference = operation[4];
+
+        for (NSValue *value in sizes)
+        {
+            @autoreleasepool
+            {
+                NSSize size = value.sizeValue;
+                SWBenchmarkInput kind = [operation[1] integerValue];
+                SWBenchmarkJob *job = [self jobWithSize:size input:kind seed:1];
+                NSBitmapImageRep *expected = reference(job);
+                NSBitmapImageRep *actual = [self imageFromResult:run(job)];
+
+                NSUInteger differingBytes = 0;
+                NSUInteger maxDelta = 0;
+                BOOL sameSize = (actual && actual.pixelsWide == expected.pixelsWide && actual.pixelsHigh == expected.pixelsHigh);
+                for (NSInteger y = 0; sameSize && y < expected.pixelsHigh; y++)
+                {
+                    const unsigned char *a = actual.bitmapData + y * actual.bytesPerRow;
+                    const unsigned char *e = expected.bitmapData + y * expected.bytesPerRow;
+                    for (NSInteger x = 0; x < expected.pixelsWide * 4; x++)
+                    {
+                        NSUInteger delta = (a[x] > e[x]) ? a[x] - e[x] : e[x] - a[x];
+                        differingBytes += (delta != 0);
+                        maxDelta = MAX(maxDelta, delta);
+                    }
+                }
+
+                BOOL exact = sameSize && differingBytes == 0;
+                allExact &= exact;
+                NSMutableDictionary *entry = [@{@"operation": name,
+                                                @"width": @(size.width),
+                                                @"height": @(size.height),
+                                                @"exact": @(exact)} mutableCopy];
+                if (!sameSize)
+                    entry[@"error"] = actual ? @"wrong size" : @"no result";
+                else if (!exact)
+                {
+                    entry[@"differing_bytes"] = @(differingBytes);
+                    entry[@"max_delta"] = @(maxDelta);
+                }
+                [results addObject:entry];
+            }
+        }
+    }
+
+    if (passed)
+        *passed = allExact;
+    return results;
+}
+
+
++ (BOOL)runIfRequestedWithStatus:(int *)status
+{
+    // Only ever from the command line, like the stroke replays
+    NSDictionary *arguments = [NSUserDefaults.standardUserDefaults volatileDomainForName:NSArgumentDomain];
+    NSString *reportPath = arguments[kSWRunBenchmarksKey];
+    if (!reportPath)
+        return NO;
+
+    BOOL verify = [arguments[@"SWBenchmarkVerify"] boolValue];
+    NSString *sizeList = arguments[@"SWBenchmarkSizes"] ?:
+        (verify ? kSWBenchmarkVerifySizes : @"640x480,1920x1080,3840x2160,7680x4320");
+    NSArray *sizes = SWBenchmarkParseSizes(sizeList);
+    NSArray *names = [arguments[@"SWBenchmarkOperations"] componentsSeparatedByString:@","];
+    NSUInteger iterations = [arguments[@"SWBenchmarkIterations"] integerValue] ?: kSWBenchmarkDefaultIterations;
+
+    NSOperatingSystemVersion os = NSProcessInfo.processInfo.operatingSystemVersion;
+    NSMutableDictionary *report = [@{@"date": [[[NSISO8601DateFormatter alloc] init] stringFromDate:[NSDate date]],
+                                     @"cpus": @(NSProcessInfo.processInfo.activeProcessorCount),
+                                     @"os": [NSString stringWithFormat:@"%ld.%ld.%ld", (long)os.majorVersion,
+                                             (long)os.minorVersion, (long)os.patchVersion]} mutableCopy];
+    BOOL passed = YES;
+    if (verify)
+        report[@"verify"] = [self verifyOperations:names sizes:sizes passed:&passed];
+    else
+        report[@"results"] = [self timeOperations:names sizes:sizes iterations:iterations];
+
+    NSData *json = [NSJSONSerialization dataWithJSONObject:report
+                                                   options:NSJSONWritingPrettyPrinted | NSJSONWritingSortedKeys
+                                                     error:NULL];
+    if ([reportPath isEqualToString:@"-"])
+    {
+        fwrite(json.bytes, 1, json.length, stdout);
+        fputc('\n', stdout);
+    }
+    else
+        [json writeToFile:reportPath.stringByExpandingTildeInPath atomically:YES];
+
+    if (status)
+        *status = passed ? EXIT_SUCCESS : EXIT_FAILURE;
+    return YES;
+}
+
+@end
@@ -18,38 +18,102 @@
 
 
 #import <Cocoa/Cocoa.h>
+#import "SWLayer.h"
 
+@class SWLayerComposite;
+
+// Canvases of at least SWScratchFileThreshold megabytes (0, the default, for
+// never) keep their layers in scratch files in SWScratchDirectory (default: the
+// temporary folder), with SWScratchResidentMegabytes of each kept in memory
+extern NSString * const kSWScratchFileThresholdKey;
+extern NSString * const kSWScratchResidentMegabytesKey;
+extern NSString * const kSWScratchDirectoryKey;
 
 @interface SWImageDataSource : NSObject 
 {
-    NSBitmapImageRep * mainImage;    // The main storage image
+    NSMutableArray * layers;    // SWLayers, bottom first
+    NSUInteger activeLayerIndex;    // The one that's drawn in: its image is the main image
     NSBitmapImageRep * bufferImage;    // The buffer drawn to for temporary actions
     
     NSArray * imageArray;    // Array of images used for drawing (the images above)
     
     NSSize size;            // Cached size
+    
+    // Flattened layers, each kept up to date a tile at a time
+    SWLayerComposite * belowComposite;    // Everything under the active layer
+    SWLayerComposite * aboveComposite;    // Everything over it
+    SWLayerComposite * flatComposite;    // The lot, brought up to date where edits are noted
+    
+    NSMutableData * editedRects;    // NSRects drawn over since the journal last took them
+    BOOL wholeCanvasEdited;    // Or everywhere
+    
+    BOOL usesScratchFile;    // Out of core: see kSWScratchFileThresholdKey
 }
 
 // Initializers
-- (instancetype)initWithSize:(NSSize)size NS_DESIGNATED_INITIALIZER;
+- (instancetype)initWithSize:(NSSize)size fillBackground:(BOOL)shouldFill NS_DESIGNATED_INITIALIZER;
+- (instancetype)initWithSize:(NSSize)size;
+- (instancetype)initWithCGImage:(CGImageRef)image;
 - (instancetype)initWithURL:(NSURL *)url;
+- (instancetype)initWithImage:(NSBitmapImageRep *)image;    // Flipped, and adopted as-is
 - (instancetype)initWithPasteboard;
 
 // Modifiers to the image
 - (void)resizeToSize:(NSSize)size
           scaleImage:(BOOL)shouldScale;
+- (void)cropToRect:(NSRect)rect;
 
 // Need to change the image?  We got your back -- here be datas
 @property (NS_NONATOMIC_IOSONLY, readonly, copy) NSData *copyMainImageData;
 - (void)restoreMainImageFromData:(NSData *)tiffData;
-- (void)restoreBufferImageFromData:(NSData *)tiffData; // For pasting
 
 // For drawing
 @property (NS_NONATOMIC_IOSONLY, readonly, copy) NSArray *imageArray;
 
+// Layers.  Changing them swaps in copies, so a copy of the array taken
+// beforehand can put everything back
+@property (readonly, copy) NSArray * layers;
+@property (readonly) NSUInteger activeLayerIndex;
+@property (readonly) SWLayer * activeLayer;
+- (void)setLayers:(NSArray *)newLayers activeLayerIndex:(NSUInteger)index;
+- (BOOL)activateLayerWithIdentifier:(NSUInteger)identifier;
+- (SWLayer *)newBlankLayer;    // Clear, canvas-sized, not yet in the stack
+- (NSBitmapImageRep *)newCanvasImage;    // Clear, canvas-sized, and out of core if the layers are
+
+// The layers under and over the active one, flattened, or nil if there aren't
+// any.  The view draws the active layer between the two, so painting never
+// recomposites anything else
+@property (readonly) NSBitmapImageRep * compositeBelowActiveLayer;
+@property (readonly) NSBitmapImageRep * compositeAboveActiveLayer;
+
+// Every layer flattened, for saving.  Only the tiles under the edits noted
+// since the last time get redone; a single plain layer is simply the main image
+@property (readonly) NSBitmapImageRep * compositeImage;
+
 // Accessing information about the image source
 @property (readonly) NSSize size;
-@property (readonly) NSBitmapImageRep * mainImage;
-@property (readonly) NSBitmapImageRep * bufferImage;
+@property (readonly) NSBitmapImageRep * mainImage;    // The active layer's
+@property (readonly) NSBitmapImageRep * bufferImage;    // Created on first use
+@property (readonly) BOOL hasBufferImage;
+
+// Out-of-core canvases need to know what's about to be used, so it's in memory
+// by then, and what hasn't been used in a while, so it can make room.  These
+// do nothing for any other canvas
+@property (readonly) BOOL usesScratchFile;
+- (void)noteVisibleRect:(NSRect)rect;
+- (void)noteStrokeFromPoint:(NSPoint)from toPoint:(NSPoint)to radius:(CGFloat)radius;
+@property (readonly) SWScratchStatistics scratchStatistics;    // Added up over every layer
+
+// Where the canvas has been drawn in, in the view's coordinates.  The tools
+// only tell the paint view where they drew, so it passes every rect on; any
+// other edit covers the whole canvas.  The flattened image is redone there
+- (void)noteEditedRect:(NSRect)rect;
+- (void)noteWholeCanvasEdited;
+
+// Everything noted since the last call, as NSRects, or nil for the whole canvas
+- (NSData *)takeEditedRects;
+
+// Called with every rect noted, and NSZeroRect for the whole canvas
+@property (copy) void (^editHandler)(NSRect rect);
 
 @end
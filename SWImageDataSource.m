@@ -19,6 +19,150 @@
 
 #import "SWImageDataSource.h"
 #import "SWToolboxController.h"
+#import "SWBMPCodec.h"
+#import "SWClipboard.h"
+#import <ImageIO/ImageIO.h>
+
+
+NSString * const kSWScratchFileThresholdKey = @"SWScratchFileThreshold";
+NSString * const kSWScratchResidentMegabytesKey = @"SWScratchResidentMegabytes";
+NSString * const kSWScratchDirectoryKey = @"SWScratchDirectory";
+
+// How much of an out-of-core canvas stays in memory, unless the defaults say
+static const NSInteger kSWDefaultScratchResidentMegabytes = 512;
+
+// How many events' worth of a stroke's direction gets read ahead
+static const CGFloat kSWStrokeLookahead = 4.0;
+
+
+// Big enough that a canvas is a few hundred tiles, small enough that a brush
+// stroke only dirties a handful
+static const NSInteger kSWLayerTileSize = 64;
+
+// Edited rects past this many get merged into one, in case nobody takes them
+static const NSUInteger kSWMaxEditedRects = 256;
+
+
+// A stack of layers flattened into one image, redrawn only a tile at a time.
+// Tiles are numbered from the first row in memory
+@interface SWLayerComposite : NSObject
+{
+    NSBitmapImageRep *image;
+    uint8_t *dirtyTiles;
+    NSInteger tilesWide, tilesHigh;
+    BOOL anyDirty;
+}
+
+- (instancetype)initWithImage:(NSBitmapImageRep *)image NS_DESIGNATED_INITIALIZER;    // Clear, and canvas-sized
+- (void)invalidateAll;
+- (void)invalidateRect:(NSRect)rect;    // In the view's coordinates
+
+// Brings the dirty tiles up to date with the layers, and returns the image
+- (NSBitmapImageRep *)imageFromLayers:(NSArray *)stack;
+
+@property (readonly) NSBitmapImageRep *image;    // As of the last time it was brought up to date
+
+@end
+
+
+@implementation SWLayerComposite
+
+@synthesize image;
+
+- (instancetype)init
+{
+    return [self initWithImage:nil];
+}
+
+- (instancetype)initWithImage:(NSBitmapImageRep *)newImage
+{
+    self = [super init];
+    if (self)
+    {
+        image = newImage;
+        tilesWide = (image.pixelsWide + kSWLayerTileSize - 1) / kSWLayerTileSize;
+        tilesHigh = (image.pixelsHigh + kSWLayerTileSize - 1) / kSWLayerTileSize;
+        dirtyTiles = calloc(MAX(tilesWide * tilesHigh, 1), 1);
+        [self invalidateAll];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(dirtyTiles);
+}
+
+- (void)invalidateAll
+{
+    memset(dirtyTiles, 1, tilesWide * tilesHigh);
+    anyDirty = YES;
+}
+
+- (void)invalidateRect:(NSRect)rect
+{
+    NSInteger w = image.pixelsWide, h = image.pixelsHigh;
+    rect = NSIntersectionRect(NSInsetRect(NSIntegralRect(rect), -1.0, -1.0), NSMakeRect(0, 0, w, h));
+    if (NSIsEmptyRect(rect))
+        return;
+    
+    // The view's y runs the other way from memory
+    NSInteger x0 = (NSInteger)NSMinX(rect) / kSWLayerTileSize;
+    NSInteger x1 = ((NSInteger)NSMaxX(rect) - 1) / kSWLayerTileSize;
+    NSInteger y0 = (h - (NSInteger)NSMaxY(rect)) / kSWLayerTileSize;
+    NSInteger y1 = (h - (NSInteger)NSMinY(rect) - 1) / kSWLayerTileSize;
+    for (NSInteger ty = y0; ty <= y1; ty++)
+        memset(dirtyTiles + ty * tilesWide + x0, 1, x1 - x0 + 1);
+    anyDirty = YES;
+}
+
+- (NSBitmapImageRep *)imageFromLayers:(NSArray *)stack
+{
+    if (!anyDirty)
+        return image;
+    
+    // One clipping rectangle per run of dirty tiles in a row.  The image's y
+    // runs the other way from memory, so the first row of tiles is at the top
+    NSInteger w = image.pixelsWide, h = image.pixelsHigh;
+    CGRect *rects = malloc(tilesWide * tilesHigh * sizeof(CGRect));
+    size_t rectCount = 0;
+    for (NSInteger ty = 0; ty < tilesHigh; ty++)
+    {
+        uint8_t *row = dirtyTiles + ty * tilesWide;
+        for (NSInteger tx = 0; tx < tilesWide; )
+        {
+            if (!row[tx])
+            {
+                tx++;
+                continue;
+            }
+            NSInteger run = tx;
+            while (run < tilesWide && row[run])
+                run++;
+            
+            NSInteger y0 = ty * kSWLayerTileSize, y1 = MIN(y0 + kSWLayerTileSize, h);
+            NSInteger x1 = MIN(run * kSWLayerTileSize, w);
+            rects[rectCount++] = CGRectMake(tx * kSWLayerTileSize, h - y1, x1 - tx * kSWLayerTileSize, y1 - y0);
+            tx = run;
+        }
+    }
+    
+    NSRect bounds = NSMakeRect(0, 0, w, h);
+    SWLockFocus(image);
+    CGContextRef context = [NSGraphicsContext currentContext].CGContext;
+    CGContextClipToRects(context, rects, rectCount);
+    CGContextClearRect(context, NSRectToCGRect(bounds));
+    for (SWLayer *layer in stack)
+        [layer drawInContext:context rect:bounds];
+    SWUnlockFocus(image);
+    free(rects);
+    
+    memset(dirtyTiles, 0, tilesWide * tilesHigh);
+    anyDirty = NO;
+    return image;
+}
+
+@end
 
 
 @implementation SWImageDataSource
@@ -29,6 +173,12 @@
 
 
 - (instancetype)initWithSize:(NSSize)sizeIn
+{
+    return [self initWithSize:sizeIn fillBackground:YES];
+}
+
+
+- (instancetype)initWithSize:(NSSize)sizeIn fillBackground:(BOOL)shouldFill
 {
     self = [super init];
     if (self)
@@ -36,69 +186,93 @@
         // Save the size
         size = sizeIn;
         
-        // Create the two images we'll be using
-        NSBitmapImageRep *mainImage = nil, *bufferImage = nil;
-        [SWImageTools initImageRep:&mainImage withSize:size];
-        [SWImageTools initImageRep:&bufferImage withSize:size];
-        self->mainImage = mainImage;
-        self->bufferImage = bufferImage;
+        // Create the main image. The buffer image isn't needed until a tool
+        // starts drawing, so it gets created lazily by its accessor
+        // Canvases too big for memory live in a scratch file
+        NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+        NSInteger threshold = [defaults integerForKey:kSWScratchFileThresholdKey];
+        usesScratchFile = (threshold > 0 && size.width * size.height * 4 >= threshold * 1024.0 * 1024.0);
         
-        // New Image: gotta paint the background color
-        SWLockFocus(mainImage);
-        
-        NSColor *bgColor = [[SWToolboxController sharedToolboxPanelController] backgroundColor];
-        [bgColor setFill];
-
-        NSRect newRect = (NSRect) { NSZeroPoint, sizeIn };
-        NSRectFill(newRect);
+        NSBitmapImageRep *mainImage = [self newCanvasImage];
+        SWLayer *background = [[SWLayer alloc] initWithImage:mainImage
+                                                        name:NSLocalizedString(@"Background", @"The name of a document's first layer")];
+        self->layers = [[NSMutableArray alloc] initWithObjects:background, nil];
+        self->activeLayerIndex = 0;
+        self->bufferImage = nil;
         
-        SWUnlockFocus(mainImage);        
+        // New Image: gotta paint the background color.  Every tile shares the
+        // one tile of it until it's drawn in, so a huge canvas costs next to nothing
+        if (shouldFill)
+        {
+            NSColor *bgColor = [[SWToolboxController sharedToolboxPanelController] backgroundColor];
+            [SWImageTools fillImage:mainImage withColor:bgColor];
+        }
     }
     return self;
 }
 
 
-- (instancetype)initWithURL:(NSURL *)url
+// Decodes the image directly into our flipped main image, in one pass.  Every
+// pixel gets replaced, so there's no point in painting the background first
+- (instancetype)initWithCGImage:(CGImageRef)image
 {
-    // Temporary image to get dimensions
-    NSBitmapImageRep *tempImage = [NSBitmapImageRep imageRepWithContentsOfURL:url];
-
-    if (!tempImage)    // failure case
+    if (!image)    // failure case
         return nil;
+    
+    if (self = [self initWithSize:NSMakeSize(CGImageGetWidth(image), CGImageGetHeight(image)) fillBackground:NO])
+        [SWImageTools drawFlippedToImage:self.mainImage fromCGImage:image];
+    
+    return self;
+}
 
-    // Run baseline initializer
-    if (self = [self initWithSize:NSMakeSize(tempImage.pixelsWide, tempImage.pixelsHigh)]) {
-        // Copy the image to the mainImage
-        [SWImageTools drawToImage:mainImage fromImage:tempImage withComposition:NO];
 
-        // Flip it, since our views are all flipped
-        if (mainImage)
-            [SWImageTools flipImageVertical:mainImage];
+- (instancetype)initWithURL:(NSURL *)url
+{
+    // Plain BMPs are already laid out like our canvas, so they skip ImageIO
+    SWBMPReader *bmp = [[SWBMPReader alloc] initWithURL:url];
+    if (bmp)
+    {
+        if (self = [self initWithSize:bmp.size fillBackground:NO])
+            [bmp readIntoImage:self.mainImage];
+        return self;
     }
-
+    
+    // ImageIO doesn't decode anything until the image is drawn, so the only
+    // full-size pass is the one into the main image
+    CGImageSourceRef source = CGImageSourceCreateWithURL((__bridge CFURLRef)url, NULL);
+    if (!source)    // failure case
+        return nil;
+    
+    CGImageRef image = CGImageSourceCreateImageAtIndex(source, 0, NULL);
+    CFRelease(source);
+    
+    self = [self initWithCGImage:image];
+    CGImageRelease(image);
+    
     return self;
 }
 
 
-- (instancetype)initWithPasteboard
+// Takes over an image that's already in our flipped layout
+- (instancetype)initWithImage:(NSBitmapImageRep *)image
 {
-    NSBitmapImageRep *tempImage = [NSBitmapImageRep imageRepWithPasteboard:[NSPasteboard generalPasteboard]];
-    
-    NSAssert(tempImage, @"We can't initialize with a pasteboard without an image on it!");
-    if (!tempImage)    // failure case
+    if (!image)
         return nil;
     
-    // Run baseline initializer
-    if (self = [self initWithSize:NSMakeSize(tempImage.pixelsWide, tempImage.pixelsHigh)]) {
-        // Copy the image to the mainImage
-        [SWImageTools drawToImage:mainImage fromImage:tempImage withComposition:NO];
+    if (self = [self initWithSize:NSMakeSize(image.pixelsWide, image.pixelsHigh) fillBackground:NO])
+        self.activeLayer.image = image;
+    return self;
+}
 
-        // Flip it, since our views are all flipped
-        if (mainImage)
-            [SWImageTools flipImageVertical:mainImage];
-    }
 
-    return self;
+// The clipboard hands back an image in our flipped layout, so it becomes the
+// main image as-is
+- (instancetype)initWithPasteboard
+{
+    NSBitmapImageRep *image = [[SWPasteboardClipboard generalClipboard] canvasImage];
+    
+    NSAssert(image, @"We can't initialize with a pasteboard without an image on it!");
+    return [self initWithImage:image];
 }
 
 // -----------------------------------------------------------------------------
@@ -108,106 +282,443 @@
 - (void)resizeToSize:(NSSize)newSize
           scaleImage:(BOOL)shouldScale;
 {
-    // We'll be replacing the two images behind the scenes
-    NSBitmapImageRep *newMainImage = nil;
-    NSBitmapImageRep *newBufferImage = nil;
-    [SWImageTools initImageRep:&newMainImage 
-                      withSize:newSize];
-    [SWImageTools initImageRep:&newBufferImage
-                      withSize:newSize];
-    
+    // Every layer gets a new image behind the scenes: the old ones are left
+    // alone, for whoever's still holding on to them
     NSRect newRect = (NSRect) { NSZeroPoint, newSize };
-    SWLockFocus(newMainImage);
-    if (shouldScale) 
-    {
-        // Stretch the image to the correct size
-        [NSGraphicsContext currentContext].imageInterpolation = NSImageInterpolationNone;
-        [mainImage drawInRect:newRect];
-    }
-    else 
+    for (NSUInteger i = 0; i < layers.count; i++)
     {
-        NSColor *bgColor = [[SWToolboxController sharedToolboxPanelController] backgroundColor];
-        [bgColor setFill];
-        NSRectFill(newRect);
-        [mainImage drawAtPoint:NSZeroPoint];
+        SWLayer *layer = layers[i];
+        NSBitmapImageRep *newImage = [self newCanvasImageOfSize:newSize];
+        
+        // Only the bottom layer gets a background: the rest stay see-through.
+        // Growing the canvas leaves the new part as the shared background tile
+        if (!shouldScale && i == 0)
+        {
+            NSColor *bgColor = [[SWToolboxController sharedToolboxPanelController] backgroundColor];
+            [SWImageTools fillImage:newImage withColor:bgColor];
+        }
+        
+        SWLockFocus(newImage);
+        if (shouldScale) 
+        {
+            // Stretch the image to the correct size
+            [NSGraphicsContext currentContext].imageInterpolation = NSImageInterpolationNone;
+            [layer.image drawInRect:newRect];
+        }
+        else 
+            [layer.image drawAtPoint:NSZeroPoint];
+        SWUnlockFocus(newImage);
+        layer.image = newImage;
     }
-    SWUnlockFocus(newMainImage);
     
-    // Release and set (no need to retain: we already own the new images)
-    mainImage = newMainImage;
-    bufferImage = newBufferImage;
+    // The buffer image will be recreated at the new size when it's next needed,
+    // and so will the composites
+    bufferImage = nil;
+    imageArray = nil;
+    [self discardComposites];
+    [self noteWholeCanvasEdited];
     
     // Finally, update our cached size
     size = newSize;
 }
 
 
+// Every layer keeps only what's inside rect, which becomes the whole canvas
+- (void)cropToRect:(NSRect)rect
+{
+    NSSize newSize = rect.size;
+    for (SWLayer *layer in layers)
+    {
+        NSBitmapImageRep *newImage = [self newCanvasImageOfSize:newSize];
+        [SWImageTools drawToImage:newImage
+                        fromImage:layer.image
+                          atPoint:NSMakePoint(-rect.origin.x, -rect.origin.y)
+                  withComposition:NO];
+        layer.image = newImage;
+    }
+    
+    bufferImage = nil;
+    imageArray = nil;
+    [self discardComposites];
+    [self noteWholeCanvasEdited];
+    size = newSize;
+}
+
+
 // -----------------------------------------------------------------------------
 //  Accessors
 // -----------------------------------------------------------------------------
 
 @synthesize size;
-@synthesize mainImage;
-@synthesize bufferImage;
+@synthesize activeLayerIndex;
+@synthesize usesScratchFile;
+@synthesize editHandler;
+
+
+- (NSBitmapImageRep *)mainImage
+{
+    return self.activeLayer.image;
+}
+
+
+// Most documents are opened just to be looked at, so only create the buffer
+// image once something asks for it
+- (NSBitmapImageRep *)bufferImage
+{
+    if (!bufferImage)
+    {
+        NSBitmapImageRep *bufferImage = nil;
+        [SWImageTools initImageRep:&bufferImage withSize:size];
+        self->bufferImage = bufferImage;
+    }
+    return bufferImage;
+}
+
+
+// Lets the view skip drawing an overlay that doesn't exist yet
+- (BOOL)hasBufferImage
+{
+    return (bufferImage != nil);
+}
 
 
 // Creates an array if none exists, and returns it
 - (NSArray *)imageArray
 {
     if (!imageArray)
-        imageArray = [[NSArray alloc] initWithObjects:mainImage, bufferImage, nil];
+        imageArray = [[NSArray alloc] initWithObjects:self.mainImage, self.bufferImage, nil];
     
     return imageArray;
 }
 
 
 // -----------------------------------------------------------------------------
-//  Data
+//  Layers
 // -----------------------------------------------------------------------------
 
-- (NSData *)copyMainImageData
+- (NSArray *)layers
 {
-    if (mainImage)
-        return mainImage.TIFFRepresentation;
+    return [[NSArray alloc] initWithArray:layers copyItems:YES];
+}
+
+
+- (SWLayer *)activeLayer
+{
+    return layers[activeLayerIndex];
+}
+
+
+- (void)setLayers:(NSArray *)newLayers activeLayerIndex:(NSUInteger)index
+{
+    NSParameterAssert(index < newLayers.count);
     
-    // No image, no data
-    return nil;
+    // Undo can hand back layers from before a resize
+    NSSize newSize = [newLayers[0] image].size;
+    if (!NSEqualSizes(newSize, size))
+    {
+        size = newSize;
+        bufferImage = nil;
+        [self discardComposites];
+    }
+    
+    // The same layers in the same places only need recompositing where a
+    // setting changed; anything else and the whole lot starts over
+    BOOL sameStack = (index == activeLayerIndex && newLayers.count == layers.count);
+    for (NSUInteger i = 0; sameStack && i < layers.count; i++)
+        sameStack = ([newLayers[i] identifier] == [layers[i] identifier] && [newLayers[i] image] == [layers[i] image]);
+    
+    if (sameStack)
+    {
+        for (NSUInteger i = 0; i < layers.count; i++)
+        {
+            SWLayer *before = layers[i], *after = newLayers[i];
+            if (before.visible == after.visible && before.opacity == after.opacity && before.blendMode == after.blendMode)
+                continue;
+            
+            if (i < activeLayerIndex)
+                [belowComposite invalidateAll];
+            else if (i > activeLayerIndex)
+                [aboveComposite invalidateAll];
+            [flatComposite invalidateAll];
+            [self noteWholeCanvasEdited];
+        }
+    }
+    else
+    {
+        [belowComposite invalidateAll];
+        [aboveComposite invalidateAll];
+        [flatComposite invalidateAll];
+        [self noteWholeCanvasEdited];
+    }
+    
+    layers = [[NSMutableArray alloc] initWithArray:newLayers copyItems:YES];
+    activeLayerIndex = index;
+    imageArray = nil;
 }
 
 
-- (void)restoreMainImageFromData:(NSData *)tiffData
+- (BOOL)activateLayerWithIdentifier:(NSUInteger)identifier
 {
-    if (!tiffData)
+    for (NSUInteger i = 0; i < layers.count; i++)
+    {
+        if ([layers[i] identifier] != identifier)
+            continue;
+        if (i != activeLayerIndex)
+            [self setLayers:self.layers activeLayerIndex:i];
+        return YES;
+    }
+    return NO;
+}
+
+
+- (SWLayer *)newBlankLayer
+{
+    NSBitmapImageRep *image = [self newCanvasImage];
+    NSString *name = [NSString stringWithFormat:NSLocalizedString(@"Layer %lu", @"The name of a new layer"),
+                      (unsigned long)layers.count + 1];
+    return [[SWLayer alloc] initWithImage:image name:name];
+}
+
+
+- (NSBitmapImageRep *)newCanvasImage
+{
+    return [self newCanvasImageOfSize:size];
+}
+
+
+- (NSBitmapImageRep *)newCanvasImageOfSize:(NSSize)newSize
+{
+    NSBitmapImageRep *image = nil;
+    if (usesScratchFile)
+    {
+        NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+        NSString *directory = [defaults stringForKey:kSWScratchDirectoryKey] ?: NSTemporaryDirectory();
+        NSInteger megabytes = [defaults integerForKey:kSWScratchResidentMegabytesKey];
+        if (megabytes <= 0)
+            megabytes = kSWDefaultScratchResidentMegabytes;
+        [SWImageTools initScratchImageRep:&image
+                                 withSize:newSize
+                              inDirectory:[NSURL fileURLWithPath:directory isDirectory:YES]
+                            residentBytes:(size_t)megabytes * 1024 * 1024];
+    }
+    else
+        [SWImageTools initImageRep:&image withSize:newSize];
+    return image;
+}
+
+
+// -----------------------------------------------------------------------------
+//  Out-of-core canvases
+// -----------------------------------------------------------------------------
+
+// Every image the view draws from
+- (NSArray *)visibleImages
+{
+    NSMutableArray *images = [NSMutableArray arrayWithObject:self.mainImage];
+    NSBitmapImageRep *below = self.compositeBelowActiveLayer, *above = self.compositeAboveActiveLayer;
+    if (below)
+        [images addObject:below];
+    if (above)
+        [images addObject:above];
+    return images;
+}
+
+
+- (void)noteVisibleRect:(NSRect)rect
+{
+    if (!usesScratchFile)
         return;
     
-    NSBitmapImageRep *imageRep = [[NSBitmapImageRep alloc] initWithData:tiffData];
-    [SWImageTools drawToImage:mainImage fromImage:imageRep withComposition:NO];
+    // Scrolling is likeliest to bring in what's just outside
+    NSRect around = NSInsetRect(rect, -NSWidth(rect) / 2, -NSHeight(rect) / 2);
+    for (NSBitmapImageRep *image in [self visibleImages])
+    {
+        SWImageUseRect(image, rect, NO);
+        SWImageUseRect(image, around, YES);
+    }
 }
 
 
-- (void)restoreBufferImageFromData:(NSData *)tiffData
+- (void)noteStrokeFromPoint:(NSPoint)from toPoint:(NSPoint)to radius:(CGFloat)radius
 {
-    if (!tiffData)
+    if (!usesScratchFile)
         return;
     
-    NSBitmapImageRep *imageRep = [[NSBitmapImageRep alloc] initWithData:tiffData];
+    // Where the stroke is now, and where it'll be if it keeps going the same
+    // way for a few more events
+    radius = MAX(radius, 1.0) + 1.0;
+    NSRect now = NSMakeRect(MIN(from.x, to.x) - radius, MIN(from.y, to.y) - radius,
+                            fabs(to.x - from.x) + 2 * radius, fabs(to.y - from.y) + 2 * radius);
+    NSPoint ahead = NSMakePoint(to.x + (to.x - from.x) * kSWStrokeLookahead, to.y + (to.y - from.y) * kSWStrokeLookahead);
+    NSRect next = NSMakeRect(MIN(to.x, ahead.x) - radius, MIN(to.y, ahead.y) - radius,
+                             fabs(ahead.x - to.x) + 2 * radius, fabs(ahead.y - to.y) + 2 * radius);
     
-    // Unlike the main image, the buffer image can have its size change.  Do that here.
-    NSRect bufferImageRect = NSMakeRect(0, 0, bufferImage.pixelsWide, bufferImage.pixelsHigh);
-    NSRect pastedImageRect = NSMakeRect(0, 0, imageRep.pixelsWide, imageRep.pixelsHigh);
-    NSRect finalRect = NSUnionRect(bufferImageRect, pastedImageRect);
+    SWImageUseRect(self.mainImage, now, NO);
+    SWImageUseRect(self.mainImage, next, YES);
+}
+
+
+- (SWScratchStatistics)scratchStatistics
+{
+    SWScratchStatistics total = { 0 };
+    NSMutableArray *images = [NSMutableArray array];
+    for (SWLayer *layer in layers)
+        [images addObject:layer.image];
+    if (belowComposite)
+        [images addObject:belowComposite.image];
+    if (aboveComposite)
+        [images addObject:aboveComposite.image];
+    if (flatComposite)
+        [images addObject:flatComposite.image];
     
-    if (!NSEqualRects(bufferImageRect, finalRect))
+    for (NSBitmapImageRep *image in images)
     {
-        // Pasting something bigger than the previous image, so create a new one with the new size
-        bufferImage = nil;
+        SWScratchStatistics statistics;
+        if (!SWImageGetScratchStatistics(image, &statistics))
+            continue;
+        total.pageIns += statistics.pageIns;
+        total.prefetches += statistics.prefetches;
+        total.evictions += statistics.evictions;
+        total.writeBacks += statistics.writeBacks;
+        total.residentTiles += statistics.residentTiles;
+    }
+    return total;
+}
 
-        NSBitmapImageRep *bufferImage = nil;
-        [SWImageTools initImageRep:&bufferImage withSize:finalRect.size];
-        self->bufferImage = bufferImage;
+
+- (NSBitmapImageRep *)compositeBelowActiveLayer
+{
+    if (activeLayerIndex == 0)
+        return nil;
+    
+    // A plain layer on its own is its own composite
+    NSArray *below = [layers subarrayWithRange:NSMakeRange(0, activeLayerIndex)];
+    if (below.count == 1 && [below[0] isPlain])
+        return [below[0] image];
+    
+    if (!belowComposite)
+        belowComposite = [[SWLayerComposite alloc] initWithImage:[self newCanvasImage]];
+    return [belowComposite imageFromLayers:below];
+}
+
+
+- (NSBitmapImageRep *)compositeAboveActiveLayer
+{
+    if (activeLayerIndex + 1 >= layers.count)
+        return nil;
+    
+    NSArray *above = [layers subarrayWithRange:NSMakeRange(activeLayerIndex + 1, layers.count - activeLayerIndex - 1)];
+    if (above.count == 1 && [above[0] isPlain])
+        return [above[0] image];
+    
+    if (!aboveComposite)
+        aboveComposite = [[SWLayerComposite alloc] initWithImage:[self newCanvasImage]];
+    return [aboveComposite imageFromLayers:above];
+}
+
+
+- (NSBitmapImageRep *)compositeImage
+{
+    // The common case: nothing to flatten.  The cache would go stale without
+    // anyone watching it, so let it go
+    if (layers.count == 1 && [layers[0] isPlain])
+    {
+        flatComposite = nil;
+        return self.mainImage;
     }
     
-    [SWImageTools drawToImage:bufferImage fromImage:imageRep withComposition:NO];
+    // Everything drawn in the active layer since last time has been noted as
+    // an edit, and the tiles under it are dirty already
+    if (!flatComposite)
+        flatComposite = [[SWLayerComposite alloc] initWithImage:[self newCanvasImage]];
+    return [flatComposite imageFromLayers:layers];
+}
+
+
+- (void)discardComposites
+{
+    belowComposite = nil;
+    aboveComposite = nil;
+    flatComposite = nil;
+}
+
+
+// -----------------------------------------------------------------------------
+//  Edits
+// -----------------------------------------------------------------------------
+
+- (void)noteEditedRect:(NSRect)rect
+{
+    if (NSIsEmptyRect(rect))
+        return;
+    [flatComposite invalidateRect:rect];
+    if (editHandler)
+        editHandler(rect);
+    if (wholeCanvasEdited)
+        return;
+    
+    // Strokes note the same rect over and over
+    if (!editedRects)
+        editedRects = [NSMutableData data];
+    NSUInteger count = editedRects.length / sizeof(NSRect);
+    NSRect *rects = editedRects.mutableBytes;
+    if (count > 0 && NSContainsRect(rects[count - 1], rect))
+        return;
+    
+    if (count >= kSWMaxEditedRects)
+    {
+        NSRect all = rect;
+        for (NSUInteger i = 0; i < count; i++)
+            all = NSUnionRect(all, rects[i]);
+        editedRects.length = 0;
+        rect = all;
+    }
+    [editedRects appendBytes:&rect length:sizeof(NSRect)];
+}
+
+
+- (void)noteWholeCanvasEdited
+{
+    [flatComposite invalidateAll];
+    if (editHandler)
+        editHandler(NSZeroRect);
+    wholeCanvasEdited = YES;
+    editedRects = nil;
+}
+
+
+- (NSData *)takeEditedRects
+{
+    NSData *rects = wholeCanvasEdited ? nil : (editedRects ?: [NSData data]);
+    editedRects = nil;
+    wholeCanvasEdited = NO;
+    return rects;
+}
+
+
+// -----------------------------------------------------------------------------
+//  Data
+// -----------------------------------------------------------------------------
+
+- (NSData *)copyMainImageData
+{
+    NSBitmapImageRep *mainImage = self.mainImage;
+    if (mainImage)
+        return mainImage.TIFFRepresentation;
+    
+    // No image, no data
+    return nil;
+}
+
+
+- (void)restoreMainImageFromData:(NSData *)tiffData
+{
+    if (!tiffData)
+        return;
+    
+    NSBitmapImageRep *imageRep = [[NSBitmapImageRep alloc] initWithData:tiffData];
+    [SWImageTools drawToImage:self.mainImage fromImage:imageRep withComposition:NO];
+    [self noteWholeCanvasEdited];
 }
 
 
@@ -0,0 +1,73 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+
+// A chain of operations on one of our canvases, run in a single pass over it.
+//
+// Nothing happens until the chain is run.  Flips and crops never move a pixel
+// by themselves: they only change where each pixel of the result gets read
+// from.  The per-pixel operations are kept in order, and each runs as its own
+// tight loop over a row while the row is still in the cache, so five
+// operations cost about as much memory traffic as one.
+@interface SWImagePipeline : NSObject
+{
+    NSBitmapImageRep *image;
+    NSInteger imageWidth, imageHeight;
+    
+    // Pixel (x, y) of the result, counting rows in memory order, comes from
+    // pixel (originX + x, originY + y) of the image -- or from the far end of
+    // the row or column, if it's been flipped.  Anything outside of the valid
+    // rect has been cropped away, and reads as clear
+    NSInteger originX, originY;
+    NSInteger width, height;
+    BOOL flippedX, flippedY;
+    NSInteger validX0, validY0, validX1, validY1;
+    
+    NSMutableData *steps;    // SWPipelineSteps, in order
+}
+
+// A 32-bit RGBA image, like the canvases from +[SWImageTools initImageRep:withSize:]
+- (instancetype)initWithImage:(NSBitmapImageRep *)image NS_DESIGNATED_INITIALIZER;
+- (instancetype)init NS_UNAVAILABLE;
+
+- (void)flipHorizontal;
+- (void)flipVertical;
+
+// In the coordinates of the image as it stands after everything queued so far.
+// Anything outside of it comes out clear, like +[SWImageTools cropImage:toRect:]
+- (void)cropToRect:(NSRect)rect;
+
+- (void)invert;
+- (void)stripColor:(NSColor *)color;
+- (void)makeMonochrome;    // Opaque black or white, by brightness
+
+// What the result will look like
+@property (readonly) NSSize size;
+
+// As long as nothing has been cropped, the chain can run over the image itself.
+// With no flips either, tiles that are one color all the way through stay shared
+@property (readonly) BOOL canRunInPlace;
+- (void)runInPlace;
+
+// A new canvas of the right size, holding the result.  The original is left alone
+- (NSBitmapImageRep *)newImage;
+
+@end
@@ -0,0 +1,346 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWImagePipeline.h"
+#import "SWImageTools.h"
+
+// Rows handed to each worker at a time
+#define kSWPipelineBandRows     16
+
+
+typedef NS_ENUM(NSInteger, SWPipelineStepKind) {
+    SWPipelineInvert,
+    SWPipelineStrip,
+    SWPipelineMonochrome
+};
+
+typedef struct {
+    SWPipelineStepKind kind;
+    uint32_t target;        // Strips: the pixel that goes...
+    BOOL stripsClear;       // ...along with anything clear, if that's what it is
+} SWPipelineStep;
+
+
+// Four bytes in memory order, as one pixel
+static inline uint32_t SWPipelinePack(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    uint8_t bytes[4] = { r, g, b, a };
+    uint32_t pixel;
+    memcpy(&pixel, bytes, sizeof(pixel));
+    return pixel;
+}
+
+
+// Inverting a premultiplied color without unpremultiplying: c' = a - c
+static inline uint32_t SWPipelineInvertPixel(uint32_t pixel)
+{
+    uint8_t c[4];
+    memcpy(c, &pixel, sizeof(pixel));
+    return SWPipelinePack(c[3] - c[0], c[3] - c[1], c[3] - c[2], c[3]);
+}
+
+
+static inline uint32_t SWPipelineStripPixel(uint32_t pixel, uint32_t target, BOOL stripsClear)
+{
+    uint32_t alphaMask = SWPipelinePack(0, 0, 0, 0xFF);
+    return (pixel == target || (stripsClear && !(pixel & alphaMask))) ? 0 : pixel;
+}
+
+
+// NTSC weighting, the same cutoff as +[SWImageTools createMonochromeImage:]
+static inline uint32_t SWPipelineMonochromePixel(uint32_t pixel)
+{
+    uint8_t c[4];
+    memcpy(c, &pixel, sizeof(pixel));
+    uint8_t value = (299 * c[0] + 587 * c[1] + 114 * c[2] > 128000) ? 0xFF : 0;
+    return SWPipelinePack(value, value, value, 0xFF);
+}
+
+
+// One loop per kind of step, so the compiler gets each one on its own and
+// nothing gets decided per pixel
+static void SWPipelineRunSteps(const SWPipelineStep *steps, NSUInteger stepCount, uint32_t *pixels, size_t count)
+{
+    for (NSUInteger s = 0; s < stepCount; s++)
+    {
+        const SWPipelineStep step = steps[s];
+        switch (step.kind)
+        {
+            case SWPipelineInvert:
+                for (size_t i = 0; i < count; i++)
+                    pixels[i] = SWPipelineInvertPixel(pixels[i]);
+                break;
+            case SWPipelineStrip:
+                for (size_t i = 0; i < count; i++)
+                    pixels[i] = SWPipelineStripPixel(pixels[i], step.target, step.stripsClear);
+                break;
+            case SWPipelineMonochrome:
+                for (size_t i = 0; i < count; i++)
+                    pixels[i] = SWPipelineMonochromePixel(pixels[i]);
+                break;
+        }
+    }
+}
+
+
+// Copies count pixels, back to front if asked.  The two never overlap
+static inline void SWPipelineCopyRow(uint32_t *dest, const uint32_t *src, size_t count, BOOL reversed)
+{
+    if (!reversed)
+    {
+        memcpy(dest, src, count * sizeof(uint32_t));
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+        dest[i] = src[count - 1 - i];
+}
+
+
+static inline void SWPipelineReverseRow(uint32_t *pixels, size_t count)
+{
+    for (size_t i = 0, j = count - 1; i < j; i++, j--)
+    {
+        uint32_t pixel = pixels[i];
+        pixels[i] = pixels[j];
+        pixels[j] = pixel;
+    }
+}
+
+
+@implementation SWImagePipeline
+
+- (instancetype)initWithImage:(NSBitmapImageRep *)anImage
+{
+    NSAssert(anImage.bitsPerPixel == 32 && !anImage.isPlanar, @"Only our own canvases can go through a pipeline");
+    if (self = [super init])
+    {
+        image = anImage;
+        imageWidth = width = validX1 = anImage.pixelsWide;
+        imageHeight = height = validY1 = anImage.pixelsHigh;
+        steps = [NSMutableData data];
+    }
+    return self;
+}
+
+
+- (void)flipHorizontal
+{
+    flippedX = !flippedX;
+}
+
+
+- (void)flipVertical
+{
+    flippedY = !flippedY;
+}
+
+
+- (void)cropToRect:(NSRect)rect
+{
+    rect = NSIntegralRect(rect);
+    NSAssert(rect.size.width > 0 && rect.size.height > 0, @"We can't crop to a non-positive width or height!");
+
+    // Quartz's y runs up from the bottom of memory
+    NSInteger cropWidth = rect.size.width, cropHeight = rect.size.height;
+    NSInteger x = rect.origin.x;
+    NSInteger y = height - (NSInteger)rect.origin.y - cropHeight;
+
+    originX = flippedX ? originX + width - x - cropWidth : originX + x;
+    originY = flippedY ? originY + height - y - cropHeight : originY + y;
+    width = cropWidth;
+    height = cropHeight;
+
+    validX0 = MAX(validX0, originX);
+    validY0 = MAX(validY0, originY);
+    validX1 = MIN(validX1, originX + width);
+    validY1 = MIN(validY1, originY + height);
+}
+
+
+- (void)addStep:(SWPipelineStep)step
+{
+    // Two inverts in a row cancel out, and monochrome twice is monochrome
+    NSUInteger count = steps.length / sizeof(SWPipelineStep);
+    SWPipelineStep *last = count ? (SWPipelineStep *)steps.mutableBytes + count - 1 : NULL;
+    if (last && last->kind == step.kind && step.kind == SWPipelineInvert)
+    {
+        steps.length -= sizeof(SWPipelineStep);
+        return;
+    }
+    if (last && last->kind == step.kind && step.kind == SWPipelineMonochrome)
+        return;
+    [steps appendBytes:&step length:sizeof(step)];
+}
+
+
+- (void)invert
+{
+    [self addStep:(SWPipelineStep) { SWPipelineInvert, 0, NO }];
+}
+
+
+- (void)stripColor:(NSColor *)color
+{
+    CGFloat r, g, b, a;
+    [[color colorUsingColorSpaceName:NSCalibratedRGBColorSpace] getRed:&r green:&g blue:&b alpha:&a];
+    uint32_t target = SWPipelinePack(roundf(r * 255.0), roundf(g * 255.0), roundf(b * 255.0), roundf(a * 255.0));
+    [self addStep:(SWPipelineStep) { SWPipelineStrip, target, a == 0 }];
+}
+
+
+- (void)makeMonochrome
+{
+    [self addStep:(SWPipelineStep) { SWPipelineMonochrome, 0, NO }];
+}
+
+
+- (NSSize)size
+{
+    return NSMakeSize(width, height);
+}
+
+
+- (BOOL)canRunInPlace
+{
+    return originX == 0 && originY == 0 && width == imageWidth && height == imageHeight &&
+        validX0 == 0 && validY0 == 0 && validX1 == imageWidth && validY1 == imageHeight;
+}
+
+
+- (void)runInPlace
+{
+    NSAssert(self.canRunInPlace, @"A cropped pipeline needs an image of its own");
+    const SWPipelineStep *stepList = steps.bytes;
+    NSUInteger stepCount = steps.length / sizeof(SWPipelineStep);
+
+    // Nothing moves: a tile at a time, and the ones that are all one color
+    // only have that one color worked out
+    if (!flippedX && !flippedY)
+    {
+        if (stepCount == 0)
+            return;
+        SWImageForEachTile(image, ^uint32_t(uint32_t pixel) {
+            SWPipelineRunSteps(stepList, stepCount, &pixel, 1);
+            return pixel;
+        }, ^(uint32_t *pixels, size_t count) {
+            SWPipelineRunSteps(stepList, stepCount, pixels, count);
+        });
+        return;
+    }
+
+    // Rows trade places with their mirror images, so each worker takes a band
+    // of pairs from the top half
+    unsigned char *data = image.bitmapData;
+    NSInteger bytesPerRow = image.bytesPerRow;
+    NSInteger w = imageWidth, h = imageHeight;
+    BOOL reversed = flippedX, swapsRows = flippedY;
+    NSInteger rowCount = swapsRows ? (h + 1) / 2 : h;
+    size_t bands = (rowCount + kSWPipelineBandRows - 1) / kSWPipelineBandRows;
+
+    dispatch_apply(bands, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t band) {
+        uint32_t *spare = swapsRows ? malloc(w * sizeof(uint32_t)) : NULL;
+        NSInteger end = MIN(rowCount, (NSInteger)(band + 1) * kSWPipelineBandRows);
+        for (NSInteger row = band * kSWPipelineBandRows; row < end; row++)
+        {
+            uint32_t *top = (uint32_t *)(data + row * bytesPerRow);
+            uint32_t *bottom = (uint32_t *)(data + (h - 1 - row) * bytesPerRow);
+            if (!swapsRows || top == bottom)
+            {
+                if (reversed)
+                    SWPipelineReverseRow(top, w);
+                SWPipelineRunSteps(stepList, stepCount, top, w);
+                continue;
+            }
+
+            memcpy(spare, top, w * sizeof(uint32_t));
+            SWPipelineCopyRow(top, bottom, w, reversed);
+            SWPipelineRunSteps(stepList, stepCount, top, w);
+            SWPipelineCopyRow(bottom, spare, w, reversed);
+            SWPipelineRunSteps(stepList, stepCount, bottom, w);
+        }
+        free(spare);
+    });
+}
+
+
+- (NSBitmapImageRep *)newImage
+{
+    NSBitmapImageRep *result;
+    [SWImageTools initImageRep:&result withSize:self.size];
+
+    const SWPipelineStep *stepList = steps.bytes;
+    NSUInteger stepCount = steps.length / sizeof(SWPipelineStep);
+
+    // What the steps make of a clear pixel, which is what anything cropped
+    // away reads as.  The new canvas is clear already, so if that's still clear
+    // those parts can be left alone
+    uint32_t clearPixel = 0;
+    SWPipelineRunSteps(stepList, stepCount, &clearPixel, 1);
+
+    const unsigned char *srcData = image.bitmapData;
+    unsigned char *destData = result.bitmapData;
+    NSInteger srcBytesPerRow = image.bytesPerRow, destBytesPerRow = result.bytesPerRow;
+    NSInteger w = width, h = height;
+    NSInteger x0 = originX, y0 = originY;
+    BOOL reversed = flippedX, rowsReversed = flippedY;
+
+    // The part of every row that comes from the image
+    NSInteger firstX, endX;
+    if (!reversed)
+    {
+        firstX = MAX(0, validX0 - x0);
+        endX = MIN(w, validX1 - x0);
+    }
+    else
+    {
+        firstX = MAX(0, x0 + w - validX1);
+        endX = MIN(w, x0 + w - validX0);
+    }
+    NSInteger firstY = validY0, endY = validY1;
+    size_t bands = (h + kSWPipelineBandRows - 1) / kSWPipelineBandRows;
+
+    dispatch_apply(bands, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t band) {
+        NSInteger end = MIN(h, (NSInteger)(band + 1) * kSWPipelineBandRows);
+        for (NSInteger row = band * kSWPipelineBandRows; row < end; row++)
+        {
+            uint32_t *dest = (uint32_t *)(destData + row * destBytesPerRow);
+            NSInteger srcRow = y0 + (rowsReversed ? h - 1 - row : row);
+            BOOL hasPixels = (srcRow >= firstY && srcRow < endY && firstX < endX);
+            if (!hasPixels && clearPixel == 0)
+                continue;
+
+            if (hasPixels)
+            {
+                const uint32_t *src = (const uint32_t *)(srcData + srcRow * srcBytesPerRow);
+                NSInteger srcX = reversed ? x0 + w - endX : x0 + firstX;
+                SWPipelineCopyRow(dest + firstX, src + srcX, endX - firstX, reversed);
+            }
+
+            // Whatever's left of the row is clear, and goes through the steps too
+            if (clearPixel == 0)
+                SWPipelineRunSteps(stepList, stepCount, dest + firstX, hasPixels ? endX - firstX : 0);
+            else
+                SWPipelineRunSteps(stepList, stepCount, dest, w);
+        }
+    });
+
+    return result;
+}
+
+@end
@@ -18,6 +18,7 @@
 
 
 #import <Cocoa/Cocoa.h>
+#import "SWScratchCanvas.h"
 
 
 @interface SWImageTools : NSObject
@@ -25,6 +26,7 @@
 + (void)invertImage:(NSBitmapImageRep *)image;
 + (void)clearImage:(NSBitmapImageRep *)image;
 + (void)clearImage:(NSBitmapImageRep *)image inRect:(NSRect)rect;
++ (void)fillImage:(NSBitmapImageRep *)image withColor:(NSColor *)color;
 + (void)drawToImage:(NSBitmapImageRep *)dest 
           fromImage:(NSBitmapImageRep *)src
     withComposition:(BOOL)shouldCompositeOver;
@@ -32,13 +34,19 @@
           fromImage:(NSBitmapImageRep *)src 
             atPoint:(NSPoint)point
     withComposition:(BOOL)shouldCompositeOver;
++ (void)drawFlippedToImage:(NSBitmapImageRep *)dest fromCGImage:(CGImageRef)src;
 + (void)initImageRep:(NSBitmapImageRep **)imageRep withSize:(NSSize)size;
++ (void)initImageRep:(NSBitmapImageRep **)imageRep withSize:(NSSize)size cleared:(BOOL)shouldClear;
++ (void)initScratchImageRep:(NSBitmapImageRep **)imageRep
+                   withSize:(NSSize)size
+                inDirectory:(NSURL *)directory
+              residentBytes:(size_t)residentBytes;
 + (void)flipImageHorizontal:(NSBitmapImageRep *)bitmap;
 + (void)flipImageVertical:(NSBitmapImageRep *)bitmap;
++ (NSBitmapImageRep *)flippedCopyOfImage:(NSBitmapImageRep *)bitmap;
 + (NSString *)convertFileType:(NSString *)fileType;
 + (BOOL)color:(NSColor *)c1 isEqualToColor:(NSColor *)c2;
 + (void)stripImage:(NSBitmapImageRep *)imageRep ofColor:(NSColor *)color;
-+ (NSData *)readImageFromPasteboard:(NSPasteboard *)pb;
 + (NSBitmapImageRep *)cropImage:(NSBitmapImageRep *)image toRect:(NSRect)rect;
 
 // User requested feature!
@@ -48,4 +56,26 @@
 void SWLockFocus(NSBitmapImageRep *image);
 void SWUnlockFocus(NSBitmapImageRep *image);
 
+// Adds a rect to a few that are kept apart, merging it with any it overlaps.
+// Once there are capacity of them, it goes in with the last.  Returns how many
+// there are now
+NSUInteger SWAddRectToRects(NSRect rect, NSRect *rects, NSUInteger count, NSUInteger capacity);
+
+// A color as the bytes of a premultiplied pixel in one of our canvases.  Colors
+// with no RGB components, like patterns, come out clear and return NO
+BOOL SWGetPremultipliedColor(NSColor *color, uint8_t rgba[4]);
+
+// Out-of-core images only (anything else is left alone): part of the image is
+// about to be drawn in or shown, or will be soon
+void SWImageUseRect(NSBitmapImageRep *image, NSRect rect, BOOL prefetch);
+BOOL SWImageGetScratchStatistics(NSBitmapImageRep *image, SWScratchStatistics *statistics);
+
+// Runs over a 32-bit image a tile at a time, in parallel.  Tiles of a sparse
+// canvas that are one color all the way through only go through uniformOp,
+// and whatever color it returns gets mapped over them; everything else goes
+// through pixelOp
+void SWImageForEachTile(NSBitmapImageRep *image,
+                        uint32_t (^uniformOp)(uint32_t pixel),
+                        void (^pixelOp)(uint32_t *pixels, size_t count));
+
 @end
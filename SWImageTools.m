@@ -19,29 +19,129 @@
 
 #import "SWImageTools.h"
 #import "SWDocument.h"
-#import <QuartzCore/QuartzCore.h>
+#import "SWSparseCanvas.h"
+#import "SWScratchCanvas.h"
+#import "SWImagePipeline.h"
+#import <objc/runtime.h>
 
 
 @implementation SWImageTools
 
-// Uses Core Image filters to invert the colors of the image
-+ (void)invertImage:(NSBitmapImageRep *)image
+// Sparse canvases keep their memory in an NSData hung off the image rep, which
+// gives it back when the rep goes away
+static char kSWSparseStorageKey;
+
+static NSData *SWSparseStorage(NSBitmapImageRep *image)
 {
-    NSBitmapImageRep *imageRep;
-    [SWImageTools initImageRep:&imageRep withSize:image.size];
-    [SWImageTools drawToImage:imageRep fromImage:image withComposition:NO];
-    
-    CIFilter *colorInvert = [CIFilter filterWithName:@"CIColorInvert"];
-    [colorInvert setValue: [[CIImage alloc] initWithBitmapImageRep:imageRep] forKey: @"inputImage"];
-    CIImage *result = [colorInvert valueForKey: @"outputImage"];
+    NSData *storage = objc_getAssociatedObject(image, &kSWSparseStorageKey);
+    return (storage && storage.bytes == image.bitmapData) ? storage : nil;
+}
+
+
+// Out-of-core canvases keep that memory in a scratch file, which this points at
+static char kSWScratchCanvasKey;
+
+static SWScratchCanvas *SWScratchStorage(NSBitmapImageRep *image)
+{
+    if (!SWSparseStorage(image))
+        return NULL;
+    return [objc_getAssociatedObject(image, &kSWScratchCanvasKey) pointerValue];
+}
+
+
+// Makes part of a canvas's storage one color, whichever kind of storage it is
+static void SWFillStorage(NSBitmapImageRep *image, NSData *storage, size_t offset, size_t length, uint32_t pixel)
+{
+    SWScratchCanvas *scratch = SWScratchStorage(image);
+    if (scratch)
+        SWScratchCanvasFill(scratch, offset, length, pixel);
+    else
+        SWSparseCanvasFill((uint8_t *)storage.bytes + offset, length, pixel);
+}
+
+
+// Four bytes in memory order, as one pixel
+static uint32_t SWPackPixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    uint8_t bytes[4] = { r, g, b, a };
+    uint32_t pixel;
+    memcpy(&pixel, bytes, sizeof(pixel));
+    return pixel;
+}
 
-    imageRep = [[NSBitmapImageRep alloc] initWithCIImage:result];
+
+// Runs over a canvas a tile at a time, in parallel.  A tile that's one color
+// all the way through goes to uniformOp, and whatever color comes back gets
+// mapped over it without touching a pixel, so a mostly-empty canvas stays
+// mostly empty.  Every other tile goes through pixelOp.  Bitmaps that aren't
+// sparse go through pixelOp a row at a time
+void SWImageForEachTile(NSBitmapImageRep *image,
+                        uint32_t (^uniformOp)(uint32_t pixel),
+                        void (^pixelOp)(uint32_t *pixels, size_t count))
+{
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    NSData *storage = SWSparseStorage(image);
+    if (!storage)
+    {
+        unsigned char *data = image.bitmapData;
+        NSInteger bytesPerRow = image.bytesPerRow, w = image.pixelsWide;
+        dispatch_apply(image.pixelsHigh, queue, ^(size_t row) {
+            pixelOp((uint32_t *)(data + row * bytesPerRow), w);
+        });
+        return;
+    }
+    
+    uint8_t *bytes = (uint8_t *)storage.bytes;
+    size_t tileCount = storage.length / SW_SPARSE_TILE_BYTES;
+    uint32_t *newColors = malloc(tileCount * sizeof(uint32_t));
+    bool *refills = calloc(tileCount, sizeof(bool));
+    
+    dispatch_apply(tileCount, queue, ^(size_t i) {
+        uint8_t *tile = bytes + i * SW_SPARSE_TILE_BYTES;
+        uint32_t pixel;
+        if (!SWSparseCanvasTileIsUniform(tile, SW_SPARSE_TILE_BYTES, &pixel))
+            pixelOp((uint32_t *)tile, SW_SPARSE_TILE_BYTES / sizeof(uint32_t));
+        else if ((newColors[i] = uniformOp(pixel)) != pixel)
+            refills[i] = true;
+    });
     
-    [SWImageTools drawToImage:image fromImage:imageRep withComposition:NO];
+    // Neighbors that end up the same color get mapped in one go
+    for (size_t i = 0; i < tileCount; )
+    {
+        if (!refills[i])
+        {
+            i++;
+            continue;
+        }
+        size_t run = i + 1;
+        while (run < tileCount && refills[run] && newColors[run] == newColors[i])
+            run++;
+        SWFillStorage(image, storage, i * SW_SPARSE_TILE_BYTES, (run - i) * SW_SPARSE_TILE_BYTES, newColors[i]);
+        i = run;
+    }
+    
+    free(newColors);
+    free(refills);
+}
+
+
++ (void)invertImage:(NSBitmapImageRep *)image
+{
+    SWImagePipeline *pipeline = [[SWImagePipeline alloc] initWithImage:image];
+    [pipeline invert];
+    [pipeline runInPlace];
 }
 
 + (void)clearImage:(NSBitmapImageRep *)image
 {
+    // Handing the memory back is the fastest clear of all
+    NSData *storage = SWSparseStorage(image);
+    if (storage)
+    {
+        SWFillStorage(image, storage, 0, storage.length, 0);
+        return;
+    }
+    
     NSRect rect = NSMakeRect(0,0,image.pixelsWide,image.pixelsHigh);
     [SWImageTools clearImage:image inRect:rect];
 }
@@ -56,6 +156,27 @@
 }
 
 
+// Every tile of a sparse canvas shares the one tile of the color until it's
+// drawn in
++ (void)fillImage:(NSBitmapImageRep *)image withColor:(NSColor *)color
+{
+    // Pattern colors and the like have no components to share, so they get drawn
+    uint8_t rgba[4];
+    NSData *storage = SWGetPremultipliedColor(color, rgba) ? SWSparseStorage(image) : nil;
+    if (!storage)
+    {
+        SWLockFocus(image);
+        [color setFill];
+        NSRectFillUsingOperation(NSMakeRect(0, 0, image.pixelsWide, image.pixelsHigh), NSCompositingOperationCopy);
+        SWUnlockFocus(image);
+        return;
+    }
+    
+    uint32_t pixel = SWPackPixel(rgba[0], rgba[1], rgba[2], rgba[3]);
+    SWFillStorage(image, storage, 0, storage.length, pixel);
+}
+
+
 // Just calls the bigger one with a zeroed-out origin
 + (void)drawToImage:(NSBitmapImageRep *)dest 
           fromImage:(NSBitmapImageRep *)src 
@@ -87,8 +208,36 @@
 }
 
 
+// Draws a CGImage upside-down into dest, replacing every pixel. This lets us
+// decode a file straight into our flipped canvas layout in a single pass,
+// instead of copying it in and flipping it afterwards
++ (void)drawFlippedToImage:(NSBitmapImageRep *)dest fromCGImage:(CGImageRef)src
+{
+    NSInteger w = dest.pixelsWide;
+    NSInteger h = dest.pixelsHigh;
+    
+    SWLockFocus(dest);
+    CGContextRef cgContext = [NSGraphicsContext currentContext].CGContext;
+    CGContextSetBlendMode(cgContext, kCGBlendModeCopy);
+    CGContextSetInterpolationQuality(cgContext, kCGInterpolationNone);
+    CGContextTranslateCTM(cgContext, 0, h);
+    CGContextScaleCTM(cgContext, 1.0, -1.0);
+    CGContextDrawImage(cgContext, CGRectMake(0, 0, w, h), src);
+    SWUnlockFocus(dest);
+}
+
+
 + (void)flipImageHorizontal:(NSBitmapImageRep *)bitmap
 {
+    // Our own canvases just swap their pixels around, in one pass
+    if (bitmap.bitsPerPixel == 32 && !bitmap.isPlanar)
+    {
+        SWImagePipeline *pipeline = [[SWImagePipeline alloc] initWithImage:bitmap];
+        [pipeline flipHorizontal];
+        [pipeline runInPlace];
+        return;
+    }
+    
     // Make a copy of our image for using is a second
     NSBitmapImageRep *tempImage;
     [SWImageTools initImageRep:&tempImage withSize:bitmap.size];
@@ -111,6 +260,15 @@
 
 + (void)flipImageVertical:(NSBitmapImageRep *)bitmap
 {
+    // Our own canvases just swap their pixels around, in one pass
+    if (bitmap.bitsPerPixel == 32 && !bitmap.isPlanar)
+    {
+        SWImagePipeline *pipeline = [[SWImagePipeline alloc] initWithImage:bitmap];
+        [pipeline flipVertical];
+        [pipeline runInPlace];
+        return;
+    }
+    
     // Make a copy of our image for using is a second
     NSBitmapImageRep *tempImage;
     [SWImageTools initImageRep:&tempImage withSize:bitmap.size];
@@ -131,10 +289,74 @@
 }
 
 
+// Returns an upright copy of one of our flipped images, without touching the
+// original: the rows are simply read back bottom-up, in a single pass
++ (NSBitmapImageRep *)flippedCopyOfImage:(NSBitmapImageRep *)bitmap
+{
+    NSInteger w = bitmap.pixelsWide;
+    NSInteger h = bitmap.pixelsHigh;
+    
+    NSBitmapImageRep *copy;
+    [SWImageTools initImageRep:&copy withSize:NSMakeSize(w, h) cleared:NO];
+    
+    if (bitmap.bitsPerPixel != 32 || bitmap.isPlanar)
+    {
+        // Not one of ours -- let Quartz sort out the conversion
+        [SWImageTools drawFlippedToImage:copy fromCGImage:bitmap.CGImage];
+        return copy;
+    }
+    
+    unsigned char *srcData = bitmap.bitmapData;
+    unsigned char *destData = copy.bitmapData;
+    NSInteger srcRowBytes = bitmap.bytesPerRow;
+    NSInteger destRowBytes = copy.bytesPerRow;
+    
+    NSInteger row;
+    for (row = 0; row < h; row++)
+        memcpy(destData + row * destRowBytes, srcData + (h - 1 - row) * srcRowBytes, w * 4);
+    
+    return copy;
+}
+
+
 + (void)initImageRep:(NSBitmapImageRep **)imageRep withSize:(NSSize)size
+{
+    [SWImageTools initImageRep:imageRep withSize:size cleared:YES];
+}
+
+
+// Canvases come straight from the VM system, so a new one is already clear and
+// costs nothing until it's drawn in (see SWSparseCanvas.h).  If there's no
+// address space for that, AppKit allocates it, and then the clear is worth
+// skipping when the caller is about to overwrite every pixel anyway
++ (void)initImageRep:(NSBitmapImageRep **)imageRep withSize:(NSSize)size cleared:(BOOL)shouldClear
 {
     NSUInteger w = size.width;
     NSUInteger h = size.height;
+    
+    size_t bytesPerRow = w * 4;
+    size_t length = bytesPerRow * h;
+    unsigned char *planes[1] = { SWSparseCanvasAllocate(length) };
+    if (planes[0])
+    {
+        *imageRep = [[NSBitmapImageRep alloc] initWithBitmapDataPlanes: planes 
+                                                            pixelsWide: w
+                                                            pixelsHigh: h
+                                                         bitsPerSample: 8 
+                                                       samplesPerPixel: 4 
+                                                              hasAlpha: YES 
+                                                              isPlanar: NO 
+                                                        colorSpaceName: NSCalibratedRGBColorSpace 
+                                                           bytesPerRow: bytesPerRow
+                                                          bitsPerPixel: 32];
+        NSData *storage = [[NSData alloc] initWithBytesNoCopy:planes[0]
+                                                       length:SWSparseCanvasAllocationSize(length)
+                                                  deallocator:^(void *bytes, NSUInteger allocated) {
+                                                      SWSparseCanvasFree(bytes, allocated);
+                                                  }];
+        objc_setAssociatedObject(*imageRep, &kSWSparseStorageKey, storage, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        return;
+    }
 
     *imageRep = [[NSBitmapImageRep alloc] initWithBitmapDataPlanes: nil 
                                                         pixelsWide: w
@@ -147,8 +369,49 @@
                                                        bytesPerRow: 0    // "you figure it out"
                                                       bitsPerPixel: 32];
     // Initialize it to a completely transparent image
-    [SWImageTools clearImage:*imageRep];
+    if (shouldClear)
+        [SWImageTools clearImage:*imageRep];
+}
+
+
+// Same as any other canvas, but the memory is a scratch file that only keeps
+// residentBytes of itself in memory (see SWScratchCanvas.h).  Falls back on an
+// ordinary canvas if the file can't be made
++ (void)initScratchImageRep:(NSBitmapImageRep **)imageRep
+                   withSize:(NSSize)size
+                inDirectory:(NSURL *)directory
+              residentBytes:(size_t)residentBytes
+{
+    NSUInteger w = size.width;
+    NSUInteger h = size.height;
+    
+    size_t bytesPerRow = w * 4;
+    SWScratchCanvas *scratch = SWScratchCanvasCreate(directory.fileSystemRepresentation,
+                                                     SWSparseCanvasAllocationSize(bytesPerRow * h), residentBytes);
+    if (!scratch)
+    {
+        [SWImageTools initImageRep:imageRep withSize:size];
+        return;
+    }
     
+    unsigned char *planes[1] = { SWScratchCanvasBytes(scratch) };
+    *imageRep = [[NSBitmapImageRep alloc] initWithBitmapDataPlanes: planes 
+                                                        pixelsWide: w
+                                                        pixelsHigh: h
+                                                     bitsPerSample: 8 
+                                                   samplesPerPixel: 4 
+                                                          hasAlpha: YES 
+                                                          isPlanar: NO 
+                                                    colorSpaceName: NSCalibratedRGBColorSpace 
+                                                       bytesPerRow: bytesPerRow
+                                                      bitsPerPixel: 32];
+    NSData *storage = [[NSData alloc] initWithBytesNoCopy:planes[0]
+                                                   length:SWScratchCanvasLength(scratch)
+                                              deallocator:^(void *bytes, NSUInteger allocated) {
+                                                  SWScratchCanvasDestroy(scratch);
+                                              }];
+    objc_setAssociatedObject(*imageRep, &kSWSparseStorageKey, storage, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    objc_setAssociatedObject(*imageRep, &kSWScratchCanvasKey, [NSValue valueWithPointer:scratch], OBJC_ASSOCIATION_RETAIN_NONATOMIC);
 }
 
 
@@ -259,62 +522,10 @@
 // Strips an image of all the pixels of a certain color
 + (void)stripImage:(NSBitmapImageRep *)imageRep ofColor:(NSColor *)color
 {
-    // This offset will climb through the entire image
-    //int offset;
-    NSInteger samplesPerPixel = imageRep.samplesPerPixel;
-    unsigned char *bitmapData = imageRep.bitmapData;
-    
-    // Get the components of the given NSColor
-    CGFloat colorRed, colorGreen, colorBlue, colorAlpha;
-    NSColor * convertedColor = [color colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
-    [convertedColor getRed:&colorRed green:&colorGreen blue:&colorBlue alpha:&colorAlpha];
-    
-    // Scale them up
-    NSInteger r = roundf(colorRed * 255.0);
-    NSInteger g = roundf(colorGreen * 255.0);
-    NSInteger b = roundf(colorBlue * 255.0);
-    NSInteger a = roundf(colorAlpha * 255.0);
-    
-    // We can't go linearly, as 10.4+ don't always pack bytes -- it may not be contiguous!
-    // Instead, we must go row by row
-    NSInteger row, col;
-    for (row = 0; row < imageRep.pixelsHigh; row++, bitmapData += imageRep.bytesPerRow) 
-    {
-        unsigned char* p = bitmapData;
-        for (col = 0; col < imageRep.pixelsWide; col++)
-        {
-            // Next get the components at that offset
-            NSInteger red = *p;
-            NSInteger green = *(p + 1);
-            NSInteger blue = *(p + 2);
-            NSInteger alpha = *(p + 3);            
-            if ((alpha == 0 && colorAlpha == 0) ||
-                (red == r && green == g && blue == b && alpha == a))
-            {
-                *p = 0;
-                *(p + 1) = 0;
-                *(p + 2) = 0;
-                *(p + 3) = 0;
-            }
-            
-            // Increment p
-            p += samplesPerPixel;
-        }
-    }
-}
-
-
-// Used by Paste to retrieve an image from the pasteboard
-+ (NSData *)readImageFromPasteboard:(NSPasteboard *)pb
-{
-    NSData *data = nil;
-    
-    if ([pb availableTypeFromArray:@[NSPasteboardTypeTIFF]])
-        data = [pb dataForType:NSPasteboardTypeTIFF];
-    else if ([pb availableTypeFromArray:@[NSPICTPboardType]])
-        data = [pb dataForType:NSPICTPboardType];
-
-    return data;
+    // A tile at a time: the tiles that are all one color either all go, or all stay
+    SWImagePipeline *pipeline = [[SWImagePipeline alloc] initWithImage:imageRep];
+    [pipeline stripColor:color];
+    [pipeline runInPlace];
 }
 
 
@@ -340,6 +551,51 @@
     return croppedImage;
 }
 
+// Calibrated RGB, like every canvas we make
+BOOL SWGetPremultipliedColor(NSColor *color, uint8_t rgba[4])
+{
+    NSColor *rgb = [color colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+    if (!rgb)
+    {
+        memset(rgba, 0, 4);
+        return NO;
+    }
+    CGFloat r, g, b, a;
+    [rgb getRed:&r green:&g blue:&b alpha:&a];
+    rgba[0] = (uint8_t)round(r * a * 255);
+    rgba[1] = (uint8_t)round(g * a * 255);
+    rgba[2] = (uint8_t)round(b * a * 255);
+    rgba[3] = (uint8_t)round(a * 255);
+    return YES;
+}
+
+
+// Rect is in the image's own coordinates, whose y runs up from the last row
+void SWImageUseRect(NSBitmapImageRep *image, NSRect rect, BOOL prefetch)
+{
+    SWScratchCanvas *scratch = SWScratchStorage(image);
+    if (!scratch)
+        return;
+    
+    NSInteger h = image.pixelsHigh;
+    rect = NSIntersectionRect(NSIntegralRect(rect), NSMakeRect(0, 0, image.pixelsWide, h));
+    if (NSIsEmptyRect(rect))
+        return;
+    SWScratchCanvasUse(scratch, NSMinX(rect), h - NSMaxY(rect), NSWidth(rect), NSHeight(rect),
+                       4, image.bytesPerRow, prefetch);
+}
+
+
+BOOL SWImageGetScratchStatistics(NSBitmapImageRep *image, SWScratchStatistics *statistics)
+{
+    SWScratchCanvas *scratch = SWScratchStorage(image);
+    if (!scratch)
+        return NO;
+    *statistics = SWScratchCanvasGetStatistics(scratch);
+    return YES;
+}
+
+
 void SWLockFocus(NSBitmapImageRep *image)
 {
     [NSGraphicsContext saveGraphicsState];
@@ -354,4 +610,28 @@ void SWUnlockFocus(NSBitmapImageRep *image)
 }
 
 
+NSUInteger SWAddRectToRects(NSRect rect, NSRect *rects, NSUInteger count, NSUInteger capacity)
+{
+    if (NSIsEmptyRect(rect) || capacity == 0)
+        return count;
+    for (;;)
+    {
+        NSUInteger i = 0;
+        while (i < count && !NSIntersectsRect(rects[i], rect))
+            i++;
+        if (i == count && count < capacity)
+            break;
+        
+        // What it's merged with comes out, since the two together may overlap
+        // one that neither did
+        if (i == count)
+            i = count - 1;
+        rect = NSUnionRect(rect, rects[i]);
+        rects[i] = rects[--count];
+    }
+    rects[count] = rect;
+    return count + 1;
+}
+
+
 @end
@@ -0,0 +1,33 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+
+// Our own baseline JPEG encoder.  Every row of 16x16 blocks ends with a restart
+// marker, which resets the encoder's state, so the rows can all be encoded at
+// the same time on different cores and simply joined together afterwards.
+@interface SWJPEGWriter : NSObject
+
+// Expects an upright (not flipped) 8-bit RGBA image, like the ones made by
+// +[SWImageTools flippedCopyOfImage:].  Quality goes from 0 to 1, like the
+// save panel's slider.  Transparent areas come out white
++ (NSData *)JPEGDataFromImage:(NSBitmapImageRep *)image quality:(CGFloat)quality;
+
+@end
@@ -0,0 +1,523 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWJPEGWriter.h"
+
+// Chroma is subsampled 2x2, so each MCU covers 16x16 pixels: four luma blocks,
+// one Cb and one Cr
+#define kSWJPEGMCUSize      16
+
+// The standard tables from Annex K of the JPEG spec, in natural order.  The
+// quality setting scales them the same way the IJG library does
+static const unsigned char kSWJPEGLumaQuant[64] = {
+    16,  11,  10,  16,  24,  40,  51,  61,
+    12,  12,  14,  19,  26,  58,  60,  55,
+    14,  13,  16,  24,  40,  57,  69,  56,
+    14,  17,  22,  29,  51,  87,  80,  62,
+    18,  22,  37,  56,  68, 109, 103,  77,
+    24,  35,  55,  64,  81, 104, 113,  92,
+    49,  64,  78,  87, 103, 121, 120, 101,
+    72,  92,  95,  98, 112, 100, 103,  99,
+};
+
+static const unsigned char kSWJPEGChromaQuant[64] = {
+    17,  18,  24,  47,  99,  99,  99,  99,
+    18,  21,  26,  66,  99,  99,  99,  99,
+    24,  26,  56,  99,  99,  99,  99,  99,
+    47,  66,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+    99,  99,  99,  99,  99,  99,  99,  99,
+};
+
+// Natural-order position of each coefficient in zigzag order
+static const unsigned char kSWJPEGZigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Scale factors folded into the quantizer by the AAN forward DCT
+static const float kSWJPEGAANScale[8] = {
+    1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+    1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+};
+
+// The standard Huffman tables, also from Annex K: code counts per length, then
+// the symbols in code order
+static const unsigned char kSWJPEGDCLumaBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char kSWJPEGDCChromaBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char kSWJPEGDCValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const unsigned char kSWJPEGACLumaBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const unsigned char kSWJPEGACLumaValues[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+static const unsigned char kSWJPEGACChromaBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char kSWJPEGACChromaValues[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+typedef struct SWJPEGHuffman {
+    uint16_t code[256];
+    unsigned char length[256];
+} SWJPEGHuffman;
+
+// Everything the band workers share.  None of it changes once encoding starts
+typedef struct SWJPEGEncoder {
+    const unsigned char *pixels;        // Premultiplied RGBA, top row first
+    NSInteger rowBytes;
+    NSInteger width;
+    NSInteger height;
+
+    unsigned char quant[2][64];         // Luma and chroma, natural order
+    float divisors[2][64];              // Reciprocals, in the DCT's (transposed) order
+    unsigned char zigzag[64];           // Zigzag order, in the DCT's order
+    SWJPEGHuffman dc[2];
+    SWJPEGHuffman ac[2];
+} SWJPEGEncoder;
+
+// One band's entropy-coded data
+typedef struct SWJPEGBand {
+    unsigned char *bytes;
+    size_t length;
+    size_t capacity;
+    uint32_t bits;
+    NSInteger bitCount;
+} SWJPEGBand;
+
+
+// Builds the code for each symbol from the counts per code length (Annex C)
+static void SWJPEGBuildHuffman(SWJPEGHuffman *table, const unsigned char *bits, const unsigned char *values)
+{
+    memset(table, 0, sizeof(SWJPEGHuffman));
+    uint16_t code = 0;
+    NSInteger k = 0;
+    for (NSInteger length = 1; length <= 16; length++)
+    {
+        for (NSInteger i = 0; i < bits[length - 1]; i++, k++)
+        {
+            table->code[values[k]] = code++;
+            table->length[values[k]] = length;
+        }
+        code <<= 1;
+    }
+}
+
+
+static void SWJPEGSetUp(SWJPEGEncoder *encoder, CGFloat quality)
+{
+    // IJG scaling: 50 uses the tables as they are, 100 is all ones
+    NSInteger q = MAX(1, MIN(100, (NSInteger)lround(quality * 100)));
+    NSInteger scale = (q < 50) ? 5000 / q : 200 - 2 * q;
+
+    for (NSInteger i = 0; i < 64; i++)
+    {
+        encoder->quant[0][i] = MAX(1, MIN(255, (kSWJPEGLumaQuant[i] * scale + 50) / 100));
+        encoder->quant[1][i] = MAX(1, MIN(255, (kSWJPEGChromaQuant[i] * scale + 50) / 100));
+    }
+
+    // The DCT leaves its output transposed and scaled, so the quantizer undoes
+    // both at once
+    for (NSInteger v = 0; v < 8; v++)
+    {
+        for (NSInteger u = 0; u < 8; u++)
+        {
+            float aan = kSWJPEGAANScale[v] * kSWJPEGAANScale[u] * 8.0f;
+            encoder->divisors[0][u * 8 + v] = 1.0f / (encoder->quant[0][v * 8 + u] * aan);
+            encoder->divisors[1][u * 8 + v] = 1.0f / (encoder->quant[1][v * 8 + u] * aan);
+        }
+    }
+    for (NSInteger k = 0; k < 64; k++)
+        encoder->zigzag[k] = (kSWJPEGZigzag[k] % 8) * 8 + kSWJPEGZigzag[k] / 8;
+
+    SWJPEGBuildHuffman(&encoder->dc[0], kSWJPEGDCLumaBits, kSWJPEGDCValues);
+    SWJPEGBuildHuffman(&encoder->dc[1], kSWJPEGDCChromaBits, kSWJPEGDCValues);
+    SWJPEGBuildHuffman(&encoder->ac[0], kSWJPEGACLumaBits, kSWJPEGACLumaValues);
+    SWJPEGBuildHuffman(&encoder->ac[1], kSWJPEGACChromaBits, kSWJPEGACChromaValues);
+}
+
+
+// One pass of the AAN 8-point DCT down each of the 8 columns.  The columns are
+// independent lanes, so the compiler does all 8 at once with vector math
+static inline void SWJPEGDCTColumns(float *d)
+{
+    for (NSInteger i = 0; i < 8; i++)
+    {
+        float tmp0 = d[i] + d[56 + i];
+        float tmp7 = d[i] - d[56 + i];
+        float tmp1 = d[8 + i] + d[48 + i];
+        float tmp6 = d[8 + i] - d[48 + i];
+        float tmp2 = d[16 + i] + d[40 + i];
+        float tmp5 = d[16 + i] - d[40 + i];
+        float tmp3 = d[24 + i] + d[32 + i];
+        float tmp4 = d[24 + i] - d[32 + i];
+
+        // Even part
+        float tmp10 = tmp0 + tmp3;
+        float tmp13 = tmp0 - tmp3;
+        float tmp11 = tmp1 + tmp2;
+        float tmp12 = tmp1 - tmp2;
+
+        d[i] = tmp10 + tmp11;
+        d[32 + i] = tmp10 - tmp11;
+
+        float z1 = (tmp12 + tmp13) * 0.707106781f;
+        d[16 + i] = tmp13 + z1;
+        d[48 + i] = tmp13 - z1;
+
+        // Odd part
+        tmp10 = tmp4 + tmp5;
+        tmp11 = tmp5 + tmp6;
+        tmp12 = tmp6 + tmp7;
+
+        float z5 = (tmp10 - tmp12) * 0.382683433f;
+        float z2 = 0.541196100f * tmp10 + z5;
+        float z4 = 1.306562965f * tmp12 + z5;
+        float z3 = tmp11 * 0.707106781f;
+
+        float z11 = tmp7 + z3;
+        float z13 = tmp7 - z3;
+
+        d[40 + i] = z13 + z2;
+        d[24 + i] = z13 - z2;
+        d[8 + i] = z11 + z4;
+        d[56 + i] = z11 - z4;
+    }
+}
+
+
+// Forward DCT and quantization of one level-shifted block.  Doing the columns,
+// transposing, and doing the columns again leaves the result transposed, which
+// the divisors and zigzag table already account for
+static void SWJPEGTransformBlock(float *block, const float *divisors, int *coefficients)
+{
+    SWJPEGDCTColumns(block);
+
+    for (NSInteger y = 0; y < 8; y++)
+    {
+        for (NSInteger x = y + 1; x < 8; x++)
+        {
+            float swap = block[y * 8 + x];
+            block[y * 8 + x] = block[x * 8 + y];
+            block[x * 8 + y] = swap;
+        }
+    }
+
+    SWJPEGDCTColumns(block);
+
+    for (NSInteger i = 0; i < 64; i++)
+        coefficients[i] = (int)lroundf(block[i] * divisors[i]);
+}
+
+
+static void SWJPEGPutByte(SWJPEGBand *band, unsigned char byte)
+{
+    if (band->length + 2 > band->capacity)
+    {
+        band->capacity *= 2;
+        band->bytes = realloc(band->bytes, band->capacity);
+    }
+
+    // A 0xFF in the entropy-coded data has to be followed by a zero, so it
+    // isn't mistaken for a marker
+    band->bytes[band->length++] = byte;
+    if (byte == 0xFF)
+        band->bytes[band->length++] = 0;
+}
+
+
+static inline void SWJPEGPutBits(SWJPEGBand *band, uint32_t bits, NSInteger count)
+{
+    band->bits = (band->bits << count) | (bits & ((1u << count) - 1));
+    band->bitCount += count;
+    while (band->bitCount >= 8)
+    {
+        band->bitCount -= 8;
+        SWJPEGPutByte(band, (band->bits >> band->bitCount) & 0xFF);
+    }
+}
+
+
+// Number of bits needed for a coefficient's magnitude
+static inline NSInteger SWJPEGBitLength(int value)
+{
+    unsigned int magnitude = (value < 0) ? -value : value;
+    return magnitude ? 32 - __builtin_clz(magnitude) : 0;
+}
+
+
+static void SWJPEGEncodeBlock(SWJPEGBand *band, const int *coefficients, int *previousDC,
+                              const unsigned char *zigzag, const SWJPEGHuffman *dc, const SWJPEGHuffman *ac)
+{
+    int diff = coefficients[0] - *previousDC;
+    *previousDC = coefficients[0];
+
+    // Negative values are sent as their ones' complement
+    NSInteger length = SWJPEGBitLength(diff);
+    SWJPEGPutBits(band, dc->code[length], dc->length[length]);
+    if (length)
+        SWJPEGPutBits(band, (diff < 0) ? diff - 1 : diff, length);
+
+    NSInteger run = 0;
+    for (NSInteger k = 1; k < 64; k++)
+    {
+        int value = coefficients[zigzag[k]];
+        if (value == 0)
+        {
+            run++;
+            continue;
+        }
+
+        // 0xF0 stands for sixteen zeroes in a row
+        for (; run > 15; run -= 16)
+            SWJPEGPutBits(band, ac->code[0xF0], ac->length[0xF0]);
+
+        length = SWJPEGBitLength(value);
+        NSInteger symbol = (run << 4) | length;
+        SWJPEGPutBits(band, ac->code[symbol], ac->length[symbol]);
+        SWJPEGPutBits(band, (value < 0) ? value - 1 : value, length);
+        run = 0;
+    }
+
+    // End of block
+    if (run > 0)
+        SWJPEGPutBits(band, ac->code[0x00], ac->length[0x00]);
+}
+
+
+// Encodes one row of MCUs.  Each band starts right after a restart marker, so
+// the DC predictions start over from zero
+static void SWJPEGEncodeBand(const SWJPEGEncoder *encoder, NSInteger mcuRow, SWJPEGBand *band)
+{
+    NSInteger width = encoder->width;
+    NSInteger mcuCount = (width + kSWJPEGMCUSize - 1) / kSWJPEGMCUSize;
+    int previousDC[3] = { 0, 0, 0 };
+
+    band->capacity = MAX(mcuCount * 128, 1024);
+    band->bytes = malloc(band->capacity);
+
+    float red[256], green[256], blue[256];
+    float luma[256];
+    float block[64];
+    int coefficients[64];
+
+    for (NSInteger mcu = 0; mcu < mcuCount; mcu++)
+    {
+        // Gather the MCU's pixels, repeating the last row and column past the
+        // edges.  Premultiplied colors composite over white by adding 255 - a
+        for (NSInteger row = 0; row < kSWJPEGMCUSize; row++)
+        {
+            NSInteger y = MIN(mcuRow * kSWJPEGMCUSize + row, encoder->height - 1);
+            const unsigned char *src = encoder->pixels + y * encoder->rowBytes;
+            for (NSInteger col = 0; col < kSWJPEGMCUSize; col++)
+            {
+                const unsigned char *p = src + 4 * MIN(mcu * kSWJPEGMCUSize + col, width - 1);
+                float white = 255 - p[3];
+                red[row * 16 + col] = p[0] + white;
+                green[row * 16 + col] = p[1] + white;
+                blue[row * 16 + col] = p[2] + white;
+            }
+        }
+
+        // Color conversion, level-shifted for the DCT.  Plain arithmetic over
+        // flat arrays, which vectorizes nicely
+        for (NSInteger i = 0; i < 256; i++)
+            luma[i] = 0.299f * red[i] + 0.587f * green[i] + 0.114f * blue[i] - 128.0f;
+
+        for (NSInteger b = 0; b < 4; b++)
+        {
+            const float *origin = luma + (b / 2) * 128 + (b % 2) * 8;
+            for (NSInteger row = 0; row < 8; row++)
+                memcpy(block + row * 8, origin + row * 16, 8 * sizeof(float));
+            SWJPEGTransformBlock(block, encoder->divisors[0], coefficients);
+            SWJPEGEncodeBlock(band, coefficients, &previousDC[0], encoder->zigzag, &encoder->dc[0], &encoder->ac[0]);
+        }
+
+        // Chroma: average each 2x2 square first
+        for (NSInteger component = 1; component <= 2; component++)
+        {
+            float kr = (component == 1) ? -0.168736f : 0.5f;
+            float kg = (component == 1) ? -0.331264f : -0.418688f;
+            float kb = (component == 1) ? 0.5f : -0.081312f;
+            for (NSInteger row = 0; row < 8; row++)
+            {
+                for (NSInteger col = 0; col < 8; col++)
+                {
+                    NSInteger i = row * 32 + col * 2;
+                    float r = red[i] + red[i + 1] + red[i + 16] + red[i + 17];
+                    float g = green[i] + green[i + 1] + green[i + 16] + green[i + 17];
+                    float b = blue[i] + blue[i + 1] + blue[i + 16] + blue[i + 17];
+                    block[row * 8 + col] = 0.25f * (kr * r + kg * g + kb * b);
+                }
+            }
+            SWJPEGTransformBlock(block, encoder->divisors[1], coefficients);
+            SWJPEGEncodeBlock(band, coefficients, &previousDC[component], encoder->zigzag,
+                              &encoder->dc[1], &encoder->ac[1]);
+        }
+    }
+
+    // Pad the last byte with ones
+    if (band->bitCount > 0)
+        SWJPEGPutBits(band, 0xFF, 8 - band->bitCount);
+}
+
+
+static void SWJPEGAppendMarker(NSMutableData *data, unsigned char marker, const void *payload, NSInteger length)
+{
+    unsigned char header[4] = { 0xFF, marker, (length + 2) >> 8, (length + 2) & 0xFF };
+    [data appendBytes:header length:sizeof(header)];
+    [data appendBytes:payload length:length];
+}
+
+
+static void SWJPEGAppendHuffman(NSMutableData *data, unsigned char tableClassAndID,
+                                const unsigned char *bits, const unsigned char *values)
+{
+    unsigned char payload[1 + 16 + 162];
+    NSInteger count = 0;
+    payload[0] = tableClassAndID;
+    for (NSInteger i = 0; i < 16; i++)
+    {
+        payload[1 + i] = bits[i];
+        count += bits[i];
+    }
+    memcpy(payload + 17, values, count);
+    SWJPEGAppendMarker(data, 0xC4, payload, 17 + count);
+}
+
+
+@implementation SWJPEGWriter
+
++ (NSData *)JPEGDataFromImage:(NSBitmapImageRep *)image quality:(CGFloat)quality
+{
+    NSInteger w = image.pixelsWide;
+    NSInteger h = image.pixelsHigh;
+    if (w == 0 || h == 0)
+        return nil;
+
+    // We only know how to deal with our own kind of image, and JPEG dimensions
+    // are 16-bit
+    if (image.bitsPerPixel != 32 || image.samplesPerPixel != 4 || image.isPlanar ||
+        (image.bitmapFormat & (NSBitmapFormatAlphaFirst | NSBitmapFormatAlphaNonpremultiplied | NSBitmapFormatFloatingPointSamples)) ||
+        w > UINT16_MAX || h > UINT16_MAX)
+        return [image representationUsingType:NSBitmapImageFileTypeJPEG
+                                   properties:@{NSImageCompressionFactor: @(quality)}];
+
+    SWJPEGEncoder *encoder = calloc(1, sizeof(SWJPEGEncoder));
+    encoder->pixels = image.bitmapData;
+    encoder->rowBytes = image.bytesPerRow;
+    encoder->width = w;
+    encoder->height = h;
+    SWJPEGSetUp(encoder, quality);
+
+    NSInteger bandCount = (h + kSWJPEGMCUSize - 1) / kSWJPEGMCUSize;
+    NSInteger mcusPerRow = (w + kSWJPEGMCUSize - 1) / kSWJPEGMCUSize;
+    SWJPEGBand *bands = calloc(bandCount, sizeof(SWJPEGBand));
+    dispatch_apply(bandCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        SWJPEGEncodeBand(encoder, i, &bands[i]);
+    });
+
+    size_t scanLength = 0;
+    for (NSInteger i = 0; i < bandCount; i++)
+        scanLength += bands[i].length + 2;
+
+    // Now stitch the file together
+    NSMutableData *data = [NSMutableData dataWithCapacity:scanLength + 1024];
+    const unsigned char startOfImage[2] = { 0xFF, 0xD8 };
+    [data appendBytes:startOfImage length:2];
+
+    // JFIF, version 1.1, 72 DPI
+    const unsigned char jfif[14] = { 'J', 'F', 'I', 'F', 0, 1, 1, 1, 0, 72, 0, 72, 0, 0 };
+    SWJPEGAppendMarker(data, 0xE0, jfif, sizeof(jfif));
+
+    // Quantization tables go out in zigzag order
+    for (NSInteger table = 0; table < 2; table++)
+    {
+        unsigned char payload[65];
+        payload[0] = table;
+        for (NSInteger k = 0; k < 64; k++)
+            payload[1 + k] = encoder->quant[table][kSWJPEGZigzag[k]];
+        SWJPEGAppendMarker(data, 0xDB, payload, sizeof(payload));
+    }
+
+    // Baseline frame: Y at 2x2, Cb and Cr at 1x1
+    const unsigned char frame[15] = {
+        8, h >> 8, h & 0xFF, w >> 8, w & 0xFF, 3,
+        1, 0x22, 0,
+        2, 0x11, 1,
+        3, 0x11, 1,
+    };
+    SWJPEGAppendMarker(data, 0xC0, frame, sizeof(frame));
+
+    SWJPEGAppendHuffman(data, 0x00, kSWJPEGDCLumaBits, kSWJPEGDCValues);
+    SWJPEGAppendHuffman(data, 0x10, kSWJPEGACLumaBits, kSWJPEGACLumaValues);
+    SWJPEGAppendHuffman(data, 0x01, kSWJPEGDCChromaBits, kSWJPEGDCValues);
+    SWJPEGAppendHuffman(data, 0x11, kSWJPEGACChromaBits, kSWJPEGACChromaValues);
+
+    // A restart after every row of MCUs
+    const unsigned char restart[2] = { mcusPerRow >> 8, mcusPerRow & 0xFF };
+    SWJPEGAppendMarker(data, 0xDD, restart, sizeof(restart));
+
+    const unsigned char scan[10] = { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+    SWJPEGAppendMarker(data, 0xDA, scan, sizeof(scan));
+
+    for (NSInteger i = 0; i < bandCount; i++)
+    {
+        [data appendBytes:bands[i].bytes length:bands[i].length];
+        if (i < bandCount - 1)
+        {
+            const unsigned char marker[2] = { 0xFF, 0xD0 + (i & 7) };
+            [data appendBytes:marker length:2];
+        }
+        free(bands[i].bytes);
+    }
+
+    const unsigned char endOfImage[2] = { 0xFF, 0xD9 };
+    [data appendBytes:endOfImage length:2];
+
+    free(bands);
+    free(encoder);
+    return data;
+}
+
+@end
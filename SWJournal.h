@@ -0,0 +1,81 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+
+// An append-only record of a document's edits, kept on disk until the document
+// is saved or closed.  It starts with a checkpoint (every 64x64 tile of every
+// layer, and how each is blended) and every edit after that adds only the tiles
+// it changed in the layer it drew in, along with the tool and settings that
+// made it.  Every so often the whole thing is replaced by a fresh checkpoint,
+// so it never grows far beyond the canvas.
+//
+// If Paintbrush dies with edits in flight, the journals it leaves behind are
+// replayed at the next launch to bring those canvases back.
+@interface SWJournal : NSObject
+{
+    NSURL *url;
+    int fileDescriptor;
+    dispatch_queue_t queue;     // Compression and writing happen here, in order
+
+    NSInteger width;
+    NSInteger height;
+    NSInteger tilesWide;
+    NSInteger tilesHigh;
+
+    NSUInteger operationsSinceCheckpoint;
+    NSUInteger tilesSinceCheckpoint;
+
+    NSArray *journaledLayers;   // The stack as of the last record
+    NSData *journaledStack;     // And its settings, as written
+}
+
+// Journals that nobody in this process is writing to: what's left of a crash
++ (NSArray *)abandonedJournalURLs;
+
+// New SWLayers with flipped images, bottom first, as of the last complete
+// record, or nil.  Index is set to the one that was being drawn in
++ (NSArray *)layersByReplayingJournalAtURL:(NSURL *)url activeLayerIndex:(NSUInteger *)index;
+
+// Starts a new journal with a checkpoint of every layer
+- (instancetype)initWithLayers:(NSArray *)layers activeLayerIndex:(NSUInteger)index NS_DESIGNATED_INITIALIZER;
+
+// Appends the tiles of the active layer under the dirty rects, which have to
+// cover everything drawn since the last record, and the settings of every
+// layer.  Points are the stroke that made the edit, as NSPoints, and may be
+// nil.  Rects are NSRects in the canvas's own coordinates, like the tools', and
+// nil means the whole layer.  Layers are the data source's, bottom first: if
+// any were added, taken away, moved or resized, a fresh checkpoint is taken
+- (void)recordOperation:(NSString *)name
+              lineWidth:(CGFloat)lineWidth
+              fillStyle:(NSInteger)fillStyle
+             foreground:(NSColor *)foreground
+             background:(NSColor *)background
+                 points:(NSData *)points
+             dirtyRects:(NSData *)rects
+                 layers:(NSArray *)layers
+       activeLayerIndex:(NSUInteger)index;
+
+// Deletes the journal: its edits are safe elsewhere, or not wanted
+- (void)discard;
+
+@property (readonly) NSURL *URL;
+
+@end
@@ -0,0 +1,919 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWJournal.h"
+#import "SWLayer.h"
+#import <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// The file is a header followed by records:
+//
+//   header:      "PBJ1", u32 version
+//   record:      u32 length, u8 type, payload (length - 1 bytes), u32 CRC of type + payload
+//   checkpoint:  u32 width, u32 height, stack, then every tile of every layer,
+//                bottom layer first, as u32 length + zlib data
+//   operation:   u16 length + tool name, f32 line width, u8 fill style,
+//                f32 foreground RGBA, f32 background RGBA, u32 count + f32 x/y pairs,
+//                stack, u32 count, then each dirty tile of the active layer as
+//                u32 index, u32 length + zlib data
+//   stack:       u32 layer count, u32 active layer, then for each layer from the
+//                bottom: u32 identifier, u16 length + name, f32 opacity,
+//                u8 visible, u8 blend mode
+//
+// Everything is little-endian.  Tiles are stored just like the canvas: rows of
+// premultiplied RGBA, bottom row first.  An operation's stack has to have the
+// same layers as the checkpoint before it; only their settings can change.  A
+// record that was only half written when we crashed fails its CRC, and replay
+// stops right before it.
+
+#define kSWJournalMagic             "PBJ1"
+#define kSWJournalVersion           2
+#define kSWJournalHeaderSize        8
+
+#define kSWJournalCheckpoint        1
+#define kSWJournalOperation         2
+
+#define kSWJournalTileSize          64
+
+// How many different one-color tiles a checkpoint compresses once and shares
+#define kSWJournalSharedColors      8
+
+// A fresh checkpoint replaces the journal after this many edits, or once the
+// edits since the last one have rewritten the canvas twice over, so replay never
+// has far to go
+#define kSWJournalCheckpointOperations  100
+#define kSWJournalCheckpointCoverage    2
+
+// Nothing legitimate is bigger than this, so a larger size means garbage
+#define kSWJournalMaxDimension      32768
+#define kSWJournalMaxLayers         1024
+
+
+static NSMutableSet *SWJournalLivePaths(void)
+{
+    static NSMutableSet *livePaths = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        livePaths = [NSMutableSet set];
+    });
+    return livePaths;
+}
+
+
+static NSURL *SWJournalDirectoryURL(void)
+{
+    NSString *folder = @"~/Library/Application Support/Paintbrush/Journals/".stringByExpandingTildeInPath;
+    [[NSFileManager defaultManager] createDirectoryAtPath:folder
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:NULL];
+    return [NSURL fileURLWithPath:folder isDirectory:YES];
+}
+
+
+#pragma mark Reading and writing records
+
+static inline void SWJournalAppend8(NSMutableData *data, uint8_t value)
+{
+    [data appendBytes:&value length:1];
+}
+
+
+static inline void SWJournalAppend16(NSMutableData *data, uint16_t value)
+{
+    uint16_t le = CFSwapInt16HostToLittle(value);
+    [data appendBytes:&le length:2];
+}
+
+
+static inline void SWJournalAppend32(NSMutableData *data, uint32_t value)
+{
+    uint32_t le = CFSwapInt32HostToLittle(value);
+    [data appendBytes:&le length:4];
+}
+
+
+static inline void SWJournalAppendFloat(NSMutableData *data, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    SWJournalAppend32(data, bits);
+}
+
+
+static inline uint32_t SWJournalRead32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+// Walks through a record's payload, refusing to step past its end
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    BOOL failed;
+} SWJournalCursor;
+
+
+static const unsigned char *SWJournalTake(SWJournalCursor *cursor, size_t length)
+{
+    if (cursor->failed || (size_t)(cursor->end - cursor->p) < length)
+    {
+        cursor->failed = YES;
+        return NULL;
+    }
+    const unsigned char *p = cursor->p;
+    cursor->p += length;
+    return p;
+}
+
+
+static uint32_t SWJournalTake32(SWJournalCursor *cursor)
+{
+    const unsigned char *p = SWJournalTake(cursor, 4);
+    return p ? SWJournalRead32(p) : 0;
+}
+
+
+static uint16_t SWJournalTake16(SWJournalCursor *cursor)
+{
+    const unsigned char *p = SWJournalTake(cursor, 2);
+    return p ? (p[0] | (p[1] << 8)) : 0;
+}
+
+
+// Leaves room for the length, which gets filled in by SWJournalEndRecord
+static NSMutableData *SWJournalBeginRecord(uint8_t type, NSUInteger capacity)
+{
+    NSMutableData *record = [NSMutableData dataWithCapacity:capacity + 9];
+    SWJournalAppend32(record, 0);
+    SWJournalAppend8(record, type);
+    return record;
+}
+
+
+static void SWJournalEndRecord(NSMutableData *record)
+{
+    uint32_t length = (uint32_t)(record.length - 4);
+    uint32_t le = CFSwapInt32HostToLittle(length);
+    [record replaceBytesInRange:NSMakeRange(0, 4) withBytes:&le];
+
+    uLong crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)record.bytes + 4, length);
+    SWJournalAppend32(record, (uint32_t)crc);
+}
+
+
+static NSData *SWJournalHeader(void)
+{
+    NSMutableData *header = [NSMutableData dataWithBytes:kSWJournalMagic length:4];
+    SWJournalAppend32(header, kSWJournalVersion);
+    return header;
+}
+
+
+static BOOL SWJournalWriteAll(int fd, NSData *data)
+{
+    const unsigned char *p = data.bytes;
+    size_t remaining = data.length;
+    while (remaining > 0)
+    {
+        ssize_t written = write(fd, p, remaining);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return NO;
+        }
+        p += written;
+        remaining -= written;
+    }
+    return YES;
+}
+
+
+#pragma mark Tiles
+
+typedef struct {
+    NSInteger x, y;             // In memory rows, so y = 0 is the canvas's bottom
+    NSInteger width, height;
+} SWJournalTileRect;
+
+
+static inline SWJournalTileRect SWJournalRectOfTile(NSInteger index, NSInteger tilesWide,
+                                                    NSInteger width, NSInteger height)
+{
+    SWJournalTileRect rect;
+    rect.x = (index % tilesWide) * kSWJournalTileSize;
+    rect.y = (index / tilesWide) * kSWJournalTileSize;
+    rect.width = MIN(kSWJournalTileSize, width - rect.x);
+    rect.height = MIN(kSWJournalTileSize, height - rect.y);
+    return rect;
+}
+
+
+static void SWJournalCopyTileOut(const unsigned char *bitmap, NSInteger rowBytes,
+                                 SWJournalTileRect rect, unsigned char *tile)
+{
+    size_t tileRowBytes = rect.width * 4;
+    for (NSInteger row = 0; row < rect.height; row++)
+        memcpy(tile + row * tileRowBytes, bitmap + (rect.y + row) * rowBytes + rect.x * 4, tileRowBytes);
+}
+
+
+static void SWJournalCopyTileIn(const unsigned char *tile, SWJournalTileRect rect,
+                                unsigned char *bitmap, NSInteger rowBytes)
+{
+    size_t tileRowBytes = rect.width * 4;
+    for (NSInteger row = 0; row < rect.height; row++)
+        memcpy(bitmap + (rect.y + row) * rowBytes + rect.x * 4, tile + row * tileRowBytes, tileRowBytes);
+}
+
+
+// Whether every pixel of a tile is the same, and which.  Blank and filled parts
+// of a sparse canvas are only ever read here, so they never become real memory
+static BOOL SWJournalTileIsUniform(const unsigned char *bitmap, NSInteger rowBytes, SWJournalTileRect rect,
+                                   uint32_t *pixel)
+{
+    uint32_t first = *((const uint32_t *)(bitmap + rect.y * rowBytes) + rect.x);
+    for (NSInteger row = 0; row < rect.height; row++)
+    {
+        const uint32_t *pixels = (const uint32_t *)(bitmap + (rect.y + row) * rowBytes) + rect.x;
+        for (NSInteger x = 0; x < rect.width; x++)
+            if (pixels[x] != first)
+                return NO;
+    }
+    *pixel = first;
+    return YES;
+}
+
+
+// Marks the tiles under a rect in the canvas's own coordinates, which run the
+// other way from memory rows.  A pixel of slack on every side covers whatever a
+// tool's antialiasing spilled past the rect it reported
+static void SWJournalMarkTilesInRect(NSRect rect, NSInteger width, NSInteger height, NSInteger tilesWide,
+                                     BOOL *dirty)
+{
+    rect = NSIntersectionRect(NSInsetRect(NSIntegralRect(rect), -1.0, -1.0), NSMakeRect(0, 0, width, height));
+    if (NSIsEmptyRect(rect))
+        return;
+
+    NSInteger x0 = (NSInteger)NSMinX(rect) / kSWJournalTileSize;
+    NSInteger x1 = ((NSInteger)NSMaxX(rect) - 1) / kSWJournalTileSize;
+    NSInteger y0 = (height - (NSInteger)NSMaxY(rect)) / kSWJournalTileSize;
+    NSInteger y1 = (height - (NSInteger)NSMinY(rect) - 1) / kSWJournalTileSize;
+    for (NSInteger ty = y0; ty <= y1; ty++)
+        for (NSInteger tx = x0; tx <= x1; tx++)
+            dirty[ty * tilesWide + tx] = YES;
+}
+
+
+typedef struct {
+    unsigned char *bytes;
+    uLongf length;
+} SWJournalPackedTile;
+
+
+// Speed matters far more than size here: this runs after every edit
+static void SWJournalCompress(const unsigned char *bytes, size_t length, SWJournalPackedTile *packed)
+{
+    packed->length = compressBound(length);
+    packed->bytes = malloc(packed->length);
+    if (compress2(packed->bytes, &packed->length, bytes, length, Z_BEST_SPEED) != Z_OK)
+        packed->length = 0;
+}
+
+
+// A tile of a checkpoint, as it was when the checkpoint was taken.  Tiles that
+// are one color all the way through keep just the color, and only the first of
+// each color and size gets compressed: the rest share its bytes
+typedef struct {
+    unsigned char *pixels;      // NULL if uniform
+    uint32_t pixel;
+    NSInteger sharedWith;       // An earlier tile with the same bytes, or -1
+} SWJournalCheckpointTile;
+
+
+// Takes what the checkpoint needs from the canvas, on every core.  Only tiles
+// with something drawn in them get copied
+static SWJournalCheckpointTile *SWJournalCaptureCheckpoint(NSBitmapImageRep *image, NSInteger tilesWide,
+                                                           NSInteger tileCount)
+{
+    const unsigned char *bitmap = image.bitmapData;
+    NSInteger rowBytes = image.bytesPerRow, width = image.pixelsWide, height = image.pixelsHigh;
+
+    SWJournalCheckpointTile *tiles = calloc(tileCount, sizeof(SWJournalCheckpointTile));
+    dispatch_apply(tileCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        SWJournalTileRect rect = SWJournalRectOfTile(i, tilesWide, width, height);
+        tiles[i].sharedWith = -1;
+        if (SWJournalTileIsUniform(bitmap, rowBytes, rect, &tiles[i].pixel))
+            return;
+        tiles[i].pixels = malloc(rect.width * rect.height * 4);
+        SWJournalCopyTileOut(bitmap, rowBytes, rect, tiles[i].pixels);
+    });
+
+    // Tiles of one color and size compress to the same bytes, so each only gets
+    // compressed once.  A handful of colors covers a canvas that's mostly background
+    NSInteger representatives[kSWJournalSharedColors], representativeCount = 0;
+    for (NSInteger i = 0; i < tileCount; i++)
+    {
+        if (tiles[i].pixels)
+            continue;
+        SWJournalTileRect rect = SWJournalRectOfTile(i, tilesWide, width, height);
+        for (NSInteger k = 0; k < representativeCount && tiles[i].sharedWith < 0; k++)
+        {
+            NSInteger j = representatives[k];
+            SWJournalTileRect other = SWJournalRectOfTile(j, tilesWide, width, height);
+            if (tiles[j].pixel == tiles[i].pixel && other.width == rect.width && other.height == rect.height)
+                tiles[i].sharedWith = j;
+        }
+        if (tiles[i].sharedWith < 0 && representativeCount < kSWJournalSharedColors)
+            representatives[representativeCount++] = i;
+    }
+    return tiles;
+}
+
+
+// Every layer, tile by tile, compressed on every core.  Frees the tiles
+static NSData *SWJournalCheckpointRecord(SWJournalCheckpointTile **layerTiles, NSUInteger layerCount,
+                                         NSData *stack, NSInteger width, NSInteger height)
+{
+    NSInteger tilesWide = (width + kSWJournalTileSize - 1) / kSWJournalTileSize;
+    NSInteger tilesHigh = (height + kSWJournalTileSize - 1) / kSWJournalTileSize;
+    NSInteger tileCount = tilesWide * tilesHigh;
+
+    // One after another, so a tile's number here is its layer's first plus its own
+    SWJournalPackedTile *packed = calloc(layerCount * tileCount, sizeof(SWJournalPackedTile));
+    dispatch_apply(layerCount * tileCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t k) {
+        SWJournalCheckpointTile *tile = &layerTiles[k / tileCount][k % tileCount];
+        if (tile->sharedWith >= 0)
+            return;
+        SWJournalTileRect rect = SWJournalRectOfTile(k % tileCount, tilesWide, width, height);
+        size_t length = rect.width * rect.height * 4;
+        if (tile->pixels)
+        {
+            SWJournalCompress(tile->pixels, length, &packed[k]);
+            free(tile->pixels);
+            return;
+        }
+
+        uint32_t pixels[kSWJournalTileSize * kSWJournalTileSize];
+        for (size_t p = 0; p < length / 4; p++)
+            pixels[p] = tile->pixel;
+        SWJournalCompress((const unsigned char *)pixels, length, &packed[k]);
+    });
+
+    NSUInteger length = 8 + stack.length;
+    for (NSUInteger k = 0; k < layerCount * tileCount; k++)
+    {
+        SWJournalCheckpointTile *tile = &layerTiles[k / tileCount][k % tileCount];
+        NSUInteger source = (tile->sharedWith >= 0) ? k - k % tileCount + tile->sharedWith : k;
+        length += 4 + packed[source].length;
+    }
+
+    NSMutableData *record = SWJournalBeginRecord(kSWJournalCheckpoint, length);
+    SWJournalAppend32(record, (uint32_t)width);
+    SWJournalAppend32(record, (uint32_t)height);
+    [record appendData:stack];
+    for (NSUInteger k = 0; k < layerCount * tileCount; k++)
+    {
+        SWJournalCheckpointTile *tile = &layerTiles[k / tileCount][k % tileCount];
+        NSUInteger source = (tile->sharedWith >= 0) ? k - k % tileCount + tile->sharedWith : k;
+        SWJournalAppend32(record, (uint32_t)packed[source].length);
+        [record appendBytes:packed[source].bytes length:packed[source].length];
+    }
+    for (NSUInteger k = 0; k < layerCount * tileCount; k++)
+        free(packed[k].bytes);
+    free(packed);
+    for (NSUInteger l = 0; l < layerCount; l++)
+        free(layerTiles[l]);
+    free(layerTiles);
+
+    SWJournalEndRecord(record);
+    return record;
+}
+
+
+#pragma mark Layers
+
+// What a record says about the layers: everything but their pixels
+static NSData *SWJournalStack(NSArray *layers, NSUInteger activeIndex)
+{
+    NSMutableData *stack = [NSMutableData data];
+    SWJournalAppend32(stack, (uint32_t)layers.count);
+    SWJournalAppend32(stack, (uint32_t)activeIndex);
+    for (SWLayer *layer in layers)
+    {
+        NSData *name = [layer.name dataUsingEncoding:NSUTF8StringEncoding] ?: [NSData data];
+        SWJournalAppend32(stack, (uint32_t)layer.identifier);
+        SWJournalAppend16(stack, (uint16_t)MIN(name.length, UINT16_MAX));
+        [stack appendBytes:name.bytes length:MIN(name.length, UINT16_MAX)];
+        SWJournalAppendFloat(stack, layer.opacity);
+        SWJournalAppend8(stack, layer.visible);
+        SWJournalAppend8(stack, (uint8_t)layer.blendMode);
+    }
+    return stack;
+}
+
+
+// Whether the tiles we have still line up: the same layers, with the same
+// images, in the same order.  Settings and the active layer can differ
+static BOOL SWJournalSameLayers(NSArray *before, NSArray *after)
+{
+    if (before.count != after.count)
+        return NO;
+    for (NSUInteger i = 0; i < before.count; i++)
+    {
+        SWLayer *a = before[i], *b = after[i];
+        if (a.identifier != b.identifier || a.image != b.image)
+            return NO;
+    }
+    return YES;
+}
+
+
+#pragma mark Replaying
+
+// Decompresses a batch of tiles straight into the image, on every core
+static BOOL SWJournalApplyTiles(NSBitmapImageRep *image, NSInteger tilesWide, NSInteger count,
+                                const uint32_t *indices, const unsigned char **data, const uint32_t *lengths)
+{
+    NSInteger width = image.pixelsWide;
+    NSInteger height = image.pixelsHigh;
+    NSInteger rowBytes = image.bytesPerRow;
+    unsigned char *bitmap = image.bitmapData;
+
+    __block BOOL failed = NO;
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+        unsigned char tile[kSWJournalTileSize * kSWJournalTileSize * 4];
+        SWJournalTileRect rect = SWJournalRectOfTile(indices[i], tilesWide, width, height);
+        uLongf tileLength = rect.width * rect.height * 4;
+        if (uncompress(tile, &tileLength, data[i], lengths[i]) == Z_OK &&
+            tileLength == (uLongf)(rect.width * rect.height * 4))
+            SWJournalCopyTileIn(tile, rect, bitmap, rowBytes);
+        else
+            failed = YES;
+    });
+    return !failed;
+}
+
+
+// Reads a record's tiles, then applies them.  Indices are NULL for a checkpoint,
+// which has every tile in order
+static BOOL SWJournalReadTiles(SWJournalCursor *cursor, NSBitmapImageRep *image, NSInteger count, BOOL indexed)
+{
+    NSInteger tilesWide = (image.pixelsWide + kSWJournalTileSize - 1) / kSWJournalTileSize;
+    NSInteger tilesHigh = (image.pixelsHigh + kSWJournalTileSize - 1) / kSWJournalTileSize;
+    if (count > tilesWide * tilesHigh)
+        return NO;
+
+    uint32_t *indices = malloc(count * sizeof(uint32_t));
+    uint32_t *lengths = malloc(count * sizeof(uint32_t));
+    const unsigned char **data = malloc(count * sizeof(unsigned char *));
+
+    for (NSInteger i = 0; i < count && !cursor->failed; i++)
+    {
+        indices[i] = indexed ? SWJournalTake32(cursor) : (uint32_t)i;
+        lengths[i] = SWJournalTake32(cursor);
+        data[i] = SWJournalTake(cursor, lengths[i]);
+        if (indices[i] >= tilesWide * tilesHigh)
+            cursor->failed = YES;
+    }
+
+    BOOL success = !cursor->failed && SWJournalApplyTiles(image, tilesWide, count, indices, data, lengths);
+
+    free(indices);
+    free(lengths);
+    free(data);
+    return success;
+}
+
+
+// Reads a record's stack into copies of the layers, which it checks are the
+// same ones the file had before.  A checkpoint's starts from nothing, and gets
+// new layers, with blank images of the given size
+static BOOL SWJournalReadStack(SWJournalCursor *cursor, NSMutableArray *layers, NSMutableArray *identifiers,
+                               NSUInteger *activeIndex, NSSize newSize)
+{
+    BOOL checkpoint = !NSEqualSizes(newSize, NSZeroSize);
+    uint32_t count = SWJournalTake32(cursor);
+    uint32_t active = SWJournalTake32(cursor);
+    if (cursor->failed || count == 0 || count > kSWJournalMaxLayers || active >= count ||
+        (!checkpoint && count != layers.count))
+        return NO;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t identifier = SWJournalTake32(cursor);
+        uint16_t nameLength = SWJournalTake16(cursor);
+        const unsigned char *name = SWJournalTake(cursor, nameLength);
+        const unsigned char *settings = SWJournalTake(cursor, 6);
+        if (cursor->failed)
+            return NO;
+
+        SWLayer *layer = nil;
+        if (checkpoint)
+        {
+            NSBitmapImageRep *image = nil;
+            [SWImageTools initImageRep:&image withSize:newSize cleared:NO];
+            layer = [[SWLayer alloc] initWithImage:image name:nil];
+            [layers addObject:layer];
+            [identifiers addObject:@(identifier)];
+        }
+        else if ([identifiers[i] unsignedIntValue] == identifier)
+        {
+            // Copies share the image, which is all the tiles need
+            layer = [layers[i] copy];
+            layers[i] = layer;
+        }
+        else
+            return NO;
+
+        uint32_t opacityBits = SWJournalRead32(settings);
+        float opacity;
+        memcpy(&opacity, &opacityBits, 4);
+        layer.name = [[NSString alloc] initWithBytes:name length:nameLength encoding:NSUTF8StringEncoding];
+        layer.opacity = opacity;
+        layer.visible = (settings[4] != 0);
+        layer.blendMode = (SWBlendMode)settings[5];
+    }
+
+    *activeIndex = active;
+    return YES;
+}
+
+
+// Replaces the layers with the ones the record leaves behind, if it reads
+static BOOL SWJournalApplyRecord(const unsigned char *body, uint32_t length,
+                                 NSMutableArray *layers, NSMutableArray *identifiers, NSUInteger *activeIndex)
+{
+    SWJournalCursor cursor = { body + 1, body + length, NO };
+    NSMutableArray *newLayers, *newIdentifiers;
+    NSUInteger newActiveIndex = 0;
+
+    if (body[0] == kSWJournalCheckpoint)
+    {
+        uint32_t width = SWJournalTake32(&cursor);
+        uint32_t height = SWJournalTake32(&cursor);
+        if (cursor.failed || width == 0 || height == 0 ||
+            width > kSWJournalMaxDimension || height > kSWJournalMaxDimension)
+            return NO;
+
+        newLayers = [NSMutableArray array];
+        newIdentifiers = [NSMutableArray array];
+        if (!SWJournalReadStack(&cursor, newLayers, newIdentifiers, &newActiveIndex, NSMakeSize(width, height)))
+            return NO;
+
+        NSInteger tileCount = ((width + kSWJournalTileSize - 1) / kSWJournalTileSize) *
+                              ((height + kSWJournalTileSize - 1) / kSWJournalTileSize);
+        for (SWLayer *layer in newLayers)
+            if (!SWJournalReadTiles(&cursor, layer.image, tileCount, NO))
+                return NO;
+    }
+    else if (body[0] == kSWJournalOperation)
+    {
+        // Only the stack and the tiles matter for getting the canvas back: the
+        // rest is a description of what happened
+        if (layers.count == 0)
+            return NO;
+        SWJournalTake(&cursor, SWJournalTake16(&cursor));
+        SWJournalTake(&cursor, 4 + 1 + 16 + 16);
+        SWJournalTake(&cursor, SWJournalTake32(&cursor) * (size_t)8);
+
+        newLayers = [layers mutableCopy];
+        newIdentifiers = [identifiers mutableCopy];
+        if (cursor.failed || !SWJournalReadStack(&cursor, newLayers, newIdentifiers, &newActiveIndex, NSZeroSize))
+            return NO;
+        uint32_t tileCount = SWJournalTake32(&cursor);
+        if (cursor.failed || !SWJournalReadTiles(&cursor, [newLayers[newActiveIndex] image], tileCount, YES))
+            return NO;
+    }
+    else
+    {
+        // From some future version: skip it
+        return YES;
+    }
+
+    [layers setArray:newLayers];
+    [identifiers setArray:newIdentifiers];
+    *activeIndex = newActiveIndex;
+    return YES;
+}
+
+
+@implementation SWJournal
+
+@synthesize URL = url;
+
++ (NSArray *)abandonedJournalURLs
+{
+    NSArray *contents = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:SWJournalDirectoryURL()
+                                                      includingPropertiesForKeys:nil
+                                                                         options:NSDirectoryEnumerationSkipsHiddenFiles
+                                                                           error:NULL];
+    NSMutableArray *abandoned = [NSMutableArray array];
+    NSMutableSet *livePaths = SWJournalLivePaths();
+    @synchronized(livePaths)
+    {
+        for (NSURL *candidate in contents)
+        {
+            if ([candidate.pathExtension isEqualToString:@"journal"] &&
+                ![livePaths containsObject:candidate.path.stringByStandardizingPath])
+                [abandoned addObject:candidate];
+        }
+    }
+    return abandoned;
+}
+
+
++ (NSArray *)layersByReplayingJournalAtURL:(NSURL *)journalURL activeLayerIndex:(NSUInteger *)index
+{
+    NSData *data = [NSData dataWithContentsOfURL:journalURL options:NSDataReadingMappedIfSafe error:NULL];
+    const unsigned char *bytes = data.bytes;
+    if (data.length < kSWJournalHeaderSize || memcmp(bytes, kSWJournalMagic, 4) != 0 ||
+        SWJournalRead32(bytes + 4) != kSWJournalVersion)
+        return nil;
+
+    NSMutableArray *layers = [NSMutableArray array];
+    NSMutableArray *identifiers = [NSMutableArray array];      // As the file has them
+    NSUInteger activeIndex = 0;
+    const unsigned char *p = bytes + kSWJournalHeaderSize;
+    const unsigned char *end = bytes + data.length;
+
+    // Each record needs at least its length, type and CRC
+    while (end - p >= 9)
+    {
+        uint32_t length = SWJournalRead32(p);
+        if (length < 1 || length > (size_t)(end - p) - 8)
+            break;
+
+        const unsigned char *body = p + 4;
+        uLong crc = crc32(crc32(0L, Z_NULL, 0), body, length);
+        if ((uint32_t)crc != SWJournalRead32(body + length))
+            break;
+
+        if (!SWJournalApplyRecord(body, length, layers, identifiers, &activeIndex))
+            break;
+        p = body + length + 4;
+    }
+
+    if (layers.count == 0)
+        return nil;
+    if (index)
+        *index = activeIndex;
+    return layers;
+}
+
+
+- (instancetype)init
+{
+    return [self initWithLayers:nil activeLayerIndex:0];
+}
+
+
+- (instancetype)initWithLayers:(NSArray *)layers activeLayerIndex:(NSUInteger)index
+{
+    if (index >= layers.count)
+        return nil;
+
+    if (self = [super init])
+    {
+        NSString *name = [[NSUUID UUID].UUIDString stringByAppendingPathExtension:@"journal"];
+        url = [SWJournalDirectoryURL() URLByAppendingPathComponent:name];
+        fileDescriptor = -1;
+        queue = dispatch_queue_create("com.soggywaffles.paintbrush.journal", DISPATCH_QUEUE_SERIAL);
+
+        NSMutableSet *livePaths = SWJournalLivePaths();
+        @synchronized(livePaths)
+        {
+            [livePaths addObject:url.path.stringByStandardizingPath];
+        }
+
+        [self checkpointLayers:layers activeLayerIndex:index];
+    }
+    return self;
+}
+
+
+// Starts the journal over from the layers as they are now.  The new file is
+// written off to the side, and only replaces the old one once it's complete
+- (void)checkpointLayers:(NSArray *)layers activeLayerIndex:(NSUInteger)index
+{
+    NSBitmapImageRep *image = [layers[index] image];
+    if (image.pixelsWide != width || image.pixelsHigh != height)
+    {
+        width = image.pixelsWide;
+        height = image.pixelsHigh;
+        tilesWide = (width + kSWJournalTileSize - 1) / kSWJournalTileSize;
+        tilesHigh = (height + kSWJournalTileSize - 1) / kSWJournalTileSize;
+    }
+    operationsSinceCheckpoint = 0;
+    tilesSinceCheckpoint = 0;
+
+    NSInteger w = width, h = height;
+    NSUInteger layerCount = layers.count;
+    NSData *stack = SWJournalStack(layers, index);
+    journaledLayers = [layers copy];
+    journaledStack = stack;
+    SWJournalCheckpointTile **tiles = calloc(layerCount, sizeof(SWJournalCheckpointTile *));
+    for (NSUInteger i = 0; i < layerCount; i++)
+        tiles[i] = SWJournalCaptureCheckpoint([layers[i] image], tilesWide, tilesWide * tilesHigh);
+    NSURL *journalURL = url;
+
+    dispatch_async(queue, ^{
+        NSData *record = SWJournalCheckpointRecord(tiles, layerCount, stack, w, h);
+        NSString *temporaryPath = [journalURL.path stringByAppendingPathExtension:@"tmp"];
+
+        int fd = open(temporaryPath.fileSystemRepresentation, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+        if (fd < 0)
+        {
+            if (self->fileDescriptor >= 0)
+                close(self->fileDescriptor);
+            self->fileDescriptor = -1;
+            return;
+        }
+        if (!SWJournalWriteAll(fd, SWJournalHeader()) || !SWJournalWriteAll(fd, record) || fsync(fd) != 0 ||
+            rename(temporaryPath.fileSystemRepresentation, journalURL.path.fileSystemRepresentation) != 0)
+        {
+            // The old journal no longer matches what we think is on disk,
+            // so stop writing to it altogether
+            DebugLog(@"Couldn't write a journal checkpoint: %s", strerror(errno));
+            close(fd);
+            unlink(temporaryPath.fileSystemRepresentation);
+            if (self->fileDescriptor >= 0)
+                close(self->fileDescriptor);
+            self->fileDescriptor = -1;
+            return;
+        }
+
+        if (self->fileDescriptor >= 0)
+            close(self->fileDescriptor);
+        self->fileDescriptor = fd;
+    });
+}
+
+
+- (void)recordOperation:(NSString *)name
+              lineWidth:(CGFloat)lineWidth
+              fillStyle:(NSInteger)fillStyle
+             foreground:(NSColor *)foreground
+             background:(NSColor *)background
+                 points:(NSData *)points
+             dirtyRects:(NSData *)rects
+                 layers:(NSArray *)layers
+       activeLayerIndex:(NSUInteger)index
+{
+    // A new size, or a new stack of layers, means the tiles we have no longer
+    // line up with anything
+    NSBitmapImageRep *image = [layers[index] image];
+    if (image.pixelsWide != width || image.pixelsHigh != height || !SWJournalSameLayers(journaledLayers, layers))
+    {
+        [self checkpointLayers:layers activeLayerIndex:index];
+        return;
+    }
+
+    NSInteger tileCount = tilesWide * tilesHigh;
+    BOOL *dirty = calloc(tileCount, sizeof(BOOL));
+    if (rects)
+    {
+        const NSRect *dirtyRects = rects.bytes;
+        for (NSUInteger i = 0; i < rects.length / sizeof(NSRect); i++)
+            SWJournalMarkTilesInRect(dirtyRects[i], width, height, tilesWide, dirty);
+    }
+    else
+        memset(dirty, YES, tileCount * sizeof(BOOL));
+
+    NSMutableIndexSet *dirtyTiles = [NSMutableIndexSet indexSet];
+    for (NSInteger i = 0; i < tileCount; i++)
+        if (dirty[i])
+            [dirtyTiles addIndex:i];
+    free(dirty);
+
+    // Changing a layer's settings is an edit with no tiles
+    NSData *stack = SWJournalStack(layers, index);
+    if (dirtyTiles.count == 0 && [stack isEqualToData:journaledStack])
+        return;
+    journaledLayers = [layers copy];
+    journaledStack = stack;
+
+    operationsSinceCheckpoint++;
+    tilesSinceCheckpoint += dirtyTiles.count;
+    if (operationsSinceCheckpoint >= kSWJournalCheckpointOperations ||
+        tilesSinceCheckpoint >= (NSUInteger)(kSWJournalCheckpointCoverage * tilesWide * tilesHigh))
+    {
+        [self checkpointLayers:layers activeLayerIndex:index];
+        return;
+    }
+
+    // Only the changed tiles get copied here; everything else waits for the queue
+    NSInteger count = dirtyTiles.count;
+    NSUInteger *indices = malloc(count * sizeof(NSUInteger));
+    [dirtyTiles getIndexes:indices maxCount:count inIndexRange:NULL];
+
+    size_t tileBytes = kSWJournalTileSize * kSWJournalTileSize * 4;
+    NSMutableData *tiles = [NSMutableData dataWithLength:count * tileBytes];
+    for (NSInteger i = 0; i < count; i++)
+        SWJournalCopyTileOut(image.bitmapData, image.bytesPerRow,
+                             SWJournalRectOfTile(indices[i], tilesWide, width, height),
+                             (unsigned char *)tiles.mutableBytes + i * tileBytes);
+
+    NSMutableData *description = [NSMutableData data];
+    NSData *nameData = [name dataUsingEncoding:NSUTF8StringEncoding] ?: [NSData data];
+    SWJournalAppend16(description, (uint16_t)MIN(nameData.length, UINT16_MAX));
+    [description appendBytes:nameData.bytes length:MIN(nameData.length, UINT16_MAX)];
+    SWJournalAppendFloat(description, lineWidth);
+    SWJournalAppend8(description, (uint8_t)fillStyle);
+    for (NSColor *color in @[foreground ?: [NSColor blackColor], background ?: [NSColor whiteColor]])
+    {
+        NSColor *rgb = [color colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+        SWJournalAppendFloat(description, rgb.redComponent);
+        SWJournalAppendFloat(description, rgb.greenComponent);
+        SWJournalAppendFloat(description, rgb.blueComponent);
+        SWJournalAppendFloat(description, rgb.alphaComponent);
+    }
+    NSUInteger pointCount = points.length / sizeof(NSPoint);
+    const NSPoint *strokePoints = points.bytes;
+    SWJournalAppend32(description, (uint32_t)pointCount);
+    for (NSUInteger i = 0; i < pointCount; i++)
+    {
+        SWJournalAppendFloat(description, strokePoints[i].x);
+        SWJournalAppendFloat(description, strokePoints[i].y);
+    }
+    [description appendData:stack];
+
+    NSInteger across = tilesWide, w = width, h = height;
+    dispatch_async(queue, ^{
+        if (self->fileDescriptor < 0)
+        {
+            free(indices);
+            return;
+        }
+
+        SWJournalPackedTile *compressed = calloc(count, sizeof(SWJournalPackedTile));
+        dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+            SWJournalTileRect rect = SWJournalRectOfTile(indices[i], across, w, h);
+            SWJournalCompress((const unsigned char *)tiles.bytes + i * tileBytes,
+                              rect.width * rect.height * 4, &compressed[i]);
+        });
+
+        NSMutableData *record = SWJournalBeginRecord(kSWJournalOperation, description.length + count * 64);
+        [record appendData:description];
+        SWJournalAppend32(record, (uint32_t)count);
+        for (NSInteger i = 0; i < count; i++)
+        {
+            SWJournalAppend32(record, (uint32_t)indices[i]);
+            SWJournalAppend32(record, (uint32_t)compressed[i].length);
+            [record appendBytes:compressed[i].bytes length:compressed[i].length];
+            free(compressed[i].bytes);
+        }
+        free(compressed);
+        free(indices);
+        SWJournalEndRecord(record);
+
+        if (!SWJournalWriteAll(self->fileDescriptor, record))
+        {
+            // Better no journal than one with a hole in it
+            DebugLog(@"Couldn't append to the journal: %s", strerror(errno));
+            close(self->fileDescriptor);
+            self->fileDescriptor = -1;
+        }
+    });
+}
+
+
+- (void)discard
+{
+    NSMutableSet *livePaths = SWJournalLivePaths();
+    NSString *path = url.path;
+
+    // Waits for anything still being written, so nothing gets recreated after
+    dispatch_async(queue, ^{
+        if (self->fileDescriptor >= 0)
+            close(self->fileDescriptor);
+        self->fileDescriptor = -1;
+        unlink(path.fileSystemRepresentation);
+
+        @synchronized(livePaths)
+        {
+            [livePaths removeObject:path.stringByStandardizingPath];
+        }
+    });
+}
+
+@end
@@ -0,0 +1,1592 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Times the plain C kernels on synthetic canvases and checks them against
+// scalar versions, the way SWImageBenchmark does for the AppKit operations.
+// Nothing here needs a Mac, so it's built with CMake:
+//
+//   SWKernelBenchmark [--sizes 640x480,...] [--iterations N] [--only a,b]
+//                     [--report file.json] [--verify]
+//
+// The report is JSON, on stdout unless --report names a file.  With --verify
+// the exit status is non-zero if any kernel disagrees with its reference.
+
+#include "SWBrushEngine.h"
+#include "SWColorSampler.h"
+#include "SWFillShader.h"
+#include "SWRasterizer.h"
+#include "SWScratchCanvas.h"
+#include "SWSparseCanvas.h"
+#include "SWTileHandoff.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kSWKernelDefaultIterations      5
+#define kSWKernelDefaultSizes           "640x480,1920x1080,3840x2160,7680x4320"
+
+// Odd sizes catch the edge cases that round numbers hide
+#define kSWKernelVerifySizes            "640x480,641x479,97x1"
+
+#define kSWKernelMaxSizes               16
+
+
+// The pixels one run of a case works with.  The input is never changed; the
+// canvas starts out as a copy of it before every run
+typedef struct {
+    long width, height;
+    size_t bytesPerRow;
+    uint8_t *input;             // Random premultiplied RGBA, some clear, some opaque
+    uint8_t *canvas;
+    void *state;                // Whatever the case's setUp made
+    double items;               // For cases with a unit: how many a run does
+} SWKernelJob;
+
+// How a case's result compared to its reference
+typedef struct {
+    size_t differingBytes;
+    unsigned maxDelta;
+    const char *error;          // If there was nothing to compare
+} SWKernelCheck;
+
+typedef struct {
+    const char *name;
+    const char *unit;                                       // Also reported per second, or NULL
+    bool (*setUp)(SWKernelJob *job);                        // Optional
+    void (*run)(SWKernelJob *job);
+    void (*tearDown)(SWKernelJob *job);                     // Optional
+    void (*verify)(SWKernelJob *job, SWKernelCheck *check); // Optional
+} SWKernelCase;
+
+
+// Synthetic images
+
+static inline uint32_t SWKernelRandom(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (*state = x);
+}
+
+
+static void SWKernelFillNoise(uint8_t *pixels, long width, long height, size_t bytesPerRow, uint32_t seed)
+{
+    uint32_t state = seed | 1;
+    for (long y = 0; y < height; y++)
+    {
+        uint8_t *p = pixels + y * bytesPerRow;
+        for (long x = 0; x < width; x++, p += 4)
+        {
+            uint32_t r = SWKernelRandom(&state);
+            long i = y * width + x;
+            if (i % 7 == 0)
+                p[0] = p[1] = p[2] = p[3] = 255;
+            else if (i % 9 == 0)
+                p[0] = p[1] = p[2] = p[3] = 0;
+            else
+            {
+                uint32_t a = (i % 4 == 0) ? 255 : (r >> 24);
+                p[0] = (r & 0xFF) * a / 255;
+                p[1] = ((r >> 8) & 0xFF) * a / 255;
+                p[2] = ((r >> 16) & 0xFF) * a / 255;
+                p[3] = a;
+            }
+        }
+    }
+}
+
+
+static void SWKernelCompare(const uint8_t *actual, const uint8_t *expected,
+                            long width, long height, size_t bytesPerRow, SWKernelCheck *check)
+{
+    for (long y = 0; y < height; y++)
+    {
+        const uint8_t *a = actual + y * bytesPerRow;
+        const uint8_t *e = expected + y * bytesPerRow;
+        for (long x = 0; x < width * 4; x++)
+        {
+            unsigned delta = (a[x] > e[x]) ? a[x] - e[x] : e[x] - a[x];
+            check->differingBytes += (delta != 0);
+            if (delta > check->maxDelta)
+                check->maxDelta = delta;
+        }
+    }
+}
+
+
+// Cases
+
+static void SWKernelRunCopy(SWKernelJob *job)
+{
+    // What every other case is up against: touching each byte once
+    for (long y = 0; y < job->height; y++)
+        memcpy(job->canvas + y * job->bytesPerRow, job->input + y * job->bytesPerRow, job->width * 4);
+}
+
+
+static void SWKernelVerifyCopy(SWKernelJob *job, SWKernelCheck *check)
+{
+    SWKernelRunCopy(job);
+    SWKernelCompare(job->canvas, job->input, job->width, job->height, job->bytesPerRow, check);
+}
+
+
+typedef struct {
+    uint8_t *front[2];
+    SWTileHandoff *handoff;
+    atomic_bool done;
+} SWKernelHandoffState;
+
+#define kSWKernelPublishes      64
+#define kSWKernelPublishSize    64
+
+
+static bool SWKernelSetUpHandoff(SWKernelJob *job)
+{
+    SWKernelHandoffState *state = calloc(1, sizeof(SWKernelHandoffState));
+    size_t length = job->bytesPerRow * job->height;
+    if (!state || !(state->front[0] = calloc(1, length)) || !(state->front[1] = calloc(1, length)))
+        goto fail;
+    state->handoff = SWTileHandoffCreate(job->width, job->height, 4, job->bytesPerRow, 64,
+                                         state->front[0], state->front[1]);
+    if (!state->handoff)
+        goto fail;
+    SWTileHandoffMarkAllDirty(state->handoff);
+    SWTileHandoffPublish(state->handoff, job->canvas);
+    job->state = state;
+    job->items = kSWKernelPublishes;
+    return true;
+
+fail:
+    if (state)
+    {
+        free(state->front[0]);
+        free(state->front[1]);
+    }
+    free(state);
+    return false;
+}
+
+
+static void SWKernelTearDownHandoff(SWKernelJob *job)
+{
+    SWKernelHandoffState *state = job->state;
+    SWTileHandoffDestroy(state->handoff);
+    free(state->front[0]);
+    free(state->front[1]);
+    free(state);
+}
+
+
+// Draws into a small square somewhere on the canvas and marks it, the way a
+// brush stroke does between publishes
+static void SWKernelDrawAndMark(SWKernelJob *job, uint32_t *seed)
+{
+    SWKernelHandoffState *state = job->state;
+    long size = kSWKernelPublishSize;
+    long x = SWKernelRandom(seed) % job->width, y = SWKernelRandom(seed) % job->height;
+    long w = (x + size < job->width) ? size : job->width - x;
+    long h = (y + size < job->height) ? size : job->height - y;
+    uint8_t value = SWKernelRandom(seed);
+    for (long row = y; row < y + h; row++)
+        memset(job->canvas + row * job->bytesPerRow + x * 4, value, w * 4);
+    SWTileHandoffMarkDirty(state->handoff, (SWTileRect){ x, y, w, h });
+}
+
+
+static void SWKernelRunHandoff(SWKernelJob *job)
+{
+    SWKernelHandoffState *state = job->state;
+    uint32_t seed = 1;
+    for (int i = 0; i < kSWKernelPublishes; i++)
+    {
+        SWKernelDrawAndMark(job, &seed);
+        SWTileHandoffPublish(state->handoff, job->canvas);
+        const uint8_t *front = SWTileHandoffAcquireFront(state->handoff, NULL);
+        SWTileHandoffReleaseFront(state->handoff, front);
+    }
+}
+
+
+static void *SWKernelShowFrames(void *argument)
+{
+    // The showing side, borrowing frames as fast as it can
+    SWKernelJob *job = argument;
+    SWKernelHandoffState *state = job->state;
+    volatile uint32_t sum = 0;
+    while (!atomic_load(&state->done))
+    {
+        const uint8_t *front = SWTileHandoffAcquireFront(state->handoff, NULL);
+        for (long y = 0; front && y < job->height; y += 7)
+            sum += front[y * job->bytesPerRow];
+        SWTileHandoffReleaseFront(state->handoff, front);
+    }
+    return NULL;
+}
+
+
+static void SWKernelVerifyHandoff(SWKernelJob *job, SWKernelCheck *check)
+{
+    // Publishes while another thread shows, which is also what to run under
+    // ThreadSanitizer.  Whatever got put off along the way, the frame on screen
+    // after one last publish has to be exactly what was drawn
+    SWKernelHandoffState *state = job->state;
+    pthread_t shower;
+    if (pthread_create(&shower, NULL, SWKernelShowFrames, job) != 0)
+    {
+        check->error = "couldn't start a thread";
+        return;
+    }
+    uint32_t seed = 1;
+    for (int i = 0; i < 16 * kSWKernelPublishes; i++)
+    {
+        SWKernelDrawAndMark(job, &seed);
+        SWTileHandoffPublish(state->handoff, job->canvas);
+    }
+    atomic_store(&state->done, true);
+    pthread_join(shower, NULL);
+
+    SWKernelDrawAndMark(job, &seed);
+    if (!SWTileHandoffPublish(state->handoff, job->canvas))
+    {
+        check->error = "last publish was put off";
+        return;
+    }
+    const uint8_t *front = SWTileHandoffAcquireFront(state->handoff, NULL);
+    SWKernelCompare(front, job->canvas, job->width, job->height, job->bytesPerRow, check);
+    SWTileHandoffReleaseFront(state->handoff, front);
+}
+
+
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+} SWKernelSparseState;
+
+#define kSWKernelSparsePixel    0xFF2040C0u
+
+
+static bool SWKernelSetUpSparse(SWKernelJob *job)
+{
+    SWKernelSparseState *state = malloc(sizeof(SWKernelSparseState));
+    if (!state)
+        return false;
+    state->length = SWSparseCanvasAllocationSize(job->bytesPerRow * job->height);
+    state->bytes = SWSparseCanvasAllocate(state->length);
+    if (!state->bytes)
+    {
+        free(state);
+        return false;
+    }
+    job->state = state;
+    return true;
+}
+
+
+static void SWKernelTearDownSparse(SWKernelJob *job)
+{
+    SWKernelSparseState *state = job->state;
+    SWSparseCanvasFree(state->bytes, state->length);
+    free(state);
+}
+
+
+static void SWKernelRunSparseFill(SWKernelJob *job)
+{
+    // A new canvas in a color, then cleared again
+    SWKernelSparseState *state = job->state;
+    SWSparseCanvasFill(state->bytes, state->length, kSWKernelSparsePixel);
+    SWSparseCanvasFill(state->bytes, state->length, 0);
+}
+
+
+static void SWKernelVerifySparseFill(SWKernelJob *job, SWKernelCheck *check)
+{
+    SWKernelSparseState *state = job->state;
+    uint32_t *expected = (uint32_t *)job->canvas;
+    for (size_t i = 0; i < job->bytesPerRow * job->height / 4; i++)
+        expected[i] = kSWKernelSparsePixel;
+
+    SWSparseCanvasFill(state->bytes, state->length, kSWKernelSparsePixel);
+    SWKernelCompare(state->bytes, job->canvas, job->width, job->height, job->bytesPerRow, check);
+
+    // Drawing after a fill has to land in that tile alone
+    memcpy(state->bytes, job->input, job->bytesPerRow);
+    memcpy(job->canvas, job->input, job->bytesPerRow);
+    SWKernelCompare(state->bytes, job->canvas, job->width, job->height, job->bytesPerRow, check);
+
+    memset(job->canvas, 0, job->bytesPerRow * job->height);
+    SWSparseCanvasFill(state->bytes, state->length, 0);
+    SWKernelCompare(state->bytes, job->canvas, job->width, job->height, job->bytesPerRow, check);
+}
+
+
+static void SWKernelRunSparseScan(SWKernelJob *job)
+{
+    // What journaling and saving do to find the tiles that are still shared
+    SWKernelSparseState *state = job->state;
+    size_t uniform = 0;
+    for (size_t offset = 0; offset < state->length; offset += SW_SPARSE_TILE_BYTES)
+        uniform += SWSparseCanvasTileIsUniform(state->bytes + offset, SW_SPARSE_TILE_BYTES, NULL);
+    job->items = uniform;       // So the scan can't be left out
+}
+
+
+static void SWKernelVerifySparseScan(SWKernelJob *job, SWKernelCheck *check)
+{
+    SWKernelSparseState *state = job->state;
+    SWSparseCanvasFill(state->bytes, state->length, kSWKernelSparsePixel);
+
+    // Every third tile gets one pixel changed near its end
+    size_t tiles = state->length / SW_SPARSE_TILE_BYTES;
+    for (size_t tile = 0; tile < tiles; tile += 3)
+        state->bytes[(tile + 1) * SW_SPARSE_TILE_BYTES - 2] ^= 1;
+
+    for (size_t tile = 0; tile < tiles; tile++)
+    {
+        uint32_t pixel = 0;
+        bool uniform = SWSparseCanvasTileIsUniform(state->bytes + tile * SW_SPARSE_TILE_BYTES,
+                                                   SW_SPARSE_TILE_BYTES, &pixel);
+        if (uniform != (tile % 3 != 0) || (uniform && pixel != kSWKernelSparsePixel))
+            check->differingBytes++;
+    }
+}
+
+
+#define kSWKernelScratchBand    64
+
+
+static bool SWKernelSetUpScratch(SWKernelJob *job)
+{
+    // A budget of a quarter of the canvas, so a sweep has to evict
+    const char *directory = getenv("TMPDIR");
+    size_t length = job->bytesPerRow * job->height;
+    job->state = SWScratchCanvasCreate(directory ? directory : "/tmp", length, length / 4);
+    return job->state != NULL;
+}
+
+
+static void SWKernelTearDownScratch(SWKernelJob *job)
+{
+    SWScratchCanvasDestroy(job->state);
+}
+
+
+static void SWKernelRunScratchSweep(SWKernelJob *job)
+{
+    // Drawing down the canvas a band at a time, asking for the next one ahead
+    SWScratchCanvas *canvas = job->state;
+    uint8_t *bytes = SWScratchCanvasBytes(canvas);
+    for (long y = 0; y < job->height; y += kSWKernelScratchBand)
+    {
+        long rows = (y + kSWKernelScratchBand < job->height) ? kSWKernelScratchBand : job->height - y;
+        SWScratchCanvasUse(canvas, 0, y, job->width, rows, 4, job->bytesPerRow, false);
+        if (y + rows < job->height)
+            SWScratchCanvasUse(canvas, 0, y + rows, job->width, kSWKernelScratchBand, 4, job->bytesPerRow, true);
+        memcpy(bytes + y * job->bytesPerRow, job->input + y * job->bytesPerRow, rows * job->bytesPerRow);
+    }
+    SWScratchCanvasWaitUntilIdle(canvas);
+}
+
+
+static void SWKernelVerifyScratchSweep(SWKernelJob *job, SWKernelCheck *check)
+{
+    // Everything has to come back from the file the way it went out
+    SWScratchCanvas *canvas = job->state;
+    uint8_t *bytes = SWScratchCanvasBytes(canvas);
+    SWKernelRunScratchSweep(job);
+    for (long y = 0; y < job->height; y += kSWKernelScratchBand)
+    {
+        long rows = (y + kSWKernelScratchBand < job->height) ? kSWKernelScratchBand : job->height - y;
+        SWScratchCanvasUse(canvas, 0, y, job->width, rows, 4, job->bytesPerRow, false);
+        SWKernelCompare(bytes + y * job->bytesPerRow, job->input + y * job->bytesPerRow,
+                        job->width, rows, job->bytesPerRow, check);
+    }
+}
+
+
+static void SWKernelRunScratchFill(SWKernelJob *job)
+{
+    SWScratchCanvas *canvas = job->state;
+    SWScratchCanvasFill(canvas, 0, SWScratchCanvasLength(canvas), 0xFF808080u);
+    SWScratchCanvasWaitUntilIdle(canvas);
+}
+
+
+static void SWKernelVerifyScratchFill(SWKernelJob *job, SWKernelCheck *check)
+{
+    SWScratchCanvas *canvas = job->state;
+    SWKernelRunScratchSweep(job);
+    SWKernelRunScratchFill(job);
+
+    uint32_t *expected = (uint32_t *)job->canvas;
+    for (size_t i = 0; i < job->bytesPerRow * job->height / 4; i++)
+        expected[i] = 0xFF808080u;
+    SWKernelCompare(SWScratchCanvasBytes(canvas), job->canvas, job->width, job->height, job->bytesPerRow, check);
+}
+
+
+#define kSWKernelSamples        4096
+
+
+static bool SWKernelSetUpSampler(SWKernelJob *job)
+{
+    job->state = SWColorSamplerCreate(job->input, job->width, job->height, job->bytesPerRow);
+    job->items = kSWKernelSamples;
+    return job->state != NULL;
+}
+
+
+static void SWKernelTearDownSampler(SWKernelJob *job)
+{
+    SWColorSamplerDestroy(job->state);
+}
+
+
+// The mouse wandering over the canvas, with a stroke under it every so often
+// that throws some tiles away
+static void SWKernelRunSampler(SWKernelJob *job, bool dominant)
+{
+    SWColorSampler *sampler = job->state;
+    uint32_t seed = 1;
+    long x = job->width / 2, y = job->height / 2;
+    uint8_t rgba[4];
+    for (int i = 0; i < kSWKernelSamples; i++)
+    {
+        x = (x + (long)(SWKernelRandom(&seed) % 9) - 4 + job->width) % job->width;
+        y = (y + (long)(SWKernelRandom(&seed) % 9) - 4 + job->height) % job->height;
+        if (i % 64 == 63)
+            SWColorSamplerInvalidateRect(sampler, x - 32, y - 32, 64, 64);
+        if (dominant)
+            SWColorSamplerDominant(sampler, x, y, rgba);
+        else
+            SWColorSamplerAverage(sampler, x, y, 5, rgba);
+    }
+}
+
+
+static void SWKernelRunSamplerAverage(SWKernelJob *job)
+{
+    SWKernelRunSampler(job, false);
+}
+
+
+static void SWKernelRunSamplerDominant(SWKernelJob *job)
+{
+    SWKernelRunSampler(job, true);
+}
+
+
+static void SWKernelCheckColor(const uint8_t actual[4], const uint8_t expected[4], SWKernelCheck *check)
+{
+    for (int c = 0; c < 4; c++)
+    {
+        unsigned delta = (actual[c] > expected[c]) ? actual[c] - expected[c] : expected[c] - actual[c];
+        check->differingBytes += (delta != 0);
+        if (delta > check->maxDelta)
+            check->maxDelta = delta;
+    }
+}
+
+
+static void SWKernelVerifySamplerAverage(SWKernelJob *job, SWKernelCheck *check)
+{
+    // Every box size the eyedropper uses, at random points and hanging off
+    // each corner, after drawing over some of the tiles already asked about
+    SWColorSampler *sampler = job->state;
+    uint32_t seed = 7;
+    for (int i = 0; i < 512; i++)
+    {
+        long radius = (long[]){ 0, 1, 2, 5 }[i % 4];
+        long x = (i % 32 == 0) ? -2 : (i % 32 == 1) ? job->width + 1 : (long)(SWKernelRandom(&seed) % job->width);
+        long y = (i % 32 == 2) ? -2 : (i % 32 == 3) ? job->height + 1 : (long)(SWKernelRandom(&seed) % job->height);
+        if (i == 256)
+        {
+            SWKernelFillNoise(job->input, job->width, job->height, job->bytesPerRow, 99);
+            SWColorSamplerInvalidateRect(sampler, 0, 0, job->width, job->height);
+        }
+
+        uint64_t sums[4] = { 0, 0, 0, 0 };
+        size_t count = 0;
+        for (long by = y - radius; by <= y + radius; by++)
+            for (long bx = x - radius; bx <= x + radius; bx++)
+            {
+                if (bx < 0 || by < 0 || bx >= job->width || by >= job->height)
+                    continue;
+                const uint8_t *p = job->input + by * job->bytesPerRow + bx * 4;
+                for (int c = 0; c < 4; c++)
+                    sums[c] += p[c];
+                count++;
+            }
+        uint8_t expected[4] = { 0, 0, 0, 0 }, actual[4];
+        for (int c = 0; c < 4 && count; c++)
+            expected[c] = (uint8_t)((sums[c] + count / 2) / count);
+
+        if (SWColorSamplerAverage(sampler, x, y, radius, actual) != count)
+            check->differingBytes++;
+        SWKernelCheckColor(actual, expected, check);
+    }
+}
+
+
+static void SWKernelVerifySamplerDominant(SWKernelJob *job, SWKernelCheck *check)
+{
+    // Counts every 4-bit color in the same four tiles by brute force.  Ties go
+    // to the lowest color, like the sampler's
+    SWColorSampler *sampler = job->state;
+    uint32_t *counts = calloc(65536, sizeof(uint32_t));
+    uint64_t (*sums)[4] = calloc(65536, sizeof(*sums));
+    if (!counts || !sums)
+    {
+        free(counts);
+        free(sums);
+        check->error = "out of memory";
+        return;
+    }
+
+    const long T = SW_SAMPLER_TILE_SIZE;
+    uint32_t seed = 7;
+    for (int i = 0; i < 64; i++)
+    {
+        long x = SWKernelRandom(&seed) % job->width, y = SWKernelRandom(&seed) % job->height;
+        long x0 = ((x + T / 2) / T - 1) * T, y0 = ((y + T / 2) / T - 1) * T;
+        memset(counts, 0, 65536 * sizeof(uint32_t));
+        memset(sums, 0, 65536 * sizeof(*sums));
+        for (long by = y0; by < y0 + 2 * T; by++)
+            for (long bx = x0; bx < x0 + 2 * T; bx++)
+            {
+                if (bx < 0 || by < 0 || bx >= job->width || by >= job->height)
+                    continue;
+                const uint8_t *p = job->input + by * job->bytesPerRow + bx * 4;
+                unsigned key = (p[0] >> 4) << 12 | (p[1] >> 4) << 8 | (p[2] >> 4) << 4 | (p[3] >> 4);
+                counts[key]++;
+                for (int c = 0; c < 4; c++)
+                    sums[key][c] += p[c];
+            }
+        unsigned best = 0;
+        for (unsigned key = 1; key < 65536; key++)
+            if (counts[key] > counts[best])
+                best = key;
+
+        uint8_t expected[4], actual[4];
+        for (int c = 0; c < 4; c++)
+            expected[c] = (uint8_t)((sums[best][c] + counts[best] / 2) / counts[best]);
+        if (SWColorSamplerDominant(sampler, x, y, actual) != counts[best])
+            check->differingBytes++;
+        SWKernelCheckColor(actual, expected, check);
+    }
+    free(counts);
+    free(sums);
+}
+
+
+#define kSWKernelPaths          64
+
+
+static bool SWKernelSetUpRasterizer(SWKernelJob *job)
+{
+    job->state = SWRasterizerCreate();
+    job->items = kSWKernelPaths;
+    return job->state != NULL;
+}
+
+
+static void SWKernelTearDownRasterizer(SWKernelJob *job)
+{
+    SWRasterizerDestroy(job->state);
+}
+
+
+// Four cubics, the way NSBezierPath makes an oval
+static void SWKernelAddCircle(SWRasterizer *rasterizer, double cx, double cy, double r)
+{
+    double k = 0.5522847498 * r;
+    SWRasterizerMoveTo(rasterizer, cx + r, cy);
+    SWRasterizerCubicTo(rasterizer, cx + r, cy + k, cx + k, cy + r, cx, cy + r);
+    SWRasterizerCubicTo(rasterizer, cx - k, cy + r, cx - r, cy + k, cx - r, cy);
+    SWRasterizerCubicTo(rasterizer, cx - r, cy - k, cx - k, cy - r, cx, cy - r);
+    SWRasterizerCubicTo(rasterizer, cx + k, cy - r, cx + r, cy - k, cx + r, cy);
+    SWRasterizerClose(rasterizer);
+}
+
+
+static void SWKernelRunRasterizer(SWKernelJob *job)
+{
+    // Dots of every size a brush makes, half see-through
+    SWRasterizer *rasterizer = job->state;
+    static const uint8_t color[4] = { 20, 60, 100, 128 };
+    uint32_t seed = 1;
+    for (int i = 0; i < kSWKernelPaths; i++)
+    {
+        SWRasterizerReset(rasterizer, job->width, job->height);
+        SWKernelAddCircle(rasterizer, SWKernelRandom(&seed) % job->width + 0.3,
+                          SWKernelRandom(&seed) % job->height + 0.7, 2 + SWKernelRandom(&seed) % 40);
+        SWRasterizerFill(rasterizer, SWFillNonZero, job->canvas, job->bytesPerRow, color, SWRasterBlendOver);
+    }
+}
+
+
+// x * a / 255, rounded to nearest
+static inline uint8_t SWKernelScale(unsigned x, unsigned a)
+{
+    return (uint8_t)((x * a * 2 + 255) / 510);
+}
+
+
+static void SWKernelVerifyRasterizerBlend(SWKernelJob *job, SWKernelCheck *check)
+{
+    // Rectangles on whole and half pixels have coverage that's easy to work
+    // out exactly, so every pixel can be checked against a plain blend
+    SWRasterizer *rasterizer = job->state;
+    uint8_t *expected = malloc(job->bytesPerRow * job->height);
+    if (!expected)
+    {
+        check->error = "out of memory";
+        return;
+    }
+    memcpy(expected, job->canvas, job->bytesPerRow * job->height);
+
+    uint32_t seed = 3;
+    for (int i = 0; i < 32; i++)
+    {
+        double x0 = (SWKernelRandom(&seed) % (2 * job->width)) / 2.0 - 4;
+        double y0 = (SWKernelRandom(&seed) % (2 * job->height)) / 2.0 - 4;
+        double x1 = x0 + 1 + (SWKernelRandom(&seed) % 80) / 2.0;
+        double y1 = y0 + 1 + (SWKernelRandom(&seed) % 80) / 2.0;
+        uint8_t color[4] = { 0, 0, 0, (uint8_t)SWKernelRandom(&seed) };
+        for (int c = 0; c < 3; c++)
+            color[c] = SWKernelRandom(&seed) % (color[3] + 1);
+        SWRasterBlend blend = (i % 3 == 0) ? SWRasterBlendCopy : SWRasterBlendOver;
+
+        SWRasterizerReset(rasterizer, job->width, job->height);
+        SWRasterizerMoveTo(rasterizer, x0, y0);
+        SWRasterizerLineTo(rasterizer, x1, y0);
+        SWRasterizerLineTo(rasterizer, x1, y1);
+        SWRasterizerLineTo(rasterizer, x0, y1);
+        SWRasterizerFill(rasterizer, SWFillNonZero, job->canvas, job->bytesPerRow, color, blend);
+
+        for (long y = 0; y < job->height; y++)
+            for (long x = 0; x < job->width; x++)
+            {
+                double w = fmin(x + 1, x1) - fmax(x, x0), h = fmin(y + 1, y1) - fmax(y, y0);
+                if (w <= 0 || h <= 0)
+                    continue;
+                unsigned alpha = (unsigned)(w * h * 255.0 + 0.5);
+                if (alpha == 0)
+                    continue;
+                uint8_t *p = expected + y * job->bytesPerRow + x * 4;
+                uint8_t source[4];
+                for (int c = 0; c < 4; c++)
+                    source[c] = SWKernelScale(color[c], alpha);
+                unsigned keep = (blend == SWRasterBlendOver) ? 255u - source[3] : 255u - alpha;
+                for (int c = 0; c < 4; c++)
+                    p[c] = source[c] + SWKernelScale(p[c], keep);
+            }
+    }
+
+    SWKernelCompare(job->canvas, expected, job->width, job->height, job->bytesPerRow, check);
+    free(expected);
+}
+
+
+static void SWKernelVerifyRasterizerCoverage(SWKernelJob *job, SWKernelCheck *check)
+{
+    // A circle's coverage has to add up to its area, be solid well inside it
+    // and be nothing well outside it
+    SWRasterizer *rasterizer = job->state;
+    static const uint8_t white[4] = { 255, 255, 255, 255 };
+    for (int i = 0; i < 8; i++)
+    {
+        double r = 1.5 + 5 * i, cx = job->width / 2.0 + 0.25 * i, cy = job->height / 2.0 - 0.125 * i;
+        memset(job->canvas, 0, job->bytesPerRow * job->height);
+        SWRasterizerReset(rasterizer, job->width, job->height);
+        SWKernelAddCircle(rasterizer, cx, cy, r);
+        SWRasterizerFill(rasterizer, SWFillNonZero, job->canvas, job->bytesPerRow, white, SWRasterBlendCopy);
+
+        double total = 0;
+        for (long y = 0; y < job->height; y++)
+            for (long x = 0; x < job->width; x++)
+            {
+                uint8_t alpha = job->canvas[y * job->bytesPerRow + x * 4 + 3];
+                double d = hypot(x + 0.5 - cx, y + 0.5 - cy);
+                total += alpha / 255.0;
+                if (d + 0.71 < r && alpha != 255)
+                    check->differingBytes++;
+                else if (d - 0.71 > r && alpha != 0)
+                    check->differingBytes++;
+            }
+
+        // Only whole circles can be checked by area
+        if (cx - r >= 0 && cy - r >= 0 && cx + r <= job->width && cy + r <= job->height &&
+            fabs(total - M_PI * r * r) > 0.002 * M_PI * r * r + 0.5)
+            check->differingBytes++;
+    }
+}
+
+
+static void SWKernelVerifyRasterizer(SWKernelJob *job, SWKernelCheck *check)
+{
+    SWKernelVerifyRasterizerBlend(job, check);
+    SWKernelVerifyRasterizerCoverage(job, check);
+}
+
+
+#define kSWKernelDabs           500
+
+
+static bool SWKernelSetUpDabs(SWKernelJob *job)
+{
+    job->state = SWBrushTipCacheCreate();
+    job->items = kSWKernelDabs;
+    return job->state != NULL;
+}
+
+
+static void SWKernelTearDownDabs(SWKernelJob *job)
+{
+    SWBrushTipCacheDestroy(job->state);
+}
+
+
+// A stroke of dabs across the canvas, corner to corner, like the app's
+// benchmark.  The tip is made once, in the first run, as it would be in use
+static void SWKernelRunDabs(SWKernelJob *job, SWBrushTipShape shape, long size)
+{
+    static const uint8_t color[4] = { 20, 60, 100, 200 };
+    const SWBrushTip *tip = SWBrushTipCacheGet(job->state, shape, size);
+    for (int i = 0; i < kSWKernelDabs; i++)
+    {
+        long left, top;
+        double t = (double)i / kSWKernelDabs;
+        SWBrushDabOrigin(tip, t * job->width, t * job->height, &left, &top);
+        SWBrushStamp(job->canvas, job->width, job->height, job->bytesPerRow, tip, left, top, color);
+    }
+}
+
+
+static void SWKernelRunDabsRound256(SWKernelJob *job)
+{
+    SWKernelRunDabs(job, SWTipRound, 256);
+}
+
+
+static void SWKernelRunDabsSoft256(SWKernelJob *job)
+{
+    SWKernelRunDabs(job, SWTipSoft, 256);
+}
+
+
+static void SWKernelRunDabsRound512(SWKernelJob *job)
+{
+    SWKernelRunDabs(job, SWTipRound, 512);
+}
+
+
+static void SWKernelVerifyDabs(SWKernelJob *job, SWKernelCheck *check)
+{
+    // Dabs of every shape, some hanging off the edges, against a pixel at a
+    // time: the color scaled by the mask, kept wherever it covers more
+    uint8_t *expected = malloc(job->bytesPerRow * job->height);
+    if (!expected)
+    {
+        check->error = "out of memory";
+        return;
+    }
+    memcpy(job->canvas, job->input, job->bytesPerRow * job->height);
+    memcpy(expected, job->input, job->bytesPerRow * job->height);
+
+    static const SWBrushTipShape shapes[] = { SWTipRound, SWTipSquare, SWTipSoft };
+    uint32_t seed = 5;
+    for (int i = 0; i < 96; i++)
+    {
+        // Channels over the alpha too, which a dab has to clamp
+        uint8_t color[4];
+        for (int c = 0; c < 4; c++)
+            color[c] = (uint8_t)SWKernelRandom(&seed);
+        long size = 1 + SWKernelRandom(&seed) % 64;
+        const SWBrushTip *tip = SWBrushTipCacheGet(job->state, shapes[i % 3], size);
+        if (!tip)
+        {
+            check->error = "no tip";
+            break;
+        }
+        long left, top;
+        SWBrushDabOrigin(tip, (double)(SWKernelRandom(&seed) % (job->width + 64)) - 32 + 0.25,
+                         (double)(SWKernelRandom(&seed) % (job->height + 64)) - 32 + 0.75, &left, &top);
+        SWBrushStamp(job->canvas, job->width, job->height, job->bytesPerRow, tip, left, top, color);
+
+        for (long y = top; y < top + tip->size; y++)
+            for (long x = left; x < left + tip->size; x++)
+            {
+                if (x < 0 || y < 0 || x >= job->width || y >= job->height)
+                    continue;
+                unsigned m = tip->mask[(y - top) * tip->size + (x - left)];
+                uint8_t source[4];
+                for (int c = 0; c < 4; c++)
+                    source[c] = SWKernelScale(c < 3 && color[c] > color[3] ? color[3] : color[c], m);
+                uint8_t *p = expected + y * job->bytesPerRow + x * 4;
+                if (source[3] > p[3])
+                    memcpy(p, source, 4);
+            }
+    }
+
+    SWKernelCompare(job->canvas, expected, job->width, job->height, job->bytesPerRow, check);
+    free(expected);
+}
+
+
+// Rows a worker shades at a time, as in SWFillImageWithShader
+#define kSWKernelFillBandRows   16
+#define kSWKernelFillMaxThreads 64
+
+typedef struct {
+    SWFillShader *shader;
+    uint8_t pattern[8 * 8 * 4];
+
+    // One fill, shared by its workers
+    uint8_t *pixels;
+    size_t bytesPerRow;
+    long height;
+    const uint8_t *mask;        // A byte a pixel, or NULL for every pixel
+    size_t maskBytesPerRow;
+    atomic_long nextBand;
+} SWKernelFillState;
+
+
+static bool SWKernelSetUpFill(SWKernelJob *job)
+{
+    SWKernelFillState *state = calloc(1, sizeof(SWKernelFillState));
+    if (!state || !(state->shader = SWFillShaderCreate(job->width, job->height)))
+    {
+        free(state);
+        return false;
+    }
+
+    // The app's benchmark pattern: 8 by 8 checks, white and clear
+    for (int i = 0; i < 8 * 8; i++)
+        memset(state->pattern + i * 4, ((i / 8 + i % 8) % 2) ? 0xFF : 0, 4);
+    job->state = state;
+    return true;
+}
+
+
+static void SWKernelTearDownFill(SWKernelJob *job)
+{
+    SWKernelFillState *state = job->state;
+    SWFillShaderDestroy(state->shader);
+    free(state);
+}
+
+
+static void *SWKernelFillWorker(void *argument)
+{
+    SWKernelFillState *state = argument;
+    long first;
+    while ((first = atomic_fetch_add(&state->nextBand, 1) * kSWKernelFillBandRows) < state->height)
+    {
+        long last = first + kSWKernelFillBandRows;
+        if (last > state->height)
+            last = state->height;
+        SWFillShaderFillRows(state->shader, state->pixels, state->bytesPerRow, first, last,
+                             state->mask, state->maskBytesPerRow);
+    }
+    return NULL;
+}
+
+
+// Bands of rows handed out to up to this many threads, as dispatch_apply does
+// in the app
+static void SWKernelFillBands(SWKernelJob *job, uint8_t *pixels, const uint8_t *mask, long threads)
+{
+    SWKernelFillState *state = job->state;
+    state->pixels = pixels;
+    state->bytesPerRow = job->bytesPerRow;
+    state->height = job->height;
+    state->mask = mask;
+    state->maskBytesPerRow = mask ? (size_t)job->width : 0;
+    atomic_store(&state->nextBand, 0);
+
+    pthread_t workers[kSWKernelFillMaxThreads];
+    long count = 0;
+    if (threads > kSWKernelFillMaxThreads)
+        threads = kSWKernelFillMaxThreads;
+    while (count < threads - 1 && pthread_create(&workers[count], NULL, SWKernelFillWorker, state) == 0)
+        count++;
+    SWKernelFillWorker(state);
+    for (long i = 0; i < count; i++)
+        pthread_join(workers[i], NULL);
+}
+
+
+static long SWKernelProcessors(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+
+// The same colors as the app's benchmark: black to blue, dithered
+static void SWKernelSetLinear(SWKernelJob *job)
+{
+    static const uint8_t black[4] = { 0, 0, 0, 255 }, blue[4] = { 0, 0, 255, 255 };
+    SWKernelFillState *state = job->state;
+    SWFillShaderSetDither(state->shader, 1);
+    SWFillShaderSetLinear(state->shader, 0, 0, job->width, job->height, black, blue);
+}
+
+
+static void SWKernelSetRadial(SWKernelJob *job)
+{
+    static const uint8_t black[4] = { 0, 0, 0, 255 }, blue[4] = { 0, 0, 255, 255 };
+    SWKernelFillState *state = job->state;
+    SWFillShaderSetDither(state->shader, 1);
+    SWFillShaderSetRadial(state->shader, job->width / 2.0, job->height / 2.0,
+                          hypot(job->width, job->height) / 2.0, black, blue);
+}
+
+
+static void SWKernelSetPattern(SWKernelJob *job)
+{
+    SWKernelFillState *state = job->state;
+    SWFillShaderSetPattern(state->shader, state->pattern, 8, 8, 8 * 4);
+}
+
+
+static void SWKernelRunFillLinear(SWKernelJob *job)
+{
+    SWKernelSetLinear(job);
+    SWKernelFillBands(job, job->canvas, NULL, SWKernelProcessors());
+}
+
+
+static void SWKernelRunFillRadial(SWKernelJob *job)
+{
+    SWKernelSetRadial(job);
+    SWKernelFillBands(job, job->canvas, NULL, SWKernelProcessors());
+}
+
+
+static void SWKernelRunFillPattern(SWKernelJob *job)
+{
+    SWKernelSetPattern(job);
+    SWKernelFillBands(job, job->canvas, NULL, SWKernelProcessors());
+}
+
+
+static void SWKernelRunFillLinearSingle(SWKernelJob *job)
+{
+    SWKernelSetLinear(job);
+    SWKernelFillBands(job, job->canvas, NULL, 1);
+}
+
+
+static void SWKernelVerifyFillThreads(SWKernelJob *job, void (*set)(SWKernelJob *), SWKernelCheck *check)
+{
+    // Splitting the rows between threads mustn't change anything, with a mask
+    // of every value or without one
+    size_t length = job->bytesPerRow * job->height;
+    uint8_t *expected = malloc(length);
+    uint8_t *mask = malloc((size_t)job->width * job->height);
+    if (!expected || !mask)
+    {
+        check->error = "out of memory";
+        free(expected);
+        free(mask);
+        return;
+    }
+    uint32_t seed = 9;
+    for (long i = 0; i < job->width * job->height; i++)
+        mask[i] = (uint8_t)SWKernelRandom(&seed);
+
+    set(job);
+    for (int masked = 0; masked < 2; masked++)
+    {
+        memcpy(expected, job->input, length);
+        memcpy(job->canvas, job->input, length);
+        SWFillShaderFillRows(((SWKernelFillState *)job->state)->shader, expected, job->bytesPerRow,
+                             0, job->height, masked ? mask : NULL, masked ? (size_t)job->width : 0);
+        SWKernelFillBands(job, job->canvas, masked ? mask : NULL, 4);
+        SWKernelCompare(job->canvas, expected, job->width, job->height, job->bytesPerRow, check);
+    }
+    free(expected);
+    free(mask);
+}
+
+
+static void SWKernelVerifyFillLinear(SWKernelJob *job, SWKernelCheck *check)
+{
+    SWKernelVerifyFillThreads(job, SWKernelSetLinear, check);
+}
+
+
+static void SWKernelVerifyFillRadial(SWKernelJob *job, SWKernelCheck *check)
+{
+    SWKernelVerifyFillThreads(job, SWKernelSetRadial, check);
+}
+
+
+static void SWKernelVerifyFillPattern(SWKernelJob *job, SWKernelCheck *check)
+{
+    SWKernelVerifyFillThreads(job, SWKernelSetPattern, check);
+
+    // ...and the pattern is tiled from the origin, a pixel at a time
+    uint8_t *expected = malloc(job->bytesPerRow * job->height);
+    if (!expected)
+    {
+        check->error = "out of memory";
+        return;
+    }
+    const uint8_t *pattern = ((SWKernelFillState *)job->state)->pattern;
+    for (long y = 0; y < job->height; y++)
+        for (long x = 0; x < job->width; x++)
+            memcpy(expected + y * job->bytesPerRow + x * 4, pattern + ((y % 8) * 8 + x % 8) * 4, 4);
+    SWKernelRunFillPattern(job);
+    SWKernelCompare(job->canvas, expected, job->width, job->height, job->bytesPerRow, check);
+    free(expected);
+}
+
+
+// A smooth brush stroke mirrored eight ways, grown an event at a time, the
+// way the brush and eraser draw one.  Each segment's stroke is a capsule,
+// a polygon here rather than Quartz's outline, and the stroke is them all put
+// together
+#define kSWKernelStrokeEvents   120
+#define kSWKernelStrokeRadius   4.0
+#define kSWKernelStrokeCopies   8
+#define kSWKernelCapSteps       16
+
+typedef struct {
+    long left, top, right, bottom;
+} SWKernelRect;
+
+typedef struct {
+    SWRasterizer *rasterizer;
+    double (*points)[2];        // Every copy of every point, copy after copy
+    long pointCount;
+} SWKernelStrokeState;
+
+
+static bool SWKernelRectIsEmpty(SWKernelRect r)
+{
+    return r.left >= r.right || r.top >= r.bottom;
+}
+
+
+static bool SWKernelRectsOverlap(SWKernelRect a, SWKernelRect b)
+{
+    return !SWKernelRectIsEmpty(a) && !SWKernelRectIsEmpty(b) &&
+           a.left < b.right && b.left < a.right && a.top < b.bottom && b.top < a.bottom;
+}
+
+
+static SWKernelRect SWKernelRectUnion(SWKernelRect a, SWKernelRect b)
+{
+    if (SWKernelRectIsEmpty(a))
+        return b;
+    if (SWKernelRectIsEmpty(b))
+        return a;
+    return (SWKernelRect){ a.left < b.left ? a.left : b.left, a.top < b.top ? a.top : b.top,
+                           a.right > b.right ? a.right : b.right, a.bottom > b.bottom ? a.bottom : b.bottom };
+}
+
+
+// SWAddRectToRects, in whole pixels
+static int SWKernelAddRect(SWKernelRect rect, SWKernelRect *rects, int count, int capacity)
+{
+    if (SWKernelRectIsEmpty(rect))
+        return count;
+    for (;;)
+    {
+        int i = 0;
+        while (i < count && !SWKernelRectsOverlap(rects[i], rect))
+            i++;
+        if (i == count && count < capacity)
+            break;
+        if (i == count)
+            i = count - 1;
+        rect = SWKernelRectUnion(rect, rects[i]);
+        rects[i] = rects[--count];
+    }
+    rects[count] = rect;
+    return count + 1;
+}
+
+
+// Where the copies of a point go: across the middle both ways, and the diagonals
+static void SWKernelMirror8(const SWKernelJob *job, double x, double y, double copies[][2])
+{
+    double cx = job->width / 2.0, cy = job->height / 2.0, dx = x - cx, dy = y - cy;
+    const double moves[kSWKernelStrokeCopies][2] = {
+        { dx, dy }, { -dx, dy }, { dx, -dy }, { -dx, -dy },
+        { dy, dx }, { -dy, dx }, { dy, -dx }, { -dy, -dx }
+    };
+    for (int i = 0; i < kSWKernelStrokeCopies; i++)
+    {
+        copies[i][0] = cx + moves[i][0];
+        copies[i][1] = cy + moves[i][1];
+    }
+}
+
+
+static bool SWKernelSetUpStroke(SWKernelJob *job)
+{
+    SWKernelStrokeState *state = calloc(1, sizeof(SWKernelStrokeState));
+    if (!state)
+        return false;
+    state->rasterizer = SWRasterizerCreate();
+    state->points = malloc(sizeof(double[2]) * kSWKernelStrokeEvents * kSWKernelStrokeCopies);
+    if (!state->rasterizer || !state->points)
+    {
+        SWRasterizerDestroy(state->rasterizer);
+        free(state->points);
+        free(state);
+        return false;
+    }
+
+    // A loop that winds out from a third of the way in, crossing itself
+    double (*copies)[2] = malloc(sizeof(double[2]) * kSWKernelStrokeCopies);
+    for (long i = 0; copies && i < kSWKernelStrokeEvents; i++)
+    {
+        double t = i * 0.15, r = 4 + i * 0.25 * (job->width < job->height ? job->width : job->height) / 100.0;
+        SWKernelMirror8(job, floor(job->width * 0.3 + r * cos(t)) + 0.5, floor(job->height * 0.3 + r * sin(t)) + 0.5, copies);
+        for (int c = 0; c < kSWKernelStrokeCopies; c++)
+        {
+            state->points[c * kSWKernelStrokeEvents + i][0] = copies[c][0];
+            state->points[c * kSWKernelStrokeEvents + i][1] = copies[c][1];
+        }
+    }
+    free(copies);
+    state->pointCount = kSWKernelStrokeEvents;
+    job->state = state;
+    job->items = kSWKernelStrokeEvents;
+    return true;
+}
+
+
+static void SWKernelTearDownStroke(SWKernelJob *job)
+{
+    SWKernelStrokeState *state = job->state;
+    SWRasterizerDestroy(state->rasterizer);
+    free(state->points);
+    free(state);
+}
+
+
+// One segment's round-capped stroke, moved by (-left, -top)
+static void SWKernelAddCapsule(SWRasterizer *rasterizer, const double *a, const double *b, long left, long top)
+{
+    double angle = atan2(b[1] - a[1], b[0] - a[0]);
+    for (int end = 0; end < 2; end++)
+    {
+        const double *p = end ? b : a;
+        double start = angle + (end ? -M_PI_2 : M_PI_2);
+        for (int i = 0; i <= kSWKernelCapSteps; i++)
+        {
+            double theta = start + M_PI * i / kSWKernelCapSteps;
+            double x = p[0] + kSWKernelStrokeRadius * cos(theta) - left;
+            double y = p[1] + kSWKernelStrokeRadius * sin(theta) - top;
+            if (end == 0 && i == 0)
+                SWRasterizerMoveTo(rasterizer, x, y);
+            else
+                SWRasterizerLineTo(rasterizer, x, y);
+        }
+    }
+    SWRasterizerClose(rasterizer);
+}
+
+
+// The segments from the first up to the last point, or just the ones that reach
+// into a rect, filled into that rect
+static void SWKernelFillStroke(SWKernelJob *job, long last, SWKernelRect rect)
+{
+    static const uint8_t color[4] = { 30, 60, 120, 153 };
+    SWKernelStrokeState *state = job->state;
+    double reach = kSWKernelStrokeRadius + 1;
+
+    for (long y = rect.top; y < rect.bottom; y++)
+        memset(job->canvas + y * job->bytesPerRow + rect.left * 4, 0, (rect.right - rect.left) * 4);
+    SWRasterizerReset(state->rasterizer, rect.right - rect.left, rect.bottom - rect.top);
+    for (int c = 0; c < kSWKernelStrokeCopies; c++)
+    {
+        const double (*points)[2] = (const double (*)[2])state->points + c * kSWKernelStrokeEvents;
+        for (long i = 0; i <= last; i++)
+        {
+            const double *a = points[i > 0 ? i - 1 : 0], *b = points[i];
+            if (fmax(a[0], b[0]) + reach < rect.left || fmin(a[0], b[0]) - reach > rect.right ||
+                fmax(a[1], b[1]) + reach < rect.top || fmin(a[1], b[1]) - reach > rect.bottom)
+                continue;
+            SWKernelAddCapsule(state->rasterizer, a, b, rect.left, rect.top);
+        }
+    }
+    SWRasterizerFill(state->rasterizer, SWFillNonZero, job->canvas + rect.top * job->bytesPerRow + rect.left * 4,
+                     job->bytesPerRow, color, SWRasterBlendCopy);
+}
+
+
+static void SWKernelRunStrokeWhole(SWKernelJob *job)
+{
+    // The whole stroke again on every event
+    SWKernelRect all = { 0, 0, job->width, job->height };
+    for (long i = 0; i < kSWKernelStrokeEvents; i++)
+        SWKernelFillStroke(job, i, all);
+}
+
+
+static void SWKernelRunStrokeIncremental(SWKernelJob *job)
+{
+    // Only where each copy's new segment and the one before it reach, like
+    // addRectToRedrawRect: does
+    SWKernelStrokeState *state = job->state;
+    SWKernelRect saved[kSWKernelStrokeCopies] = { { 0, 0, 0, 0 } };
+    long reach = (long)ceil(kSWKernelStrokeRadius) + 1;
+    for (long i = 0; i < kSWKernelStrokeEvents; i++)
+    {
+        SWKernelRect rects[kSWKernelStrokeCopies];
+        int count = 0;
+        for (int c = 0; c < kSWKernelStrokeCopies; c++)
+        {
+            const double *a = state->points[c * kSWKernelStrokeEvents + (i > 0 ? i - 1 : 0)];
+            const double *b = state->points[c * kSWKernelStrokeEvents + i];
+            SWKernelRect rect = { (long)floor(fmin(a[0], b[0])) - reach, (long)floor(fmin(a[1], b[1])) - reach,
+                                  (long)ceil(fmax(a[0], b[0])) + reach, (long)ceil(fmax(a[1], b[1])) + reach };
+            SWKernelRect both = SWKernelRectUnion(rect, saved[c]);
+            saved[c] = rect;
+            both.left = both.left < 0 ? 0 : both.left;
+            both.top = both.top < 0 ? 0 : both.top;
+            both.right = both.right > job->width ? job->width : both.right;
+            both.bottom = both.bottom > job->height ? job->height : both.bottom;
+            count = SWKernelAddRect(both, rects, count, kSWKernelStrokeCopies);
+        }
+        for (int r = 0; r < count; r++)
+            SWKernelFillStroke(job, i, rects[r]);
+    }
+}
+
+
+static void SWKernelVerifyStroke(SWKernelJob *job, SWKernelCheck *check)
+{
+    // Drawn as it grows, it has to come out as it does drawn all at once.  The
+    // rasterizer adds coverage up in floats, and clipping it to a rect adds it
+    // up in a different order, so an edge pixel can round the other way: a
+    // step off is allowed, nothing more
+    uint8_t *expected = malloc(job->bytesPerRow * job->height);
+    if (!expected)
+    {
+        check->error = "out of memory";
+        return;
+    }
+    SWKernelRunStrokeWhole(job);
+    memcpy(expected, job->canvas, job->bytesPerRow * job->height);
+    memcpy(job->canvas, job->input, job->bytesPerRow * job->height);
+    for (long y = 0; y < job->height; y++)
+        memset(job->canvas + y * job->bytesPerRow, 0, job->width * 4);
+    SWKernelRunStrokeIncremental(job);
+    for (long y = 0; y < job->height; y++)
+        for (long x = 0; x < job->width * 4; x++)
+        {
+            uint8_t a = job->canvas[y * job->bytesPerRow + x], e = expected[y * job->bytesPerRow + x];
+            unsigned delta = (a > e) ? a - e : e - a;
+            check->differingBytes += (delta > 1);
+            if (delta > 1 && delta > check->maxDelta)
+                check->maxDelta = delta;
+        }
+    free(expected);
+}
+
+
+static const SWKernelCase SWKernelCases[] = {
+    { "copy", NULL, NULL, SWKernelRunCopy, NULL, SWKernelVerifyCopy },
+    { "handoff_publish", "publishes", SWKernelSetUpHandoff, SWKernelRunHandoff, SWKernelTearDownHandoff, SWKernelVerifyHandoff },
+    { "sparse_fill", NULL, SWKernelSetUpSparse, SWKernelRunSparseFill, SWKernelTearDownSparse, SWKernelVerifySparseFill },
+    { "sparse_scan", NULL, SWKernelSetUpSparse, SWKernelRunSparseScan, SWKernelTearDownSparse, SWKernelVerifySparseScan },
+    { "scratch_sweep", NULL, SWKernelSetUpScratch, SWKernelRunScratchSweep, SWKernelTearDownScratch, SWKernelVerifyScratchSweep },
+    { "scratch_fill", NULL, SWKernelSetUpScratch, SWKernelRunScratchFill, SWKernelTearDownScratch, SWKernelVerifyScratchFill },
+    { "sampler_average", "samples", SWKernelSetUpSampler, SWKernelRunSamplerAverage, SWKernelTearDownSampler, SWKernelVerifySamplerAverage },
+    { "sampler_dominant", "samples", SWKernelSetUpSampler, SWKernelRunSamplerDominant, SWKernelTearDownSampler, SWKernelVerifySamplerDominant },
+    { "raster_circles", "paths", SWKernelSetUpRasterizer, SWKernelRunRasterizer, SWKernelTearDownRasterizer, SWKernelVerifyRasterizer },
+    { "dabs_round_256", "dabs", SWKernelSetUpDabs, SWKernelRunDabsRound256, SWKernelTearDownDabs, SWKernelVerifyDabs },
+    { "dabs_soft_256", "dabs", SWKernelSetUpDabs, SWKernelRunDabsSoft256, SWKernelTearDownDabs, SWKernelVerifyDabs },
+    { "dabs_round_512", "dabs", SWKernelSetUpDabs, SWKernelRunDabsRound512, SWKernelTearDownDabs, SWKernelVerifyDabs },
+    { "fill_linear", NULL, SWKernelSetUpFill, SWKernelRunFillLinear, SWKernelTearDownFill, SWKernelVerifyFillLinear },
+    { "fill_linear_1_thread", NULL, SWKernelSetUpFill, SWKernelRunFillLinearSingle, SWKernelTearDownFill, SWKernelVerifyFillLinear },
+    { "fill_radial", NULL, SWKernelSetUpFill, SWKernelRunFillRadial, SWKernelTearDownFill, SWKernelVerifyFillRadial },
+    { "fill_pattern", NULL, SWKernelSetUpFill, SWKernelRunFillPattern, SWKernelTearDownFill, SWKernelVerifyFillPattern },
+    { "stroke_mirror8_whole", "events", SWKernelSetUpStroke, SWKernelRunStrokeWhole, SWKernelTearDownStroke, SWKernelVerifyStroke },
+    { "stroke_mirror8_incremental", "events", SWKernelSetUpStroke, SWKernelRunStrokeIncremental, SWKernelTearDownStroke, SWKernelVerifyStroke },
+};
+
+#define kSWKernelCaseCount (sizeof(SWKernelCases) / sizeof(SWKernelCases[0]))
+
+
+// Running
+
+static double SWKernelMilliseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1.0e6;
+}
+
+
+static int SWKernelCompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static int SWKernelParseSizes(const char *list, long sizes[][2])
+{
+    int count = 0;
+    while (*list && count < kSWKernelMaxSizes)
+    {
+        char *end;
+        long w = strtol(list, &end, 10);
+        if (*end != 'x')
+            return -1;
+        long h = strtol(end + 1, &end, 10);
+        if (w <= 0 || h <= 0 || (*end && *end != ','))
+            return -1;
+        sizes[count][0] = w;
+        sizes[count][1] = h;
+        count++;
+        list = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+
+static bool SWKernelIsSelected(const char *name, const char *only)
+{
+    if (!only)
+        return true;
+    size_t length = strlen(name);
+    for (const char *p = only; *p; )
+    {
+        const char *comma = strchr(p, ',');
+        size_t n = comma ? (size_t)(comma - p) : strlen(p);
+        if (n == length && strncmp(p, name, n) == 0)
+            return true;
+        p += n + (comma != NULL);
+    }
+    return false;
+}
+
+
+static bool SWKernelJobCreate(SWKernelJob *job, const SWKernelCase *kernel, long width, long height)
+{
+    memset(job, 0, sizeof(*job));
+    job->width = width;
+    job->height = height;
+    job->bytesPerRow = ((size_t)width * 4 + 15) & ~(size_t)15;
+    job->input = malloc(job->bytesPerRow * height);
+    job->canvas = malloc(job->bytesPerRow * height);
+    if (!job->input || !job->canvas)
+    {
+        free(job->input);
+        free(job->canvas);
+        return false;
+    }
+    SWKernelFillNoise(job->input, width, height, job->bytesPerRow, 1);
+    memcpy(job->canvas, job->input, job->bytesPerRow * height);
+    if (kernel->setUp && !kernel->setUp(job))
+    {
+        free(job->input);
+        free(job->canvas);
+        return false;
+    }
+    return true;
+}
+
+
+static void SWKernelJobDestroy(SWKernelJob *job, const SWKernelCase *kernel)
+{
+    if (kernel->tearDown)
+        kernel->tearDown(job);
+    free(job->input);
+    free(job->canvas);
+}
+
+
+static void SWKernelTime(FILE *report, long sizes[][2], int sizeCount, int iterations, const char *only)
+{
+    double *times = malloc(iterations * sizeof(double));
+    bool first = true;
+
+    fprintf(report, "  \"results\": [");
+    for (size_t c = 0; c < kSWKernelCaseCount; c++)
+    {
+        const SWKernelCase *kernel = &SWKernelCases[c];
+        if (!SWKernelIsSelected(kernel->name, only))
+            continue;
+
+        for (int s = 0; s < sizeCount; s++)
+        {
+            SWKernelJob job;
+            if (!SWKernelJobCreate(&job, kernel, sizes[s][0], sizes[s][1]))
+            {
+                fprintf(stderr, "%s: couldn't set up at %ldx%ld\n", kernel->name, sizes[s][0], sizes[s][1]);
+                continue;
+            }
+
+            // One untimed run to warm up the caches and fault in the pages
+            for (int iteration = 0; iteration <= iterations; iteration++)
+            {
+                memcpy(job.canvas, job.input, job.bytesPerRow * job.height);
+                double start = SWKernelMilliseconds();
+                kernel->run(&job);
+                if (iteration > 0)
+                    times[iteration - 1] = SWKernelMilliseconds() - start;
+            }
+            qsort(times, iterations, sizeof(double), SWKernelCompareDoubles);
+            double median = times[iterations / 2];
+
+            fprintf(report, "%s\n    {\"operation\": \"%s\", \"width\": %ld, \"height\": %ld, "
+                    "\"iterations\": %d, \"median_ms\": %.4f, \"min_ms\": %.4f, \"max_ms\": %.4f, "
+                    "\"megapixels_per_s\": %.2f",
+                    first ? "" : ",", kernel->name, job.width, job.height, iterations,
+                    median, times[0], times[iterations - 1],
+                    median > 0 ? job.width * job.height / (median * 1000.0) : 0.0);
+            if (kernel->unit)
+                fprintf(report, ", \"%s_per_s\": %.1f", kernel->unit,
+                        median > 0 ? job.items / (median / 1000.0) : 0.0);
+            fprintf(report, "}");
+            first = false;
+
+            SWKernelJobDestroy(&job, kernel);
+        }
+    }
+    fprintf(report, "\n  ]\n");
+    free(times);
+}
+
+
+static bool SWKernelVerify(FILE *report, long sizes[][2], int sizeCount, const char *only)
+{
+    bool allExact = true, first = true;
+
+    fprintf(report, "  \"verify\": [");
+    for (size_t c = 0; c < kSWKernelCaseCount; c++)
+    {
+        // Only the ones with a well-defined answer
+        const SWKernelCase *kernel = &SWKernelCases[c];
+        if (!kernel->verify || !SWKernelIsSelected(kernel->name, only))
+            continue;
+
+        for (int s = 0; s < sizeCount; s++)
+        {
+            SWKernelJob job;
+            SWKernelCheck check = { 0, 0, NULL };
+            if (SWKernelJobCreate(&job, kernel, sizes[s][0], sizes[s][1]))
+            {
+                kernel->verify(&job, &check);
+                SWKernelJobDestroy(&job, kernel);
+            }
+            else
+                check.error = "couldn't set up";
+
+            bool exact = !check.error && check.differingBytes == 0;
+            allExact &= exact;
+            fprintf(report, "%s\n    {\"operation\": \"%s\", \"width\": %ld, \"height\": %ld, \"exact\": %s",
+                    first ? "" : ",", kernel->name, sizes[s][0], sizes[s][1], exact ? "true" : "false");
+            if (check.error)
+                fprintf(report, ", \"error\": \"%s\"", check.error);
+            else if (!exact)
+                fprintf(report, ", \"differing_bytes\": %zu, \"max_delta\": %u", check.differingBytes, check.maxDelta);
+            fprintf(report, "}");
+            first = false;
+
+            if (!exact)
+                fprintf(stderr, "%s at %ldx%ld doesn't match its reference\n", kernel->name, sizes[s][0], sizes[s][1]);
+        }
+    }
+    fprintf(report, "\n  ]\n");
+    return allExact;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *sizeList = NULL, *only = NULL, *reportPath = NULL;
+    int iterations = kSWKernelDefaultIterations;
+    bool verify = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--verify") == 0)
+            verify = true;
+        else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc)
+            sizeList = argv[++i];
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc)
+            only = argv[++i];
+        else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc)
+            reportPath = argv[++i];
+        else
+        {
+            fprintf(stderr, "usage: %s [--sizes WxH,...] [--iterations N] [--only name,...] "
+                    "[--report file.json] [--verify]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    long sizes[kSWKernelMaxSizes][2];
+    if (!sizeList)
+        sizeList = verify ? kSWKernelVerifySizes : kSWKernelDefaultSizes;
+    int sizeCount = SWKernelParseSizes(sizeList, sizes);
+    if (sizeCount <= 0 || iterations <= 0)
+    {
+        fprintf(stderr, "%s: bad --sizes or --iterations\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *report = reportPath ? fopen(reportPath, "w") : stdout;
+    if (!report)
+    {
+        perror(reportPath);
+        return EXIT_FAILURE;
+    }
+
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(report, "{\n  \"date\": \"%s\",\n  \"cpus\": %ld,\n", date, sysconf(_SC_NPROCESSORS_ONLN));
+
+    bool passed = true;
+    if (verify)
+        passed = SWKernelVerify(report, sizes, sizeCount, only);
+    else
+        SWKernelTime(report, sizes, sizeCount, iterations, only);
+    fprintf(report, "}\n");
+
+    if (report != stdout)
+        fclose(report);
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
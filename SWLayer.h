@@ -0,0 +1,68 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+// How a layer combines with what's below it.  The order is the order of the
+// Blend Mode menu, whose items are tagged with these
+typedef NS_ENUM(NSInteger, SWBlendMode) {
+    SWBlendModeNormal,
+    SWBlendModeMultiply,
+    SWBlendModeScreen,
+    SWBlendModeOverlay,
+    SWBlendModeDarken,
+    SWBlendModeLighten
+};
+
+
+// One layer of a document: an image in the canvas's flipped layout, and how
+// it gets combined with everything below it.
+//
+// Copies share the image, and keep the identifier, so a copy stands for the
+// same layer at an earlier point in time (which is just what undo needs)
+@interface SWLayer : NSObject <NSCopying>
+{
+    NSBitmapImageRep *image;
+    NSString *name;
+    CGFloat opacity;
+    BOOL visible;
+    SWBlendMode blendMode;
+    NSUInteger identifier;
+}
+
+- (instancetype)initWithImage:(NSBitmapImageRep *)image name:(NSString *)name NS_DESIGNATED_INITIALIZER;
+
+// Sets the context's alpha and blend mode to the layer's
+- (void)applyToContext:(CGContextRef)context;
+
+// Draws the layer over the whole of rect, with its opacity and blend mode.
+// Hidden layers draw nothing
+- (void)drawInContext:(CGContextRef)context rect:(NSRect)rect;
+
+@property (strong) NSBitmapImageRep *image;
+@property (copy) NSString *name;
+@property (assign) CGFloat opacity;
+@property (assign, getter=isVisible) BOOL visible;
+@property (assign) SWBlendMode blendMode;
+@property (readonly) NSUInteger identifier;
+
+// Visible, fully opaque and Normal: drawing it is a plain source-over
+@property (readonly) BOOL isPlain;
+
+@end
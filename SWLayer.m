@@ -0,0 +1,98 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWLayer.h"
+
+@implementation SWLayer
+
+@synthesize image;
+@synthesize name;
+@synthesize opacity;
+@synthesize visible;
+@synthesize blendMode;
+@synthesize identifier;
+
+- (instancetype)init
+{
+    return [self initWithImage:nil name:nil];
+}
+
+- (instancetype)initWithImage:(NSBitmapImageRep *)anImage name:(NSString *)aName
+{
+    self = [super init];
+    if (self)
+    {
+        static NSUInteger lastIdentifier = 0;
+        
+        image = anImage;
+        name = [aName copy];
+        opacity = 1.0;
+        visible = YES;
+        blendMode = SWBlendModeNormal;
+        identifier = ++lastIdentifier;
+    }
+    return self;
+}
+
+- (id)copyWithZone:(NSZone *)zone
+{
+    SWLayer *copy = [[SWLayer allocWithZone:zone] initWithImage:image name:name];
+    copy->opacity = opacity;
+    copy->visible = visible;
+    copy->blendMode = blendMode;
+    copy->identifier = identifier;
+    return copy;
+}
+
+
+- (BOOL)isPlain
+{
+    return visible && opacity >= 1.0 && blendMode == SWBlendModeNormal;
+}
+
+
+- (void)applyToContext:(CGContextRef)context
+{
+    static const CGBlendMode modes[] = {
+        kCGBlendModeNormal,
+        kCGBlendModeMultiply,
+        kCGBlendModeScreen,
+        kCGBlendModeOverlay,
+        kCGBlendModeDarken,
+        kCGBlendModeLighten
+    };
+    
+    CGContextSetAlpha(context, opacity);
+    if (blendMode >= 0 && blendMode < (SWBlendMode)(sizeof(modes) / sizeof(modes[0])))
+        CGContextSetBlendMode(context, modes[blendMode]);
+}
+
+
+- (void)drawInContext:(CGContextRef)context rect:(NSRect)rect
+{
+    if (!visible || opacity <= 0.0 || !image)
+        return;
+    
+    CGContextSaveGState(context);
+    [self applyToContext:context];
+    CGContextDrawImage(context, NSRectToCGRect(rect), image.CGImage);
+    CGContextRestoreGState(context);
+}
+
+@end
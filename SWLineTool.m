@@ -71,15 +71,21 @@
                          bufferImage:(NSBitmapImageRep *)bufferImage 
                           mouseEvent:(SWMouseEvent)event
 {
+    if (event == MOUSE_DOWN)
+        [self beginSymmetryInImage:mainImage];
+    
     // Use the points clicked to build a redraw rectangle
     [super addRedrawRectFromPoint:savedPoint toPoint:point];
 
     [SWImageTools clearImage:bufferImage];
     
+    // Antialiased lines are always drawn in the buffer, which then goes down
+    // over the image as it was shown
+    BOOL smooth = self.antialias;
     if (event == MOUSE_UP) 
     {
         [document handleUndoWithImageData:nil frame:NSZeroRect];
-        drawToMe = mainImage;
+        drawToMe = smooth ? bufferImage : mainImage;
     }
     else
         drawToMe = bufferImage;
@@ -88,11 +94,25 @@
     if (event == MOUSE_DOWN)
         primaryColor = (flags & NSEventModifierFlagOption) ? backColor : frontColor;
     
+    if (smooth)
+    {
+        [self strokePath:[self symmetricPath:[self pathFromPoint:savedPoint toPoint:point]] 
+                 inImage:drawToMe 
+               withColor:primaryColor 
+               operation:NSCompositingOperationSourceOver];
+        if (event == MOUSE_UP)
+        {
+            [SWImageTools drawToImage:mainImage fromImage:bufferImage withComposition:YES];
+            [SWImageTools clearImage:bufferImage];
+        }
+        return nil;
+    }
+    
     SWLockFocus(drawToMe); 
     [[NSGraphicsContext currentContext] setShouldAntialias:NO];
     
     [primaryColor setStroke];
-    [[self pathFromPoint:savedPoint toPoint:point] stroke];
+    [[self symmetricPath:[self pathFromPoint:savedPoint toPoint:point]] stroke];
     
     SWUnlockFocus(drawToMe);
     return nil;
@@ -0,0 +1,33 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+
+
+// Our own PNG encoder. AppKit's is single-threaded, which makes saving big
+// paintings painfully slow. This one filters and deflates bands of rows on all
+// cores, and picks the smallest pixel format the image fits in: a palette for
+// 256 colors or fewer, RGB for opaque images, RGBA for everything else.
+@interface SWPNGWriter : NSObject
+
+// Expects an upright (not flipped) 8-bit RGBA image, like the ones made by
+// +[SWImageTools flippedCopyOfImage:]
++ (NSData *)PNGDataFromImage:(NSBitmapImageRep *)image;
+
+@end
@@ -0,0 +1,541 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWPNGWriter.h"
+#import <zlib.h>
+
+// Each band of rows gets filtered and deflated on its own core.  Bands this big
+// keep the per-band overhead (a sync flush marker) down to a few bytes
+#define kSWPNGBandBytes     (256 * 1024)
+
+// Deflate looks back at most this far, so priming each band with the end of
+// the previous one compresses about as well as one long stream
+#define kSWPNGWindowBytes   32768
+
+#define kSWPNGMaxPalette    256
+#define kSWPNGHashBits      10
+#define kSWPNGHashSize      (1 << kSWPNGHashBits)
+
+static const unsigned char kSWPNGSignature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+
+// Everything the band workers need to know about the output format
+typedef struct SWPNGFormat {
+    const unsigned char *pixels;        // Premultiplied RGBA, top row first
+    NSInteger pixelRowBytes;
+    NSInteger width;
+    NSInteger height;
+
+    unsigned char colorType;            // 2 (RGB), 3 (palette) or 6 (RGBA)
+    unsigned char bitDepth;             // 8, or 1, 2 or 4 for small palettes
+    NSInteger filterBytes;              // Distance to the "left" byte when filtering
+    NSInteger rowBytes;                 // Packed row length, without the filter byte
+
+    // Palette lookup: an open-addressed hash of the raw (premultiplied) pixels.
+    // Distinct raw pixels can never outnumber distinct unpremultiplied colors,
+    // so counting them is enough to know whether a palette will work
+    uint32_t paletteKeys[kSWPNGHashSize];
+    short paletteSlots[kSWPNGHashSize];
+    NSInteger paletteCount;
+} SWPNGFormat;
+
+// One deflated band, ready to be written out as an IDAT chunk
+typedef struct SWPNGBand {
+    unsigned char *data;
+    size_t length;
+    size_t inputLength;
+    uLong adler;
+} SWPNGBand;
+
+
+static inline uint32_t SWPNGHash(uint32_t color)
+{
+    return (color * 2654435761u) >> (32 - kSWPNGHashBits);
+}
+
+
+// Returns the palette index for a color, or -1 if it isn't in the palette
+static inline NSInteger SWPNGPaletteLookup(const SWPNGFormat *format, uint32_t color)
+{
+    uint32_t slot = SWPNGHash(color);
+    while (format->paletteSlots[slot] >= 0)
+    {
+        if (format->paletteKeys[slot] == color)
+            return format->paletteSlots[slot];
+        slot = (slot + 1) & (kSWPNGHashSize - 1);
+    }
+    return -1;
+}
+
+
+static inline void SWPNGUnpremultiply(const unsigned char *src, unsigned char *dest)
+{
+    NSUInteger a = src[3];
+    if (a == 255)
+    {
+        dest[0] = src[0]; dest[1] = src[1]; dest[2] = src[2];
+    }
+    else if (a == 0)
+    {
+        dest[0] = dest[1] = dest[2] = 0;
+    }
+    else
+    {
+        dest[0] = MIN((src[0] * 255 + a / 2) / a, 255);
+        dest[1] = MIN((src[1] * 255 + a / 2) / a, 255);
+        dest[2] = MIN((src[2] * 255 + a / 2) / a, 255);
+    }
+    dest[3] = a;
+}
+
+
+// Looks at every pixel once to pick the output format, and builds the palette
+// along the way if the image turns out to have few enough colors
+static void SWPNGChooseFormat(SWPNGFormat *format)
+{
+    BOOL isOpaque = YES;
+    BOOL fitsPalette = YES;
+    uint32_t lastColor = 0;
+    BOOL hasLastColor = NO;
+
+    format->paletteCount = 0;
+    memset(format->paletteSlots, 0xFF, sizeof(format->paletteSlots));
+
+    NSInteger x, y;
+    for (y = 0; y < format->height; y++)
+    {
+        const unsigned char *p = format->pixels + y * format->pixelRowBytes;
+        for (x = 0; x < format->width; x++, p += 4)
+        {
+            if (p[3] != 255)
+                isOpaque = NO;
+
+            // Paintings are full of runs of the same color: skip the hash for them
+            uint32_t color;
+            memcpy(&color, p, 4);
+            if (!fitsPalette || (hasLastColor && color == lastColor))
+                continue;
+            lastColor = color;
+            hasLastColor = YES;
+
+            uint32_t slot = SWPNGHash(color);
+            while (format->paletteSlots[slot] >= 0 && format->paletteKeys[slot] != color)
+                slot = (slot + 1) & (kSWPNGHashSize - 1);
+
+            if (format->paletteSlots[slot] < 0)
+            {
+                if (format->paletteCount == kSWPNGMaxPalette)
+                {
+                    fitsPalette = NO;
+                    continue;
+                }
+                format->paletteKeys[slot] = color;
+                format->paletteSlots[slot] = format->paletteCount++;
+            }
+        }
+
+        // Once we know it's a truecolor image with alpha, there's nothing left to learn
+        if (!fitsPalette && !isOpaque)
+            break;
+    }
+
+    if (fitsPalette)
+    {
+        format->colorType = 3;
+        if (format->paletteCount <= 2)
+            format->bitDepth = 1;
+        else if (format->paletteCount <= 4)
+            format->bitDepth = 2;
+        else if (format->paletteCount <= 16)
+            format->bitDepth = 4;
+        else
+            format->bitDepth = 8;
+        format->filterBytes = 1;
+        format->rowBytes = (format->width * format->bitDepth + 7) / 8;
+    }
+    else if (isOpaque)
+    {
+        // Fast path: premultiplied and straight alpha are the same thing here
+        format->colorType = 2;
+        format->bitDepth = 8;
+        format->filterBytes = 3;
+        format->rowBytes = format->width * 3;
+    }
+    else
+    {
+        format->colorType = 6;
+        format->bitDepth = 8;
+        format->filterBytes = 4;
+        format->rowBytes = format->width * 4;
+    }
+}
+
+
+// Converts one row of the image into PNG pixels, without the filter byte
+static void SWPNGPackRow(const SWPNGFormat *format, NSInteger y, unsigned char *out)
+{
+    const unsigned char *p = format->pixels + y * format->pixelRowBytes;
+    NSInteger x, w = format->width;
+
+    if (format->colorType == 2)
+    {
+        for (x = 0; x < w; x++, p += 4, out += 3)
+        {
+            out[0] = p[0];
+            out[1] = p[1];
+            out[2] = p[2];
+        }
+    }
+    else if (format->colorType == 6)
+    {
+        for (x = 0; x < w; x++, p += 4, out += 4)
+            SWPNGUnpremultiply(p, out);
+    }
+    else
+    {
+        NSInteger depth = format->bitDepth;
+        uint32_t lastColor = 0;
+        NSInteger lastIndex = -1;
+
+        memset(out, 0, format->rowBytes);
+        for (x = 0; x < w; x++, p += 4)
+        {
+            uint32_t color;
+            memcpy(&color, p, 4);
+            if (lastIndex < 0 || color != lastColor)
+            {
+                lastColor = color;
+                lastIndex = SWPNGPaletteLookup(format, color);
+            }
+
+            if (depth == 8)
+                out[x] = lastIndex;
+            else
+                out[(x * depth) >> 3] |= lastIndex << (8 - depth - ((x * depth) & 7));
+        }
+    }
+}
+
+
+static inline unsigned char SWPNGPaeth(NSInteger a, NSInteger b, NSInteger c)
+{
+    NSInteger p = a + b - c;
+    NSInteger pa = labs(p - a);
+    NSInteger pb = labs(p - b);
+    NSInteger pc = labs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    else if (pb <= pc)
+        return b;
+    return c;
+}
+
+
+// Applies one of the five PNG filters, returning the usual "sum of absolute
+// differences" score that we use to pick a filter for the row
+static NSUInteger SWPNGFilterRow(NSInteger filter, const unsigned char *row, const unsigned char *prior,
+                                 NSInteger length, NSInteger bpp, unsigned char *out)
+{
+    NSUInteger score = 0;
+    NSInteger i;
+    for (i = 0; i < length; i++)
+    {
+        NSInteger left = (i >= bpp) ? row[i - bpp] : 0;
+        NSInteger up = prior[i];
+        NSInteger upLeft = (i >= bpp) ? prior[i - bpp] : 0;
+        unsigned char value;
+
+        switch (filter)
+        {
+            case 1:     value = row[i] - left; break;
+            case 2:     value = row[i] - up; break;
+            case 3:     value = row[i] - ((left + up) >> 1); break;
+            case 4:     value = row[i] - SWPNGPaeth(left, up, upLeft); break;
+            default:    value = row[i]; break;
+        }
+        out[i] = value;
+        score += (value < 128) ? value : 256 - value;
+    }
+    return score;
+}
+
+
+// Filters the rows [firstRow, lastRow) into their final spot in the output
+static void SWPNGFilterBand(const SWPNGFormat *format, NSInteger firstRow, NSInteger lastRow, unsigned char *filtered)
+{
+    NSInteger rowBytes = format->rowBytes;
+    unsigned char *prior = calloc(rowBytes, 1);
+    unsigned char *row = malloc(rowBytes);
+    unsigned char *scratch = malloc(rowBytes);
+
+    // The first row of a band is filtered against the last row of the band above
+    if (firstRow > 0)
+        SWPNGPackRow(format, firstRow - 1, prior);
+
+    NSInteger y;
+    for (y = firstRow; y < lastRow; y++)
+    {
+        unsigned char *out = filtered + y * (rowBytes + 1);
+        SWPNGPackRow(format, y, row);
+
+        if (format->colorType == 3)
+        {
+            // The spec recommends no filtering at all for palette images
+            out[0] = 0;
+            memcpy(out + 1, row, rowBytes);
+        }
+        else
+        {
+            // Try every filter and keep whichever looks most compressible
+            NSUInteger bestScore = NSUIntegerMax;
+            NSInteger filter;
+            for (filter = 0; filter < 5; filter++)
+            {
+                NSUInteger score = SWPNGFilterRow(filter, row, prior, rowBytes, format->filterBytes, scratch);
+                if (score < bestScore)
+                {
+                    bestScore = score;
+                    out[0] = filter;
+                    memcpy(out + 1, scratch, rowBytes);
+                }
+            }
+        }
+
+        unsigned char *temp = prior;
+        prior = row;
+        row = temp;
+    }
+
+    free(prior);
+    free(row);
+    free(scratch);
+}
+
+
+// Deflates one band as a raw deflate fragment. Every band but the last ends with
+// a sync flush, so the fragments can simply be concatenated into one stream
+static void SWPNGDeflateBand(const unsigned char *filtered, size_t start, size_t length, BOOL isLast, SWPNGBand *band)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+
+    if (start > 0)
+    {
+        size_t dictionaryLength = MIN(start, kSWPNGWindowBytes);
+        deflateSetDictionary(&stream, filtered + start - dictionaryLength, (uInt)dictionaryLength);
+    }
+
+    // Leave room for the flush marker on top of zlib's worst case
+    size_t capacity = deflateBound(&stream, length) + 16;
+    band->data = malloc(capacity);
+
+    stream.next_in = (Bytef *)(filtered + start);
+    stream.avail_in = (uInt)length;
+    stream.next_out = band->data;
+    stream.avail_out = (uInt)capacity;
+    deflate(&stream, isLast ? Z_FINISH : Z_SYNC_FLUSH);
+    NSCAssert(stream.avail_in == 0, @"Deflate ran out of room!");
+
+    band->length = capacity - stream.avail_out;
+    band->inputLength = length;
+    band->adler = adler32(adler32(0L, Z_NULL, 0), filtered + start, (uInt)length);
+    deflateEnd(&stream);
+}
+
+
+static void SWPNGAppendUInt32(NSMutableData *data, uint32_t value)
+{
+    uint32_t bigEndian = CFSwapInt32HostToBig(value);
+    [data appendBytes:&bigEndian length:4];
+}
+
+
+// Writes a chunk whose contents are split over several buffers, so large IDATs
+// never need to be copied together first
+static void SWPNGAppendChunkParts(NSMutableData *png, const char *type, const void **parts, const size_t *lengths, NSInteger count)
+{
+    size_t total = 0;
+    NSInteger i;
+    for (i = 0; i < count; i++)
+        total += lengths[i];
+
+    SWPNGAppendUInt32(png, (uint32_t)total);
+    [png appendBytes:type length:4];
+
+    uLong crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)type, 4);
+    for (i = 0; i < count; i++)
+    {
+        if (lengths[i] == 0)
+            continue;
+        [png appendBytes:parts[i] length:lengths[i]];
+        crc = crc32(crc, parts[i], (uInt)lengths[i]);
+    }
+    SWPNGAppendUInt32(png, (uint32_t)crc);
+}
+
+
+static void SWPNGAppendChunk(NSMutableData *png, const char *type, const void *data, size_t length)
+{
+    SWPNGAppendChunkParts(png, type, &data, &length, 1);
+}
+
+
+@implementation SWPNGWriter
+
++ (NSData *)PNGDataFromImage:(NSBitmapImageRep *)image
+{
+    NSInteger w = image.pixelsWide;
+    NSInteger h = image.pixelsHigh;
+    if (w == 0 || h == 0)
+        return nil;
+
+    // We only know how to deal with our own kind of image
+    if (image.bitsPerPixel != 32 || image.samplesPerPixel != 4 || image.isPlanar ||
+        (image.bitmapFormat & (NSBitmapFormatAlphaFirst | NSBitmapFormatAlphaNonpremultiplied | NSBitmapFormatFloatingPointSamples)))
+        return [image representationUsingType:NSBitmapImageFileTypePNG properties:@{}];
+
+    SWPNGFormat *format = calloc(1, sizeof(SWPNGFormat));
+    format->pixels = image.bitmapData;
+    format->pixelRowBytes = image.bytesPerRow;
+    format->width = w;
+    format->height = h;
+    SWPNGChooseFormat(format);
+
+    // Pass one: filter all the rows, a band at a time
+    NSInteger rowBytes = format->rowBytes;
+    NSInteger rowsPerBand = MAX(1, kSWPNGBandBytes / (rowBytes + 1));
+    NSInteger bandCount = (h + rowsPerBand - 1) / rowsPerBand;
+    size_t filteredLength = h * (rowBytes + 1);
+    unsigned char *filtered = malloc(filteredLength);
+
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply(bandCount, queue, ^(size_t i) {
+        NSInteger firstRow = i * rowsPerBand;
+        SWPNGFilterBand(format, firstRow, MIN(firstRow + rowsPerBand, h), filtered);
+    });
+
+    // Pass two: deflate the bands, each primed with the tail of the one before
+    size_t bandLength = rowsPerBand * (rowBytes + 1);
+    SWPNGBand *bands = calloc(bandCount, sizeof(SWPNGBand));
+    dispatch_apply(bandCount, queue, ^(size_t i) {
+        size_t start = i * bandLength;
+        SWPNGDeflateBand(filtered, start, MIN(bandLength, filteredLength - start), (i == bandCount - 1), &bands[i]);
+    });
+
+    uLong adler = adler32(0L, Z_NULL, 0);
+    size_t compressedLength = 0;
+    NSInteger i;
+    for (i = 0; i < bandCount; i++)
+    {
+        adler = adler32_combine(adler, bands[i].adler, bands[i].inputLength);
+        compressedLength += bands[i].length;
+    }
+
+    // Now stitch the file together
+    NSMutableData *png = [NSMutableData dataWithCapacity:compressedLength + 2048 + bandCount * 12];
+    [png appendBytes:kSWPNGSignature length:sizeof(kSWPNGSignature)];
+
+    unsigned char header[13];
+    uint32_t bigWidth = CFSwapInt32HostToBig((uint32_t)w);
+    uint32_t bigHeight = CFSwapInt32HostToBig((uint32_t)h);
+    memcpy(header, &bigWidth, 4);
+    memcpy(header + 4, &bigHeight, 4);
+    header[8] = format->bitDepth;
+    header[9] = format->colorType;
+    header[10] = 0;     // Deflate
+    header[11] = 0;     // Adaptive filtering
+    header[12] = 0;     // No interlacing
+    SWPNGAppendChunk(png, "IHDR", header, sizeof(header));
+
+    // Keep the color profile, like AppKit does
+    NSData *profile = image.colorSpace.ICCProfileData;
+    if (profile)
+    {
+        uLongf profileLength = compressBound(profile.length);
+        NSMutableData *iccp = [NSMutableData dataWithBytes:"ICC Profile\0\0" length:13];
+        NSUInteger offset = iccp.length;
+        iccp.length = offset + profileLength;
+        if (compress2((Bytef *)iccp.mutableBytes + offset, &profileLength, profile.bytes, profile.length, Z_BEST_COMPRESSION) == Z_OK)
+        {
+            iccp.length = offset + profileLength;
+            SWPNGAppendChunk(png, "iCCP", iccp.bytes, iccp.length);
+        }
+    }
+
+    if (format->colorType == 3)
+    {
+        unsigned char colors[kSWPNGMaxPalette * 3];
+        unsigned char alphas[kSWPNGMaxPalette];
+        NSInteger alphaCount = 0;
+        NSInteger slot;
+        for (slot = 0; slot < kSWPNGHashSize; slot++)
+        {
+            NSInteger index = format->paletteSlots[slot];
+            if (index < 0)
+                continue;
+
+            unsigned char straight[4];
+            SWPNGUnpremultiply((const unsigned char *)&format->paletteKeys[slot], straight);
+            memcpy(colors + index * 3, straight, 3);
+            alphas[index] = straight[3];
+
+            // tRNS only has to go as far as the last non-opaque entry
+            if (straight[3] != 255)
+                alphaCount = MAX(alphaCount, index + 1);
+        }
+        SWPNGAppendChunk(png, "PLTE", colors, format->paletteCount * 3);
+        if (alphaCount > 0)
+            SWPNGAppendChunk(png, "tRNS", alphas, alphaCount);
+    }
+
+    // One IDAT per band. The zlib header goes in front of the first one, and
+    // the checksum of the whole stream after the last one
+    static const unsigned char zlibHeader[2] = { 0x78, 0x9C };
+    uint32_t bigAdler = CFSwapInt32HostToBig((uint32_t)adler);
+    for (i = 0; i < bandCount; i++)
+    {
+        const void *parts[3];
+        size_t lengths[3];
+        NSInteger count = 0;
+
+        if (i == 0)
+        {
+            parts[count] = zlibHeader;
+            lengths[count++] = sizeof(zlibHeader);
+        }
+        parts[count] = bands[i].data;
+        lengths[count++] = bands[i].length;
+        if (i == bandCount - 1)
+        {
+            parts[count] = &bigAdler;
+            lengths[count++] = 4;
+        }
+        SWPNGAppendChunkParts(png, "IDAT", parts, lengths, count);
+        free(bands[i].data);
+    }
+    SWPNGAppendChunk(png, "IEND", NULL, 0);
+
+    free(bands);
+    free(filtered);
+    free(format);
+
+    return png;
+}
+
+@end
@@ -24,6 +24,8 @@
 @class SWTool;
 @class SWDocument;
 @class SWImageDataSource;
+@class SWStrokeRecording;
+@class SWCanvasRenderer;
 
 @interface SWPaintView : NSView 
 {
@@ -43,12 +45,35 @@
 
     BOOL isPayingAttention;
     
+    // Every point of the current stroke, as NSPoints, for the journal
+    NSMutableData *strokePoints;
+    CGFloat dragTravelled;      // Since the last evenly-spaced drag point
+    
+    // Every rect the current stroke has drawn over, as NSRects.  Tools that
+    // draw in the buffer only put it all down in the image on mouse up
+    NSMutableData *strokeRects;
+    BOOL isHandlingToolEvent;
+    
+    // Only while strokes are being recorded for benchmarking
+    SWStrokeRecording *strokeRecording;
+    
+    // Draws for the tools that can manage without the main thread, from mouse
+    // down until they're finished
+    SWCanvasRenderer *renderer;
+    SWTool *renderingTool;
+    
     NSColor *backgroundColor;
     
     // Grid related
     BOOL showsGrid;
     CGFloat gridSpacing;
     NSColor *gridColor;
+    
+    // The grid path is only built for the visible area, and reused until
+    // the spacing, zoom or view size changes
+    NSBezierPath *cachedGridPath;
+    NSRect cachedGridRect;
+    CGFloat cachedGridScale;
 }
 
 - (void)preparePaintViewWithDataSource:(SWImageDataSource *)ds
@@ -57,6 +82,13 @@
 - (void)setBackgroundColor:(NSColor *)color;
 - (void)clearOverlay;
 
+// The points of the last stroke, until cleared
+@property (readonly) NSData *strokePoints;
+- (void)clearStrokePoints;
+
+// While a mouse event is with the tool, which says where it drew
+@property (readonly) BOOL isHandlingToolEvent;
+
 // Getting info
 //- (NSPoint)currentMouseLocation;
 
@@ -65,6 +97,7 @@
 @property (NS_NONATOMIC_IOSONLY) CGFloat gridSpacing;
 @property (NS_NONATOMIC_IOSONLY, copy) NSColor *gridColor;
 - (NSBezierPath *)gridInRect:(NSRect)rect;
+- (void)invalidateGrid;
 
 @end
 
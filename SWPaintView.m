@@ -26,9 +26,14 @@
 #import "SWAppController.h"
 #import "SWDocument.h"
 #import "SWImageDataSource.h"
+#import "SWStrokeRecording.h"
+#import "SWCanvasRenderer.h"
 
 @implementation SWPaintView
 
+@synthesize strokePoints;
+@synthesize isHandlingToolEvent;
+
 - (void)preparePaintViewWithDataSource:(SWImageDataSource *)ds
                                toolbox:(SWToolbox *)tb
 {
@@ -37,6 +42,12 @@
     dataSource = ds; // Hold on to it!
     toolbox = tb; // This one too!
     
+    // Tools that keep something of the canvas hear about every edit
+    __weak SWToolbox *weakToolbox = tb;
+    dataSource.editHandler = ^(NSRect rect) {
+        [weakToolbox canvasDidChangeInRect:rect];
+    };
+    
     // First things first: make sure we are the right size!
     NSRect frameRect = NSMakeRect(0.0, 0.0, ds.size.width, ds.size.height);
     self.frame = frameRect;
@@ -116,29 +127,66 @@
         [NSGraphicsContext currentContext].imageInterpolation = NSImageInterpolationNone;
         CGContextRef cgContext = [NSGraphicsContext currentContext].CGContext;
         NSBitmapImageRep *mainImage = dataSource.mainImage;
-        NSBitmapImageRep *bufferImage = dataSource.bufferImage;
+        NSBitmapImageRep *bufferImage = dataSource.hasBufferImage ? dataSource.bufferImage : nil;
+        SWLayer *activeLayer = dataSource.activeLayer;
         
-        //CGContextBeginTransparencyLayer(cgContext, NULL);
+        // Whatever's under the layer being drawn in comes pre-flattened, as does
+        // whatever's over it, so the number of layers makes no difference here
+        NSBitmapImageRep *belowImage = dataSource.compositeBelowActiveLayer;
+        NSBitmapImageRep *aboveImage = dataSource.compositeAboveActiveLayer;
+        [dataSource noteVisibleRect:self.visibleRect];
+        if (belowImage)
+            CGContextDrawImage(cgContext, NSRectToCGRect(self.bounds), belowImage.CGImage);
         
-        // Draw the NSBitmapImageRep to the view
-        if (mainImage) 
-            CGContextDrawImage(cgContext, NSRectToCGRect(self.bounds), mainImage.CGImage);
-        
-        // If there's an overlay image being used at the moment, draw it
-        if (bufferImage) 
+        // The overlay is headed for the active layer, so it goes in with the
+        // layer's opacity and blend mode, as one
+        if (activeLayer.visible)
         {
-            NSRect rect = (NSRect){ NSZeroPoint, bufferImage.size };
-            CGContextDrawImage(cgContext, NSRectToCGRect(rect), bufferImage.CGImage);
+            BOOL isPlain = activeLayer.isPlain;
+            if (!isPlain)
+            {
+                CGContextSaveGState(cgContext);
+                [activeLayer applyToContext:cgContext];
+                CGContextBeginTransparencyLayerWithRect(cgContext, NSRectToCGRect(rect), NULL);
+            }
+            
+            // Draw the NSBitmapImageRep to the view
+            if (mainImage) 
+                CGContextDrawImage(cgContext, NSRectToCGRect(self.bounds), mainImage.CGImage);
+            
+            // If there's an overlay image being used at the moment, draw it
+            // (from the renderer instead, while it has the buffer)
+            if (bufferImage && ![renderer drawInContext:cgContext]) 
+            {
+                NSRect rect = (NSRect){ NSZeroPoint, bufferImage.size };
+                CGContextDrawImage(cgContext, NSRectToCGRect(rect), bufferImage.CGImage);
+            }
+            
+            if (!isPlain)
+            {
+                CGContextEndTransparencyLayer(cgContext);
+                CGContextRestoreGState(cgContext);
+            }
         }
         
-        //CGContextEndTransparencyLayer(cgContext);
+        if (aboveImage)
+            CGContextDrawImage(cgContext, NSRectToCGRect(self.bounds), aboveImage.CGImage);
         
         // If the grid is turned on, draw that too (but only after everything else!
-        if (showsGrid && [(SWScalingScrollView *)self.superview.superview scaleFactor] > 2.0) 
+        CGFloat scale = [(SWScalingScrollView *)self.superview.superview scaleFactor];
+        if (showsGrid && scale > 2.0) 
         {
+            // Reuse the last grid if it already covers the area being redrawn
+            if (!cachedGridPath || cachedGridScale != scale || !NSContainsRect(cachedGridRect, rect))
+            {
+                cachedGridRect = NSIntersectionRect(NSUnionRect(self.visibleRect, rect), self.bounds);
+                cachedGridScale = scale;
+                cachedGridPath = [self gridInRect:cachedGridRect];
+            }
+            
             [gridColor set];
             [[NSGraphicsContext currentContext] setShouldAntialias:NO];
-            [[self gridInRect:self.frame] stroke];
+            [cachedGridPath stroke];
         }
         
         [NSGraphicsContext restoreGraphicsState];
@@ -190,43 +238,123 @@
 - (void)mouseDown:(NSEvent *)event
 {
     isPayingAttention = YES;
+    [self startRenderingIfNeeded];
+    [renderer waitUntilDone];
+    
     NSPoint p = event.locationInWindow;
     NSPoint downPoint = [self convertPoint:p fromView:nil];
     
     // Necessary for when the view is zoomed above 100%
     currentPoint.x = floor(downPoint.x);
     currentPoint.y = floor(downPoint.y);
+    
+    strokePoints = [NSMutableData dataWithBytes:&currentPoint length:sizeof(NSPoint)];
+    strokeRects = [NSMutableData data];
+    dragTravelled = 0.0;
 
     [toolbox.currentTool setSavedPoint:currentPoint];
     
     // If it's shifted, do something about it
     toolbox.currentTool.flags = event.modifierFlags;
+    [self recordEvent:MOUSE_DOWN from:event];
+    isHandlingToolEvent = YES;
     [toolbox.currentTool performDrawAtPoint:currentPoint 
                       withMainImage:dataSource.mainImage
                         bufferImage:dataSource.bufferImage
                          mouseEvent:MOUSE_DOWN];
+    isHandlingToolEvent = NO;
     
-    [self setNeedsDisplayInRect:[toolbox.currentTool invalidRect]];
+    if (renderer.isRunning)
+    {
+        NSRect rects[kSWMaxSymmetryCopies];
+        NSUInteger count = [toolbox.currentTool getInvalidRects:rects];
+        for (NSUInteger i = 0; i < count; i++)
+            [renderer publishRect:rects[i]];
+    }
+    [self showToolRects:toolbox.currentTool];
 }
 
 - (void)mouseDragged:(NSEvent *)event
 {
     if (isPayingAttention) 
     {
-        NSPoint p = event.locationInWindow;
-        NSPoint dragPoint = [self convertPoint:p fromView:nil];
+        // Whatever piled up in the queue while the tool was busy goes to it in
+        // one call, so a slow tool draws once a frame rather than falling further
+        // and further behind the mouse
+        NSMutableData *dragPoints = [NSMutableData data];
+        NSPoint lastPoint = currentPoint;
+        NSUInteger dragFlags = 0;
+        NSEvent *upEvent = nil;
         
-        // Necessary for when the view is zoomed above 100%
-        currentPoint.x = floor(dragPoint.x);
-        currentPoint.y = floor(dragPoint.y);
+        for (NSEvent *dragEvent = event; dragEvent; )
+        {
+            NSPoint p = dragEvent.locationInWindow;
+            NSPoint dragPoint = [self convertPoint:p fromView:nil];
+            
+            // Necessary for when the view is zoomed above 100%
+            currentPoint.x = floor(dragPoint.x);
+            currentPoint.y = floor(dragPoint.y);
+            [strokePoints appendBytes:&currentPoint length:sizeof(NSPoint)];
+            [dragPoints appendBytes:&currentPoint length:sizeof(NSPoint)];
+            
+            dragFlags = dragEvent.modifierFlags;
+            [self recordEvent:MOUSE_DRAGGED from:dragEvent];
+            
+            dragEvent = [NSApp nextEventMatchingMask:(NSEventMaskLeftMouseDragged | NSEventMaskLeftMouseUp)
+                                           untilDate:[NSDate distantPast]
+                                              inMode:NSDefaultRunLoopMode
+                                             dequeue:YES];
+            if (dragEvent.type == NSEventTypeLeftMouseUp)
+            {
+                upEvent = dragEvent;
+                dragEvent = nil;
+            }
+        }
         
-        toolbox.currentTool.flags = event.modifierFlags;
-        [toolbox.currentTool performDrawAtPoint:currentPoint 
-                                    withMainImage:dataSource.mainImage
-                                      bufferImage:dataSource.bufferImage
-                                       mouseEvent:MOUSE_DRAGGED];
+        // An out-of-core canvas reads ahead along the stroke
+        [dataSource noteStrokeFromPoint:lastPoint
+                                toPoint:currentPoint
+                                 radius:[SWToolboxController sharedToolboxPanelController].lineWidth];
+        
+        CGFloat spacing = toolbox.currentTool.dragSpacing;
+        if (spacing > 0.0)
+            dragPoints = SWResampledPoints(lastPoint, dragPoints, spacing, &dragTravelled);
+        
+        SWTool *tool = toolbox.currentTool;
+        NSBitmapImageRep *mainImage = dataSource.mainImage;
+        NSBitmapImageRep *bufferImage = dataSource.bufferImage;
+        
+        if (renderer.isRunning)
+        {
+            // The renderer tells us when there's something to see
+            SWCanvasRenderer *dragRenderer = renderer;
+            [renderer perform:^{
+                tool.flags = dragFlags;
+                [tool performDrawAlongPoints:dragPoints.bytes
+                                       count:dragPoints.length / sizeof(NSPoint)
+                               withMainImage:mainImage
+                                 bufferImage:bufferImage];
+                NSRect rects[kSWMaxSymmetryCopies];
+                NSUInteger count = [tool getInvalidRects:rects];
+                for (NSUInteger i = 0; i < count; i++)
+                    [dragRenderer markDirty:rects[i]];
+            }];
+        }
+        else
+        {
+            tool.flags = dragFlags;
+            isHandlingToolEvent = YES;
+            [tool performDrawAlongPoints:dragPoints.bytes
+                                   count:dragPoints.length / sizeof(NSPoint)
+                           withMainImage:mainImage
+                             bufferImage:bufferImage];
+            isHandlingToolEvent = NO;
+            
+            [self showToolRects:tool];
+        }
         
-        [self setNeedsDisplayInRect:[toolbox.currentTool invalidRect]];
+        if (upEvent)
+            [self mouseUp:upEvent];
     }
 }
 
@@ -234,23 +362,109 @@
 {
     if (isPayingAttention) 
     {
+        [renderer waitUntilDone];
+        
         NSPoint p = event.locationInWindow;
         NSPoint upPoint = [self convertPoint:p fromView:nil];
         
         // Necessary for when the view is zoomed above 100%
         currentPoint.x = floor(upPoint.x);
         currentPoint.y = floor(upPoint.y);
+        [strokePoints appendBytes:&currentPoint length:sizeof(NSPoint)];
         toolbox.currentTool.flags = event.modifierFlags;
+        [self recordEvent:MOUSE_UP from:event];
+        isHandlingToolEvent = YES;
         NSBezierPath *path = [toolbox.currentTool performDrawAtPoint:currentPoint 
                                                          withMainImage:dataSource.mainImage
                                                            bufferImage:dataSource.bufferImage
                                                             mouseEvent:MOUSE_UP];
+        isHandlingToolEvent = NO;
         
         if (path) {
             expPath = path;
         }
         
-        [self setNeedsDisplayInRect:[toolbox.currentTool invalidRect]];
+        [self stopRenderingIfDone];
+        [self showToolRects:toolbox.currentTool];
+        
+        // Whatever went into the buffer has only now reached the image
+        const NSRect *rects = strokeRects.bytes;
+        for (NSUInteger i = 0; i < strokeRects.length / sizeof(NSRect); i++)
+            [dataSource noteEditedRect:rects[i]];
+        strokeRects = nil;
+    }
+}
+
+
+// The tools that can, draw on the renderer's queue from mouse down on.  A new
+// one is needed whenever the buffer image has been replaced
+- (void)startRenderingIfNeeded
+{
+    SWTool *tool = toolbox.currentTool;
+    if (renderer.isRunning && renderingTool == tool)
+        return;
+    
+    [self stopRendering];
+    if (!tool.drawsOffMainThread)
+        return;
+    
+    NSBitmapImageRep *bufferImage = dataSource.bufferImage;
+    if (renderer.bufferImage != bufferImage)
+    {
+        renderer = [[SWCanvasRenderer alloc] initWithBufferImage:bufferImage];
+        
+        __weak SWPaintView *weakSelf = self;
+        renderer.displayHandler = ^(NSRect changedRect) {
+            [weakSelf setNeedsDisplayInRect:changedRect];
+            [weakSelf noteToolRect:changedRect];
+        };
+    }
+    
+    renderingTool = tool;
+    renderingTool.renderer = renderer;
+    [renderer start];
+}
+
+// Once the mouse is up and the tool's timers have run down, the buffer goes
+// back to the main thread
+- (void)stopRenderingIfDone
+{
+    if (renderer.isRunning && !renderingTool.isAnimating)
+        [self stopRendering];
+}
+
+- (void)stopRendering
+{
+    [renderer stop];
+    renderingTool.renderer = nil;
+    renderingTool = nil;
+}
+
+// Keeps a copy of each stroke for replaying later, when asked to.  Recording
+// starts on mouse down, with the toolbox's settings, and is saved on mouse up
+- (void)recordEvent:(SWMouseEvent)mouseEvent from:(NSEvent *)event
+{
+    if (mouseEvent == MOUSE_DOWN)
+    {
+        strokeRecording = nil;
+        if (![SWStrokeRecording recordingDirectoryURL])
+            return;
+        
+        strokeRecording = [[SWStrokeRecording alloc] initWithToolName:NSStringFromClass([toolbox.currentTool class])
+                                                           canvasSize:dataSource.size];
+        strokeRecording.lineWidth = toolboxController.lineWidth;
+        strokeRecording.fillStyle = toolboxController.fillStyle;
+        strokeRecording.frontColor = toolboxController.foregroundColor;
+        strokeRecording.backColor = toolboxController.backgroundColor;
+        strokeRecording.toolDefaults = [SWStrokeRecording currentToolDefaults];
+    }
+    
+    [strokeRecording addEvent:mouseEvent atPoint:currentPoint flags:event.modifierFlags timestamp:event.timestamp];
+    
+    if (mouseEvent == MOUSE_UP)
+    {
+        [strokeRecording writeToRecordingDirectory];
+        strokeRecording = nil;
     }
 }
 
@@ -316,6 +530,7 @@
     // Necessary for when the view is zoomed above 100%
     motionPoint.x = floor(motionPoint.x) + 0.5;
     motionPoint.y = floor(motionPoint.y) + 0.5;    
+    [toolbox.currentTool setMainImage:dataSource.mainImage bufferImage:dataSource.bufferImage];
     [toolbox.currentTool mouseHasMoved:motionPoint];
 }
 
@@ -375,23 +590,25 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 
-// Generates the NSBezeierPath used as the grid
+// Generates the NSBezeierPath used as the grid, limited to the lines that
+// actually cross the given rect (the edges of the canvas are never drawn)
 - (NSBezierPath *)gridInRect:(NSRect)rect
 {
-    NSUInteger curLine, endLine;
+    NSInteger curLine, endLine;
     NSBezierPath *gridPath = [NSBezierPath bezierPath];
+    NSRect bounds = self.bounds;
     
     // Columns
-    curLine = ceil((NSMinX(rect)) / gridSpacing) + 1;
-    endLine = ceil((NSMaxX(rect)) / gridSpacing) - 1;
+    curLine = MAX(ceil(NSMinX(rect) / gridSpacing), 1);
+    endLine = MIN(floor(NSMaxX(rect) / gridSpacing), ceil(NSMaxX(bounds) / gridSpacing) - 1);
     for (; curLine<=endLine; curLine++) {
         [gridPath moveToPoint:NSMakePoint((curLine * gridSpacing), NSMinY(rect))];
         [gridPath lineToPoint:NSMakePoint((curLine * gridSpacing), NSMaxY(rect))];
     }
     
     // Rows
-    curLine = ceil((NSMinY(rect)) / gridSpacing) + 1;
-    endLine = ceil((NSMaxY(rect)) / gridSpacing) - 1;
+    curLine = MAX(ceil(NSMinY(rect) / gridSpacing), 1);
+    endLine = MIN(floor(NSMaxY(rect) / gridSpacing), ceil(NSMaxY(bounds) / gridSpacing) - 1);
     for (; curLine<=endLine; curLine++) {
         [gridPath moveToPoint:NSMakePoint(NSMinX(rect), (curLine * gridSpacing))];
         [gridPath lineToPoint:NSMakePoint(NSMaxX(rect), (curLine * gridSpacing))];
@@ -403,6 +620,12 @@
     return gridPath;
 }
 
+// Throws away the cached grid, so it will be rebuilt on the next redraw
+- (void)invalidateGrid
+{
+    cachedGridPath = nil;
+}
+
 // Switch the grid, if it isn't already the same as the parameter
 - (void)setShowsGrid:(BOOL)shouldShowGrid 
 {
@@ -417,6 +640,7 @@
 {
     if (gridSpacing != newGridSpacing) {
         gridSpacing = newGridSpacing;
+        [self invalidateGrid];
         [self setNeedsDisplay: YES];
     }
 }
@@ -425,6 +649,7 @@
 - (void)setGridColor:(NSColor *)newGridColor 
 {
     gridColor = newGridColor;
+    [self invalidateGrid];
     [self setNeedsDisplay: YES];
 }
 
@@ -462,13 +687,56 @@
     [self setNeedsDisplay:YES];
 }
 
+- (void)clearStrokePoints
+{
+    strokePoints = nil;
+}
+
+// Everything that keeps a copy of the canvas catches up from the rects the
+// tools report, so each goes to the data source as well as to the screen
+- (void)noteToolRect:(NSRect)rect
+{
+    [strokeRects appendBytes:&rect length:sizeof(NSRect)];
+    [dataSource noteEditedRect:rect];
+}
+
+// Each piece of what a tool just drew goes to the screen and the data source
+- (void)showToolRects:(SWTool *)tool
+{
+    NSRect rects[kSWMaxSymmetryCopies];
+    NSUInteger count = [tool getInvalidRects:rects];
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        [self setNeedsDisplayInRect:rects[i]];
+        [self noteToolRect:rects[i]];
+    }
+}
+
 // Tells the mainImage to refresh itself. Can be called from anywhere in the application.
 - (void)refreshImage:(id)sender
 {
+    // Animations finish up on the main thread
+    [self stopRenderingIfDone];
+    
     if (sender)
-        [self setNeedsDisplayInRect:[sender invalidRect]];
+    {
+        [self showToolRects:sender];
+    }
     else
+    {
         [self setNeedsDisplay:YES];
+        [dataSource noteWholeCanvasEdited];
+    }
+}
+
+// The same for a preview a tool drew in the buffer, which only needs showing:
+// nothing that keeps a copy of the canvas has to hear about it
+- (void)refreshPreview:(id)sender
+{
+    NSRect rects[kSWMaxSymmetryCopies];
+    NSUInteger count = [sender getInvalidRects:rects];
+    for (NSUInteger i = 0; i < count; i++)
+        [self setNeedsDisplayInRect:rects[i]];
 }
 
 
@@ -506,4 +774,12 @@
     return YES;
 }
 
+
+// The canvas changed size, so the grid's outer lines may have moved
+- (void)setFrameSize:(NSSize)newSize
+{
+    [super setFrameSize:newSize];
+    [self invalidateGrid];
+}
+
 @end
@@ -0,0 +1,414 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "SWRasterizer.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// How far a flattened curve may stray from the real one, in pixels
+#define SW_RASTER_TOLERANCE 0.02
+
+// One pixel an edge passes through.  Cover is how far the edges move through
+// it, up being negative; area is cover weighted by how far across the pixel
+// they are, so cover - area is how much of the pixel is to their right
+typedef struct {
+    int32_t x, y;
+    float cover, area;
+} SWRasterCell;
+
+struct SWRasterizer {
+    long width, height;
+
+    SWRasterCell *cells;
+    size_t cellCount, cellCapacity;
+    bool sorted;
+    bool failed;
+
+    double startX, startY;
+    double currentX, currentY;
+    bool open;
+
+    long boundsX0, boundsY0, boundsX1, boundsY1;
+};
+
+
+SWRasterizer *SWRasterizerCreate(void)
+{
+    return calloc(1, sizeof(SWRasterizer));
+}
+
+
+void SWRasterizerDestroy(SWRasterizer *rasterizer)
+{
+    if (!rasterizer)
+        return;
+    free(rasterizer->cells);
+    free(rasterizer);
+}
+
+
+void SWRasterizerReset(SWRasterizer *rasterizer, long width, long height)
+{
+    rasterizer->width = width > 0 ? width : 0;
+    rasterizer->height = height > 0 ? height : 0;
+    rasterizer->cellCount = 0;
+    rasterizer->sorted = true;
+    rasterizer->failed = false;
+    rasterizer->open = false;
+    rasterizer->boundsX0 = rasterizer->boundsY0 = rasterizer->boundsX1 = rasterizer->boundsY1 = 0;
+}
+
+
+static void SWRasterAddCell(SWRasterizer *r, long x, long y, double cover, double area)
+{
+    // Edges come in one piece after another, so they mostly land in the cell
+    // they were just in
+    if (r->cellCount)
+    {
+        SWRasterCell *last = &r->cells[r->cellCount - 1];
+        if (last->x == x && last->y == y)
+        {
+            last->cover += cover;
+            last->area += area;
+            return;
+        }
+        if (last->y > y || (last->y == y && last->x > x))
+            r->sorted = false;
+    }
+
+    if (r->cellCount == r->cellCapacity)
+    {
+        size_t capacity = r->cellCapacity ? r->cellCapacity * 2 : 1024;
+        SWRasterCell *cells = realloc(r->cells, capacity * sizeof(SWRasterCell));
+        if (!cells)
+        {
+            r->failed = true;
+            return;
+        }
+        r->cells = cells;
+        r->cellCapacity = capacity;
+    }
+    r->cells[r->cellCount++] = (SWRasterCell){ (int32_t)x, (int32_t)y, (float)cover, (float)area };
+}
+
+
+// Part of an edge inside one row, from xa to xb, moving dy down through it.
+// Whatever is left of the image still counts, as if it ran down the left
+// edge; whatever is right of it can't change any pixel we have
+static void SWRasterAddRowPiece(SWRasterizer *r, long y, double xa, double xb, double dy)
+{
+    double lo = xa < xb ? xa : xb;
+    double hi = xa < xb ? xb : xa;
+    double w = (double)r->width;
+    if (lo >= w)
+        return;
+
+    if (hi == lo)
+    {
+        if (lo <= 0)
+            SWRasterAddCell(r, 0, y, dy, 0);
+        else
+        {
+            long x = (long)lo;
+            SWRasterAddCell(r, x, y, dy, dy * (lo - x));
+        }
+        return;
+    }
+
+    // The edge is straight, so its dy is spread evenly over its width
+    double dydx = dy / (hi - lo);
+    if (lo < 0)
+    {
+        double left = (hi < 0 ? hi : 0) - lo;
+        SWRasterAddCell(r, 0, y, left * dydx, 0);
+        lo = 0;
+        if (hi <= 0)
+            return;
+    }
+    if (hi > w)
+        hi = w;
+
+    for (long x = (long)lo; x < hi; x++)
+    {
+        double u = lo > x ? lo : x;
+        double v = hi < x + 1 ? hi : x + 1;
+        if (v <= u)
+            continue;
+        double part = (v - u) * dydx;
+        SWRasterAddCell(r, x, y, part, part * ((u + v) * 0.5 - x));
+    }
+}
+
+
+static void SWRasterAddLine(SWRasterizer *r, double x0, double y0, double x1, double y1)
+{
+    if (y0 == y1 || !isfinite(x0) || !isfinite(y0) || !isfinite(x1) || !isfinite(y1))
+        return;
+
+    double top = y0 < y1 ? y0 : y1;
+    double bottom = y0 < y1 ? y1 : y0;
+    if (bottom <= 0 || top >= r->height)
+        return;
+
+    // Rows off the top or bottom don't change the ones we have, so they're
+    // simply left out
+    double sign = y1 > y0 ? 1.0 : -1.0;
+    double dxdy = (x1 - x0) / (y1 - y0);
+    long firstRow = top < 0 ? 0 : (long)top;
+    long lastRow = bottom > r->height ? r->height - 1 : (long)ceil(bottom) - 1;
+    for (long y = firstRow; y <= lastRow; y++)
+    {
+        double ya = top > y ? top : y;
+        double yb = bottom < y + 1 ? bottom : y + 1;
+        if (yb <= ya)
+            continue;
+        double xa = x0 + (ya - y0) * dxdy;
+        double xb = x0 + (yb - y0) * dxdy;
+        SWRasterAddRowPiece(r, y, xa, xb, sign * (yb - ya));
+    }
+}
+
+
+void SWRasterizerMoveTo(SWRasterizer *rasterizer, double x, double y)
+{
+    SWRasterizerClose(rasterizer);
+    rasterizer->startX = rasterizer->currentX = x;
+    rasterizer->startY = rasterizer->currentY = y;
+    rasterizer->open = true;
+}
+
+
+void SWRasterizerLineTo(SWRasterizer *rasterizer, double x, double y)
+{
+    if (!rasterizer->open)
+        SWRasterizerMoveTo(rasterizer, rasterizer->currentX, rasterizer->currentY);
+    SWRasterAddLine(rasterizer, rasterizer->currentX, rasterizer->currentY, x, y);
+    rasterizer->currentX = x;
+    rasterizer->currentY = y;
+}
+
+
+// How many lines a curve needs to stay within the tolerance, from how far its
+// control points are from being in a straight line
+static long SWRasterSegments(double deviation, double scale)
+{
+    double n = ceil(sqrt(scale * deviation / SW_RASTER_TOLERANCE));
+    if (!(n >= 1))
+        return 1;
+    return n > 1000 ? 1000 : (long)n;
+}
+
+
+void SWRasterizerQuadTo(SWRasterizer *rasterizer, double cx, double cy, double x, double y)
+{
+    double x0 = rasterizer->currentX, y0 = rasterizer->currentY;
+    long n = SWRasterSegments(hypot(x0 - 2 * cx + x, y0 - 2 * cy + y), 0.25);
+    for (long i = 1; i < n; i++)
+    {
+        double t = (double)i / n, s = 1 - t;
+        SWRasterizerLineTo(rasterizer,
+                           s * s * x0 + 2 * s * t * cx + t * t * x,
+                           s * s * y0 + 2 * s * t * cy + t * t * y);
+    }
+    SWRasterizerLineTo(rasterizer, x, y);
+}
+
+
+void SWRasterizerCubicTo(SWRasterizer *rasterizer, double c1x, double c1y, double c2x, double c2y, double x, double y)
+{
+    double x0 = rasterizer->currentX, y0 = rasterizer->currentY;
+    double d1 = hypot(x0 - 2 * c1x + c2x, y0 - 2 * c1y + c2y);
+    double d2 = hypot(c1x - 2 * c2x + x, c1y - 2 * c2y + y);
+    long n = SWRasterSegments(d1 > d2 ? d1 : d2, 0.75);
+    for (long i = 1; i < n; i++)
+    {
+        double t = (double)i / n, s = 1 - t;
+        double a = s * s * s, b = 3 * s * s * t, c = 3 * s * t * t, d = t * t * t;
+        SWRasterizerLineTo(rasterizer,
+                           a * x0 + b * c1x + c * c2x + d * x,
+                           a * y0 + b * c1y + c * c2y + d * y);
+    }
+    SWRasterizerLineTo(rasterizer, x, y);
+}
+
+
+void SWRasterizerClose(SWRasterizer *rasterizer)
+{
+    if (!rasterizer->open)
+        return;
+    SWRasterAddLine(rasterizer, rasterizer->currentX, rasterizer->currentY, rasterizer->startX, rasterizer->startY);
+    rasterizer->currentX = rasterizer->startX;
+    rasterizer->currentY = rasterizer->startY;
+    rasterizer->open = false;
+}
+
+
+static int SWRasterCompareCells(const void *a, const void *b)
+{
+    const SWRasterCell *p = a, *q = b;
+    if (p->y != q->y)
+        return p->y < q->y ? -1 : 1;
+    return (p->x > q->x) - (p->x < q->x);
+}
+
+
+// 0 to 255, from the winding number
+static unsigned SWRasterAlpha(double winding, SWFillRule rule)
+{
+    double coverage = fabs(winding);
+    if (rule == SWFillEvenOdd)
+    {
+        coverage = fmod(coverage, 2.0);
+        if (coverage > 1.0)
+            coverage = 2.0 - coverage;
+    }
+    else if (coverage > 1.0)
+        coverage = 1.0;
+    return (unsigned)(coverage * 255.0 + 0.5);
+}
+
+
+// Every byte of a pixel times alpha / 255, rounded, two bytes at a time
+static inline uint32_t SWRasterScale(uint32_t pixel, uint32_t alpha)
+{
+    uint32_t rb = (pixel & 0x00FF00FF) * alpha + 0x00800080;
+    uint32_t ag = ((pixel >> 8) & 0x00FF00FF) * alpha + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    ag = ((ag + ((ag >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+    return rb | (ag << 8);
+}
+
+
+// The color at some coverage, over or instead of count pixels.  The loop is
+// one multiply-add per pixel on whole 32-bit words, with nothing depending on
+// the pixel before, so the compiler vectorizes it
+static void SWRasterBlendSpan(uint32_t *pixels, long count, uint32_t color, unsigned alpha, SWRasterBlend blend)
+{
+    if (alpha == 0 || count <= 0)
+        return;
+
+    uint32_t source = SWRasterScale(color, alpha);
+    uint8_t bytes[4];
+    memcpy(bytes, &source, 4);
+    uint32_t keep = (blend == SWRasterBlendOver) ? 255u - bytes[3] : 255u - alpha;
+
+    if (keep == 0)
+    {
+        for (long i = 0; i < count; i++)
+            pixels[i] = source;
+    }
+    else
+    {
+        for (long i = 0; i < count; i++)
+            pixels[i] = source + SWRasterScale(pixels[i], keep);
+    }
+}
+
+
+int SWRasterizerFill(SWRasterizer *rasterizer, SWFillRule rule,
+                     uint8_t *pixels, size_t bytesPerRow,
+                     const uint8_t rgba[4], SWRasterBlend blend)
+{
+    SWRasterizerClose(rasterizer);
+    rasterizer->boundsX0 = rasterizer->boundsY0 = rasterizer->boundsX1 = rasterizer->boundsY1 = 0;
+    if (rasterizer->failed)
+        return 0;
+    if (!rasterizer->sorted)
+    {
+        qsort(rasterizer->cells, rasterizer->cellCount, sizeof(SWRasterCell), SWRasterCompareCells);
+        rasterizer->sorted = true;
+    }
+
+    // Premultiplied, so no channel can be more than the alpha
+    uint8_t clamped[4] = { rgba[0], rgba[1], rgba[2], rgba[3] };
+    for (int c = 0; c < 3; c++)
+        if (clamped[c] > clamped[3])
+            clamped[c] = clamped[3];
+    uint32_t color;
+    memcpy(&color, clamped, 4);
+
+    long x0 = rasterizer->width, y0 = rasterizer->height, x1 = 0, y1 = 0;
+    const SWRasterCell *cells = rasterizer->cells;
+    size_t count = rasterizer->cellCount;
+    size_t i = 0;
+    while (i < count)
+    {
+        long y = cells[i].y;
+        uint32_t *row = (uint32_t *)(pixels + (size_t)y * bytesPerRow);
+        double winding = 0;
+
+        if (y < y0)
+            y0 = y;
+        y1 = y + 1;
+        if (cells[i].x < x0)
+            x0 = cells[i].x;
+
+        while (i < count && cells[i].y == y)
+        {
+            // All the edges in this pixel
+            long x = cells[i].x;
+            double cover = 0, area = 0;
+            for (; i < count && cells[i].y == y && cells[i].x == x; i++)
+            {
+                cover += cells[i].cover;
+                area += cells[i].area;
+            }
+            if (x >= rasterizer->width)
+                continue;
+
+            SWRasterBlendSpan(row + x, 1, color, SWRasterAlpha(winding + cover - area, rule), blend);
+            winding += cover;
+            if (x + 1 > x1)
+                x1 = x + 1;
+
+            // Then everything up to the next one is solid
+            long next = (i < count && cells[i].y == y) ? cells[i].x : rasterizer->width;
+            if (next > rasterizer->width)
+                next = rasterizer->width;
+            unsigned alpha = SWRasterAlpha(winding, rule);
+            if (alpha && next > x + 1)
+            {
+                SWRasterBlendSpan(row + x + 1, next - x - 1, color, alpha, blend);
+                if (next > x1)
+                    x1 = next;
+            }
+        }
+    }
+
+    if (x1 > x0 && y1 > y0)
+    {
+        rasterizer->boundsX0 = x0;
+        rasterizer->boundsY0 = y0;
+        rasterizer->boundsX1 = x1;
+        rasterizer->boundsY1 = y1;
+    }
+    return 1;
+}
+
+
+void SWRasterizerGetBounds(const SWRasterizer *rasterizer, long *x, long *y, long *width, long *height)
+{
+    *x = rasterizer->boundsX0;
+    *y = rasterizer->boundsY0;
+    *width = rasterizer->boundsX1 - rasterizer->boundsX0;
+    *height = rasterizer->boundsY1 - rasterizer->boundsY0;
+}
@@ -0,0 +1,92 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Antialiased filling of paths, with the coverage of every pixel worked out
+// exactly from the area of it inside the path.
+//
+// Edges are walked a scanline at a time, and each pixel they cross becomes a
+// cell holding how far the edges move up or down through it and how much of
+// it they cut off.  Only those cells are ever stored; running along a row,
+// the cells add up to the winding number, so the pixels between them come
+// out as solid spans without anything being stored for them at all.  The
+// spans are blended into the pixels a whole span at a time.
+//
+// Where edges overlap inside a single pixel, their windings are averaged over
+// it before the fill rule gets them, as in most scanline rasterizers; the
+// coverage is exact everywhere else.
+//
+// Nothing here depends on what's already in the pixels, or on Quartz, so the
+// same path always comes out the same.  Pixels are 8-bit premultiplied RGBA,
+// and coordinates count rows in memory order, with a pixel's center at
+// (x + 0.5, y + 0.5).  Plain C, so it can be built and hammered on anywhere.
+// Not thread-safe.
+
+#ifndef SWRASTERIZER_H
+#define SWRASTERIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    SWFillNonZero,
+    SWFillEvenOdd
+} SWFillRule;
+
+typedef enum {
+    SWRasterBlendOver,    // Like NSCompositingOperationSourceOver
+    SWRasterBlendCopy     // Like NSCompositingOperationCopy: the path replaces what's under it
+} SWRasterBlend;
+
+typedef struct SWRasterizer SWRasterizer;
+
+SWRasterizer *SWRasterizerCreate(void);
+void SWRasterizerDestroy(SWRasterizer *rasterizer);
+
+// Throws away the path, and clips the next one to an image of this size.
+// Keeps the memory for next time
+void SWRasterizerReset(SWRasterizer *rasterizer, long width, long height);
+
+// Curves are flattened to within a fiftieth of a pixel.  Every subpath is closed
+// when it's filled, whether it was closed here or not
+void SWRasterizerMoveTo(SWRasterizer *rasterizer, double x, double y);
+void SWRasterizerLineTo(SWRasterizer *rasterizer, double x, double y);
+void SWRasterizerQuadTo(SWRasterizer *rasterizer, double cx, double cy, double x, double y);
+void SWRasterizerCubicTo(SWRasterizer *rasterizer, double c1x, double c1y, double c2x, double c2y, double x, double y);
+void SWRasterizerClose(SWRasterizer *rasterizer);
+
+// Fills the path into the pixels, which have to be the size given to Reset,
+// with a premultiplied color.  Returns 0 if there wasn't the memory to hold
+// the path.  The path stays, so it can be filled again somewhere else
+int SWRasterizerFill(SWRasterizer *rasterizer, SWFillRule rule,
+                     uint8_t *pixels, size_t bytesPerRow,
+                     const uint8_t rgba[4], SWRasterBlend blend);
+
+// The smallest rectangle of pixels the last fill could have touched, in pixels
+// and memory order.  Empty if nothing was
+void SWRasterizerGetBounds(const SWRasterizer *rasterizer, long *x, long *y, long *width, long *height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
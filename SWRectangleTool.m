@@ -52,22 +52,25 @@
                          bufferImage:(NSBitmapImageRep *)bufferImage 
                           mouseEvent:(SWMouseEvent)event
 {
+    if (event == MOUSE_DOWN)
+        [self beginSymmetryInImage:mainImage];
+    
     // Use the points clicked to build a redraw rectangle
     [super addRedrawRectFromPoint:savedPoint toPoint:point];
     
     [SWImageTools clearImage:bufferImage];
     
+    // Antialiased shapes are always drawn in the buffer, which then goes down
+    // over the image as it was shown
+    BOOL smooth = self.antialias;
     if (event == MOUSE_UP)
     {
         [document handleUndoWithImageData:nil frame:NSZeroRect];
-        drawToMe = mainImage;    
+        drawToMe = smooth ? bufferImage : mainImage;
     }
     else
         drawToMe = bufferImage;
     
-    SWLockFocus(drawToMe); 
-    [[NSGraphicsContext currentContext] setShouldAntialias:NO];
-    
     // Which colors should we draw with?
     if (event == MOUSE_DOWN) {
         if (flags & NSEventModifierFlagOption) {
@@ -79,23 +82,46 @@
         }
     }
     
-    [self pathFromPoint:savedPoint toPoint:point];
+    NSBezierPath *shape = [self symmetricPath:[self pathFromPoint:savedPoint toPoint:point]];
+    if (smooth)
+    {
+        if (shouldFill)
+            [self fillPath:shape 
+                   inImage:drawToMe 
+                 withColor:(shouldStroke ? secondaryColor : primaryColor) 
+                 operation:NSCompositingOperationSourceOver];
+        if (shouldStroke)
+            [self strokePath:shape 
+                     inImage:drawToMe 
+                   withColor:primaryColor 
+                   operation:NSCompositingOperationSourceOver];
+        if (event == MOUSE_UP)
+        {
+            [SWImageTools drawToImage:mainImage fromImage:bufferImage withComposition:YES];
+            [SWImageTools clearImage:bufferImage];
+        }
+        return nil;
+    }
+    
+    SWLockFocus(drawToMe); 
+    [[NSGraphicsContext currentContext] setShouldAntialias:NO];
+    
     if (shouldFill && shouldStroke)
     {
         [primaryColor setStroke];
         [secondaryColor setFill];
-        [path fill];
-        [path stroke];
+        [shape fill];
+        [shape stroke];
     }
     else if (shouldFill) 
     {
         [primaryColor setFill];
-        [path fill];
+        [shape fill];
     }
     else if (shouldStroke) 
     {
         [primaryColor setStroke];
-        [path stroke];
+        [shape stroke];
     }
     
     SWUnlockFocus(drawToMe);
@@ -25,6 +25,7 @@ extern NSString * const kSWCurrentFileType;
     // We maintain a different view for certain fileTypes, as well as a default one
     IBOutlet NSView *defaultView;
     IBOutlet NSView *jpegView;
+    IBOutlet NSView *gifView;
     
     // This is the slot they can go in
     IBOutlet NSView *containerView;
@@ -38,6 +39,7 @@ extern NSString * const kSWCurrentFileType;
     // Used in the various subviews
     BOOL isAlphaEnabled;
     CGFloat imageQuality;
+    BOOL isDitheringEnabled;
 }
 
 - (void)updateViewForFileType:(NSString *)fileType;
@@ -49,5 +51,6 @@ extern NSString * const kSWCurrentFileType;
 // These values are bound (binded?) to the controls in the various subviews
 @property (assign) BOOL isAlphaEnabled;
 @property (assign) CGFloat imageQuality;
+@property (nonatomic, assign) BOOL isDitheringEnabled;    // GIFs only
 
 @end
@@ -21,6 +21,8 @@
 
 #import "SWSavePanelAccessoryViewController.h"
 #import "SWDocument.h"
+#import "SWAppController.h"
+#import "SWGIFWriter.h"
 
 
 NSString * const kSWCurrentFileType = @"currentFileType";
@@ -31,6 +33,7 @@ NSString * const kSWCurrentFileType = @"currentFileType";
 @synthesize currentFileType;
 @synthesize isAlphaEnabled;
 @synthesize imageQuality;
+@synthesize isDitheringEnabled;
 
 
 // Overridden to initially populate the popup button
@@ -46,6 +49,22 @@ NSString * const kSWCurrentFileType = @"currentFileType";
     // Initialize the values for the controls in the subviews
     self.imageQuality = 0.8;
     [self setIsAlphaEnabled:YES];
+    self.isDitheringEnabled = ([NSUserDefaults.standardUserDefaults integerForKey:kSWGIFDitheringKey] != SWGIFDitheringNone);
+}
+
+
+// The checkbox stands for the GIF dithering preference, which otherwise keeps
+// whichever kind of dithering it names
+- (void)setIsDitheringEnabled:(BOOL)enabled
+{
+    isDitheringEnabled = enabled;
+    
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    SWGIFDithering dithering = [defaults integerForKey:kSWGIFDitheringKey];
+    if (!enabled)
+        [defaults setInteger:SWGIFDitheringNone forKey:kSWGIFDitheringKey];
+    else if (dithering == SWGIFDitheringNone)
+        [defaults setInteger:SWGIFDitheringDiffusion forKey:kSWGIFDitheringKey];
 }
 
 
@@ -71,6 +90,8 @@ NSString * const kSWCurrentFileType = @"currentFileType";
     // Now we can add the correct subview
     if ([fileType isEqualToString:@"JPEG"]) {
         [containerView addSubview:jpegView];
+    } else if ([fileType isEqualToString:@"GIF"]) {
+        [containerView addSubview:gifView];
     }/* else {
         // In all other cases, just use this view
         [containerView addSubview:defaultView];
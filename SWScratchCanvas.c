@@ -0,0 +1,409 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "SWScratchCanvas.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SW_SCRATCH_NONE SIZE_MAX
+
+// A list of tile indices for the background thread
+typedef struct {
+    size_t *tiles;
+    size_t count, capacity;
+} SWScratchQueue;
+
+struct SWScratchCanvas {
+    int fd;
+    uint8_t *bytes;
+    size_t length, tileCount, budget, pageSize;
+
+    // Everything below is under the lock
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    pthread_t worker;
+    bool stopping, busy;
+
+    // Tiles we're keeping resident, most recently used first, linked through
+    // their indices
+    size_t *prev, *next;
+    uint8_t *listed;
+    size_t head, tail, listCount;
+
+    SWScratchQueue evict, prefetch;
+    SWScratchStatistics statistics;
+};
+
+
+static bool SWScratchQueuePush(SWScratchQueue *queue, size_t tile)
+{
+    if (queue->count == queue->capacity)
+    {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 256;
+        size_t *tiles = realloc(queue->tiles, capacity * sizeof(size_t));
+        if (!tiles)
+            return false;
+        queue->tiles = tiles;
+        queue->capacity = capacity;
+    }
+    queue->tiles[queue->count++] = tile;
+    return true;
+}
+
+
+static void SWScratchUnlink(SWScratchCanvas *canvas, size_t tile)
+{
+    size_t before = canvas->prev[tile], after = canvas->next[tile];
+    if (before != SW_SCRATCH_NONE)
+        canvas->next[before] = after;
+    else
+        canvas->head = after;
+    if (after != SW_SCRATCH_NONE)
+        canvas->prev[after] = before;
+    else
+        canvas->tail = before;
+    canvas->listed[tile] = 0;
+    canvas->listCount--;
+}
+
+
+static void SWScratchPushFront(SWScratchCanvas *canvas, size_t tile)
+{
+    canvas->prev[tile] = SW_SCRATCH_NONE;
+    canvas->next[tile] = canvas->head;
+    if (canvas->head != SW_SCRATCH_NONE)
+        canvas->prev[canvas->head] = tile;
+    else
+        canvas->tail = tile;
+    canvas->head = tile;
+    canvas->listed[tile] = 1;
+    canvas->listCount++;
+}
+
+
+// Asks the system whether the tile's pages are in memory, and whether any of
+// them have been written to (which only the Mac can tell us: elsewhere, every
+// resident page is assumed to be)
+static void SWScratchResidency(SWScratchCanvas *canvas, size_t tile, bool *resident, bool *modified)
+{
+    unsigned char pages[SW_SCRATCH_TILE_BYTES / 4096];
+    size_t count = SW_SCRATCH_TILE_BYTES / canvas->pageSize;
+    *resident = false;
+    *modified = false;
+    if (mincore(canvas->bytes + tile * SW_SCRATCH_TILE_BYTES, SW_SCRATCH_TILE_BYTES, (void *)pages) != 0)
+        return;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (pages[i] & 1)
+            *resident = true;
+#ifdef MINCORE_MODIFIED
+        if (pages[i] & (MINCORE_MODIFIED | MINCORE_MODIFIED_OTHER))
+            *modified = true;
+#else
+        if (pages[i] & 1)
+            *modified = true;
+#endif
+    }
+}
+
+
+static void *SWScratchWorker(void *context)
+{
+    SWScratchCanvas *canvas = context;
+    SWScratchQueue evict = { 0 }, prefetch = { 0 };
+
+    pthread_mutex_lock(&canvas->lock);
+    while (!canvas->stopping)
+    {
+        if (canvas->evict.count == 0 && canvas->prefetch.count == 0)
+        {
+            canvas->busy = false;
+            pthread_cond_broadcast(&canvas->idle);
+            pthread_cond_wait(&canvas->wake, &canvas->lock);
+            continue;
+        }
+        canvas->busy = true;
+
+        // Take the work, leaving empty queues behind.  A tile that got used
+        // again since it was put out doesn't go after all
+        SWScratchQueue swap = canvas->evict;
+        canvas->evict = evict;
+        evict = swap;
+        swap = canvas->prefetch;
+        canvas->prefetch = prefetch;
+        prefetch = swap;
+
+        size_t kept = 0;
+        for (size_t i = 0; i < evict.count; i++)
+            if (!canvas->listed[evict.tiles[i]])
+                evict.tiles[kept++] = evict.tiles[i];
+        evict.count = kept;
+        pthread_mutex_unlock(&canvas->lock);
+
+        for (size_t i = 0; i < prefetch.count; i++)
+            madvise(canvas->bytes + prefetch.tiles[i] * SW_SCRATCH_TILE_BYTES, SW_SCRATCH_TILE_BYTES, MADV_WILLNEED);
+
+        // Dirty pages in a shared mapping belong to the file, not to us, so
+        // letting go never loses anything: it just starts the write sooner
+        uint64_t writeBacks = 0;
+        for (size_t i = 0; i < evict.count; i++)
+        {
+            uint8_t *tile = canvas->bytes + evict.tiles[i] * SW_SCRATCH_TILE_BYTES;
+            bool resident, modified;
+            SWScratchResidency(canvas, evict.tiles[i], &resident, &modified);
+            if (modified)
+            {
+                msync(tile, SW_SCRATCH_TILE_BYTES, MS_ASYNC);
+                writeBacks++;
+            }
+            if (resident)
+                madvise(tile, SW_SCRATCH_TILE_BYTES, MADV_DONTNEED);
+        }
+
+        pthread_mutex_lock(&canvas->lock);
+        canvas->statistics.writeBacks += writeBacks;
+        evict.count = 0;
+        prefetch.count = 0;
+    }
+    canvas->busy = false;
+    pthread_cond_broadcast(&canvas->idle);
+    pthread_mutex_unlock(&canvas->lock);
+
+    free(evict.tiles);
+    free(prefetch.tiles);
+    return NULL;
+}
+
+
+SWScratchCanvas *SWScratchCanvasCreate(const char *directory, size_t length, size_t residentBytes)
+{
+    SWScratchCanvas *canvas = calloc(1, sizeof(SWScratchCanvas));
+    if (!canvas)
+        return NULL;
+
+    canvas->fd = -1;
+    canvas->pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    canvas->tileCount = (length + SW_SCRATCH_TILE_BYTES - 1) / SW_SCRATCH_TILE_BYTES;
+    if (canvas->tileCount == 0)
+        canvas->tileCount = 1;
+    canvas->length = canvas->tileCount * SW_SCRATCH_TILE_BYTES;
+    canvas->budget = residentBytes / SW_SCRATCH_TILE_BYTES;
+    if (canvas->budget == 0)
+        canvas->budget = 1;
+    canvas->head = canvas->tail = SW_SCRATCH_NONE;
+
+    if (canvas->pageSize < 4096 || SW_SCRATCH_TILE_BYTES % canvas->pageSize != 0)
+    {
+        free(canvas);
+        return NULL;
+    }
+
+    // Nobody else ever needs to see the file, so it goes as soon as it's open
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/Paintbrush Scratch.XXXXXX", directory ? directory : "/tmp");
+    canvas->fd = mkstemp(path);
+    if (canvas->fd >= 0)
+        unlink(path);
+
+    canvas->prev = malloc(canvas->tileCount * sizeof(size_t));
+    canvas->next = malloc(canvas->tileCount * sizeof(size_t));
+    canvas->listed = calloc(canvas->tileCount, 1);
+
+    if (canvas->fd < 0 || !canvas->prev || !canvas->next || !canvas->listed ||
+        ftruncate(canvas->fd, (off_t)canvas->length) != 0)
+    {
+        SWScratchCanvasDestroy(canvas);
+        return NULL;
+    }
+
+    void *bytes = mmap(NULL, canvas->length, PROT_READ | PROT_WRITE, MAP_SHARED, canvas->fd, 0);
+    if (bytes == MAP_FAILED)
+    {
+        SWScratchCanvasDestroy(canvas);
+        return NULL;
+    }
+    canvas->bytes = bytes;
+
+    pthread_mutex_init(&canvas->lock, NULL);
+    pthread_cond_init(&canvas->wake, NULL);
+    pthread_cond_init(&canvas->idle, NULL);
+    if (pthread_create(&canvas->worker, NULL, SWScratchWorker, canvas) != 0)
+    {
+        munmap(canvas->bytes, canvas->length);
+        canvas->bytes = NULL;
+        pthread_mutex_destroy(&canvas->lock);
+        pthread_cond_destroy(&canvas->wake);
+        pthread_cond_destroy(&canvas->idle);
+        SWScratchCanvasDestroy(canvas);
+        return NULL;
+    }
+
+    return canvas;
+}
+
+
+void SWScratchCanvasDestroy(SWScratchCanvas *canvas)
+{
+    if (!canvas)
+        return;
+
+    // The worker only exists once the mapping does
+    if (canvas->bytes)
+    {
+        pthread_mutex_lock(&canvas->lock);
+        canvas->stopping = true;
+        pthread_cond_signal(&canvas->wake);
+        pthread_mutex_unlock(&canvas->lock);
+        pthread_join(canvas->worker, NULL);
+
+        munmap(canvas->bytes, canvas->length);
+        pthread_mutex_destroy(&canvas->lock);
+        pthread_cond_destroy(&canvas->wake);
+        pthread_cond_destroy(&canvas->idle);
+    }
+    if (canvas->fd >= 0)
+        close(canvas->fd);
+
+    free(canvas->prev);
+    free(canvas->next);
+    free(canvas->listed);
+    free(canvas->evict.tiles);
+    free(canvas->prefetch.tiles);
+    free(canvas);
+}
+
+
+uint8_t *SWScratchCanvasBytes(SWScratchCanvas *canvas)
+{
+    return canvas->bytes;
+}
+
+
+size_t SWScratchCanvasLength(SWScratchCanvas *canvas)
+{
+    return canvas->length;
+}
+
+
+void SWScratchCanvasUse(SWScratchCanvas *canvas, size_t x, size_t y, size_t width, size_t height,
+                        size_t bytesPerPixel, size_t bytesPerRow, bool prefetch)
+{
+    if (width == 0 || height == 0)
+        return;
+
+    bool wakeWorker = false;
+    pthread_mutex_lock(&canvas->lock);
+
+    // The rows go down through memory, so each row's tiles come after the last's
+    size_t lastTile = SW_SCRATCH_NONE;
+    for (size_t row = y; row < y + height; row++)
+    {
+        size_t start = row * bytesPerRow + x * bytesPerPixel;
+        size_t end = start + width * bytesPerPixel;
+        if (end > canvas->length)
+            break;
+
+        size_t first = start / SW_SCRATCH_TILE_BYTES, last = (end - 1) / SW_SCRATCH_TILE_BYTES;
+        if (lastTile != SW_SCRATCH_NONE && first <= lastTile)
+            first = lastTile + 1;
+        for (size_t tile = first; tile <= last; tile++)
+        {
+            if (canvas->listed[tile])
+            {
+                SWScratchUnlink(canvas, tile);
+                SWScratchPushFront(canvas, tile);
+                continue;
+            }
+
+            bool resident, modified;
+            SWScratchResidency(canvas, tile, &resident, &modified);
+            if (!resident && prefetch)
+            {
+                if (SWScratchQueuePush(&canvas->prefetch, tile))
+                    canvas->statistics.prefetches++;
+                wakeWorker = true;
+            }
+            else if (!resident)
+                canvas->statistics.pageIns++;
+            SWScratchPushFront(canvas, tile);
+        }
+        if (lastTile == SW_SCRATCH_NONE || last > lastTile)
+            lastTile = last;
+    }
+
+    // Over budget: the ones used longest ago go
+    while (canvas->listCount > canvas->budget)
+    {
+        size_t tile = canvas->tail;
+        SWScratchUnlink(canvas, tile);
+        if (SWScratchQueuePush(&canvas->evict, tile))
+            canvas->statistics.evictions++;
+        wakeWorker = true;
+    }
+
+    if (wakeWorker)
+        pthread_cond_signal(&canvas->wake);
+    pthread_mutex_unlock(&canvas->lock);
+}
+
+
+void SWScratchCanvasFill(SWScratchCanvas *canvas, size_t offset, size_t length, uint32_t pixel)
+{
+    if (offset >= canvas->length)
+        return;
+    if (length > canvas->length - offset)
+        length = canvas->length - offset;
+
+    // Reading a hole costs nothing, so there's no sense in writing zeros over one
+    for (size_t start = offset; start < offset + length; start += SW_SCRATCH_TILE_BYTES)
+    {
+        size_t count = (offset + length - start < SW_SCRATCH_TILE_BYTES ? offset + length - start : SW_SCRATCH_TILE_BYTES) / sizeof(uint32_t);
+        uint32_t *p = (uint32_t *)(canvas->bytes + start);
+        size_t same = 0;
+        while (same < count && p[same] == pixel)
+            same++;
+        for (size_t i = same; i < count; i++)
+            p[i] = pixel;
+    }
+}
+
+
+SWScratchStatistics SWScratchCanvasGetStatistics(SWScratchCanvas *canvas)
+{
+    pthread_mutex_lock(&canvas->lock);
+    SWScratchStatistics statistics = canvas->statistics;
+    statistics.residentTiles = canvas->listCount;
+    pthread_mutex_unlock(&canvas->lock);
+    return statistics;
+}
+
+
+void SWScratchCanvasWaitUntilIdle(SWScratchCanvas *canvas)
+{
+    pthread_mutex_lock(&canvas->lock);
+    while (canvas->busy || canvas->evict.count > 0 || canvas->prefetch.count > 0)
+        pthread_cond_wait(&canvas->idle, &canvas->lock);
+    pthread_mutex_unlock(&canvas->lock);
+}
@@ -0,0 +1,87 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Pixel memory for canvases bigger than the machine: a scratch file, mapped.
+//
+// The file is unlinked as soon as it's open, so it's gone the moment we are,
+// and it starts out as one big hole that reads back as zeros.  The system pages
+// the canvas in and out of it by itself; on top of that we keep our own idea of
+// what should stay resident.  Whoever draws or shows part of the canvas says so
+// first, a tile at a time, and once more tiles have been used than the budget
+// allows, the least recently used get written back and let go of.  Tiles can
+// also be asked for ahead of time.  Writing back and reading ahead both happen
+// on a thread of their own, so whoever's drawing never waits on the disk for
+// anything but what they actually touch.
+//
+// Plain C and pthreads, so it can be built and hammered on anywhere.
+
+#ifndef SWSCRATCHCANVAS_H
+#define SWSCRATCHCANVAS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A multiple of the page size everywhere we run
+#define SW_SCRATCH_TILE_BYTES ((size_t)16 * 1024)
+
+// For tuning the budget
+typedef struct {
+    uint64_t pageIns;           // Tiles that weren't in memory when they were used
+    uint64_t prefetches;        // Tiles read ahead of being used
+    uint64_t evictions;         // Tiles let go of to stay within the budget
+    uint64_t writeBacks;        // Evicted tiles that had to go out to the file first
+    size_t residentTiles;       // Tiles we're currently keeping in memory
+} SWScratchStatistics;
+
+typedef struct SWScratchCanvas SWScratchCanvas;
+
+// length gets rounded up to whole tiles.  Returns NULL if the file can't be
+// made or mapped
+SWScratchCanvas *SWScratchCanvasCreate(const char *directory, size_t length, size_t residentBytes);
+void SWScratchCanvasDestroy(SWScratchCanvas *canvas);
+
+uint8_t *SWScratchCanvasBytes(SWScratchCanvas *canvas);
+size_t SWScratchCanvasLength(SWScratchCanvas *canvas);
+
+// Part of the canvas, as rows of pixels, is about to be used: its tiles move to
+// the front of the line, and the ones at the back go if there are too many.
+// Prefetching reads them in the background instead of waiting for them.  Safe
+// from any thread
+void SWScratchCanvasUse(SWScratchCanvas *canvas, size_t x, size_t y, size_t width, size_t height,
+                        size_t bytesPerPixel, size_t bytesPerRow, bool prefetch);
+
+// Makes every 32-bit pixel in [offset, offset + length) the same.  Tiles that
+// already are don't get written
+void SWScratchCanvasFill(SWScratchCanvas *canvas, size_t offset, size_t length, uint32_t pixel);
+
+SWScratchStatistics SWScratchCanvasGetStatistics(SWScratchCanvas *canvas);
+
+// Waits for everything handed to the background thread so far
+void SWScratchCanvasWaitUntilIdle(SWScratchCanvas *canvas);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
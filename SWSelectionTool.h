@@ -45,7 +45,10 @@
 @property (NS_NONATOMIC_IOSONLY, readonly) NSRect clippingRect;
 @property (NS_NONATOMIC_IOSONLY, readonly, copy) NSBitmapImageRep *selectedImage;
 @property (NS_NONATOMIC_IOSONLY, readonly, copy) NSData *imageData;
-- (void)setClippingRect:(NSRect)rect forImage:(NSBitmapImageRep *)image withMainImage:(NSBitmapImageRep *)image;
+- (void)setClippingRect:(NSRect)rect
+               forImage:(NSBitmapImageRep *)image
+          withMainImage:(NSBitmapImageRep *)mainImage
+            bufferImage:(NSBitmapImageRep *)bufferImage;
 - (void)drawNewBorder:(NSTimer *)timer;
 - (void)updateBackgroundOmission;
 
@@ -324,30 +324,24 @@
     return clippingRect;
 }
 
-// Called from the PaintView when an image is pasted
-- (void)setClippingRect:(NSRect)rect forImage:(NSBitmapImageRep *)image withMainImage:(NSBitmapImageRep *)mainImage
+// Called from the document when an image is pasted.  The image (already
+// flipped, and the size of the rect) becomes the selection as-is
+- (void)setClippingRect:(NSRect)rect
+               forImage:(NSBitmapImageRep *)image
+          withMainImage:(NSBitmapImageRep *)mainImage
+            bufferImage:(NSBitmapImageRep *)bufferImage
 {
     _mainImage = mainImage;
-    _bufferImage = image;
+    _bufferImage = bufferImage;
     deltax = deltay = 0;
     clippingRect = rect;
     oldOrigin = rect.origin;
     isSelected = YES;
     
-    // Create the image to paste
-    NSBitmapImageRep *selectedImage = nil, *selImageWithTransparency = nil;
-    [SWImageTools initImageRep:&selectedImage withSize:_bufferImage.size];
-    self->selectedImage = selectedImage;
-    SWLockFocus(selectedImage);
-    [NSGraphicsContext currentContext].imageInterpolation = NSImageInterpolationNone;
-    // Create the point to paste at
-    NSPoint point = NSMakePoint(clippingRect.origin.x, clippingRect.origin.y + (clippingRect.size.height - selectedImage.size.height));
-    [image drawAtPoint:point];
-    SWUnlockFocus(selectedImage);
-    
     // Make the copies of the image for with/without transparency
-    selImageSansTransparency = selectedImage;
-    [SWImageTools initImageRep:&selImageWithTransparency withSize:_bufferImage.size];
+    NSBitmapImageRep *selImageWithTransparency = nil;
+    selImageSansTransparency = image;
+    [SWImageTools initImageRep:&selImageWithTransparency withSize:image.size cleared:NO];
     self->selImageWithTransparency = selImageWithTransparency;
     [SWImageTools drawToImage:selImageWithTransparency
                     fromImage:selImageSansTransparency 
@@ -19,6 +19,7 @@
 
 #import "SWSizeWindowController.h"
 #import "SWDocument.h"
+#import "SWClipboard.h"
 
 
 static NSString *sizeMenuLabels[] = { @"640_480", @"800_600", @"1024_768", @"1280_1024" };
@@ -83,11 +84,12 @@ static NSUInteger sizeOffset = 3; // How many non-size menu items are there?
 - (IBAction)changeSizeButton:(id)sender
 {
     if (sizeButton.selectedItem == clipboard) {
-        NSData *data = [SWImageTools readImageFromPasteboard:[NSPasteboard generalPasteboard]];
-        if (data) {
-            NSBitmapImageRep *temp = [[NSBitmapImageRep alloc] initWithData:data];
-            widthField.stringValue = @(temp.size.width).stringValue;
-            heightField.stringValue = @(temp.size.height).stringValue;
+        // Only the image's header gets read here
+        SWPasteboardClipboard *clipboard = [SWPasteboardClipboard generalClipboard];
+        if (clipboard.hasImage) {
+            NSSize size = clipboard.imageSize;
+            widthField.stringValue = @(size.width).stringValue;
+            heightField.stringValue = @(size.height).stringValue;
         }
     } else {
         NSInteger index = sizeButton.indexOfSelectedItem;
@@ -104,7 +106,7 @@ static NSUInteger sizeOffset = 3; // How many non-size menu items are there?
 - (BOOL)validateMenuItem:(NSMenuItem *)menuItem
 {
     if (menuItem == clipboard) {
-        return ([SWImageTools readImageFromPasteboard:[NSPasteboard generalPasteboard]] != nil);
+        return [[SWPasteboardClipboard generalClipboard] hasImage];
     }
     return YES;
 }
@@ -0,0 +1,127 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "SWSparseCanvas.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+
+// The shared tile gets mapped this much at a time, so a huge canvas is a few
+// thousand mappings rather than a few hundred thousand
+static const size_t kSWSparseFillChunk = 16 * SW_SPARSE_TILE_BYTES;
+#endif
+
+
+size_t SWSparseCanvasAllocationSize(size_t length)
+{
+    size_t tiles = (length + SW_SPARSE_TILE_BYTES - 1) / SW_SPARSE_TILE_BYTES;
+    return (tiles ? tiles : 1) * SW_SPARSE_TILE_BYTES;
+}
+
+
+void *SWSparseCanvasAllocate(size_t length)
+{
+    void *bytes = mmap(NULL, SWSparseCanvasAllocationSize(length), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANON, -1, 0);
+    return (bytes == MAP_FAILED) ? NULL : bytes;
+}
+
+
+void SWSparseCanvasFree(void *bytes, size_t length)
+{
+    if (bytes)
+        munmap(bytes, SWSparseCanvasAllocationSize(length));
+}
+
+
+static void SWSparseCanvasWritePattern(uint8_t *bytes, size_t length, uint32_t pixel)
+{
+    uint32_t *p = (uint32_t *)bytes;
+    for (size_t i = 0; i < length / sizeof(uint32_t); i++)
+        p[i] = pixel;
+}
+
+
+void SWSparseCanvasFill(void *bytes, size_t length, uint32_t pixel)
+{
+    if (length == 0)
+        return;
+
+    // Clear is the easy one: fresh zero pages, and whatever was drawn there
+    // goes back to the system
+    if (pixel == 0)
+    {
+        if (mmap(bytes, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_FIXED, -1, 0) != MAP_FAILED)
+            return;
+        memset(bytes, 0, length);
+        return;
+    }
+
+#ifdef __APPLE__
+    // One chunk of the color, mapped copy-on-write over the lot.  The mappings
+    // keep its pages alive once we let go of it
+    size_t chunk = length < kSWSparseFillChunk ? length : kSWSparseFillChunk;
+    uint8_t *source = mmap(NULL, chunk, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (source != MAP_FAILED)
+    {
+        SWSparseCanvasWritePattern(source, chunk, pixel);
+        for (size_t offset = 0; offset < length; offset += chunk)
+        {
+            size_t size = (length - offset < chunk) ? length - offset : chunk;
+            mach_vm_address_t target = (mach_vm_address_t)((uint8_t *)bytes + offset);
+            vm_prot_t current, maximum;
+            kern_return_t result = mach_vm_remap(mach_task_self(), &target, size, 0,
+                                                 VM_FLAGS_FIXED | VM_FLAGS_OVERWRITE,
+                                                 mach_task_self(), (mach_vm_address_t)source, TRUE,
+                                                 &current, &maximum, VM_INHERIT_DEFAULT);
+            if (result != KERN_SUCCESS)
+                memcpy((uint8_t *)bytes + offset, source, size);
+        }
+        munmap(source, chunk);
+        return;
+    }
+#endif
+
+    SWSparseCanvasWritePattern(bytes, length, pixel);
+}
+
+
+bool SWSparseCanvasTileIsUniform(const void *tile, size_t length, uint32_t *pixel)
+{
+    const uint32_t *p = tile;
+    uint32_t first = p[0];
+    uint64_t pair = ((uint64_t)first << 32) | first;
+
+    const uint64_t *q = tile;
+    for (size_t i = 0; i < length / sizeof(uint64_t); i++)
+        if (q[i] != pair)
+            return false;
+
+    if (pixel)
+        *pixel = first;
+    return true;
+}
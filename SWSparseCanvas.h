@@ -0,0 +1,66 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Pixel memory that only costs anything where something has been drawn.
+//
+// It comes straight from the VM system, split into tiles of SW_SPARSE_TILE_BYTES
+// in memory order.  A tile nobody has written to is just a mapping: either the
+// system's zero page, or -- once the canvas has been filled with a color -- one
+// shared tile of that color, mapped copy-on-write over every other.  A tile
+// becomes real memory the first time something draws in it, and goes back to
+// being a mapping when it's filled or cleared all over again.
+//
+// Quartz draws into it like any other bitmap, so nothing else has to know.
+// Plain C, so it can be built and hammered on anywhere; away from the Mac,
+// filling with a color writes every pixel instead of sharing one tile.
+
+#ifndef SWSPARSECANVAS_H
+#define SWSPARSECANVAS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A multiple of the page size everywhere we run
+#define SW_SPARSE_TILE_BYTES ((size_t)64 * 1024)
+
+// Whole tiles, all zero, none of it real yet.  Returns NULL if there isn't the
+// address space.  The length is rounded up to whole tiles: pass the same one
+// back to free it
+void *SWSparseCanvasAllocate(size_t length);
+size_t SWSparseCanvasAllocationSize(size_t length);
+void SWSparseCanvasFree(void *bytes, size_t length);
+
+// Makes every 32-bit pixel in the tiles covering [bytes, bytes + length) the
+// same, without touching them.  Both ends have to be on tile boundaries
+void SWSparseCanvasFill(void *bytes, size_t length, uint32_t pixel);
+
+// Whether a tile holds the same 32-bit pixel all the way through, and which.
+// Only reads, so it never makes a shared tile real
+bool SWSparseCanvasTileIsUniform(const void *tile, size_t length, uint32_t *pixel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
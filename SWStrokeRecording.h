@@ -0,0 +1,108 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import <Cocoa/Cocoa.h>
+#import "SWTool.h"
+
+// Launch arguments for a headless replay run (see +[SWStrokeBenchmark runIfRequested]):
+//
+//   -SWReplayStrokes <file or folder>     recordings to replay
+//   -SWReplaySizes 640x480,3840x2160      canvas sizes (default: the recorded one)
+//   -SWReplayIterations <n>               runs per recording and size (default: 5)
+//   -SWReplayGoldenDirectory <folder>     final canvases to compare against
+//   -SWReplayUpdateGolden YES             write the final canvases there instead
+//   -SWReplayReport <file>                where the JSON goes (default: stdout)
+//
+// Strokes get recorded while the SWStrokeRecordingDirectory default names a folder
+extern NSString * const kSWStrokeRecordingDirectoryKey;
+extern NSString * const kSWReplayStrokesKey;
+
+
+// One stroke, from mouse down to mouse up, exactly as the paint view handed it
+// to the tool, along with the settings it was drawn with
+@interface SWStrokeRecording : NSObject
+{
+    NSString *toolName;
+    NSSize canvasSize;
+    CGFloat lineWidth;
+    NSInteger fillStyle;
+    NSColor *frontColor;
+    NSColor *backColor;
+    NSDictionary *toolDefaults; // The tools' own preferences, by defaults key
+
+    NSMutableData *events;      // SWStrokeEvents, little-endian
+    NSTimeInterval startTime;
+}
+
+// Where new recordings go, or nil when we're not recording
++ (NSURL *)recordingDirectoryURL;
+
+// The preferences tools read for themselves rather than being handed by the
+// toolbox (brush style, spacing and tip, antialiasing and symmetry), as they
+// are now.  Unset ones are left out
++ (NSDictionary *)currentToolDefaults;
+
+- (instancetype)initWithToolName:(NSString *)name canvasSize:(NSSize)size NS_DESIGNATED_INITIALIZER;
+- (instancetype)initWithContentsOfURL:(NSURL *)url;
+
+- (void)addEvent:(SWMouseEvent)event atPoint:(NSPoint)point flags:(NSUInteger)flags timestamp:(NSTimeInterval)timestamp;
+- (BOOL)writeToURL:(NSURL *)url;
+
+// Saves it in the recording directory, named after the tool and the time
+- (void)writeToRecordingDirectory;
+
+@property (readonly) NSString *toolName;
+@property (readonly) NSSize canvasSize;
+@property (readonly) NSUInteger eventCount;
+@property (assign) CGFloat lineWidth;
+@property (assign) NSInteger fillStyle;
+@property (copy) NSColor *frontColor;
+@property (copy) NSColor *backColor;
+@property (copy) NSDictionary *toolDefaults;
+
+// Feeds every event to a tool that nobody else is using, as if it came from a
+// paint view, with the recorded tool defaults in place of the user's.  Drags
+// are spaced out the way the paint view does it.  The block, if any, runs
+// after each event
+- (void)replayWithTool:(SWTool *)tool
+             mainImage:(NSBitmapImageRep *)mainImage
+           bufferImage:(NSBitmapImageRep *)bufferImage
+            afterEvent:(void (^)(NSUInteger index))block;
+
+@end
+
+
+// Replays recordings headlessly against fresh tools and canvases, timing every
+// event, and checks the final canvases against known-good ones
+@interface SWStrokeBenchmark : NSObject
+
+// Runs and returns YES if the launch arguments asked for a replay, in which
+// case the application shouldn't start at all.  The exit status is put in status
++ (BOOL)runIfRequestedWithStatus:(int *)status;
+
+// One recording at one size: the report entry, as a JSON-ready dictionary
++ (NSDictionary *)runRecording:(SWStrokeRecording *)recording
+                        atSize:(NSSize)size
+                    iterations:(NSUInteger)iterations
+                   finalCanvas:(NSBitmapImageRep **)finalCanvas;
+
+// Number of pixels that differ between two canvases of the same size
++ (NSUInteger)differingPixelsBetweenImage:(NSBitmapImageRep *)image andImage:(NSBitmapImageRep *)other;
+
+@end
@@ -0,0 +1,581 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#import "SWStrokeRecording.h"
+#import "SWToolboxController.h"
+#import "SWBrushTool.h"
+#import "SWImageDataSource.h"
+#import "SWPNGWriter.h"
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+
+NSString * const kSWStrokeRecordingDirectoryKey = @"SWStrokeRecordingDirectory";
+NSString * const kSWReplayStrokesKey = @"SWReplayStrokes";
+
+#define kSWStrokeRecordingVersion       1
+#define kSWStrokeRecordingExtension     @"pbstroke"
+#define kSWStrokeDefaultIterations      5
+
+
+// One call to -performDrawAtPoint:...
+typedef struct {
+    float x;
+    float y;
+    float time;         // Seconds since the mouse went down
+    uint32_t flags;
+    uint32_t type;      // SWMouseEvent
+} SWStrokeEvent;
+
+// ...and the same, as stored in the file: every field little-endian
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t time;
+    uint32_t flags;
+    uint32_t type;
+} SWStrokeStoredEvent;
+
+
+static inline uint32_t SWStrokeSwapFloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    return CFSwapInt32HostToLittle(bits);
+}
+
+
+static inline float SWStrokeUnswapFloat(uint32_t bits)
+{
+    float value;
+    bits = CFSwapInt32LittleToHost(bits);
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+
+static NSArray *SWStrokeArrayFromColor(NSColor *color)
+{
+    NSColor *rgb = [color colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+    if (!rgb)
+        return @[@0, @0, @0, @1];
+    return @[@(rgb.redComponent), @(rgb.greenComponent), @(rgb.blueComponent), @(rgb.alphaComponent)];
+}
+
+
+static NSColor *SWStrokeColorFromArray(NSArray *array)
+{
+    if (array.count != 4)
+        return [NSColor blackColor];
+    return [NSColor colorWithCalibratedRed:[array[0] doubleValue]
+                                     green:[array[1] doubleValue]
+                                      blue:[array[2] doubleValue]
+                                     alpha:[array[3] doubleValue]];
+}
+
+
+@implementation SWStrokeRecording
+
+@synthesize toolName;
+@synthesize canvasSize;
+@synthesize lineWidth;
+@synthesize fillStyle;
+@synthesize frontColor;
+@synthesize backColor;
+@synthesize toolDefaults;
+
++ (NSURL *)recordingDirectoryURL
+{
+    NSString *path = [NSUserDefaults.standardUserDefaults stringForKey:kSWStrokeRecordingDirectoryKey];
+    if (path.length == 0)
+        return nil;
+    return [NSURL fileURLWithPath:path.stringByExpandingTildeInPath isDirectory:YES];
+}
+
+
++ (NSDictionary *)currentToolDefaults
+{
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    NSMutableDictionary *values = [NSMutableDictionary dictionary];
+    for (NSString *key in @[kSWBrushStyleKey, kSWBrushSpacingKey, kSWBrushTipImageKey,
+                            kSWAntialiasKey, kSWSymmetryKey, kSWSymmetryFoldsKey])
+    {
+        id value = [defaults objectForKey:key];
+        if (value)
+            values[key] = value;
+    }
+    return values;
+}
+
+
+- (instancetype)init
+{
+    return [self initWithToolName:nil canvasSize:NSZeroSize];
+}
+
+
+- (instancetype)initWithToolName:(NSString *)name canvasSize:(NSSize)size
+{
+    if (self = [super init])
+    {
+        toolName = [name copy];
+        canvasSize = size;
+        lineWidth = 1.0;
+        frontColor = [NSColor blackColor];
+        backColor = [NSColor whiteColor];
+        events = [NSMutableData data];
+        startTime = -1.0;
+    }
+    return self;
+}
+
+
+- (instancetype)initWithContentsOfURL:(NSURL *)url
+{
+    NSData *data = [NSData dataWithContentsOfURL:url];
+    NSDictionary *plist = data ? [NSPropertyListSerialization propertyListWithData:data
+                                                                           options:NSPropertyListImmutable
+                                                                            format:NULL
+                                                                             error:NULL] : nil;
+    if (![plist isKindOfClass:[NSDictionary class]] ||
+        [plist[@"Version"] integerValue] != kSWStrokeRecordingVersion)
+        return nil;
+
+    NSSize size = NSMakeSize([plist[@"Width"] doubleValue], [plist[@"Height"] doubleValue]);
+    if (self = [self initWithToolName:plist[@"Tool"] canvasSize:size])
+    {
+        lineWidth = [plist[@"LineWidth"] doubleValue];
+        fillStyle = [plist[@"FillStyle"] integerValue];
+        frontColor = SWStrokeColorFromArray(plist[@"FrontColor"]);
+        backColor = SWStrokeColorFromArray(plist[@"BackColor"]);
+        if ([plist[@"ToolDefaults"] isKindOfClass:[NSDictionary class]])
+            toolDefaults = plist[@"ToolDefaults"];
+        NSData *eventData = plist[@"Events"];
+        if ([eventData isKindOfClass:[NSData class]])
+            [events setData:eventData];
+        events.length -= events.length % sizeof(SWStrokeStoredEvent);
+    }
+    return self;
+}
+
+
+- (NSUInteger)eventCount
+{
+    return events.length / sizeof(SWStrokeStoredEvent);
+}
+
+
+- (void)addEvent:(SWMouseEvent)event atPoint:(NSPoint)point flags:(NSUInteger)flags timestamp:(NSTimeInterval)timestamp
+{
+    if (startTime < 0)
+        startTime = timestamp;
+
+    SWStrokeStoredEvent stored;
+    stored.x = SWStrokeSwapFloat(point.x);
+    stored.y = SWStrokeSwapFloat(point.y);
+    stored.time = SWStrokeSwapFloat(timestamp - startTime);
+    stored.flags = CFSwapInt32HostToLittle((uint32_t)flags);
+    stored.type = CFSwapInt32HostToLittle((uint32_t)event);
+    [events appendBytes:&stored length:sizeof(stored)];
+}
+
+
+- (SWStrokeEvent)eventAtIndex:(NSUInteger)index
+{
+    SWStrokeStoredEvent stored = ((const SWStrokeStoredEvent *)events.bytes)[index];
+    SWStrokeEvent event;
+    event.x = SWStrokeUnswapFloat(stored.x);
+    event.y = SWStrokeUnswapFloat(stored.y);
+    event.time = SWStrokeUnswapFloat(stored.time);
+    event.flags = CFSwapInt32LittleToHost(stored.flags);
+    event.type = CFSwapInt32LittleToHost(stored.type);
+    return event;
+}
+
+
+- (BOOL)writeToURL:(NSURL *)url
+{
+    NSDictionary *plist = @{@"Version": @kSWStrokeRecordingVersion,
+                            @"Tool": toolName ?: @"",
+                            @"Width": @(canvasSize.width),
+                            @"Height": @(canvasSize.height),
+                            @"LineWidth": @(lineWidth),
+                            @"FillStyle": @(fillStyle),
+                            @"FrontColor": SWStrokeArrayFromColor(frontColor),
+                            @"BackColor": SWStrokeArrayFromColor(backColor),
+                            @"ToolDefaults": toolDefaults ?: @{},
+                            @"Events": [events copy]};
+    NSData *data = [NSPropertyListSerialization dataWithPropertyList:plist
+                                                              format:NSPropertyListBinaryFormat_v1_0
+                                                             options:0
+                                                               error:NULL];
+    return [data writeToURL:url atomically:YES];
+}
+
+
+- (void)writeToRecordingDirectory
+{
+    NSURL *directory = [SWStrokeRecording recordingDirectoryURL];
+    if (!directory || self.eventCount == 0)
+        return;
+
+    [[NSFileManager defaultManager] createDirectoryAtURL:directory
+                             withIntermediateDirectories:YES
+                                              attributes:nil
+                                                   error:NULL];
+    NSString *name = [NSString stringWithFormat:@"%@-%.0f", toolName,
+                      [NSDate timeIntervalSinceReferenceDate] * 1000.0];
+    [self writeToURL:[[directory URLByAppendingPathComponent:name]
+                      URLByAppendingPathExtension:kSWStrokeRecordingExtension]];
+}
+
+
+- (void)replayWithTool:(SWTool *)tool
+             mainImage:(NSBitmapImageRep *)mainImage
+           bufferImage:(NSBitmapImageRep *)bufferImage
+            afterEvent:(void (^)(NSUInteger index))block
+{
+    // The same settings the toolbox would have sent it
+    [tool setFrontColor:frontColor];
+    [tool setBackColor:backColor];
+    [tool setLineWidth:lineWidth];
+    [tool setShouldFill:(fillStyle == FILL_ONLY || fillStyle == FILL_AND_STROKE)
+                 stroke:(fillStyle == STROKE_ONLY || fillStyle == FILL_AND_STROKE)];
+
+    // The tools read these straight from the defaults, so the recorded ones go
+    // over the user's for the length of the replay.  The argument domain wins
+    // over everything else and is never saved
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    NSDictionary *arguments = [defaults volatileDomainForName:NSArgumentDomain];
+    NSMutableDictionary *replaying = [arguments mutableCopy] ?: [NSMutableDictionary dictionary];
+    [replaying addEntriesFromDictionary:toolDefaults];
+    [defaults removeVolatileDomainForName:NSArgumentDomain];
+    [defaults setVolatileDomain:replaying forName:NSArgumentDomain];
+
+    NSPoint lastPoint = NSZeroPoint;
+    CGFloat dragTravelled = 0.0;
+    NSUInteger count = self.eventCount;
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        SWStrokeEvent event = [self eventAtIndex:i];
+        NSPoint point = NSMakePoint(event.x, event.y);
+        tool.flags = event.flags;
+
+        if (event.type == MOUSE_DRAGGED)
+        {
+            // Just like -[SWPaintView mouseDragged:], one event at a time
+            NSData *dragPoints = [NSData dataWithBytes:&point length:sizeof(NSPoint)];
+            CGFloat spacing = tool.dragSpacing;
+            if (spacing > 0.0)
+                dragPoints = SWResampledPoints(lastPoint, dragPoints, spacing, &dragTravelled);
+            [tool performDrawAlongPoints:dragPoints.bytes
+                                   count:dragPoints.length / sizeof(NSPoint)
+                           withMainImage:mainImage
+                             bufferImage:bufferImage];
+        }
+        else
+        {
+            // ...and -mouseDown: and -mouseUp:
+            if (event.type == MOUSE_DOWN)
+            {
+                [tool setSavedPoint:point];
+                dragTravelled = 0.0;
+            }
+            [tool performDrawAtPoint:point
+                       withMainImage:mainImage
+                         bufferImage:bufferImage
+                          mouseEvent:event.type];
+        }
+        lastPoint = point;
+
+        if (block)
+            block(i);
+    }
+
+    [defaults removeVolatileDomainForName:NSArgumentDomain];
+    if (arguments)
+        [defaults setVolatileDomain:arguments forName:NSArgumentDomain];
+}
+
+@end
+
+
+#pragma mark -
+
+static uint64_t SWStrokeBenchmarkFootprint(void)
+{
+    task_vm_info_data_t info;
+    mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&info, &count) != KERN_SUCCESS)
+        return 0;
+    return info.phys_footprint;
+}
+
+
+static double SWStrokeBenchmarkMicroseconds(uint64_t ticks)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)ticks * timebase.numer / timebase.denom / 1000.0;
+}
+
+
+static int SWStrokeBenchmarkCompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+// Nearest-rank percentile of a sorted array
+static double SWStrokeBenchmarkPercentile(const double *sorted, NSUInteger count, double percentile)
+{
+    if (count == 0)
+        return 0.0;
+    NSUInteger rank = (NSUInteger)ceil(percentile / 100.0 * count);
+    return sorted[MIN(MAX(rank, 1), count) - 1];
+}
+
+
+// Accepts "640x480,1920x1080"
+static NSArray *SWStrokeBenchmarkParseSizes(NSString *string)
+{
+    NSMutableArray *sizes = [NSMutableArray array];
+    for (NSString *component in [string componentsSeparatedByString:@","])
+    {
+        NSArray *parts = [component componentsSeparatedByString:@"x"];
+        if (parts.count == 2 && [parts[0] integerValue] > 0 && [parts[1] integerValue] > 0)
+            [sizes addObject:[NSValue valueWithSize:NSMakeSize([parts[0] integerValue], [parts[1] integerValue])]];
+    }
+    return sizes;
+}
+
+
+static NSArray *SWStrokeBenchmarkRecordingURLs(NSString *path)
+{
+    NSURL *url = [NSURL fileURLWithPath:path.stringByExpandingTildeInPath];
+    BOOL isDirectory = NO;
+    if (![[NSFileManager defaultManager] fileExistsAtPath:url.path isDirectory:&isDirectory])
+        return @[];
+    if (!isDirectory)
+        return @[url];
+
+    NSArray *contents = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:url
+                                                      includingPropertiesForKeys:nil
+                                                                         options:NSDirectoryEnumerationSkipsHiddenFiles
+                                                                           error:NULL];
+    NSPredicate *isRecording = [NSPredicate predicateWithFormat:@"pathExtension == %@", kSWStrokeRecordingExtension];
+    return [[contents filteredArrayUsingPredicate:isRecording] sortedArrayUsingComparator:^(NSURL *a, NSURL *b) {
+        return [a.lastPathComponent compare:b.lastPathComponent];
+    }];
+}
+
+
+@implementation SWStrokeBenchmark
+
++ (NSDictionary *)runRecording:(SWStrokeRecording *)recording
+                        atSize:(NSSize)size
+                    iterations:(NSUInteger)iterations
+                   finalCanvas:(NSBitmapImageRep **)finalCanvas
+{
+    Class toolClass = NSClassFromString(recording.toolName);
+    if (![toolClass isSubclassOfClass:[SWTool class]])
+        return @{@"tool": recording.toolName ?: @"", @"error": @"unknown tool"};
+
+    NSUInteger count = recording.eventCount;
+    iterations = MAX(iterations, 1);
+    double *latencies = calloc(MAX(count * iterations, 1), sizeof(double));
+    double totalTime = 0.0;
+
+    uint64_t baseline = SWStrokeBenchmarkFootprint();
+    __block uint64_t peak = baseline;
+
+    for (NSUInteger iteration = 0; iteration < iterations; iteration++)
+    {
+        @autoreleasepool
+        {
+            // A plain white canvas, without asking the toolbox for its colors
+            SWImageDataSource *dataSource = [[SWImageDataSource alloc] initWithSize:size fillBackground:NO];
+            NSBitmapImageRep *mainImage = dataSource.mainImage;
+            NSBitmapImageRep *bufferImage = dataSource.bufferImage;
+            SWLockFocus(mainImage);
+            [[NSColor whiteColor] setFill];
+            NSRectFill(NSMakeRect(0, 0, size.width, size.height));
+            SWUnlockFocus(mainImage);
+
+            // No controller: nothing from the outside can change its settings
+            SWTool *tool = [[toolClass alloc] initWithController:nil];
+
+            double *times = latencies + iteration * count;
+            __block uint64_t mark = mach_absolute_time();
+            [recording replayWithTool:tool mainImage:mainImage bufferImage:bufferImage afterEvent:^(NSUInteger i) {
+                times[i] = SWStrokeBenchmarkMicroseconds(mach_absolute_time() - mark);
+
+                // Kept out of the timings
+                peak = MAX(peak, SWStrokeBenchmarkFootprint());
+                mark = mach_absolute_time();
+            }];
+
+            for (NSUInteger i = 0; i < count; i++)
+                totalTime += times[i];
+
+            if (finalCanvas && iteration == iterations - 1)
+                *finalCanvas = mainImage;
+        }
+    }
+
+    NSUInteger samples = count * iterations;
+    qsort(latencies, samples, sizeof(double), SWStrokeBenchmarkCompareDoubles);
+    NSDictionary *latency = @{@"p50": @(SWStrokeBenchmarkPercentile(latencies, samples, 50)),
+                              @"p90": @(SWStrokeBenchmarkPercentile(latencies, samples, 90)),
+                              @"p99": @(SWStrokeBenchmarkPercentile(latencies, samples, 99)),
+                              @"max": @(samples ? latencies[samples - 1] : 0.0),
+                              @"mean": @(samples ? totalTime / samples : 0.0)};
+    free(latencies);
+
+    return @{@"tool": recording.toolName,
+             @"width": @(size.width),
+             @"height": @(size.height),
+             @"events": @(count),
+             @"iterations": @(iterations),
+             @"latency_us": latency,
+             @"total_ms": @(totalTime / iterations / 1000.0),
+             @"peak_memory_bytes": @(peak - baseline)};
+}
+
+
++ (NSUInteger)differingPixelsBetweenImage:(NSBitmapImageRep *)image andImage:(NSBitmapImageRep *)other
+{
+    if (image.pixelsWide != other.pixelsWide || image.pixelsHigh != other.pixelsHigh)
+        return NSUIntegerMax;
+
+    NSInteger width = image.pixelsWide;
+    NSUInteger differing = 0;
+    for (NSInteger y = 0; y < image.pixelsHigh; y++)
+    {
+        const uint32_t *a = (const uint32_t *)(image.bitmapData + y * image.bytesPerRow);
+        const uint32_t *b = (const uint32_t *)(other.bitmapData + y * other.bytesPerRow);
+        for (NSInteger x = 0; x < width; x++)
+            differing += (a[x] != b[x]);
+    }
+    return differing;
+}
+
+
+// Compares (or replaces) the golden canvas, and notes the outcome in the entry
++ (BOOL)checkCanvas:(NSBitmapImageRep *)canvas
+   againstGoldenURL:(NSURL *)goldenURL
+             update:(BOOL)update
+              entry:(NSMutableDictionary *)entry
+{
+    if (update)
+    {
+        NSData *png = [SWPNGWriter PNGDataFromImage:[SWImageTools flippedCopyOfImage:canvas]];
+        BOOL written = [png writeToURL:goldenURL atomically:YES];
+        entry[@"golden"] = written ? @"written" : @"unwritable";
+        return written;
+    }
+
+    SWImageDataSource *golden = [[SWImageDataSource alloc] initWithURL:goldenURL];
+    if (!golden)
+    {
+        entry[@"golden"] = @"missing";
+        return YES;
+    }
+
+    NSUInteger differing = [self differingPixelsBetweenImage:canvas andImage:golden.mainImage];
+    entry[@"golden"] = differing ? @"mismatch" : @"match";
+    if (differing)
+        entry[@"differing_pixels"] = @(differing == NSUIntegerMax ? -1 : (NSInteger)differing);
+    return (differing == 0);
+}
+
+
++ (BOOL)runIfRequestedWithStatus:(int *)status
+{
+    // Only ever from the command line: a stray preference mustn't keep the
+    // application from starting
+    NSDictionary *arguments = [NSUserDefaults.standardUserDefaults volatileDomainForName:NSArgumentDomain];
+    NSString *path = arguments[kSWReplayStrokesKey];
+    if (!path)
+        return NO;
+
+    NSArray *sizes = SWStrokeBenchmarkParseSizes(arguments[@"SWReplaySizes"]);
+    NSUInteger iterations = [arguments[@"SWReplayIterations"] integerValue] ?: kSWStrokeDefaultIterations;
+    NSString *goldenPath = [arguments[@"SWReplayGoldenDirectory"] stringByExpandingTildeInPath];
+    BOOL updateGolden = [arguments[@"SWReplayUpdateGolden"] boolValue];
+    if (goldenPath && updateGolden)
+        [[NSFileManager defaultManager] createDirectoryAtPath:goldenPath
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:NULL];
+
+    NSMutableArray *runs = [NSMutableArray array];
+    BOOL passed = YES;
+    for (NSURL *url in SWStrokeBenchmarkRecordingURLs(path))
+    {
+        SWStrokeRecording *recording = [[SWStrokeRecording alloc] initWithContentsOfURL:url];
+        NSString *name = url.lastPathComponent.stringByDeletingPathExtension;
+        if (!recording)
+        {
+            [runs addObject:@{@"recording": name, @"error": @"unreadable"}];
+            passed = NO;
+            continue;
+        }
+
+        for (NSValue *value in (sizes.count ? sizes : @[[NSValue valueWithSize:recording.canvasSize]]))
+        {
+            NSSize size = value.sizeValue;
+            NSBitmapImageRep *canvas = nil;
+            NSMutableDictionary *entry = [[self runRecording:recording
+                                                      atSize:size
+                                                  iterations:iterations
+                                                 finalCanvas:&canvas] mutableCopy];
+            entry[@"recording"] = name;
+
+            if (entry[@"error"])
+                passed = NO;
+            else if (goldenPath)
+            {
+                NSString *goldenName = [NSString stringWithFormat:@"%@-%.0fx%.0f.png", name, size.width, size.height];
+                NSURL *goldenURL = [NSURL fileURLWithPath:[goldenPath stringByAppendingPathComponent:goldenName]];
+                passed &= [self checkCanvas:canvas againstGoldenURL:goldenURL update:updateGolden entry:entry];
+            }
+            [runs addObject:entry];
+        }
+    }
+
+    NSData *json = [NSJSONSerialization dataWithJSONObject:@{@"runs": runs}
+                                                   options:NSJSONWritingPrettyPrinted | NSJSONWritingSortedKeys
+                                                     error:NULL];
+    NSString *reportPath = [arguments[@"SWReplayReport"] stringByExpandingTildeInPath];
+    if (reportPath)
+        [json writeToFile:reportPath atomically:YES];
+    else
+    {
+        fwrite(json.bytes, 1, json.length, stdout);
+        fputc('\n', stdout);
+    }
+
+    if (status)
+        *status = passed ? EXIT_SUCCESS : EXIT_FAILURE;
+    return YES;
+}
+
+@end
@@ -24,6 +24,12 @@
     BOOL canInsert;
     NSAttributedString *stringToInsert;
     NSBitmapImageRep *image;
+    
+    // stringToInsert, drawn once, and where it goes from the (floored) mouse
+    // point.  Following the mouse is then only a matter of copying it around
+    NSBitmapImageRep *textImage;
+    NSPoint textOffset;
+    NSRect previewRect;    // Where it is in the buffer, if anywhere
 }
 
 - (void)insertText:(NSNotification *)note;
@@ -41,6 +41,43 @@
     return nil;
 }
 
+// Lays out and draws the string into textImage, if it hasn't been already
+- (void)prepareTextImage
+{
+    if (textImage || !stringToInsert)
+        return;
+    
+    // The size of the string, as a guesstimate
+    NSSize textSize = [stringToInsert size];
+    NSRect rect = [stringToInsert boundingRectWithSize:textSize 
+                                               options:NSStringDrawingUsesFontLeading | NSStringDrawingUsesDeviceMetrics];
+    
+    CGFloat xOffset = fabs(rect.origin.x);
+    CGFloat yOffset = fabs(rect.origin.y);
+    NSSize size = NSMakeSize(rect.size.width + xOffset + textSize.width,
+                             rect.size.height + yOffset + textSize.height);
+    
+    // The text sits above the point, and may start part of the way into a
+    // pixel; the image starts on the pixel and keeps the fraction inside
+    CGFloat top = yOffset - size.height;
+    textOffset = NSMakePoint(0, floor(top));
+    CGFloat fraction = top - floor(top);
+    
+    [SWImageTools initImageRep:&textImage 
+                      withSize:NSMakeSize(ceil(size.width), ceil(size.height + fraction))];
+    
+    // Drawn upside down, like everything else in the canvas
+    NSInteger height = textImage.pixelsHigh;
+    SWLockFocus(textImage);
+    NSAffineTransform *transform = [NSAffineTransform transform];
+    [transform scaleXBy:1.0 yBy:-1.0];
+    [transform translateXBy:0 yBy:(0-height)];
+    [transform concat];
+    [stringToInsert drawAtPoint:NSMakePoint(xOffset, height - fraction - size.height)];
+    SWUnlockFocus(textImage);
+}
+
+
 - (NSBezierPath *)performDrawAtPoint:(NSPoint)point 
                        withMainImage:(NSBitmapImageRep *)mainImage 
                          bufferImage:(NSBitmapImageRep *)bufferImage 
@@ -49,7 +86,15 @@
     _mainImage = mainImage;
     _bufferImage = bufferImage;
     
-    [SWImageTools clearImage:bufferImage];
+    // Take the last preview back out, and nothing else
+    [super resetRedrawRect];
+    if (!NSIsEmptyRect(previewRect))
+    {
+        [SWImageTools clearImage:bufferImage inRect:previewRect];
+        [super addRectToRedrawRect:previewRect];
+        previewRect = NSZeroRect;
+    }
+    
     if (canInsert) 
     {
         if (event == MOUSE_MOVED)
@@ -65,42 +110,30 @@
         else
             return nil; // Return in all other cases
         
-        // The size of the string, as a guesstimate
-        NSSize textSize = [stringToInsert size];
-        
-        // Assign the redrawRect based on the string's size and the insertion point
-        NSRect rect = [stringToInsert boundingRectWithSize:[stringToInsert size] 
-                                                   options:NSStringDrawingUsesFontLeading | NSStringDrawingUsesDeviceMetrics];
+        [self prepareTextImage];
+        if (!textImage)
+            return nil;
         
-        CGFloat xOffset = fabs(rect.origin.x);
-        CGFloat yOffset = fabs(rect.origin.y);
-        rect.size.width += xOffset + textSize.width;
-        rect.size.height += yOffset + textSize.height;
-        
-        // Shift it
-        rect.origin = NSMakePoint(floorf(point.x), floorf(point.y));
-        rect.origin.y -= rect.size.height;
-        rect.origin.y += yOffset;
-
+        NSRect rect = NSMakeRect(floor(point.x) + textOffset.x, floor(point.y) + textOffset.y,
+                                 textImage.pixelsWide, textImage.pixelsHigh);
         [super addRectToRedrawRect:rect];
-        rect.origin.x += xOffset;
-
-        // Fix the origin, since we're dealing with flipped stuff
-        rect.origin.y = drawToMe.pixelsHigh - rect.origin.y - rect.size.height;
-        
-        SWLockFocus(drawToMe);
-        NSAffineTransform *transform = [NSAffineTransform transform];            
-        // Create the transform
-        [transform scaleXBy:1.0 yBy:-1.0];
-        [transform translateXBy:0 yBy:(0-drawToMe.pixelsHigh)];
-        [transform concat];
-        [stringToInsert drawAtPoint:rect.origin];
-        [NSGraphicsContext restoreGraphicsState];
-        SWUnlockFocus(drawToMe);
         
-        [NSApp sendAction:@selector(refreshImage:)
-                       to:nil
-                     from:self];
+        // The preview replaces whatever was under it in the buffer; the real
+        // thing goes over the image
+        [SWImageTools drawToImage:drawToMe 
+                        fromImage:textImage 
+                          atPoint:rect.origin 
+                  withComposition:(drawToMe == mainImage)];
+        // Only putting the text down is an edit: the preview just gets shown
+        if (drawToMe == bufferImage)
+        {
+            previewRect = rect;
+            [super refreshPreview];
+        }
+        else
+            [NSApp sendAction:@selector(refreshImage:)
+                           to:nil
+                         from:self];
     }
     else if (event == MOUSE_DOWN) 
     {
@@ -114,6 +147,7 @@
 - (void)insertText:(NSNotification *)note
 {
     stringToInsert = [[NSAttributedString alloc] initWithAttributedString:note.userInfo[@"newText"]];
+    textImage = nil;
     
     // Get the current point and then draw it
     // Doesn't work quite right yet
@@ -137,7 +171,11 @@
 - (void)tieUpLooseEnds
 {
     stringToInsert = nil;
+    textImage = nil;
     canInsert = NO;
+    if (_bufferImage && !NSIsEmptyRect(previewRect))
+        [SWImageTools clearImage:_bufferImage inRect:previewRect];
+    previewRect = NSZeroRect;
     
     [super tieUpLooseEnds];
 }
@@ -0,0 +1,242 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "SWTileHandoff.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct SWTileHandoff {
+    size_t width, height;
+    size_t bytesPerPixel, bytesPerRow;
+    size_t tileSize, tilesWide, tilesHigh;
+    uint8_t *front[2];
+    
+    // Drawing side only: which tiles each buffer is behind on, and what's been
+    // drawn since the last frame went out
+    uint8_t *stale[2];
+    bool anyStale[2];
+    SWTileRect pending;
+    bool hasPending;
+    
+    // Shared, under the lock
+    pthread_mutex_t lock;
+    int shown;                  // -1 until the first frame
+    unsigned readers[2];
+    SWTileRect changed;
+    bool hasChanged;
+    uint64_t generation;
+};
+
+
+static SWTileRect SWTileRectUnion(SWTileRect a, SWTileRect b)
+{
+    size_t x0 = a.x < b.x ? a.x : b.x;
+    size_t y0 = a.y < b.y ? a.y : b.y;
+    size_t x1 = (a.x + a.width > b.x + b.width) ? a.x + a.width : b.x + b.width;
+    size_t y1 = (a.y + a.height > b.y + b.height) ? a.y + a.height : b.y + b.height;
+    return (SWTileRect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+
+SWTileHandoff *SWTileHandoffCreate(size_t width, size_t height, size_t bytesPerPixel,
+                                   size_t bytesPerRow, size_t tileSize,
+                                   uint8_t *front0, uint8_t *front1)
+{
+    if (!width || !height || !tileSize || !front0 || !front1)
+        return NULL;
+    
+    SWTileHandoff *handoff = calloc(1, sizeof(SWTileHandoff));
+    if (!handoff)
+        return NULL;
+    
+    handoff->width = width;
+    handoff->height = height;
+    handoff->bytesPerPixel = bytesPerPixel;
+    handoff->bytesPerRow = bytesPerRow;
+    handoff->tileSize = tileSize;
+    handoff->tilesWide = (width + tileSize - 1) / tileSize;
+    handoff->tilesHigh = (height + tileSize - 1) / tileSize;
+    handoff->front[0] = front0;
+    handoff->front[1] = front1;
+    handoff->shown = -1;
+    
+    size_t tileCount = handoff->tilesWide * handoff->tilesHigh;
+    handoff->stale[0] = calloc(tileCount, 1);
+    handoff->stale[1] = calloc(tileCount, 1);
+    if (!handoff->stale[0] || !handoff->stale[1] || pthread_mutex_init(&handoff->lock, NULL) != 0)
+    {
+        free(handoff->stale[0]);
+        free(handoff->stale[1]);
+        free(handoff);
+        return NULL;
+    }
+    return handoff;
+}
+
+
+void SWTileHandoffDestroy(SWTileHandoff *handoff)
+{
+    if (!handoff)
+        return;
+    pthread_mutex_destroy(&handoff->lock);
+    free(handoff->stale[0]);
+    free(handoff->stale[1]);
+    free(handoff);
+}
+
+
+void SWTileHandoffMarkDirty(SWTileHandoff *handoff, SWTileRect rect)
+{
+    // Clip it to the canvas, which also takes care of anything way off to the side
+    if (rect.x >= handoff->width || rect.y >= handoff->height || !rect.width || !rect.height)
+        return;
+    if (rect.width > handoff->width - rect.x)
+        rect.width = handoff->width - rect.x;
+    if (rect.height > handoff->height - rect.y)
+        rect.height = handoff->height - rect.y;
+    
+    size_t tx0 = rect.x / handoff->tileSize, tx1 = (rect.x + rect.width - 1) / handoff->tileSize;
+    size_t ty0 = rect.y / handoff->tileSize, ty1 = (rect.y + rect.height - 1) / handoff->tileSize;
+    for (size_t ty = ty0; ty <= ty1; ty++)
+    {
+        size_t row = ty * handoff->tilesWide;
+        memset(handoff->stale[0] + row + tx0, 1, tx1 - tx0 + 1);
+        memset(handoff->stale[1] + row + tx0, 1, tx1 - tx0 + 1);
+    }
+    handoff->anyStale[0] = handoff->anyStale[1] = true;
+    
+    handoff->pending = handoff->hasPending ? SWTileRectUnion(handoff->pending, rect) : rect;
+    handoff->hasPending = true;
+}
+
+
+void SWTileHandoffMarkAllDirty(SWTileHandoff *handoff)
+{
+    SWTileHandoffMarkDirty(handoff, (SWTileRect){ 0, 0, handoff->width, handoff->height });
+}
+
+
+bool SWTileHandoffPublish(SWTileHandoff *handoff, const uint8_t *back)
+{
+    pthread_mutex_lock(&handoff->lock);
+    int target = (handoff->shown < 0) ? 0 : 1 - handoff->shown;
+    bool busy = handoff->readers[target] > 0;
+    pthread_mutex_unlock(&handoff->lock);
+    
+    // Nobody can start reading the target until we swap, so it's ours until then
+    if (busy || !handoff->anyStale[target])
+        return false;
+    
+    uint8_t *front = handoff->front[target];
+    uint8_t *stale = handoff->stale[target];
+    size_t tileSize = handoff->tileSize;
+    
+    for (size_t ty = 0; ty < handoff->tilesHigh; ty++)
+    {
+        size_t y0 = ty * tileSize;
+        size_t y1 = (y0 + tileSize < handoff->height) ? y0 + tileSize : handoff->height;
+        uint8_t *staleRow = stale + ty * handoff->tilesWide;
+        
+        // Copy runs of neighbouring tiles a row at a time
+        for (size_t tx = 0; tx < handoff->tilesWide; )
+        {
+            if (!staleRow[tx])
+            {
+                tx++;
+                continue;
+            }
+            size_t run = tx;
+            while (run < handoff->tilesWide && staleRow[run])
+                staleRow[run++] = 0;
+            
+            size_t x0 = tx * tileSize;
+            size_t x1 = (run * tileSize < handoff->width) ? run * tileSize : handoff->width;
+            size_t offset = x0 * handoff->bytesPerPixel;
+            size_t length = (x1 - x0) * handoff->bytesPerPixel;
+            // Rows that already match are left alone: reading an untouched
+            // part of a sparse buffer costs nothing, but writing makes it real
+            for (size_t y = y0; y < y1; y++)
+            {
+                uint8_t *to = front + y * handoff->bytesPerRow + offset;
+                const uint8_t *from = back + y * handoff->bytesPerRow + offset;
+                if (memcmp(to, from, length) != 0)
+                    memcpy(to, from, length);
+            }
+            tx = run;
+        }
+    }
+    handoff->anyStale[target] = false;
+    
+    pthread_mutex_lock(&handoff->lock);
+    handoff->shown = target;
+    handoff->generation++;
+    if (handoff->hasPending)
+    {
+        handoff->changed = handoff->hasChanged ? SWTileRectUnion(handoff->changed, handoff->pending) : handoff->pending;
+        handoff->hasChanged = true;
+    }
+    pthread_mutex_unlock(&handoff->lock);
+    
+    handoff->hasPending = false;
+    return true;
+}
+
+
+const uint8_t *SWTileHandoffAcquireFront(SWTileHandoff *handoff, SWTileRect *changed)
+{
+    const uint8_t *front = NULL;
+    SWTileRect none = { 0, 0, 0, 0 };
+    
+    pthread_mutex_lock(&handoff->lock);
+    if (handoff->shown >= 0)
+    {
+        handoff->readers[handoff->shown]++;
+        front = handoff->front[handoff->shown];
+    }
+    if (changed)
+        *changed = handoff->hasChanged ? handoff->changed : none;
+    handoff->hasChanged = false;
+    pthread_mutex_unlock(&handoff->lock);
+    
+    return front;
+}
+
+
+void SWTileHandoffReleaseFront(SWTileHandoff *handoff, const uint8_t *front)
+{
+    if (!front)
+        return;
+    
+    pthread_mutex_lock(&handoff->lock);
+    int index = (front == handoff->front[0]) ? 0 : 1;
+    if (handoff->readers[index] > 0)
+        handoff->readers[index]--;
+    pthread_mutex_unlock(&handoff->lock);
+}
+
+
+uint64_t SWTileHandoffGeneration(SWTileHandoff *handoff)
+{
+    pthread_mutex_lock(&handoff->lock);
+    uint64_t generation = handoff->generation;
+    pthread_mutex_unlock(&handoff->lock);
+    return generation;
+}
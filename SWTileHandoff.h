@@ -0,0 +1,79 @@
+/**
+ * Paintbrush
+ * Copyright (C) 2007-2019  Michael Schreiber
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Hands finished frames from a thread that draws to a thread that shows them.
+//
+// The drawing thread works in a buffer of its own.  As it goes it marks what it
+// touched, and every so often publishes: the touched tiles get copied into
+// whichever of the two presentation buffers isn't on screen, and the two swap.
+// The showing thread borrows the one that's on screen for as long as it takes
+// to draw it.  Neither side ever waits on the other for more than a few
+// pointer swaps: if the showing thread still has the buffer the drawing thread
+// wants, the publish is simply put off until the next one.
+//
+// Plain C and pthreads, so it can be built and hammered on anywhere.
+
+#ifndef SWTILEHANDOFF_H
+#define SWTILEHANDOFF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// In pixels, origin at the first row in memory
+typedef struct {
+    size_t x, y, width, height;
+} SWTileRect;
+
+typedef struct SWTileHandoff SWTileHandoff;
+
+// The two presentation buffers belong to the caller, and must outlive the
+// handoff.  Returns NULL if it can't get the memory for its bookkeeping
+SWTileHandoff *SWTileHandoffCreate(size_t width, size_t height, size_t bytesPerPixel,
+                                   size_t bytesPerRow, size_t tileSize,
+                                   uint8_t *front0, uint8_t *front1);
+void SWTileHandoffDestroy(SWTileHandoff *handoff);
+
+// Drawing side.  Only ever from one thread at a time
+void SWTileHandoffMarkDirty(SWTileHandoff *handoff, SWTileRect rect);
+void SWTileHandoffMarkAllDirty(SWTileHandoff *handoff);
+
+// Copies the dirty tiles of back, laid out like the presentation buffers, and
+// swaps.  Returns false if there was nothing to publish, or if it had to be put
+// off because the buffer is still being shown
+bool SWTileHandoffPublish(SWTileHandoff *handoff, const uint8_t *back);
+
+// Showing side.  Returns the newest frame, or NULL if nothing has been
+// published yet, and the bounds of what changed since the last call.  Every
+// frame that's returned has to be given back
+const uint8_t *SWTileHandoffAcquireFront(SWTileHandoff *handoff, SWTileRect *changed);
+void SWTileHandoffReleaseFront(SWTileHandoff *handoff, const uint8_t *front);
+
+// How many frames have been published, for whoever's counting
+uint64_t SWTileHandoffGeneration(SWTileHandoff *handoff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
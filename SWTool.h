@@ -18,9 +18,11 @@
 
 
 #import <Cocoa/Cocoa.h>
+#import "SWRasterizer.h"
 
 @class SWToolboxController;
 @class SWDocument;
+@class SWCanvasRenderer;
 
 typedef NS_ENUM(NSUInteger, SWMouseEvent) {
     MOUSE_DOWN, 
@@ -29,6 +31,27 @@ typedef NS_ENUM(NSUInteger, SWMouseEvent) {
     MOUSE_MOVED
 };
 
+extern NSString * const kSWAntialiasKey;    // Smooth edges for the tools that can
+extern NSString * const kSWSymmetryKey;     // An SWSymmetry
+extern NSString * const kSWSymmetryFoldsKey;    // How many copies SWSymmetryRotational makes
+
+// Copies of each stroke made about the middle of the canvas, by the brush,
+// eraser, airbrush, line and shape tools
+typedef NS_ENUM(NSInteger, SWSymmetry) {
+    SWSymmetryNone = 0,
+    SWSymmetryMirror,           // Left and right
+    SWSymmetryMirror4,          // Left and right, and top and bottom
+    SWSymmetryMirror8,          // Across the diagonals as well
+    SWSymmetryRotational        // Turned kSWSymmetryFoldsKey times around
+};
+
+#define kSWMaxSymmetryCopies    12
+
+// Walks the polyline from start through points, dropping a point every spacing
+// pixels along it, for tools with a dragSpacing.  travelled carries over from
+// one batch to the next
+NSMutableData *SWResampledPoints(NSPoint start, NSData *points, CGFloat spacing, CGFloat *travelledPtr);
+
 @interface SWTool : NSObject
 {
     NSColor *frontColor;
@@ -44,13 +67,31 @@ typedef NS_ENUM(NSUInteger, SWMouseEvent) {
     BOOL shouldShowTransparencyOptions;
     NSUInteger flags;
     NSPoint savedPoint;
-    NSRect redrawRect, savedRect;
+    NSRect redrawRect;
     SWToolboxController *toolboxController;
     
     NSCursor *customCursor;
     
     // We need to talk to the document once in a while
     SWDocument *document;
+    
+    // Only while the paint view is drawing with us off the main thread
+    SWCanvasRenderer *renderer;
+    
+    // Made the first time we draw antialiased, and kept for its memory
+    SWRasterizer *rasterizer;
+    
+    // Where the copies of the current stroke go, the first being the stroke
+    // itself.  Worked out at mouse down by the tools that draw symmetrically
+    CGAffineTransform symmetry[kSWMaxSymmetryCopies];
+    NSUInteger symmetryCount;
+    
+    // The redraw rect in pieces, and each copy's rectangle from last time.
+    // The pieces only count while redrawRect is still the one they make up
+    NSRect redrawRects[kSWMaxSymmetryCopies], savedRects[kSWMaxSymmetryCopies];
+    NSUInteger redrawRectCount;
+    NSRect redrawPiecesRect;
+    BOOL batchingRedraw;
 }
 
 - (instancetype)initWithController:(SWToolboxController *)controller NS_DESIGNATED_INITIALIZER;
@@ -67,14 +108,113 @@ typedef NS_ENUM(NSUInteger, SWMouseEvent) {
 @property (NS_NONATOMIC_IOSONLY, readonly, copy) NSColor *drawingColor;
 - (void)tieUpLooseEnds;
 - (void)mouseHasMoved:(NSPoint)aPoint;
+
+// Something was drawn in the canvas there, or all over it (and maybe into a new
+// image) for NSZeroRect.  For tools that keep something of the canvas around
+- (void)canvasDidChangeInRect:(NSRect)rect;
+
+// The images the next mouseHasMoved: is over, for tools that draw while hovering
+- (void)setMainImage:(NSBitmapImageRep *)mainImage bufferImage:(NSBitmapImageRep *)bufferImage;
 - (BOOL)isEqualToTool:(SWTool *)aTool;
 - (void)deleteKey;
 
-// Used for faster drawing: don't redraw the entire screen, just this portion
+// All the drag points that piled up since the last frame, oldest first.  The
+// default hands them to performDrawAtPoint: one at a time; tools that redraw
+// their whole stroke on each call should override it and redraw just once
+- (NSBezierPath *)performDrawAlongPoints:(const NSPoint *)points
+                                   count:(NSUInteger)count
+                           withMainImage:(NSBitmapImageRep *)mainImage
+                             bufferImage:(NSBitmapImageRep *)bufferImage;
+
+// Tools that can draw their drags, and their timers, off the main thread.  Mouse
+// down and mouse up still come on the main thread, with nothing else running
+@property (NS_NONATOMIC_IOSONLY, readonly) BOOL drawsOffMainThread;
+
+// YES while a timer of the tool's is still drawing, even after the mouse is up
+@property (NS_NONATOMIC_IOSONLY, readonly) BOOL isAnimating;
+
+// A repeating timer for tools that animate.  It fires on the renderer's queue
+// when there is one, and on the main thread otherwise
+- (dispatch_source_t)startTimerWithInterval:(NSTimeInterval)interval handler:(dispatch_block_t)handler;
+
+// Stops it, waiting for a tick that's already under way.  Main thread only
+- (void)stopTimer:(dispatch_source_t)timer;
+
+// Shows what was just drawn into the invalid rect outside of a mouse event
+- (void)refreshInvalidRect;
+
+// Shows a preview that was just drawn into the buffer's invalid rect.  It isn't
+// an edit, so unlike the above it's never journaled and never recomposited.
+// Main thread only
+- (void)refreshPreview;
+
+// Tools that want their drag points evenly spaced, rather than wherever the
+// mouse happened to be sampled, return the spacing in pixels.  Zero means as-is
+@property (NS_NONATOMIC_IOSONLY, readonly) CGFloat dragSpacing;
+
+// Whether the user wants antialiased drawing, from kSWAntialiasKey
+@property (NS_NONATOMIC_IOSONLY, readonly) BOOL antialias;
+
+// Antialiased drawing, through SWRasterizer rather than Quartz: the same path
+// always comes out the same, whatever it's drawn over.  Only Copy and
+// SourceOver are supported.  Tools draw into the buffer with these, and put
+// the buffer down over the image at the end, so the image gets exactly the
+// pixels that were previewed
+- (void)fillPath:(NSBezierPath *)aPath 
+         inImage:(NSBitmapImageRep *)image 
+       withColor:(NSColor *)color 
+       operation:(NSCompositingOperation)operation;
+- (void)strokePath:(NSBezierPath *)aPath 
+           inImage:(NSBitmapImageRep *)image 
+         withColor:(NSColor *)color 
+         operation:(NSCompositingOperation)operation;
+
+// Antialiased strokes that only ever grow, drawn again just where they have:
+// each rect is cleared, and every copy of every segment that reaches into it is
+// stroked there again, clipped to it.  For paths of lines with round caps and
+// joins, whose stroke is the same as all its segments' strokes put together,
+// so the pixels are the ones stroking every copy of the whole path would give,
+// to within Quartz's rounding of the arcs
+- (void)restrokeSymmetricPath:(NSBezierPath *)aPath 
+                      inImage:(NSBitmapImageRep *)image 
+                    withColor:(NSColor *)color 
+                      inRects:(const NSRect *)rects 
+                        count:(NSUInteger)count;
+
+// Works out where the copies of a stroke in this image go, from kSWSymmetryKey.
+// Tools that draw symmetrically call it at mouse down; the others never make
+// more than the one
+- (void)beginSymmetryInImage:(NSBitmapImageRep *)image;
+
+// Every copy of the path from an element on, in one path, so they're all drawn
+// in a single pass.  Mirrored copies are turned around, so filling them keeps
+// all of them however they overlap.  The path itself if there's just the one
+- (NSBezierPath *)symmetricPath:(NSBezierPath *)aPath;
+- (NSBezierPath *)symmetricPath:(NSBezierPath *)aPath fromElement:(NSInteger)first;
+
+// Every copy of a point, and of a rectangle, in the order of the transforms
+- (NSUInteger)symmetricPoints:(NSPoint *)points ofPoint:(NSPoint)point;
+- (NSUInteger)symmetricRects:(NSRect *)rects ofRect:(NSRect)rect;
+
+// Used for faster drawing: don't redraw the entire screen, just this portion.
+// The rectangles take in every copy of a symmetric stroke
 - (NSRect)addRedrawRectFromPoint:(NSPoint)p1 toPoint:(NSPoint)p2;
 - (NSRect)addRectToRedrawRect:(NSRect)newRect;
 @property (NS_NONATOMIC_IOSONLY, readonly) NSRect invalidRect;
 - (void)resetRedrawRect;
+
+// The invalid rect in pieces, one for each copy of a symmetric stroke unless
+// they overlap, so copies in opposite corners don't take in everything between
+// them.  Room for kSWMaxSymmetryCopies; returns how many there are
+- (NSUInteger)getInvalidRects:(NSRect *)rects;
+
+// For tools that draw a batch of points, or several things, at once: the redraw
+// rect starts out empty, and keeps everything added to it until the end
+- (void)beginRedrawBatch;
+- (void)endRedrawBatch;
+
+// A rectangle that's already where it goes, copies and all
+- (void)addPieceToRedrawRect:(NSRect)rect;
 @property (NS_NONATOMIC_IOSONLY, readonly) BOOL shouldShowContextualMenu;
 //- (BOOL)shouldShowFillOptions;
 //- (BOOL)shouldShowTransparencyOptions;
@@ -84,6 +224,7 @@ typedef NS_ENUM(NSUInteger, SWMouseEvent) {
 @property (readonly) BOOL shouldShowTransparencyOptions;
 @property (assign) NSUInteger flags;
 @property (retain, readwrite) SWDocument * document;
+@property (strong) SWCanvasRenderer *renderer;
 
 @end
 
@@ -19,11 +19,141 @@
 
 #import "SWTool.h"
 #import "SWToolboxController.h"
+#import "SWCanvasRenderer.h"
+
+NSString * const kSWAntialiasKey = @"Antialias";
+NSString * const kSWSymmetryKey = @"Symmetry";
+NSString * const kSWSymmetryFoldsKey = @"SymmetryFolds";
+
+// The eight ways a square maps onto itself, as a, b, c, d of an affine
+// transform: the four for SWSymmetryMirror4 first, and the first two of those
+// for SWSymmetryMirror.  Written out so quarter turns are exact
+static const CGFloat kSWMirrors[8][4] = {
+    {  1,  0,  0,  1 },
+    { -1,  0,  0,  1 },     // Left and right
+    {  1,  0,  0, -1 },     // Top and bottom
+    { -1,  0,  0, -1 },     // Both, a half turn
+    {  0,  1, -1,  0 },     // Quarter turns
+    {  0, -1,  1,  0 },
+    {  0,  1,  1,  0 },     // The diagonals
+    {  0, -1, -1,  0 }
+};
+
+// Line width, caps and the rest, which transforming a path keeps but building
+// a new one doesn't
+static void SWCopyPathStyle(NSBezierPath *from, NSBezierPath *to)
+{
+    to.lineWidth = from.lineWidth;
+    to.lineCapStyle = from.lineCapStyle;
+    to.lineJoinStyle = from.lineJoinStyle;
+    to.miterLimit = from.miterLimit;
+    to.windingRule = from.windingRule;
+}
+
+// Hands a Quartz path to the rasterizer, turned the right way up for memory,
+// and moved for filling the part of the image from (left, top) on
+typedef struct {
+    SWRasterizer *rasterizer;
+    CGFloat height;
+    CGFloat left, top;
+} SWRasterizerTarget;
+
+static void SWAddPathElement(void *info, const CGPathElement *element)
+{
+    SWRasterizerTarget *target = info;
+    SWRasterizer *r = target->rasterizer;
+    CGFloat h = target->height - target->top, l = target->left;
+    const CGPoint *p = element->points;
+    switch (element->type)
+    {
+        case kCGPathElementMoveToPoint:
+            SWRasterizerMoveTo(r, p[0].x - l, h - p[0].y);
+            break;
+        case kCGPathElementAddLineToPoint:
+            SWRasterizerLineTo(r, p[0].x - l, h - p[0].y);
+            break;
+        case kCGPathElementAddQuadCurveToPoint:
+            SWRasterizerQuadTo(r, p[0].x - l, h - p[0].y, p[1].x - l, h - p[1].y);
+            break;
+        case kCGPathElementAddCurveToPoint:
+            SWRasterizerCubicTo(r, p[0].x - l, h - p[0].y, p[1].x - l, h - p[1].y, p[2].x - l, h - p[2].y);
+            break;
+        case kCGPathElementCloseSubpath:
+            SWRasterizerClose(r);
+            break;
+    }
+}
+
+// NSBezierPath only learned -CGPath recently
+static CGMutablePathRef SWCreateCGPath(NSBezierPath *aPath)
+{
+    CGMutablePathRef cgPath = CGPathCreateMutable();
+    NSPoint points[3];
+    for (NSInteger i = 0; i < aPath.elementCount; i++)
+    {
+        switch ([aPath elementAtIndex:i associatedPoints:points])
+        {
+            case NSBezierPathElementMoveTo:
+                CGPathMoveToPoint(cgPath, NULL, points[0].x, points[0].y);
+                break;
+            case NSBezierPathElementLineTo:
+                CGPathAddLineToPoint(cgPath, NULL, points[0].x, points[0].y);
+                break;
+            case NSBezierPathElementCurveTo:
+                CGPathAddCurveToPoint(cgPath, NULL, points[0].x, points[0].y, 
+                                      points[1].x, points[1].y, points[2].x, points[2].y);
+                break;
+            case NSBezierPathElementClosePath:
+                CGPathCloseSubpath(cgPath);
+                break;
+            default:
+                break;
+        }
+    }
+    return cgPath;
+}
+
+// Walks the polyline from start through points, dropping a point every spacing
+// pixels along it.  travelled is how far we'd already gone since the last point
+// dropped, and is left that way for the next batch, so the spacing stays even
+NSMutableData *SWResampledPoints(NSPoint start, NSData *points, CGFloat spacing, CGFloat *travelledPtr)
+{
+    NSMutableData *resampled = [NSMutableData data];
+    const NSPoint *p = points.bytes;
+    NSUInteger count = points.length / sizeof(NSPoint);
+    NSPoint from = start;
+    CGFloat travelled = *travelledPtr;
+    
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        CGFloat dx = p[i].x - from.x;
+        CGFloat dy = p[i].y - from.y;
+        CGFloat length = hypot(dx, dy);
+        
+        while (length > 0.0 && travelled + length >= spacing)
+        {
+            CGFloat t = (spacing - travelled) / length;
+            from = NSMakePoint(from.x + dx * t, from.y + dy * t);
+            [resampled appendBytes:&from length:sizeof(NSPoint)];
+            
+            dx = p[i].x - from.x;
+            dy = p[i].y - from.y;
+            length = hypot(dx, dy);
+            travelled = 0.0;
+        }
+        travelled += length;
+        from = p[i];
+    }
+    *travelledPtr = travelled;
+    return resampled;
+}
+
 
 @implementation SWTool
 
 @synthesize flags;
 @synthesize document;
+@synthesize renderer;
 
 - (instancetype)initWithController:(SWToolboxController *)controller
 {
@@ -82,7 +212,10 @@
 
 - (void)resetRedrawRect
 {
-    redrawRect = savedRect = NSMakeRect(CGFLOAT_MAX, CGFLOAT_MAX, 0.0, 0.0);
+    redrawRect = NSMakeRect(CGFLOAT_MAX, CGFLOAT_MAX, 0.0, 0.0);
+    for (NSUInteger i = 0; i < kSWMaxSymmetryCopies; i++)
+        savedRects[i] = redrawRect;
+    redrawRectCount = 0;
 }
 
 - (NSColor *)drawingColor
@@ -151,6 +284,104 @@
     DebugLog(@"%@ tool is tying up loose ends", [self class]);
 }
 
+- (void)canvasDidChangeInRect:(NSRect)rect
+{
+    // Nothing kept, nothing to do
+}
+
+- (NSBezierPath *)performDrawAlongPoints:(const NSPoint *)points
+                                   count:(NSUInteger)count
+                           withMainImage:(NSBitmapImageRep *)mainImage
+                             bufferImage:(NSBitmapImageRep *)bufferImage
+{
+    // Each call only remembers the last two segments' rectangles, so the
+    // whole batch's have to be kept
+    NSBezierPath *result = nil;
+    [self beginRedrawBatch];
+    for (NSUInteger i = 0; i < count; i++)
+        result = [self performDrawAtPoint:points[i]
+                            withMainImage:mainImage
+                              bufferImage:bufferImage
+                               mouseEvent:MOUSE_DRAGGED];
+    [self endRedrawBatch];
+    return result;
+}
+
+- (CGFloat)dragSpacing
+{
+    return 0.0;
+}
+
+// Only the tools that have been checked to keep to themselves between mouse
+// down and mouse up can be trusted with another thread
+- (BOOL)drawsOffMainThread
+{
+    return NO;
+}
+
+- (BOOL)isAnimating
+{
+    return NO;
+}
+
+- (dispatch_source_t)startTimerWithInterval:(NSTimeInterval)interval handler:(dispatch_block_t)handler
+{
+    SWCanvasRenderer *currentRenderer = self.renderer;
+    dispatch_queue_t timerQueue = currentRenderer ? currentRenderer.queue : dispatch_get_main_queue();
+    dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, timerQueue);
+    uint64_t nanoseconds = (uint64_t)(interval * NSEC_PER_SEC);
+    dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)nanoseconds), nanoseconds, nanoseconds / 10);
+    dispatch_source_set_event_handler(timer, handler);
+    dispatch_resume(timer);
+    return timer;
+}
+
+- (void)stopTimer:(dispatch_source_t)timer
+{
+    if (!timer)
+        return;
+    dispatch_source_cancel(timer);
+    
+    // A cancelled timer doesn't fire again, but one that's already firing on the
+    // render queue has to be let finish before we touch the images ourselves
+    [self.renderer waitUntilDone];
+}
+
+- (void)refreshInvalidRect
+{
+    if ([NSThread isMainThread])
+    {
+        [NSApp sendAction:@selector(refreshImage:)
+                       to:nil
+                     from:self];
+        return;
+    }
+    
+    // The paint view may have taken the renderer back in the meantime
+    SWCanvasRenderer *currentRenderer = self.renderer;
+    if (currentRenderer)
+    {
+        NSRect rects[kSWMaxSymmetryCopies];
+        NSUInteger count = [self getInvalidRects:rects];
+        for (NSUInteger i = 0; i < count; i++)
+            [currentRenderer markDirty:rects[i]];
+        [currentRenderer publish];
+    }
+    else
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [NSApp sendAction:@selector(refreshImage:)
+                           to:nil
+                         from:nil];
+        });
+}
+
+- (void)refreshPreview
+{
+    [NSApp sendAction:@selector(refreshPreview:)
+                   to:nil
+                 from:self];
+}
+
 - (BOOL)isEqualToTool:(SWTool *)aTool
 {
     return ([[self class] isEqualTo:[aTool class]]);
@@ -161,6 +392,185 @@
     // Does nothing! It's up to the subclasses to implement this one
 }
 
+- (BOOL)antialias
+{
+    return [NSUserDefaults.standardUserDefaults boolForKey:kSWAntialiasKey];
+}
+
+// Clipped to a rect of whole pixels inside the image
+- (void)fillCGPath:(CGPathRef)cgPath 
+          evenOdd:(BOOL)evenOdd 
+          inImage:(NSBitmapImageRep *)image 
+           inRect:(NSRect)clip
+        withColor:(NSColor *)color 
+        operation:(NSCompositingOperation)operation
+{
+    // Anything that isn't one of our canvases gets Quartz's idea of it
+    if (image.bitsPerPixel != 32 || image.isPlanar || image.bitmapFormat & NSBitmapFormatAlphaFirst)
+    {
+        SWLockFocus(image);
+        NSGraphicsContext *context = [NSGraphicsContext currentContext];
+        context.shouldAntialias = YES;
+        context.compositingOperation = operation;
+        CGContextClipToRect(context.CGContext, NSRectToCGRect(clip));
+        CGContextAddPath(context.CGContext, cgPath);
+        [color setFill];
+        if (evenOdd)
+            CGContextEOFillPath(context.CGContext);
+        else
+            CGContextFillPath(context.CGContext);
+        SWUnlockFocus(image);
+        return;
+    }
+    
+    uint8_t rgba[4];
+    SWGetPremultipliedColor(color, rgba);
+    
+    if (!rasterizer)
+        rasterizer = SWRasterizerCreate();
+    
+    // The rasterizer clips to the part of the image it's given
+    NSInteger height = image.pixelsHigh;
+    NSInteger left = NSMinX(clip), top = height - NSMaxY(clip);
+    SWRasterizerReset(rasterizer, NSWidth(clip), NSHeight(clip));
+    SWRasterizerTarget target = { rasterizer, height, left, top };
+    CGPathApply(cgPath, &target, SWAddPathElement);
+    
+    SWImageUseRect(image, NSIntersectionRect(clip, NSRectFromCGRect(CGPathGetPathBoundingBox(cgPath))), NO);
+    SWRasterizerFill(rasterizer, evenOdd ? SWFillEvenOdd : SWFillNonZero, 
+                     image.bitmapData + top * image.bytesPerRow + left * 4, image.bytesPerRow, rgba, 
+                     (operation == NSCompositingOperationCopy) ? SWRasterBlendCopy : SWRasterBlendOver);
+}
+
+- (void)fillCGPath:(CGPathRef)cgPath 
+          evenOdd:(BOOL)evenOdd 
+          inImage:(NSBitmapImageRep *)image 
+        withColor:(NSColor *)color 
+        operation:(NSCompositingOperation)operation
+{
+    [self fillCGPath:cgPath 
+             evenOdd:evenOdd 
+             inImage:image 
+              inRect:NSMakeRect(0, 0, image.pixelsWide, image.pixelsHigh) 
+           withColor:color 
+           operation:operation];
+}
+
+- (void)fillPath:(NSBezierPath *)aPath 
+         inImage:(NSBitmapImageRep *)image 
+       withColor:(NSColor *)color 
+       operation:(NSCompositingOperation)operation
+{
+    CGMutablePathRef cgPath = SWCreateCGPath(aPath);
+    [self fillCGPath:cgPath 
+             evenOdd:(aPath.windingRule == NSWindingRuleEvenOdd) 
+             inImage:image 
+           withColor:color 
+           operation:operation];
+    CGPathRelease(cgPath);
+}
+
+// A stroke is the fill of its outline
+- (void)strokePath:(NSBezierPath *)aPath 
+           inImage:(NSBitmapImageRep *)image 
+         withColor:(NSColor *)color 
+         operation:(NSCompositingOperation)operation
+{
+    CGMutablePathRef cgPath = SWCreateCGPath(aPath);
+    CGPathRef outline = CGPathCreateCopyByStrokingPath(cgPath, NULL, aPath.lineWidth, 
+                                                       (CGLineCap)aPath.lineCapStyle, 
+                                                       (CGLineJoin)aPath.lineJoinStyle, 
+                                                       aPath.miterLimit);
+    CGPathRelease(cgPath);
+    [self fillCGPath:outline evenOdd:NO inImage:image withColor:color operation:operation];
+    CGPathRelease(outline);
+}
+
+- (void)restrokeSymmetricPath:(NSBezierPath *)aPath 
+                      inImage:(NSBitmapImageRep *)image 
+                    withColor:(NSColor *)color 
+                      inRects:(const NSRect *)rects 
+                        count:(NSUInteger)count
+{
+    NSRect clips[kSWMaxSymmetryCopies];
+    CGMutablePathRef pieces[kSWMaxSymmetryCopies];
+    NSRect bounds = NSMakeRect(0, 0, image.pixelsWide, image.pixelsHigh);
+    count = MIN(count, kSWMaxSymmetryCopies);
+    for (NSUInteger r = 0; r < count; r++)
+    {
+        clips[r] = NSIntersectionRect(NSIntegralRect(rects[r]), bounds);
+        pieces[r] = CGPathCreateMutable();
+    }
+    
+    // Every segment of every copy, to each rect its stroke reaches into, as a
+    // line of its own
+    CGFloat reach = aPath.lineWidth / 2.0 + 1.0;
+    NSUInteger copies = MAX(symmetryCount, 1);
+    NSInteger elementCount = aPath.elementCount;
+    for (NSUInteger c = 0; c < copies; c++)
+    {
+        CGAffineTransform t = (symmetryCount > 1) ? symmetry[c] : CGAffineTransformIdentity;
+        CGPoint from = CGPointZero;
+        NSPoint points[3];
+        for (NSInteger i = 0; i < elementCount; i++)
+        {
+            NSBezierPathElement element = [aPath elementAtIndex:i associatedPoints:points];
+            CGPoint to = CGPointApplyAffineTransform(NSPointToCGPoint(points[0]), t);
+            if (element == NSBezierPathElementLineTo)
+            {
+                NSRect reached = NSMakeRect(MIN(from.x, to.x) - reach, MIN(from.y, to.y) - reach, 
+                                            fabs(to.x - from.x) + 2 * reach, fabs(to.y - from.y) + 2 * reach);
+                for (NSUInteger r = 0; r < count; r++)
+                    if (NSIntersectsRect(reached, clips[r]))
+                    {
+                        CGPathMoveToPoint(pieces[r], NULL, from.x, from.y);
+                        CGPathAddLineToPoint(pieces[r], NULL, to.x, to.y);
+                    }
+            }
+            from = to;
+        }
+    }
+    
+    BOOL ownCanvas = (image.bitsPerPixel == 32 && !image.isPlanar && !(image.bitmapFormat & NSBitmapFormatAlphaFirst));
+    for (NSUInteger r = 0; r < count; r++)
+    {
+        NSRect clip = clips[r];
+        if (!NSIsEmptyRect(clip))
+        {
+            if (ownCanvas)
+            {
+                NSInteger left = NSMinX(clip), top = image.pixelsHigh - NSMaxY(clip);
+                SWImageUseRect(image, clip, NO);
+                for (NSInteger y = top; y < top + (NSInteger)NSHeight(clip); y++)
+                    memset(image.bitmapData + y * image.bytesPerRow + left * 4, 0, (size_t)NSWidth(clip) * 4);
+            }
+            else
+                [SWImageTools clearImage:image inRect:clip];
+            
+            if (!CGPathIsEmpty(pieces[r]))
+            {
+                CGPathRef outline = CGPathCreateCopyByStrokingPath(pieces[r], NULL, aPath.lineWidth, 
+                                                                   kCGLineCapRound, kCGLineJoinRound, 
+                                                                   aPath.miterLimit);
+                [self fillCGPath:outline 
+                         evenOdd:NO 
+                         inImage:image 
+                          inRect:clip 
+                       withColor:color 
+                       operation:NSCompositingOperationCopy];
+                CGPathRelease(outline);
+            }
+        }
+        CGPathRelease(pieces[r]);
+    }
+}
+
+- (void)setMainImage:(NSBitmapImageRep *)mainImage bufferImage:(NSBitmapImageRep *)bufferImage
+{
+    _mainImage = mainImage;
+    _bufferImage = bufferImage;
+}
+
 - (NSBezierPath *)path
 {
     return path;
@@ -172,6 +582,152 @@
     return NO;
 }
 
+- (void)beginSymmetryInImage:(NSBitmapImageRep *)image
+{
+    NSUserDefaults *defaults = NSUserDefaults.standardUserDefaults;
+    SWSymmetry kind = [defaults integerForKey:kSWSymmetryKey];
+    CGFloat about[kSWMaxSymmetryCopies][4];
+    NSUInteger count = 1;
+    if (kind == SWSymmetryRotational)
+    {
+        count = MIN(MAX([defaults integerForKey:kSWSymmetryFoldsKey], 2), kSWMaxSymmetryCopies);
+        for (NSUInteger i = 0; i < count; i++)
+        {
+            // Turns that land on an axis land on it exactly
+            CGFloat angle = 2.0 * M_PI * i / count;
+            CGFloat c = cos(angle), s = sin(angle);
+            if (fabs(c) < 1e-9)
+                c = 0.0;
+            if (fabs(s) < 1e-9)
+                s = 0.0;
+            about[i][0] = c;
+            about[i][1] = s;
+            about[i][2] = -s;
+            about[i][3] = c;
+        }
+    }
+    else
+    {
+        if (kind == SWSymmetryMirror)
+            count = 2;
+        else if (kind == SWSymmetryMirror4)
+            count = 4;
+        else if (kind == SWSymmetryMirror8)
+            count = 8;
+        memcpy(about, kSWMirrors, count * sizeof(about[0]));
+    }
+    
+    // Everything turns, or flips, about the middle of the canvas
+    CGFloat cx = image.pixelsWide / 2.0, cy = image.pixelsHigh / 2.0;
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        CGAffineTransform t = CGAffineTransformMake(about[i][0], about[i][1], about[i][2], about[i][3], 0, 0);
+        t = CGAffineTransformConcat(CGAffineTransformMakeTranslation(-cx, -cy), t);
+        symmetry[i] = CGAffineTransformConcat(t, CGAffineTransformMakeTranslation(cx, cy));
+    }
+    symmetryCount = count;
+}
+
+- (NSBezierPath *)symmetricPath:(NSBezierPath *)aPath
+{
+    return [self symmetricPath:aPath fromElement:0];
+}
+
+- (NSBezierPath *)symmetricPath:(NSBezierPath *)aPath fromElement:(NSInteger)first
+{
+    NSBezierPath *piece = aPath;
+    if (first > 0)
+    {
+        piece = [NSBezierPath bezierPath];
+        SWCopyPathStyle(aPath, piece);
+        
+        NSInteger count = aPath.elementCount;
+        NSPoint points[3];
+        if (first < count && [aPath elementAtIndex:first] != NSBezierPathElementMoveTo)
+        {
+            // Carry on from wherever the path had got to
+            NSPoint current = NSZeroPoint, start = NSZeroPoint;
+            for (NSInteger i = 0; i < first; i++)
+            {
+                switch ([aPath elementAtIndex:i associatedPoints:points])
+                {
+                    case NSBezierPathElementMoveTo:
+                        current = start = points[0];
+                        break;
+                    case NSBezierPathElementLineTo:
+                        current = points[0];
+                        break;
+                    case NSBezierPathElementCurveTo:
+                        current = points[2];
+                        break;
+                    default:
+                        current = start;
+                        break;
+                }
+            }
+            [piece moveToPoint:current];
+        }
+        for (NSInteger i = first; i < count; i++)
+        {
+            switch ([aPath elementAtIndex:i associatedPoints:points])
+            {
+                case NSBezierPathElementMoveTo:
+                    [piece moveToPoint:points[0]];
+                    break;
+                case NSBezierPathElementLineTo:
+                    [piece lineToPoint:points[0]];
+                    break;
+                case NSBezierPathElementCurveTo:
+                    [piece curveToPoint:points[2] controlPoint1:points[0] controlPoint2:points[1]];
+                    break;
+                default:
+                    [piece closePath];
+                    break;
+            }
+        }
+    }
+    if (symmetryCount <= 1)
+        return piece;
+    
+    NSBezierPath *copies = [NSBezierPath bezierPath];
+    SWCopyPathStyle(aPath, copies);
+    for (NSUInteger i = 0; i < symmetryCount; i++)
+    {
+        CGAffineTransform t = symmetry[i];
+        NSAffineTransform *transform = [NSAffineTransform transform];
+        transform.transformStruct = (NSAffineTransformStruct){ t.a, t.b, t.c, t.d, t.tx, t.ty };
+        NSBezierPath *copy = [transform transformBezierPath:piece];
+        if (t.a * t.d - t.b * t.c < 0)
+            copy = copy.bezierPathByReversingPath;
+        [copies appendBezierPath:copy];
+    }
+    return copies;
+}
+
+- (NSUInteger)symmetricPoints:(NSPoint *)points ofPoint:(NSPoint)point
+{
+    if (symmetryCount <= 1)
+    {
+        points[0] = point;
+        return 1;
+    }
+    for (NSUInteger i = 0; i < symmetryCount; i++)
+        points[i] = NSPointFromCGPoint(CGPointApplyAffineTransform(NSPointToCGPoint(point), symmetry[i]));
+    return symmetryCount;
+}
+
+- (NSUInteger)symmetricRects:(NSRect *)rects ofRect:(NSRect)rect
+{
+    if (symmetryCount <= 1 || NSIsEmptyRect(rect))
+    {
+        rects[0] = rect;
+        return 1;
+    }
+    for (NSUInteger i = 0; i < symmetryCount; i++)
+        rects[i] = NSIntegralRect(NSRectFromCGRect(CGRectApplyAffineTransform(NSRectToCGRect(rect), symmetry[i])));
+    return symmetryCount;
+}
+
 // Used to make the drawing faster
 - (NSRect)addRedrawRectFromPoint:(NSPoint)p1 toPoint:(NSPoint)p2
 {
@@ -183,25 +739,73 @@
 
 - (NSRect)addRectToRedrawRect:(NSRect)newRect
 {
-    // The redraw region should include both the current rectangle and
-    // the last action's rectangle
-    redrawRect = NSUnionRect(newRect, savedRect);
-    
-    // Save the current new rectangle for next time
-    savedRect = newRect;
-    
-    // Just to be save, outsed the right of the rectangle by an extra pixel
-    // Hack to fix bug with some fonts and the text tool
-    redrawRect.size.width += 1.0;
+    NSRect copies[kSWMaxSymmetryCopies];
+    NSUInteger count = [self symmetricRects:copies ofRect:newRect];
+    if (!batchingRedraw)
+    {
+        redrawRect = redrawPiecesRect = NSZeroRect;
+        redrawRectCount = 0;
+    }
     
+    for (NSUInteger i = 0; i < count; i++)
+    {
+        // The redraw region should include both the current rectangle and
+        // the last action's rectangle, a copy at a time
+        NSRect rect = NSUnionRect(copies[i], savedRects[i]);
+        
+        // Save the current new rectangle for next time
+        savedRects[i] = copies[i];
+        
+        // Just to be save, outsed the right of the rectangle by an extra pixel
+        // Hack to fix bug with some fonts and the text tool
+        rect.size.width += 1.0;
+        
+        [self addPieceToRedrawRect:rect];
+    }
     return redrawRect;
 }
 
+- (void)addPieceToRedrawRect:(NSRect)rect
+{
+    if (!NSEqualRects(redrawRect, redrawPiecesRect))
+    {
+        // Something set redrawRect itself; that's the first piece
+        redrawRectCount = SWAddRectToRects(redrawRect, redrawRects, 0, kSWMaxSymmetryCopies);
+        redrawPiecesRect = redrawRect;
+    }
+    redrawRectCount = SWAddRectToRects(rect, redrawRects, redrawRectCount, kSWMaxSymmetryCopies);
+    redrawRect = redrawPiecesRect = NSUnionRect(redrawRect, rect);
+}
+
+- (void)beginRedrawBatch
+{
+    redrawRect = redrawPiecesRect = NSZeroRect;
+    redrawRectCount = 0;
+    batchingRedraw = YES;
+}
+
+- (void)endRedrawBatch
+{
+    batchingRedraw = NO;
+}
+
 - (NSRect)invalidRect
 {
     return redrawRect;
 }
 
+- (NSUInteger)getInvalidRects:(NSRect *)rects
+{
+    // Tools that set redrawRect themselves get it back whole
+    if (redrawRectCount == 0 || !NSEqualRects(redrawRect, redrawPiecesRect))
+    {
+        rects[0] = redrawRect;
+        return 1;
+    }
+    memcpy(rects, redrawRects, redrawRectCount * sizeof(NSRect));
+    return redrawRectCount;
+}
+
 - (BOOL)shouldShowFillOptions
 {
     return NO;
@@ -214,6 +818,7 @@
 
 - (void)dealloc
 {
+    SWRasterizerDestroy(rasterizer);
     [toolboxController removeObserver:self forKeyPath:@"lineWidth"];
     [toolboxController removeObserver:self forKeyPath:@"foregroundColor"];
     [toolboxController removeObserver:self forKeyPath:@"backgroundColor"];
@@ -38,5 +38,6 @@
 + (NSArray *)toolClassList;
 - (SWTool *)toolForLabel:(NSString *)label;
 - (void)tieUpLooseEndsForCurrentTool;
+- (void)canvasDidChangeInRect:(NSRect)rect;    // Tells every tool
 
 @end
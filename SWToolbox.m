@@ -115,4 +115,11 @@
 }
 
 
+- (void)canvasDidChangeInRect:(NSRect)rect
+{
+    for (SWTool *tool in toolList.objectEnumerator)
+        [tool canvasDidChangeInRect:rect];
+}
+
+
 @end
@@ -18,8 +18,19 @@
 
 
 #import <Cocoa/Cocoa.h>
+#import "SWStrokeRecording.h"
+#import "SWImageBenchmark.h"
+#import "SWImageBatch.h"
 
 int main(int argc, char *argv[])
 {
+    // Replaying recorded strokes, benchmarking and batch processing happen without any windows at all
+    int status = EXIT_SUCCESS;
+    @autoreleasepool {
+        if ([SWStrokeBenchmark runIfRequestedWithStatus:&status] ||
+            [SWImageBenchmark runIfRequestedWithStatus:&status] ||
+            [SWImageBatch runIfRequestedWithStatus:&status])
+            return status;
+    }
     return NSApplicationMain(argc, (const char **) argv);
 }